@@ -0,0 +1,157 @@
+/**
+ * @file bench.c
+ * Runs the benchmarks of the OTA hot paths on the host.
+ *
+ * Usage: ota_bench [--quick] [filter]
+ *   --quick  short runs, used by ctest to check that every benchmark works
+ *   filter   runs only the cases whose name contains the text
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "esp_log.h"
+#include "bench.h"
+
+#define BENCH_MIN_TIME_NS 200000000LL
+#define BENCH_QUICK_MIN_TIME_NS 5000000LL
+#define BENCH_REPETITIONS 5
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+static uint64_t alloc_count;
+static uint64_t alloc_bytes;
+
+static int64_t min_time_ns = BENCH_MIN_TIME_NS;
+static int repetitions = BENCH_REPETITIONS;
+static const char *filter;
+
+/* Every heap allocation of the device code and cJSON is counted, see the --wrap link options */
+
+void *__wrap_malloc(size_t size)
+{
+    alloc_count++;
+    alloc_bytes += size;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    alloc_count++;
+    alloc_bytes += nmemb * size;
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    alloc_count++;
+    alloc_bytes += size;
+    return __real_realloc(ptr, size);
+}
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int64_t time_run(const struct bench_case *bench, long iterations)
+{
+    int64_t start = now_ns();
+    bench->run(bench->ctx, iterations);
+    return now_ns() - start;
+}
+
+void bench_section(const char *title)
+{
+    if (filter == NULL)
+    {
+        printf("\n%s\n", title);
+    }
+}
+
+bool bench_run(const struct bench_case *bench)
+{
+    if (filter != NULL && strstr(bench->name, filter) == NULL)
+    {
+        return true;
+    }
+    if (bench->check != NULL && !bench->check(bench->ctx))
+    {
+        printf("  %-46s CHECK FAILED\n", bench->name);
+        return false;
+    }
+
+    // Grow the iterations until a run takes a tenth of the minimum time, then scale up
+    long iterations = 1;
+    int64_t elapsed = time_run(bench, iterations);
+    while (elapsed < min_time_ns / 10 && iterations < (1L << 30))
+    {
+        iterations *= elapsed > 0 && min_time_ns / 10 / elapsed < 10 ? 2 : 10;
+        elapsed = time_run(bench, iterations);
+    }
+    if (elapsed < min_time_ns && elapsed > 0)
+    {
+        iterations = (long) (iterations * ((double) min_time_ns / elapsed));
+    }
+
+    double best_ns = 0;
+    uint64_t allocs = 0;
+    uint64_t bytes = 0;
+    for (int i = 0; i < repetitions; i++)
+    {
+        uint64_t count_before = alloc_count;
+        uint64_t bytes_before = alloc_bytes;
+        double ns = (double) time_run(bench, iterations) / iterations;
+        if (i == 0 || ns < best_ns)
+        {
+            best_ns = ns;
+        }
+        allocs = alloc_count - count_before;
+        bytes = alloc_bytes - bytes_before;
+    }
+
+    printf("  %-46s %12.1f %10.2f %12.1f", bench->name, best_ns, (double) allocs / iterations, (double) bytes / iterations);
+    if (bench->bytes != 0)
+    {
+        printf(" %10.1f", bench->bytes / best_ns * 1000.0);
+    } else
+    {
+        printf(" %10s", "-");
+    }
+    printf("\n");
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--quick") == 0)
+        {
+            min_time_ns = BENCH_QUICK_MIN_TIME_NS;
+            repetitions = 1;
+        } else
+        {
+            filter = argv[i];
+        }
+    }
+
+    // The logs would dominate the measurement, they are written to a serial port on the device
+    esp_log_level_set("*", ESP_LOG_NONE);
+
+    printf("SHA-256 backend: %s\n", SHA256_BACKEND);
+    printf("  %-46s %12s %10s %12s %10s\n", "benchmark", "ns/op", "allocs/op", "bytes/op", "MB/s");
+
+    bool ok = bench_ota();
+    ok = bench_fw_state() && ok;
+    ok = bench_proto() && ok;
+    ok = bench_md() && ok;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,43 @@
+/**
+ * @file bench.h
+ * Micro benchmark harness of the host build: time per operation and heap allocations per operation.
+ */
+
+#ifndef PRJ_BENCH_MODULE
+#define PRJ_BENCH_MODULE
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*! Keeps the compiler from dropping or merging the iterations of a measured loop */
+#define BENCH_CLOBBER() __asm__ volatile("" ::: "memory")
+
+/*! Runs the measured operation the given number of times */
+typedef void (*bench_fn_t)(void *ctx, long iterations);
+
+/*! Checks the result of one operation before it is measured, false fails the benchmark */
+typedef bool (*bench_check_t)(void *ctx);
+
+struct bench_case
+{
+    const char *name;
+    bench_fn_t run;
+    bench_check_t check;
+    void *ctx;
+    /*! Bytes processed per operation for the throughput column, 0 if it doesn't apply */
+    size_t bytes;
+};
+
+/*! Measures the case and prints its line of the report, returns false if its check failed */
+bool bench_run(const struct bench_case *bench);
+
+/*! Prints a section heading of the report */
+void bench_section(const char *title);
+
+/* Benchmarks of each source, they return false if a check failed */
+bool bench_ota(void);
+bool bench_fw_state(void);
+bool bench_proto(void);
+bool bench_md(void);
+
+#endif
@@ -0,0 +1,47 @@
+/**
+ * @file bench_fw_state.c
+ * Benchmark of the fw_state telemetry message built on every state change.
+ */
+
+#include "fw_state.c"
+
+#include "fake_host.h"
+#include "bench.h"
+
+static struct fw_state fw_state;
+
+static void run_publish_state(void *ctx, long iterations)
+{
+    for (long i = 0; i < iterations; i++)
+    {
+        publish_state_msg(&fw_state, ctx, false);
+        BENCH_CLOBBER();
+    }
+}
+
+static bool check_publish_state(void *ctx)
+{
+    static const char expected[] =
+                    "{\"current_fw_title\":\"mqttOta\",\"current_fw_version\":\"V1.1\",\"fw_state\":\"DOWNLOADING\"}";
+    publish_state_msg(&fw_state, ctx, false);
+    const struct fake_mqtt_message *msg = fake_mqtt_last_publish(NULL);
+    return strcmp(msg->topic, TB_TELEMETRY_TOPIC) == 0 && msg->len == sizeof(expected) - 1
+                    && memcmp(msg->data, expected, msg->len) == 0;
+}
+
+bool bench_fw_state(void)
+{
+    static struct fw_state_msg downloading = { .title = "mqttOta", .version = "V1.1", .state = "DOWNLOADING" };
+    static struct fw_state_msg failed = { .title = "mqttOta", .version = "V1.1", .state = "FAILED", .error =
+                    "Checksum verification failed" };
+
+    const esp_mqtt_client_config_t mqtt_cfg = { .uri = CONFIG_MQTT_BROKER_URL };
+    fw_state_init(&fw_state, esp_mqtt_client_init(&mqtt_cfg));
+
+    bench_section("fw_state telemetry");
+    const struct bench_case state = { "publish_state_msg", run_publish_state, check_publish_state, &downloading, 0 };
+    const struct bench_case state_error = { "publish_state_msg with fw_error", run_publish_state, NULL, &failed, 0 };
+    bool ok = bench_run(&state);
+    ok = bench_run(&state_error) && ok;
+    return ok;
+}
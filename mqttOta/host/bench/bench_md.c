@@ -0,0 +1,70 @@
+/**
+ * @file bench_md.c
+ * Benchmark of the SHA-256 updates of the download, one per received chunk.
+ */
+
+#include <string.h>
+#include "mbedtls/md.h"
+
+#include "bench.h"
+
+#define BENCH_MD_MAX_SIZE 30000
+
+static unsigned char input[BENCH_MD_MAX_SIZE];
+
+struct md_ctx
+{
+    mbedtls_md_context_t md;
+    size_t size;
+};
+
+static void run_md_update(void *ctx, long iterations)
+{
+    struct md_ctx *md_ctx = ctx;
+    for (long i = 0; i < iterations; i++)
+    {
+        mbedtls_md_update(&md_ctx->md, input, md_ctx->size);
+    }
+}
+
+static bool check_sha256(void *ctx)
+{
+    static const unsigned char expected[32] = { 0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d,
+                                                0xae, 0x22, 0x23, 0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10,
+                                                0xff, 0x61, 0xf2, 0x00, 0x15, 0xad };
+    unsigned char digest[32];
+    mbedtls_md_context_t md;
+    mbedtls_md_init(&md);
+    mbedtls_md_setup(&md, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0);
+    mbedtls_md_starts(&md);
+    mbedtls_md_update(&md, (const unsigned char*) "abc", 3);
+    mbedtls_md_finish(&md, digest);
+    mbedtls_md_free(&md);
+    return memcmp(digest, expected, sizeof(digest)) == 0;
+}
+
+bool bench_md(void)
+{
+    static const size_t sizes[] = { 64, 1024, 4096, BENCH_MD_MAX_SIZE };
+    static const char *names[] = { "mbedtls_md_update, 64 B", "mbedtls_md_update, 1024 B", "mbedtls_md_update, 4096 B",
+                                   "mbedtls_md_update, 30000 B (chunk)" };
+    bool ok = true;
+
+    for (size_t i = 0; i < sizeof(input); i++)
+    {
+        input[i] = (unsigned char) i;
+    }
+
+    bench_section("SHA-256 of the download");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        struct md_ctx md_ctx = { .size = sizes[i] };
+        mbedtls_md_init(&md_ctx.md);
+        mbedtls_md_setup(&md_ctx.md, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0);
+        mbedtls_md_starts(&md_ctx.md);
+        const struct bench_case update = { names[i], run_md_update, i == 0 ? check_sha256 : NULL, &md_ctx, sizes[i] };
+        ok = bench_run(&update) && ok;
+        mbedtls_md_free(&md_ctx.md);
+    }
+    return ok;
+}
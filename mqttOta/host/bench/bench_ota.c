@@ -0,0 +1,271 @@
+/**
+ * @file bench_ota.c
+ * Benchmarks of mqttOta.c: the digest formatting, the OTA config parsing and the topic
+ * dispatch of the MQTT event handler, fed with the payloads ThingsBoard sends.
+ */
+
+#include "mqttOta.c"
+
+#include "fake_host.h"
+#include "bench.h"
+
+#define BENCH_CHUNK_TOPIC "v2/fw/response/1/chunk/12"
+
+/* Checksum of a 1 MB firmware */
+#define BENCH_FW_CHECKSUM "4f5b4c8f1e2d3a69b07c51d2e8a9f6034c7d1b2e5f8a9c0d3e6f7a8b9c0d1e2f"
+
+/*! Response of ThingsBoard to the shared attributes request of a device with a firmware assigned */
+static const char attributes_response[] = "{\"shared\":{\"fw_checksum_algorithm\":\"SHA256\",\"fw_checksum\":\"" BENCH_FW_CHECKSUM
+"\",\"fw_size\":1048576,\"fw_title\":\"mqttOta\",\"fw_version\":\"V1.1\",\"fw_tag\":\"mqttOta V1.1\"}}";
+
+/*! Update ThingsBoard pushes when a firmware is assigned to the device */
+static const char attributes_update[] = "{\"fw_title\":\"mqttOta\",\"fw_version\":\"V1.1\",\"fw_tag\":\"mqttOta V1.1\","
+"\"fw_size\":1048576,\"fw_checksum_algorithm\":\"SHA256\",\"fw_checksum\":\"" BENCH_FW_CHECKSUM "\"}";
+
+/*! Update ThingsBoard pushes when the firmware is unassigned */
+static const char attributes_deleted[] = "{\"deleted\":[\"fw_title\",\"fw_version\",\"fw_tag\",\"fw_size\","
+"\"fw_checksum_algorithm\",\"fw_checksum\"]}";
+
+static const char rpc_request[] = "{\"method\":\"getCurrentTime\",\"params\":{}}";
+
+/*! Device the benchmarks run on, its module contexts are set up like app_main() does */
+static struct ota_device device;
+
+static unsigned char digest[32];
+static char digest_string[65];
+static char chunk[CHUNK_SIZE];
+
+/*! Formatting of the digest before hexToHexString() was optimized */
+static void hex_sprintf_baseline(unsigned char *input, char *output, int input_len)
+{
+    int loop = 0;
+    int i = 0;
+    while (loop < input_len)
+    {
+        sprintf((char*) (output + i), "%02x", input[loop]);
+        loop += 1;
+        i += 2;
+    }
+    output[i++] = '\0';
+}
+
+static void run_hex(void *ctx, long iterations)
+{
+    for (long i = 0; i < iterations; i++)
+    {
+        hexToHexString(digest, digest_string, sizeof(digest));
+        BENCH_CLOBBER();
+    }
+}
+
+static void run_hex_baseline(void *ctx, long iterations)
+{
+    for (long i = 0; i < iterations; i++)
+    {
+        hex_sprintf_baseline(digest, digest_string, sizeof(digest));
+        BENCH_CLOBBER();
+    }
+}
+
+static bool check_hex(void *ctx)
+{
+    char expected[65];
+    hex_sprintf_baseline(digest, expected, sizeof(digest));
+    hexToHexString(digest, digest_string, sizeof(digest));
+    return strcmp(expected, digest_string) == 0;
+}
+
+/*! Parsed payload given to parse_ota_config(), and whether it is merged like an update */
+struct parse_ctx
+{
+    const cJSON *object;
+    bool merge;
+};
+
+static void run_parse_ota_config(void *ctx, long iterations)
+{
+    struct parse_ctx *parse = ctx;
+    for (long i = 0; i < iterations; i++)
+    {
+        parse_ota_config(&device, parse->object, parse->merge);
+        BENCH_CLOBBER();
+    }
+}
+
+static bool check_parse_ota_config(void *ctx)
+{
+    struct parse_ctx *parse = ctx;
+    parse_ota_config(&device, parse->object, parse->merge);
+    if (parse->merge)
+    {
+        return device.shared_attributes.fw_title[0] == 0 && device.shared_attributes.fw_size == 0;
+    }
+    return device.shared_attributes.fw_size == 1048576 && strcmp(device.shared_attributes.fw_version, "V1.1") == 0
+                    && strcmp(device.shared_attributes.fw_checksum, BENCH_FW_CHECKSUM) == 0;
+}
+
+static void run_attributes_response(void *ctx, long iterations)
+{
+    for (long i = 0; i < iterations; i++)
+    {
+        shared_attributes_received(1, attributes_response, sizeof(attributes_response) - 1, &device);
+        BENCH_CLOBBER();
+    }
+}
+
+static bool check_attributes_response(void *ctx)
+{
+    clearSharedAttributes(&device);
+    xEventGroupClearBits(device.event_group, OTA_CONFIG_FETCHED_EVENT);
+    shared_attributes_received(1, attributes_response, sizeof(attributes_response) - 1, &device);
+    return (xEventGroupGetBits(device.event_group) & OTA_CONFIG_FETCHED_EVENT) != 0
+                    && strcmp(device.shared_attributes.fw_version, "V1.1") == 0;
+}
+
+/*! MQTT_EVENT_DATA given to mqtt_event_handler() */
+struct event_ctx
+{
+    const char *topic;
+    const char *data;
+    int data_len;
+    /*! Set for a firmware chunk, the handler only accepts the pending one */
+    bool chunk;
+};
+
+static void deliver(struct event_ctx *event_ctx)
+{
+    esp_mqtt_event_t event = {
+        .event_id = MQTT_EVENT_DATA,
+        .client = device.mqtt_client,
+        .user_context = &device,
+        .topic = (char*) event_ctx->topic,
+        .topic_len = strlen(event_ctx->topic),
+        .data = (char*) event_ctx->data,
+        .data_len = event_ctx->data_len,
+        .total_data_len = event_ctx->data_len
+    };
+    if (event_ctx->chunk)
+    {
+        strcpy(device.fwResponse, BENCH_CHUNK_TOPIC);
+    }
+    mqtt_event_handler(&event);
+    if (event_ctx->chunk)
+    {
+        free((void*) device.rcvdChunk);
+        device.rcvdChunk = NULL;
+    }
+}
+
+static void run_event(void *ctx, long iterations)
+{
+    for (long i = 0; i < iterations; i++)
+    {
+        deliver(ctx);
+        BENCH_CLOBBER();
+    }
+}
+
+static bool check_event_update(void *ctx)
+{
+    clearSharedAttributes(&device);
+    xEventGroupClearBits(device.event_group, OTA_CONFIG_UPDATED_EVENT);
+    deliver(ctx);
+    return (xEventGroupGetBits(device.event_group) & OTA_CONFIG_UPDATED_EVENT) != 0;
+}
+
+static bool check_event_chunk(void *ctx)
+{
+    struct event_ctx *event_ctx = ctx;
+    xEventGroupClearBits(device.event_group, MQTT_CHUNK_RECEIVED_EVENT);
+    strcpy(device.fwResponse, BENCH_CHUNK_TOPIC);
+    esp_mqtt_event_t event = {
+        .event_id = MQTT_EVENT_DATA,
+        .user_context = &device,
+        .topic = (char*) event_ctx->topic,
+        .topic_len = strlen(event_ctx->topic),
+        .data = (char*) event_ctx->data,
+        .data_len = event_ctx->data_len
+    };
+    mqtt_event_handler(&event);
+    bool ok = (xEventGroupGetBits(device.event_group) & MQTT_CHUNK_RECEIVED_EVENT) != 0 && device.rcvdChunkSize == CHUNK_SIZE
+                    && memcmp(device.rcvdChunk, chunk, CHUNK_SIZE) == 0 && device.fwResponse[0] == 0;
+    free((void*) device.rcvdChunk);
+    device.rcvdChunk = NULL;
+    return ok;
+}
+
+static bool check_event_rpc(void *ctx)
+{
+    int count_before;
+    int count_after;
+    fake_mqtt_last_publish(&count_before);
+    deliver(ctx);
+    const struct fake_mqtt_message *response = fake_mqtt_last_publish(&count_after);
+    return count_after == count_before + 1 && strcmp(response->topic, "v1/devices/me/rpc/response/42") == 0;
+}
+
+bool bench_ota(void)
+{
+    bool ok = true;
+
+    for (size_t i = 0; i < sizeof(digest); i++)
+    {
+        digest[i] = (unsigned char) (i * 37 + 11);
+    }
+    for (size_t i = 0; i < sizeof(chunk); i++)
+    {
+        chunk[i] = (char) esp_random();
+    }
+
+    device.event_group = xEventGroupCreate();
+    const esp_mqtt_client_config_t mqtt_cfg = { .uri = CONFIG_MQTT_BROKER_URL, .event_handle = mqtt_event_handler,
+                    .user_context = &device };
+    device.mqtt_client = esp_mqtt_client_init(&mqtt_cfg);
+    trace_init(&device.trace);
+    rollout_init(&device.rollout);
+    fw_state_init(&device.fw_state, device.mqtt_client);
+    tb_request_init(&device.requests, device.mqtt_client);
+
+    bench_section("Digest formatting");
+    const struct bench_case hex = { "hexToHexString, 32 B", run_hex, check_hex, NULL, 32 };
+    const struct bench_case hex_baseline = { "sprintf per byte (baseline), 32 B", run_hex_baseline, NULL, NULL, 32 };
+    ok = bench_run(&hex) && ok;
+    ok = bench_run(&hex_baseline) && ok;
+
+    bench_section("OTA config parsing");
+    cJSON *response = cJSON_Parse(attributes_response);
+    cJSON *deleted = cJSON_Parse(attributes_deleted);
+    struct parse_ctx parse_response = { cJSON_GetObjectItem(response, "shared"), false };
+    struct parse_ctx parse_deleted = { deleted, true };
+    const struct bench_case parse = { "parse_ota_config, attributes response", run_parse_ota_config, check_parse_ota_config,
+                    &parse_response, 0 };
+    const struct bench_case parse_delete = { "parse_ota_config, deleted keys", run_parse_ota_config, check_parse_ota_config,
+                    &parse_deleted, 0 };
+    const struct bench_case received = { "shared_attributes_received, parse and apply", run_attributes_response,
+                    check_attributes_response, NULL, sizeof(attributes_response) - 1 };
+    ok = bench_run(&parse) && ok;
+    ok = bench_run(&parse_delete) && ok;
+    ok = bench_run(&received) && ok;
+    cJSON_Delete(response);
+    cJSON_Delete(deleted);
+
+    bench_section("MQTT_EVENT_DATA dispatch");
+    struct event_ctx update = { TB_ATTRIBUTES_TOPIC, attributes_update, sizeof(attributes_update) - 1, false };
+    struct event_ctx fw_chunk = { BENCH_CHUNK_TOPIC, chunk, CHUNK_SIZE, true };
+    struct event_ctx rpc = { "v1/devices/me/rpc/request/42", rpc_request, sizeof(rpc_request) - 1, false };
+    struct event_ctx late_response = { "v1/devices/me/attributes/response/7", attributes_response, sizeof(attributes_response) - 1,
+                    false };
+    struct event_ctx late_chunk = { "v2/fw/response/1/chunk/11", chunk, 1024, false };
+    const struct bench_case event_update = { "attributes update", run_event, check_event_update, &update,
+                    sizeof(attributes_update) - 1 };
+    const struct bench_case event_chunk = { "firmware chunk, 30000 B", run_event, check_event_chunk, &fw_chunk, CHUNK_SIZE };
+    const struct bench_case event_rpc = { "RPC request, unknown method", run_event, check_event_rpc, &rpc, 0 };
+    const struct bench_case event_late_response = { "response of no pending request", run_event, NULL, &late_response, 0 };
+    const struct bench_case event_late_chunk = { "chunk that isn't pending, no topic match", run_event, NULL, &late_chunk, 0 };
+    ok = bench_run(&event_update) && ok;
+    ok = bench_run(&event_chunk) && ok;
+    ok = bench_run(&event_rpc) && ok;
+    ok = bench_run(&event_late_response) && ok;
+    ok = bench_run(&event_late_chunk) && ok;
+    return ok;
+}
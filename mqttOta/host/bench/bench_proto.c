@@ -0,0 +1,252 @@
+/**
+ * @file bench_proto.c
+ * Benchmarks of the two payload formats of CONFIG_TB_PAYLOAD_PROTOBUF: the telemetry encoding and
+ * the shared attributes decoding with tb_proto.c against cJSON, with the size of both payloads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mqttOta.h"
+#include "tb_proto.h"
+#include "bench.h"
+
+/* Field numbers and key types of ThingsBoard's transport.proto, see tb_proto.c */
+#define TSKV_TS 1
+#define TSKV_KV 2
+#define KV_KEY 1
+#define KV_TYPE 2
+#define KV_LONG 4
+#define KV_STRING 6
+#define KV_TYPE_LONG 1
+#define KV_TYPE_STRING 3
+#define RESPONSE_REQUEST_ID 1
+#define RESPONSE_SHARED_ATTRIBUTE_LIST 3
+#define UPDATE_SHARED_UPDATED 1
+
+#define BENCH_FW_CHECKSUM "4f5b4c8f1e2d3a69b07c51d2e8a9f6034c7d1b2e5f8a9c0d3e6f7a8b9c0d1e2f"
+#define BENCH_FW_SIZE 1048576
+
+/*! OTA keys ThingsBoard sends, in both formats */
+static const char *const fw_string_keys[][2] =
+{
+    { "fw_title", "mqttOta" },
+    { "fw_version", "V1.1" },
+    { "fw_tag", "mqttOta V1.1" },
+    { "fw_checksum_algorithm", "SHA256" },
+    { "fw_checksum", BENCH_FW_CHECKSUM },
+};
+
+static const char json_update[] = "{\"fw_title\":\"mqttOta\",\"fw_version\":\"V1.1\",\"fw_tag\":\"mqttOta V1.1\","
+"\"fw_checksum_algorithm\":\"SHA256\",\"fw_checksum\":\"" BENCH_FW_CHECKSUM "\",\"fw_size\":1048576}";
+
+static const char json_response[] = "{\"shared\":{\"fw_title\":\"mqttOta\",\"fw_version\":\"V1.1\",\"fw_tag\":\"mqttOta V1.1\","
+"\"fw_checksum_algorithm\":\"SHA256\",\"fw_checksum\":\"" BENCH_FW_CHECKSUM "\",\"fw_size\":1048576}}";
+
+static uint8_t proto_update[512];
+static size_t proto_update_len;
+static uint8_t proto_response[512];
+static size_t proto_response_len;
+
+static const struct tb_proto_telemetry telemetry = {
+    .current_fw_title = "mqttOta",
+    .current_fw_version = "V1.1",
+    .fw_state = "DOWNLOADING"
+};
+
+/* Minimal protobuf writer for the downlink messages the device only decodes, the buffers are large enough */
+
+static size_t put_varint(uint8_t *buf, uint64_t value)
+{
+    size_t len = 0;
+    do
+    {
+        buf[len] = value & 0x7f;
+        value >>= 7;
+        if (value != 0)
+        {
+            buf[len] |= 0x80;
+        }
+        len++;
+    } while (value != 0);
+    return len;
+}
+
+static size_t put_bytes(uint8_t *buf, uint32_t field, const void *data, size_t data_len)
+{
+    size_t len = put_varint(buf, (field << 3) | 2);
+    len += put_varint(buf + len, data_len);
+    memcpy(buf + len, data, data_len);
+    return len + data_len;
+}
+
+static size_t put_int(uint8_t *buf, uint32_t field, uint64_t value)
+{
+    size_t len = put_varint(buf, field << 3);
+    return len + put_varint(buf + len, value);
+}
+
+/*! Encodes one TsKvProto of a string value, or of a long value if value is NULL */
+static size_t put_ts_kv(uint8_t *buf, uint32_t field, const char *key, const char *value, int64_t long_value)
+{
+    uint8_t kv[256];
+    size_t kv_len = put_bytes(kv, KV_KEY, key, strlen(key));
+    if (value != NULL)
+    {
+        kv_len += put_int(kv + kv_len, KV_TYPE, KV_TYPE_STRING);
+        kv_len += put_bytes(kv + kv_len, KV_STRING, value, strlen(value));
+    } else
+    {
+        kv_len += put_int(kv + kv_len, KV_TYPE, KV_TYPE_LONG);
+        kv_len += put_int(kv + kv_len, KV_LONG, (uint64_t) long_value);
+    }
+
+    uint8_t ts_kv[300];
+    size_t ts_kv_len = put_int(ts_kv, TSKV_TS, 1700000000000ULL);
+    ts_kv_len += put_bytes(ts_kv + ts_kv_len, TSKV_KV, kv, kv_len);
+    return put_bytes(buf, field, ts_kv, ts_kv_len);
+}
+
+/*! Encodes the OTA keys as the repeated TsKvProto field of a message */
+static size_t put_fw_keys(uint8_t *buf, uint32_t field)
+{
+    size_t len = 0;
+    for (size_t i = 0; i < sizeof(fw_string_keys) / sizeof(fw_string_keys[0]); i++)
+    {
+        len += put_ts_kv(buf + len, field, fw_string_keys[i][0], fw_string_keys[i][1], 0);
+    }
+    return len + put_ts_kv(buf + len, field, "fw_size", NULL, BENCH_FW_SIZE);
+}
+
+static char *json_encode_telemetry(void)
+{
+    cJSON *object = cJSON_CreateObject();
+    cJSON_AddStringToObject(object, TB_CLIENT_ATTR_FIELD_CURRENT_FW_TITLE, telemetry.current_fw_title);
+    cJSON_AddStringToObject(object, TB_CLIENT_ATTR_FIELD_CURRENT_FW, telemetry.current_fw_version);
+    cJSON_AddStringToObject(object, TB_CLIENT_ATTR_FIELD_FW_STATE, telemetry.fw_state);
+    char *text = cJSON_PrintUnformatted(object);
+    cJSON_Delete(object);
+    return text;
+}
+
+static void run_json_encode(void *ctx, long iterations)
+{
+    for (long i = 0; i < iterations; i++)
+    {
+        free(json_encode_telemetry());
+        BENCH_CLOBBER();
+    }
+}
+
+static void run_proto_encode(void *ctx, long iterations)
+{
+    uint8_t buf[TB_PROTO_TELEMETRY_MAX_SIZE];
+    for (long i = 0; i < iterations; i++)
+    {
+        tb_proto_encode_telemetry(buf, sizeof(buf), &telemetry);
+        BENCH_CLOBBER();
+    }
+}
+
+static void run_json_parse(void *ctx, long iterations)
+{
+    for (long i = 0; i < iterations; i++)
+    {
+        cJSON_Delete(cJSON_Parse(ctx));
+        BENCH_CLOBBER();
+    }
+}
+
+static void run_proto_decode_update(void *ctx, long iterations)
+{
+    for (long i = 0; i < iterations; i++)
+    {
+        cJSON_Delete(tb_proto_decode_attributes_update(proto_update, proto_update_len));
+        BENCH_CLOBBER();
+    }
+}
+
+static void run_proto_decode_response(void *ctx, long iterations)
+{
+    for (long i = 0; i < iterations; i++)
+    {
+        cJSON_Delete(tb_proto_decode_attributes_response(proto_response, proto_response_len));
+        BENCH_CLOBBER();
+    }
+}
+
+/*! Both formats have to carry the same keys and values, in the same order */
+static bool same_attributes(const cJSON *json, cJSON *decoded)
+{
+    char *expected = cJSON_PrintUnformatted(json);
+    char *actual = decoded != NULL ? cJSON_PrintUnformatted(decoded) : NULL;
+    bool same = actual != NULL && strcmp(expected, actual) == 0;
+    free(expected);
+    free(actual);
+    cJSON_Delete(decoded);
+    return same;
+}
+
+static bool check_decode_update(void *ctx)
+{
+    cJSON *json = cJSON_Parse(json_update);
+    bool same = same_attributes(json, tb_proto_decode_attributes_update(proto_update, proto_update_len));
+    cJSON_Delete(json);
+    return same;
+}
+
+static bool check_decode_response(void *ctx)
+{
+    cJSON *json = cJSON_Parse(json_response);
+    bool same = same_attributes(cJSON_GetObjectItem(json, "shared"),
+                    tb_proto_decode_attributes_response(proto_response, proto_response_len));
+    cJSON_Delete(json);
+    return same;
+}
+
+bool bench_proto(void)
+{
+    proto_update_len = put_fw_keys(proto_update, UPDATE_SHARED_UPDATED);
+    proto_response_len = put_int(proto_response, RESPONSE_REQUEST_ID, 1);
+    proto_response_len += put_fw_keys(proto_response + proto_response_len, RESPONSE_SHARED_ATTRIBUTE_LIST);
+
+    uint8_t proto_telemetry[TB_PROTO_TELEMETRY_MAX_SIZE];
+    int proto_telemetry_len = tb_proto_encode_telemetry(proto_telemetry, sizeof(proto_telemetry), &telemetry);
+    char *json_telemetry = json_encode_telemetry();
+    size_t json_telemetry_len = strlen(json_telemetry);
+    free(json_telemetry);
+
+    // MB/s of the encoders is output bytes, of the decoders input bytes
+    char title[128];
+    snprintf(title, sizeof(title), "telemetry encoding: JSON %u B, protobuf %d B", (unsigned) json_telemetry_len,
+                    proto_telemetry_len);
+    bench_section(title);
+    const struct bench_case json_encode = { "cJSON_PrintUnformatted telemetry", run_json_encode, NULL, NULL,
+                    json_telemetry_len };
+    const struct bench_case proto_encode = { "tb_proto_encode_telemetry", run_proto_encode, NULL, NULL,
+                    proto_telemetry_len };
+    bool ok = bench_run(&json_encode);
+    ok = bench_run(&proto_encode) && ok;
+
+    snprintf(title, sizeof(title), "shared attributes update decoding: JSON %u B, protobuf %u B",
+                    (unsigned) strlen(json_update), (unsigned) proto_update_len);
+    bench_section(title);
+    const struct bench_case json_update_parse = { "cJSON_Parse update", run_json_parse, NULL, (void*) json_update,
+                    strlen(json_update) };
+    const struct bench_case proto_update_decode = { "tb_proto_decode_attributes_update", run_proto_decode_update,
+                    check_decode_update, NULL, proto_update_len };
+    ok = bench_run(&json_update_parse) && ok;
+    ok = bench_run(&proto_update_decode) && ok;
+
+    snprintf(title, sizeof(title), "attributes response decoding: JSON %u B, protobuf %u B",
+                    (unsigned) strlen(json_response), (unsigned) proto_response_len);
+    bench_section(title);
+    const struct bench_case json_response_parse = { "cJSON_Parse response", run_json_parse, NULL,
+                    (void*) json_response, strlen(json_response) };
+    const struct bench_case proto_response_decode = { "tb_proto_decode_attributes_response", run_proto_decode_response,
+                    check_decode_response, NULL, proto_response_len };
+    ok = bench_run(&json_response_parse) && ok;
+    ok = bench_run(&proto_response_decode) && ok;
+    return ok;
+}
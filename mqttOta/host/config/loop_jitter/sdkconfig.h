@@ -0,0 +1,51 @@
+/*
+ * Configuration of the loop jitter simulation: the host benchmark configuration with the jitter report
+ * of the example application enabled.
+ */
+#define CONFIG_IDF_TARGET "esp32"
+#define CONFIG_IDF_TARGET_ESP32 1
+#define CONFIG_IDF_FIRMWARE_CHIP_ID 0x0000
+#define CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE 1
+
+#define CONFIG_WIFI_SSID "TP-LINK_nano"
+#define CONFIG_WIFI_PASSWORD "trickham"
+#define CONFIG_MQTT_BROKER_URL "mqtt://192.168.0.118"
+#define CONFIG_MQTT_BROKER_PORT 1883
+#define CONFIG_MQTT_RECONNECT_TIMEOUT_MS 10000
+#define CONFIG_MQTT_ACCESS_TOKEN "esp32_test"
+#define CONFIG_MQTT_MAX_ENDPOINTS 4
+#define CONFIG_MQTT_ENDPOINT_HOLD_S 30
+#define CONFIG_FW_STATE_COALESCE_MS 1000
+#define CONFIG_FW_STATE_DELIVERY_TIMEOUT_MS 3000
+#define CONFIG_OTA_PRE_ERASE 1
+#define CONFIG_OTA_PRE_ERASE_STEP_KB 64
+#define CONFIG_OTA_STREAMING_VERIFY 1
+#define CONFIG_OTA_CHUNK_TIMEOUT_MS 10000
+#define CONFIG_OTA_CHUNK_RETRIES 5
+#define CONFIG_OTA_MAX_ATTEMPTS 3
+#define CONFIG_OTA_HTTP_DOWNLOAD 1
+#define CONFIG_OTA_HTTP_RANGES_IN_FLIGHT 1
+#define CONFIG_OTA_HTTP_MIN_FREE_HEAP_KB 64
+#define CONFIG_OTA_HTTP_TIMEOUT_MS 10000
+#define CONFIG_OTA_HTTP_RETRIES 5
+#define CONFIG_OTA_SELF_TEST 1
+#define CONFIG_OTA_SELF_TEST_DURATION_S 60
+#define CONFIG_OTA_SELF_TEST_CONNECT_TIMEOUT_S 120
+#define CONFIG_OTA_SELF_TEST_BASELINE_WINDOWS 4
+#define CONFIG_OTA_SELF_TEST_MAX_BOOT_PERCENT 150
+#define CONFIG_OTA_SELF_TEST_MAX_RTT_PERCENT 200
+#define CONFIG_OTA_SELF_TEST_MIN_HEAP_PERCENT 80
+#define CONFIG_OTA_ROLLOUT_START_JITTER_S 30
+#define CONFIG_OTA_ROLLOUT_MAX_RATE 0
+#define CONFIG_OTA_ROLLOUT_WINDOW ""
+#define CONFIG_OTA_ROLLOUT_SNTP_SERVER "pool.ntp.org"
+#define CONFIG_APP_JITTER_REPORT_S 10
+#define CONFIG_OTA_TASK_PRIORITY 5
+#define CONFIG_OTA_TASK_CORE -1
+#define CONFIG_APP_TASK_PRIORITY 5
+#define CONFIG_APP_TASK_CORE -1
+#define CONFIG_OTA_TRACE 1
+#define CONFIG_OTA_TRACE_BUFFER_SIZE 256
+#define CONFIG_TB_PAYLOAD_JSON 1
+#define CONFIG_TB_REQUEST_MAX_PENDING 4
+#define CONFIG_TB_RPC_MAX_METHODS 8
@@ -0,0 +1,772 @@
+/**
+ * @file fake_flash.c
+ * Partition, OTA and NVS API of the host build on the flash of fake_storage().
+ *
+ * The flash behaves like NOR flash: an erase sets a sector to 0xFF and a write can only clear bits.
+ * Erases, writes and reads take virtual time, so a simulation sees the cost of the flash operations, the
+ * read back of an image by esp_ota_end() and esp_ota_set_boot_partition() included.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "esp_partition.h"
+#include "esp_ota_ops.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_sleep.h"
+#include "nvs_flash.h"
+#include "mbedtls/md.h"
+#include "fake_host.h"
+#include "fake_state.h"
+
+/* Typical times of the SPI flash of an ESP32 module */
+#define FLASH_ERASE_SECTOR_US 45000
+#define FLASH_WRITE_US_PER_KB 2800
+/*! Read through the flash cache, with the SHA-256 of a read back image */
+#define FLASH_READ_US_PER_KB 250
+
+#define IMAGE_MAGIC 0xE9
+#define IMAGE_HEADER_SIZE 24
+#define IMAGE_SEGMENT_HEADER_SIZE 8
+#define IMAGE_HASH_APPENDED 23
+#define IMAGE_MAX_SEGMENTS 16
+#define IMAGE_DIGEST_SIZE 32
+
+#define NVS_TYPE_U32 1
+#define NVS_TYPE_STR 2
+#define NVS_TYPE_BLOB 3
+
+#define NVS_MAX_HANDLES 16
+
+#define OTA_SLOTS 2
+
+static const esp_partition_t partitions[] = {
+    { .type = ESP_PARTITION_TYPE_DATA, .subtype = ESP_PARTITION_SUBTYPE_DATA_NVS, .address = 0x9000, .size = 0x4000, .label = "nvs" },
+    { .type = ESP_PARTITION_TYPE_DATA, .subtype = ESP_PARTITION_SUBTYPE_DATA_OTA, .address = 0xd000, .size = 0x2000, .label = "otadata" },
+    { .type = ESP_PARTITION_TYPE_APP, .subtype = ESP_PARTITION_SUBTYPE_APP_FACTORY, .address = 0x10000, .size = 0x100000, .label = "factory" },
+    { .type = ESP_PARTITION_TYPE_APP, .subtype = ESP_PARTITION_SUBTYPE_APP_OTA_0, .address = 0x110000, .size = 0x100000, .label = "ota_0" },
+    { .type = ESP_PARTITION_TYPE_APP, .subtype = ESP_PARTITION_SUBTYPE_APP_OTA_1, .address = 0x210000, .size = 0x100000, .label = "ota_1" },
+    { .type = ESP_PARTITION_TYPE_DATA, .subtype = ESP_PARTITION_SUBTYPE_DATA_SPIFFS, .address = 0x310000, .size = 0x40000, .label = "storage" }
+};
+
+#define FACTORY_PARTITION (&partitions[2])
+#define OTA_PARTITION(slot) (&partitions[3 + (slot)])
+
+/*! State of the OTA started with esp_ota_begin(), one at a time */
+struct ota_session
+{
+    esp_ota_handle_t handle;
+    const esp_partition_t *partition;
+    size_t erased;
+    size_t written;
+};
+
+struct nvs_open_handle
+{
+    bool used;
+    bool readonly;
+    char namespace_name[16];
+};
+
+/* Flash, boot and NVS state of one host, see fake_host_create() */
+struct fake_flash
+{
+    struct fake_storage *storage;
+    const esp_partition_t *running_partition;
+    struct ota_session ota;
+    esp_ota_handle_t last_ota_handle;
+    struct nvs_open_handle nvs_handles[NVS_MAX_HANDLES];
+};
+
+static struct fake_storage builtin_storage;
+static struct fake_flash builtin_flash = { .running_partition = FACTORY_PARTITION };
+/*! Host of the calling thread */
+static __thread struct fake_flash *flash = &builtin_flash;
+
+/* RTC_DATA_ATTR variables, see esp_attr.h */
+extern uint8_t __start_fake_rtc_data[] __attribute__((weak));
+extern uint8_t __stop_fake_rtc_data[] __attribute__((weak));
+/*! Contents of the RTC variables at the start of the process, a boot other than a timer wake-up starts with them */
+static uint8_t rtc_initial[FAKE_RTC_DATA_SIZE];
+
+__attribute__((constructor)) static void rtc_initial_save(void)
+{
+    size_t size = __start_fake_rtc_data != NULL ? (size_t) (__stop_fake_rtc_data - __start_fake_rtc_data) : 0;
+    if (size > sizeof(rtc_initial))
+    {
+        fprintf(stderr, "fake_flash: RTC data of %zu bytes exceeds FAKE_RTC_DATA_SIZE\n", size);
+        abort();
+    }
+    if (size != 0)
+    {
+        memcpy(rtc_initial, __start_fake_rtc_data, size);
+    }
+}
+
+struct fake_storage *fake_storage(void)
+{
+    if (flash->storage == NULL)
+    {
+        flash->storage = &builtin_storage;
+        fake_storage_format(flash->storage);
+    }
+    return flash->storage;
+}
+
+void fake_storage_use(struct fake_storage *new_storage)
+{
+    flash->storage = new_storage;
+}
+
+struct fake_flash *fake_flash_create(struct fake_storage *host_storage)
+{
+    struct fake_flash *new_flash = calloc(1, sizeof(*new_flash));
+    if (new_flash == NULL)
+    {
+        abort();
+    }
+    new_flash->storage = host_storage;
+    new_flash->running_partition = FACTORY_PARTITION;
+    return new_flash;
+}
+
+void fake_flash_use(struct fake_flash *new_flash)
+{
+    flash = new_flash != NULL ? new_flash : &builtin_flash;
+}
+
+void fake_flash_destroy(struct fake_flash *host_flash)
+{
+    free(host_flash);
+}
+
+void fake_storage_format(struct fake_storage *format_storage)
+{
+    memset(format_storage, 0, sizeof(*format_storage));
+    memset(format_storage->flash, 0xff, sizeof(format_storage->flash));
+    format_storage->boot_slot = -1;
+    format_storage->slot_state[0] = ESP_OTA_IMG_UNDEFINED;
+    format_storage->slot_state[1] = ESP_OTA_IMG_UNDEFINED;
+}
+
+static int slot_of(const esp_partition_t *partition)
+{
+    for (int slot = 0; slot < OTA_SLOTS; slot++)
+    {
+        if (partition == OTA_PARTITION(slot))
+        {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+static bool in_partition(const esp_partition_t *partition, size_t offset, size_t size)
+{
+    return partition != NULL && offset <= partition->size && size <= partition->size - offset;
+}
+
+/* Partitions */
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label)
+{
+    for (size_t i = 0; i < sizeof(partitions) / sizeof(partitions[0]); i++)
+    {
+        if (partitions[i].type == type && (subtype == ESP_PARTITION_SUBTYPE_ANY || partitions[i].subtype == subtype)
+                        && (label == NULL || strcmp(partitions[i].label, label) == 0))
+        {
+            return &partitions[i];
+        }
+    }
+    return NULL;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst, size_t size)
+{
+    if (!in_partition(partition, src_offset, size))
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(dst, fake_storage()->flash + partition->address + src_offset, size);
+    fake_os_advance_us((int64_t) size * FLASH_READ_US_PER_KB / 1024);
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t dst_offset, const void *src, size_t size)
+{
+    if (!in_partition(partition, dst_offset, size))
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    uint8_t *bytes = fake_storage()->flash + partition->address + dst_offset;
+    const uint8_t *data = src;
+    for (size_t i = 0; i < size; i++)
+    {
+        bytes[i] &= data[i];
+    }
+    fake_os_advance_us((int64_t) size * FLASH_WRITE_US_PER_KB / 1024);
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size)
+{
+    if (!in_partition(partition, offset, size))
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (offset % SPI_FLASH_SEC_SIZE != 0 || size % SPI_FLASH_SEC_SIZE != 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    // The other tasks may run between the sectors, like with SPI_FLASH_YIELD_DURING_ERASE
+    for (size_t sector = offset; sector < offset + size; sector += SPI_FLASH_SEC_SIZE)
+    {
+        memset(fake_storage()->flash + partition->address + sector, 0xff, SPI_FLASH_SEC_SIZE);
+        fake_os_advance_us(FLASH_ERASE_SECTOR_US);
+    }
+    return ESP_OK;
+}
+
+/* Images */
+
+/**
+ * @brief Checks the image written to a partition like the bootloader does: the header, the
+ *        segments within the partition and the SHA-256 appended to the image.
+ */
+static esp_err_t verify_image(const esp_partition_t *partition, size_t *image_len)
+{
+    const uint8_t *image = fake_storage()->flash + partition->address;
+    if (image[0] != IMAGE_MAGIC || image[1] > IMAGE_MAX_SEGMENTS)
+    {
+        return ESP_ERR_OTA_VALIDATE_FAILED;
+    }
+    size_t offset = IMAGE_HEADER_SIZE;
+    for (int segment = 0; segment < image[1]; segment++)
+    {
+        if (offset + IMAGE_SEGMENT_HEADER_SIZE > partition->size)
+        {
+            return ESP_ERR_OTA_VALIDATE_FAILED;
+        }
+        uint32_t data_len;
+        memcpy(&data_len, image + offset + 4, sizeof(data_len));
+        offset += IMAGE_SEGMENT_HEADER_SIZE;
+        if (data_len > partition->size - offset)
+        {
+            return ESP_ERR_OTA_VALIDATE_FAILED;
+        }
+        offset += data_len;
+    }
+    // The checksum byte pads the image to 16 bytes
+    offset = (offset + 16) & ~(size_t) 15;
+    if (image[IMAGE_HASH_APPENDED] == 1)
+    {
+        if (offset + IMAGE_DIGEST_SIZE > partition->size)
+        {
+            return ESP_ERR_OTA_VALIDATE_FAILED;
+        }
+        unsigned char digest[IMAGE_DIGEST_SIZE];
+        mbedtls_md_context_t md_ctx;
+        mbedtls_md_init(&md_ctx);
+        mbedtls_md_setup(&md_ctx, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0);
+        mbedtls_md_starts(&md_ctx);
+        mbedtls_md_update(&md_ctx, image, offset);
+        mbedtls_md_finish(&md_ctx, digest);
+        mbedtls_md_free(&md_ctx);
+        if (memcmp(digest, image + offset, sizeof(digest)) != 0)
+        {
+            return ESP_ERR_OTA_VALIDATE_FAILED;
+        }
+        offset += IMAGE_DIGEST_SIZE;
+    }
+    if (image_len != NULL)
+    {
+        *image_len = offset;
+    }
+    return ESP_OK;
+}
+
+/*! Reads back the image the device wrote and checks it */
+static esp_err_t read_back_image(const esp_partition_t *partition)
+{
+    size_t image_len = 0;
+    esp_err_t err = verify_image(partition, &image_len);
+    fake_os_advance_us((int64_t) (err == ESP_OK ? image_len : IMAGE_HEADER_SIZE) * FLASH_READ_US_PER_KB / 1024);
+    return err;
+}
+
+esp_err_t esp_ota_get_partition_description(const esp_partition_t *partition, esp_app_desc_t *app_desc)
+{
+    if (partition == NULL || app_desc == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    // The description is the start of the first segment
+    esp_partition_read(partition, IMAGE_HEADER_SIZE + IMAGE_SEGMENT_HEADER_SIZE, app_desc, sizeof(*app_desc));
+    return app_desc->magic_word == ESP_APP_DESC_MAGIC_WORD ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+/* OTA */
+
+esp_err_t esp_ota_begin(const esp_partition_t *partition, size_t image_size, esp_ota_handle_t *out_handle)
+{
+    if (partition == NULL || out_handle == NULL || slot_of(partition) < 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (partition == flash->running_partition)
+    {
+        return ESP_ERR_OTA_PARTITION_CONFLICT;
+    }
+    if (flash->ota.handle != 0)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    memset(&flash->ota, 0, sizeof(flash->ota));
+    flash->ota.partition = partition;
+    if (image_size == OTA_SIZE_UNKNOWN)
+    {
+        esp_partition_erase_range(partition, 0, partition->size);
+        flash->ota.erased = partition->size;
+    } else if (image_size != OTA_WITH_SEQUENTIAL_WRITES)
+    {
+        if (image_size > partition->size)
+        {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        flash->ota.erased = (image_size + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+        esp_partition_erase_range(partition, 0, flash->ota.erased);
+    }
+    flash->ota.handle = ++flash->last_ota_handle;
+    *out_handle = flash->ota.handle;
+    return ESP_OK;
+}
+
+static esp_err_t ota_write(esp_ota_handle_t handle, const void *data, size_t size, size_t offset, bool erase)
+{
+    if (handle == 0 || handle != flash->ota.handle)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (offset == 0 && size > 0 && ((const uint8_t*) data)[0] != IMAGE_MAGIC)
+    {
+        return ESP_ERR_OTA_VALIDATE_FAILED;
+    }
+    if (!in_partition(flash->ota.partition, offset, size))
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    // Sequential writes erase the sectors they reach
+    while (erase && flash->ota.erased < offset + size)
+    {
+        esp_partition_erase_range(flash->ota.partition, flash->ota.erased, SPI_FLASH_SEC_SIZE);
+        flash->ota.erased += SPI_FLASH_SEC_SIZE;
+    }
+    esp_err_t err = esp_partition_write(flash->ota.partition, offset, data, size);
+    if (err == ESP_OK && offset + size > flash->ota.written)
+    {
+        flash->ota.written = offset + size;
+    }
+    return err;
+}
+
+esp_err_t esp_ota_write(esp_ota_handle_t handle, const void *data, size_t size)
+{
+    return ota_write(handle, data, size, flash->ota.written, true);
+}
+
+esp_err_t esp_ota_write_with_offset(esp_ota_handle_t handle, const void *data, size_t size, uint32_t offset)
+{
+    // Like IDF, the caller must have erased the range
+    return ota_write(handle, data, size, offset, false);
+}
+
+esp_err_t esp_ota_end(esp_ota_handle_t handle)
+{
+    if (handle == 0 || handle != flash->ota.handle)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+    const esp_partition_t *partition = flash->ota.partition;
+    bool written = flash->ota.written != 0;
+    memset(&flash->ota, 0, sizeof(flash->ota));
+    if (!written)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return read_back_image(partition);
+}
+
+esp_err_t esp_ota_abort(esp_ota_handle_t handle)
+{
+    if (handle == 0 || handle != flash->ota.handle)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+    memset(&flash->ota, 0, sizeof(flash->ota));
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition)
+{
+    if (partition == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_err_t err = read_back_image(partition);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+    struct fake_storage *s = fake_storage();
+    int slot = slot_of(partition);
+    s->boot_slot = slot;
+    if (slot >= 0)
+    {
+        s->slot_state[slot] = ESP_OTA_IMG_NEW;
+    }
+    return ESP_OK;
+}
+
+const esp_partition_t *esp_ota_get_boot_partition(void)
+{
+    int slot = fake_storage()->boot_slot;
+    return slot >= 0 ? OTA_PARTITION(slot) : FACTORY_PARTITION;
+}
+
+const esp_partition_t *esp_ota_get_running_partition(void)
+{
+    return flash->running_partition;
+}
+
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start_from)
+{
+    if (start_from == NULL)
+    {
+        start_from = flash->running_partition;
+    }
+    int slot = slot_of(start_from);
+    return OTA_PARTITION(slot == 0 ? 1 : 0);
+}
+
+const esp_partition_t *esp_ota_get_last_invalid_partition(void)
+{
+    struct fake_storage *s = fake_storage();
+    for (int slot = 0; slot < OTA_SLOTS; slot++)
+    {
+        if (s->slot_state[slot] == ESP_OTA_IMG_INVALID || s->slot_state[slot] == ESP_OTA_IMG_ABORTED)
+        {
+            return OTA_PARTITION(slot);
+        }
+    }
+    return NULL;
+}
+
+esp_err_t esp_ota_get_state_partition(const esp_partition_t *partition, esp_ota_img_states_t *ota_state)
+{
+    int slot = slot_of(partition);
+    if (slot < 0 || ota_state == NULL)
+    {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    *ota_state = fake_storage()->slot_state[slot];
+    return *ota_state == ESP_OTA_IMG_UNDEFINED ? ESP_ERR_NOT_FOUND : ESP_OK;
+}
+
+esp_err_t esp_ota_mark_app_valid_cancel_rollback(void)
+{
+    int slot = slot_of(flash->running_partition);
+    if (slot >= 0)
+    {
+        fake_storage()->slot_state[slot] = ESP_OTA_IMG_VALID;
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_mark_app_invalid_rollback_and_reboot(void)
+{
+    struct fake_storage *s = fake_storage();
+    int slot = slot_of(flash->running_partition);
+    if (slot < 0)
+    {
+        return ESP_ERR_OTA_ROLLBACK_FAILED;
+    }
+    s->slot_state[slot] = ESP_OTA_IMG_INVALID;
+    int other = slot == 0 ? 1 : 0;
+    s->boot_slot = s->slot_state[other] == ESP_OTA_IMG_VALID && verify_image(OTA_PARTITION(other), NULL) == ESP_OK ? other : -1;
+    esp_restart();
+}
+
+/* Boot */
+
+const esp_partition_t *fake_boot(void)
+{
+    struct fake_storage *s = fake_storage();
+    int slot = s->boot_slot;
+    if (slot >= 0)
+    {
+        if (s->slot_state[slot] == ESP_OTA_IMG_NEW)
+        {
+            s->slot_state[slot] = ESP_OTA_IMG_PENDING_VERIFY;
+        } else if (s->slot_state[slot] == ESP_OTA_IMG_PENDING_VERIFY)
+        {
+            // Not confirmed during its first boot
+            s->slot_state[slot] = ESP_OTA_IMG_ABORTED;
+        }
+        if (s->slot_state[slot] == ESP_OTA_IMG_ABORTED || s->slot_state[slot] == ESP_OTA_IMG_INVALID
+                        || verify_image(OTA_PARTITION(slot), NULL) != ESP_OK)
+        {
+            int other = slot == 0 ? 1 : 0;
+            slot = s->slot_state[other] == ESP_OTA_IMG_VALID && verify_image(OTA_PARTITION(other), NULL) == ESP_OK ? other : -1;
+            s->boot_slot = slot;
+        }
+    }
+    flash->running_partition = slot >= 0 ? OTA_PARTITION(slot) : FACTORY_PARTITION;
+
+    if (__start_fake_rtc_data != NULL)
+    {
+        // The boots of a process run one after the other, the RTC memory is only kept over deep sleep
+        size_t size = __stop_fake_rtc_data - __start_fake_rtc_data;
+        bool wake = s->wakeup_cause == ESP_SLEEP_WAKEUP_TIMER && s->rtc_valid && size == s->rtc_size;
+        memcpy(__start_fake_rtc_data, wake ? s->rtc_data : rtc_initial, size);
+    }
+    return flash->running_partition;
+}
+
+void fake_rtc_save(void)
+{
+    struct fake_storage *s = fake_storage();
+    size_t size = __start_fake_rtc_data != NULL ? (size_t) (__stop_fake_rtc_data - __start_fake_rtc_data) : 0;
+    if (size > sizeof(s->rtc_data))
+    {
+        fprintf(stderr, "fake_flash: RTC data of %zu bytes exceeds FAKE_RTC_DATA_SIZE\n", size);
+        abort();
+    }
+    if (size != 0)
+    {
+        memcpy(s->rtc_data, __start_fake_rtc_data, size);
+    }
+    s->rtc_size = size;
+    s->rtc_valid = true;
+}
+
+esp_sleep_wakeup_cause_t esp_sleep_get_wakeup_cause(void)
+{
+    return fake_storage()->wakeup_cause;
+}
+
+esp_err_t esp_sleep_enable_timer_wakeup(uint64_t time_in_us)
+{
+    fake_storage()->sleep_us = time_in_us;
+    return ESP_OK;
+}
+
+void esp_deep_sleep_start(void)
+{
+    struct fake_storage *s = fake_storage();
+    fake_rtc_save();
+    s->wakeup_cause = s->sleep_us != 0 ? ESP_SLEEP_WAKEUP_TIMER : ESP_SLEEP_WAKEUP_UNDEFINED;
+    s->boot_end_us = fake_os_now_us();
+    if (fake_log_level >= ESP_LOG_INFO)
+    {
+        printf("I (%u) fake_os: Entering deep sleep for %llu us\n", esp_log_timestamp(), (unsigned long long) s->sleep_us);
+    }
+    fake_os_exit(FAKE_EXIT_DEEP_SLEEP);
+}
+
+/* NVS */
+
+esp_err_t nvs_flash_init(void)
+{
+    return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase(void)
+{
+    struct fake_storage *s = fake_storage();
+    memset(s->nvs, 0, sizeof(s->nvs));
+    return ESP_OK;
+}
+
+static struct nvs_open_handle *get_handle(nvs_handle_t handle)
+{
+    if (handle == 0 || handle > NVS_MAX_HANDLES || !flash->nvs_handles[handle - 1].used)
+    {
+        return NULL;
+    }
+    return &flash->nvs_handles[handle - 1];
+}
+
+static struct fake_nvs_entry *find_entry(const struct nvs_open_handle *open_handle, const char *key)
+{
+    struct fake_storage *s = fake_storage();
+    for (int i = 0; i < FAKE_NVS_MAX_ENTRIES; i++)
+    {
+        if (s->nvs[i].type != 0 && strcmp(s->nvs[i].namespace_name, open_handle->namespace_name) == 0
+                        && strcmp(s->nvs[i].key, key) == 0)
+        {
+            return &s->nvs[i];
+        }
+    }
+    return NULL;
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle)
+{
+    if (name == NULL || strlen(name) >= sizeof(flash->nvs_handles[0].namespace_name))
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (open_mode == NVS_READONLY)
+    {
+        // A namespace that was never written doesn't exist
+        bool exists = false;
+        struct fake_storage *s = fake_storage();
+        for (int i = 0; i < FAKE_NVS_MAX_ENTRIES && !exists; i++)
+        {
+            exists = s->nvs[i].type != 0 && strcmp(s->nvs[i].namespace_name, name) == 0;
+        }
+        if (!exists)
+        {
+            return ESP_ERR_NVS_NOT_FOUND;
+        }
+    }
+    for (int i = 0; i < NVS_MAX_HANDLES; i++)
+    {
+        if (!flash->nvs_handles[i].used)
+        {
+            flash->nvs_handles[i].used = true;
+            flash->nvs_handles[i].readonly = open_mode == NVS_READONLY;
+            strcpy(flash->nvs_handles[i].namespace_name, name);
+            *out_handle = i + 1;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NO_MEM;
+}
+
+void nvs_close(nvs_handle_t handle)
+{
+    struct nvs_open_handle *open_handle = get_handle(handle);
+    if (open_handle != NULL)
+    {
+        open_handle->used = false;
+    }
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+    return get_handle(handle) != NULL ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+static esp_err_t get_value(nvs_handle_t handle, const char *key, uint8_t type, void *out_value, size_t *length)
+{
+    struct nvs_open_handle *open_handle = get_handle(handle);
+    if (open_handle == NULL || key == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    struct fake_nvs_entry *entry = find_entry(open_handle, key);
+    if (entry == NULL || entry->type != type)
+    {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    if (out_value == NULL)
+    {
+        *length = entry->len;
+        return ESP_OK;
+    }
+    if (*length < entry->len)
+    {
+        *length = entry->len;
+        return ESP_ERR_NVS_INVALID_LENGTH;
+    }
+    memcpy(out_value, entry->value, entry->len);
+    *length = entry->len;
+    return ESP_OK;
+}
+
+static esp_err_t set_value(nvs_handle_t handle, const char *key, uint8_t type, const void *value, size_t length)
+{
+    struct nvs_open_handle *open_handle = get_handle(handle);
+    if (open_handle == NULL || key == NULL || strlen(key) >= sizeof(((struct fake_nvs_entry*) 0)->key))
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (open_handle->readonly)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (length > FAKE_NVS_MAX_VALUE)
+    {
+        return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+    }
+    struct fake_nvs_entry *entry = find_entry(open_handle, key);
+    struct fake_storage *s = fake_storage();
+    for (int i = 0; i < FAKE_NVS_MAX_ENTRIES && entry == NULL; i++)
+    {
+        if (s->nvs[i].type == 0)
+        {
+            entry = &s->nvs[i];
+            strcpy(entry->namespace_name, open_handle->namespace_name);
+            strcpy(entry->key, key);
+        }
+    }
+    if (entry == NULL)
+    {
+        return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+    }
+    entry->type = type;
+    entry->len = length;
+    memcpy(entry->value, value, length);
+    return ESP_OK;
+}
+
+esp_err_t nvs_get_str(nvs_handle_t handle, const char *key, char *out_value, size_t *length)
+{
+    return get_value(handle, key, NVS_TYPE_STR, out_value, length);
+}
+
+esp_err_t nvs_set_str(nvs_handle_t handle, const char *key, const char *value)
+{
+    return set_value(handle, key, NVS_TYPE_STR, value, strlen(value) + 1);
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length)
+{
+    return get_value(handle, key, NVS_TYPE_BLOB, out_value, length);
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length)
+{
+    return set_value(handle, key, NVS_TYPE_BLOB, value, length);
+}
+
+esp_err_t nvs_get_u32(nvs_handle_t handle, const char *key, uint32_t *out_value)
+{
+    size_t length = sizeof(*out_value);
+    return get_value(handle, key, NVS_TYPE_U32, out_value, &length);
+}
+
+esp_err_t nvs_set_u32(nvs_handle_t handle, const char *key, uint32_t value)
+{
+    return set_value(handle, key, NVS_TYPE_U32, &value, sizeof(value));
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key)
+{
+    struct nvs_open_handle *open_handle = get_handle(handle);
+    if (open_handle == NULL || open_handle->readonly)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    struct fake_nvs_entry *entry = find_entry(open_handle, key);
+    if (entry == NULL)
+    {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    memset(entry, 0, sizeof(*entry));
+    return ESP_OK;
+}
@@ -0,0 +1,50 @@
+/**
+ * @file fake_host.c
+ * Hosts of the simulations that run several devices in one process, see fake_host_create().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "fake_host.h"
+#include "fake_state.h"
+
+struct fake_host
+{
+    struct fake_os *os;
+    struct fake_flash *flash;
+    struct fake_net *net;
+};
+
+struct fake_host *fake_host_create(struct fake_storage *storage)
+{
+    struct fake_host *host = malloc(sizeof(*host));
+    if (host == NULL)
+    {
+        abort();
+    }
+    host->os = fake_os_create();
+    host->flash = fake_flash_create(storage);
+    host->net = fake_net_create();
+    return host;
+}
+
+void fake_host_use(struct fake_host *host)
+{
+    fake_os_use(host != NULL ? host->os : NULL);
+    fake_flash_use(host != NULL ? host->flash : NULL);
+    fake_net_use(host != NULL ? host->net : NULL);
+}
+
+int fake_host_exit_status(const struct fake_host *host)
+{
+    return fake_os_exit_status(host->os);
+}
+
+void fake_host_destroy(struct fake_host *host)
+{
+    fake_net_destroy(host->net);
+    fake_flash_destroy(host->flash);
+    fake_os_destroy(host->os);
+    free(host);
+}
@@ -0,0 +1,850 @@
+/**
+ * @file fake_net.c
+ * Wi-Fi, event loop, MQTT, HTTP and SNTP clients of the host build.
+ *
+ * Without fake_os_run() there is no network: publishes are kept for inspection and connections
+ * don't complete. Under fake_os_run() a network task delivers the events of the access point
+ * and the broker set by the simulation after their delays on the virtual clock, see
+ * fake_wifi_ap_set() and fake_mqtt_broker_set(). The HTTP client blocks its task for the
+ * delays of the server set with fake_http_server_set().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_wifi.h"
+#include "esp_event_loop.h"
+#include "esp_http_client.h"
+#include "esp_sntp.h"
+#include "mqtt_client.h"
+#include "fake_host.h"
+#include "fake_state.h"
+
+struct esp_mqtt_client
+{
+    esp_mqtt_client_config_t config;
+    char uri[256];
+    bool started;
+    bool connected;
+    /*! Set while a connect is on its way */
+    bool connecting;
+    /*! Counts the connections, events of an earlier one are dropped */
+    uint32_t session;
+    int msg_id;
+};
+
+enum net_event_type
+{
+    NET_WIFI_EVENT,
+    /*! Connect of the MQTT client, or its reconnect after the reconnect timeout */
+    NET_MQTT_CONNECT,
+    /*! The connect either succeeded or failed */
+    NET_MQTT_CONNECT_DONE,
+    NET_MQTT_EVENT,
+    /*! A publish of the device arrives at the broker */
+    NET_BROKER_PUBLISH
+};
+
+/* Event of the network task, due at a time of the virtual clock */
+struct net_event
+{
+    int64_t due_us;
+    enum net_event_type type;
+    system_event_id_t wifi_event;
+    esp_mqtt_event_id_t mqtt_event;
+    bool connect_failed;
+    uint32_t session;
+    int msg_id;
+    char *topic;
+    char *data;
+    int len;
+    struct net_event *next;
+};
+
+struct esp_http_client
+{
+    char url[256];
+    bool keep_alive;
+    /*! Range of the next request, end -1 for the rest of the resource */
+    int range_start;
+    int range_end;
+    /*! Set while the connection is open, dropped when connection differs from http_connection */
+    bool connected;
+    uint32_t connection;
+    int status;
+    const uint8_t *body;
+    int body_len;
+    int read_len;
+    /*! Time the first byte of the body arrived */
+    int64_t body_us;
+};
+
+/* Wi-Fi, MQTT and HTTP state of one host, see fake_host_create() */
+struct fake_net
+{
+    system_event_cb_t event_cb;
+    void *event_ctx;
+    wifi_storage_t wifi_storage;
+    wifi_config_t wifi_config;
+
+    struct fake_mqtt_message last_publish;
+    int publish_count;
+
+    struct fake_wifi_ap ap;
+    bool wifi_started;
+    bool wifi_connecting;
+    bool wifi_connected;
+
+    struct fake_mqtt_broker broker;
+    /*! The only client that connects, the device has one */
+    struct esp_mqtt_client *mqtt_client;
+    /*! Time the downlink is busy until, messages to the device are sent one after the other */
+    int64_t downlink_busy_until_us;
+
+    struct fake_http_server http_server;
+    /*! Counts the drops of the HTTP connections, see fake_http_server_drop() */
+    uint32_t http_connection;
+
+    /*! Pending events in the order they are due */
+    struct net_event *events;
+    bool net_task_created;
+};
+
+#define FAKE_NET_INITIALIZER { .wifi_storage = WIFI_STORAGE_FLASH, \
+                .ap = { .available = true, .channel = 6, .connect_ms = 2500, .direct_connect_ms = 400 }, \
+                .broker = { .rtt_ms = 50, .connect_ms = 300 }, .http_server = { .connect_ms = 100, .rtt_ms = 50 } }
+
+static struct fake_net builtin_net = FAKE_NET_INITIALIZER;
+/*! Host of the calling thread */
+static __thread struct fake_net *net = &builtin_net;
+
+static void net_task(void *arg);
+static void net_event_free(struct net_event *event);
+
+struct fake_net *fake_net_create(void)
+{
+    struct fake_net *new_net = malloc(sizeof(*new_net));
+    if (new_net == NULL)
+    {
+        abort();
+    }
+    *new_net = (struct fake_net) FAKE_NET_INITIALIZER;
+    return new_net;
+}
+
+void fake_net_use(struct fake_net *new_net)
+{
+    net = new_net != NULL ? new_net : &builtin_net;
+}
+
+void fake_net_destroy(struct fake_net *old_net)
+{
+    while (old_net->events != NULL)
+    {
+        struct net_event *event = old_net->events;
+        old_net->events = event->next;
+        net_event_free(event);
+    }
+    free(old_net->mqtt_client);
+    free(old_net);
+}
+
+/*! Queues an event of the network task, due after delay_us */
+static struct net_event *net_schedule(enum net_event_type type, int64_t delay_us)
+{
+    if (!net->net_task_created)
+    {
+        net->net_task_created = true;
+        xTaskCreate(net_task, "net", 4096, NULL, 20, NULL);
+    }
+
+    struct net_event *event = calloc(1, sizeof(*event));
+    if (event == NULL)
+    {
+        abort();
+    }
+    event->type = type;
+    event->due_us = fake_os_now_us() + delay_us;
+    // Events due at the same time keep their order
+    struct net_event **link = &net->events;
+    while (*link != NULL && (*link)->due_us <= event->due_us)
+    {
+        link = &(*link)->next;
+    }
+    event->next = *link;
+    *link = event;
+    fake_os_changed();
+    return event;
+}
+
+static void net_event_free(struct net_event *event)
+{
+    free(event->topic);
+    free(event->data);
+    free(event);
+}
+
+static char *copy_of(const void *data, int len)
+{
+    char *copy = malloc(len + 1);
+    if (copy == NULL)
+    {
+        abort();
+    }
+    memcpy(copy, data, len);
+    copy[len] = 0;
+    return copy;
+}
+
+static void send_wifi_event(system_event_id_t event_id)
+{
+    system_event_t event;
+    memset(&event, 0, sizeof(event));
+    event.event_id = event_id;
+    if (event_id == SYSTEM_EVENT_STA_GOT_IP)
+    {
+        event.event_info.got_ip.ip_info.ip.addr = 0x6400a8c0;
+    }
+    if (net->event_cb != NULL)
+    {
+        net->event_cb(net->event_ctx, &event);
+    }
+}
+
+static void send_mqtt_event(struct esp_mqtt_client *client, esp_mqtt_event_id_t event_id, const struct net_event *net_event)
+{
+    esp_mqtt_event_t event;
+    memset(&event, 0, sizeof(event));
+    event.event_id = event_id;
+    event.client = client;
+    event.user_context = client->config.user_context;
+    if (net_event != NULL)
+    {
+        event.msg_id = net_event->msg_id;
+        event.topic = net_event->topic;
+        event.topic_len = net_event->topic != NULL ? strlen(net_event->topic) : 0;
+        event.data = net_event->data;
+        event.data_len = net_event->len;
+        event.total_data_len = net_event->len;
+    }
+    if (client->config.event_handle != NULL)
+    {
+        client->config.event_handle(&event);
+    }
+}
+
+/*! Reports a lost connection or a failed connect, the messages on their way are lost */
+static void mqtt_disconnected(struct esp_mqtt_client *client)
+{
+    client->connected = false;
+    client->connecting = false;
+    client->session++;
+    send_mqtt_event(client, MQTT_EVENT_DISCONNECTED, NULL);
+    if (client->started && !client->config.disable_auto_reconnect)
+    {
+        int reconnect_ms = client->config.reconnect_timeout_ms != 0 ? client->config.reconnect_timeout_ms : 10000;
+        net_schedule(NET_MQTT_CONNECT, (int64_t) reconnect_ms * 1000)->session = client->session;
+    }
+}
+
+static void mqtt_connection_lost(struct esp_mqtt_client *client)
+{
+    if (client->connected || client->connecting)
+    {
+        mqtt_disconnected(client);
+    }
+}
+
+static void mqtt_connect(struct esp_mqtt_client *client)
+{
+    if (!client->started || client->connected || client->connecting)
+    {
+        return;
+    }
+    client->connecting = true;
+    send_mqtt_event(client, MQTT_EVENT_BEFORE_CONNECT, NULL);
+    int connect_ms = net->broker.connect_ms;
+    if (!net->wifi_connected)
+    {
+        connect_ms = -(int) net->broker.rtt_ms;
+    } else if (net->broker.connect != NULL)
+    {
+        connect_ms = net->broker.connect(client->uri, net->broker.ctx);
+    }
+    struct net_event *event = net_schedule(NET_MQTT_CONNECT_DONE, (int64_t) abs(connect_ms) * 1000);
+    event->connect_failed = connect_ms < 0;
+    event->session = client->session;
+}
+
+static void mqtt_connect_done(struct esp_mqtt_client *client, const struct net_event *event)
+{
+    if (event->connect_failed || !net->wifi_connected)
+    {
+        mqtt_disconnected(client);
+        return;
+    }
+    client->connecting = false;
+    client->connected = true;
+    net->downlink_busy_until_us = fake_os_now_us();
+    send_mqtt_event(client, MQTT_EVENT_CONNECTED, NULL);
+}
+
+static void net_dispatch(struct net_event *event)
+{
+    struct esp_mqtt_client *client = net->mqtt_client;
+    switch (event->type)
+    {
+    case NET_WIFI_EVENT:
+        if (!net->wifi_started)
+        {
+            break;
+        }
+        if (event->wifi_event == SYSTEM_EVENT_STA_GOT_IP)
+        {
+            net->wifi_connecting = false;
+            net->wifi_connected = true;
+        } else if (event->wifi_event == SYSTEM_EVENT_STA_DISCONNECTED)
+        {
+            net->wifi_connecting = false;
+            net->wifi_connected = false;
+        }
+        send_wifi_event(event->wifi_event);
+        break;
+    case NET_MQTT_CONNECT:
+        if (client != NULL && event->session == client->session)
+        {
+            mqtt_connect(client);
+        }
+        break;
+    case NET_MQTT_CONNECT_DONE:
+        if (client != NULL && event->session == client->session && client->connecting)
+        {
+            mqtt_connect_done(client, event);
+        }
+        break;
+    case NET_MQTT_EVENT:
+        if (client != NULL && client->connected && event->session == client->session)
+        {
+            send_mqtt_event(client, event->mqtt_event, event);
+        }
+        break;
+    case NET_BROKER_PUBLISH:
+        if (client != NULL && client->connected && event->session == client->session && net->broker.publish != NULL)
+        {
+            net->broker.publish(event->topic, event->data, event->len, net->broker.ctx);
+        }
+        break;
+    }
+}
+
+static void net_task(void *arg)
+{
+    (void) arg;
+    for (;;)
+    {
+        struct net_event *event = net->events;
+        if (event == NULL || event->due_us > fake_os_now_us())
+        {
+            fake_os_wait(event != NULL ? event->due_us : INT64_MAX);
+            continue;
+        }
+        net->events = event->next;
+        net_dispatch(event);
+        net_event_free(event);
+    }
+}
+
+void fake_wifi_ap_set(const struct fake_wifi_ap *new_ap)
+{
+    net->ap = *new_ap;
+}
+
+void fake_wifi_ap_drop(void)
+{
+    if (!net->wifi_connected)
+    {
+        return;
+    }
+    net->wifi_connected = false;
+    if (net->mqtt_client != NULL)
+    {
+        mqtt_connection_lost(net->mqtt_client);
+    }
+    net_schedule(NET_WIFI_EVENT, 0)->wifi_event = SYSTEM_EVENT_STA_DISCONNECTED;
+}
+
+bool fake_wifi_connected(void)
+{
+    return net->wifi_connected;
+}
+
+void fake_mqtt_broker_set(const struct fake_mqtt_broker *new_broker)
+{
+    net->broker = *new_broker;
+}
+
+void fake_mqtt_broker_send(const char *topic, const void *data, int len)
+{
+    fake_mqtt_broker_send_at(fake_os_now_us(), topic, data, len);
+}
+
+void fake_mqtt_broker_send_at(int64_t sent_us, const char *topic, const void *data, int len)
+{
+    if (net->mqtt_client == NULL || !net->mqtt_client->connected)
+    {
+        return;
+    }
+    // Half a round trip plus the time on the downlink, behind the messages sent before
+    int64_t now_us = fake_os_now_us();
+    int64_t start_us = net->downlink_busy_until_us > sent_us ? net->downlink_busy_until_us : sent_us;
+    int64_t transfer_us = net->broker.downlink_bytes_per_s != 0
+                    ? (int64_t) len * 1000000 / net->broker.downlink_bytes_per_s : 0;
+    net->downlink_busy_until_us = start_us + transfer_us;
+    struct net_event *event = net_schedule(NET_MQTT_EVENT,
+                    net->downlink_busy_until_us - now_us + net->broker.rtt_ms * 500);
+    event->mqtt_event = MQTT_EVENT_DATA;
+    event->session = net->mqtt_client->session;
+    event->topic = copy_of(topic, strlen(topic));
+    event->data = copy_of(data, len);
+    event->len = len;
+}
+
+void fake_mqtt_broker_drop(void)
+{
+    if (net->mqtt_client != NULL)
+    {
+        mqtt_connection_lost(net->mqtt_client);
+    }
+}
+
+bool fake_mqtt_connected(void)
+{
+    return net->mqtt_client != NULL && net->mqtt_client->connected;
+}
+
+/* Event loop */
+
+esp_err_t esp_event_loop_init(system_event_cb_t cb, void *ctx)
+{
+    net->event_cb = cb;
+    net->event_ctx = ctx;
+    return ESP_OK;
+}
+
+void tcpip_adapter_init(void)
+{
+}
+
+char *ip4addr_ntoa(const ip4_addr_t *addr)
+{
+    static __thread char str[16];
+    const uint8_t *bytes = (const uint8_t*) &addr->addr;
+    snprintf(str, sizeof(str), "%u.%u.%u.%u", bytes[0], bytes[1], bytes[2], bytes[3]);
+    return str;
+}
+
+/* Wi-Fi */
+
+esp_err_t esp_wifi_init(const wifi_init_config_t *config)
+{
+    (void) config;
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_storage(wifi_storage_t storage)
+{
+    net->wifi_storage = storage;
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_mode(wifi_mode_t mode)
+{
+    (void) mode;
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_get_config(esp_interface_t interface, wifi_config_t *conf)
+{
+    (void) interface;
+    struct fake_storage *s = fake_storage();
+    if (net->wifi_config.sta.ssid[0] == 0 && s->wifi_config_valid)
+    {
+        memcpy(net->wifi_config.sta.ssid, s->wifi_ssid, sizeof(net->wifi_config.sta.ssid));
+        memcpy(net->wifi_config.sta.password, s->wifi_password, sizeof(net->wifi_config.sta.password));
+    }
+    *conf = net->wifi_config;
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_config(esp_interface_t interface, wifi_config_t *conf)
+{
+    (void) interface;
+    net->wifi_config = *conf;
+    if (net->wifi_storage == WIFI_STORAGE_FLASH)
+    {
+        struct fake_storage *s = fake_storage();
+        memcpy(s->wifi_ssid, conf->sta.ssid, sizeof(s->wifi_ssid));
+        memcpy(s->wifi_password, conf->sta.password, sizeof(s->wifi_password));
+        s->wifi_config_valid = true;
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_get_mac(esp_interface_t ifx, uint8_t mac[6])
+{
+    (void) ifx;
+    static const uint8_t fake_mac[6] = { 0x24, 0x0a, 0xc4, 0x00, 0x00, 0x01 };
+    memcpy(mac, fake_mac, sizeof(fake_mac));
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_start(void)
+{
+    if (!net->wifi_started)
+    {
+        net->wifi_started = true;
+        net_schedule(NET_WIFI_EVENT, 0)->wifi_event = SYSTEM_EVENT_STA_START;
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_stop(void)
+{
+    fake_wifi_ap_drop();
+    net->wifi_started = false;
+    net->wifi_connecting = false;
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_connect(void)
+{
+    if (!net->wifi_started)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (net->wifi_connecting || net->wifi_connected)
+    {
+        return ESP_OK;
+    }
+    net->wifi_connecting = true;
+    // A BSSID and channel skip the scan, but only find the AP on its channel
+    bool direct = net->wifi_config.sta.bssid_set && net->wifi_config.sta.channel != 0;
+    uint32_t delay_ms = direct ? net->ap.direct_connect_ms : net->ap.connect_ms;
+    bool found = net->ap.available && (!direct || net->wifi_config.sta.channel == net->ap.channel);
+    net_schedule(NET_WIFI_EVENT, (int64_t) delay_ms * 1000)->wifi_event =
+                    found ? SYSTEM_EVENT_STA_GOT_IP : SYSTEM_EVENT_STA_DISCONNECTED;
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_sta_get_ap_info(wifi_ap_record_t *ap_info)
+{
+    memset(ap_info, 0, sizeof(*ap_info));
+    static const uint8_t fake_bssid[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+    memcpy(ap_info->bssid, fake_bssid, sizeof(fake_bssid));
+    memcpy(ap_info->ssid, net->wifi_config.sta.ssid, sizeof(net->wifi_config.sta.ssid));
+    ap_info->primary = net->ap.channel;
+    ap_info->rssi = -60;
+    return ESP_OK;
+}
+
+/* MQTT */
+
+esp_mqtt_client_handle_t esp_mqtt_client_init(const esp_mqtt_client_config_t *config)
+{
+    struct esp_mqtt_client *client = calloc(1, sizeof(*client));
+    if (client != NULL)
+    {
+        client->config = *config;
+        esp_mqtt_client_set_uri(client, config->uri);
+        net->mqtt_client = client;
+    }
+    return client;
+}
+
+esp_err_t esp_mqtt_client_set_uri(esp_mqtt_client_handle_t client, const char *uri)
+{
+    if (uri == NULL || strlen(uri) >= sizeof(client->uri))
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    strcpy(client->uri, uri);
+    return ESP_OK;
+}
+
+esp_err_t esp_mqtt_client_start(esp_mqtt_client_handle_t client)
+{
+    if (client->started)
+    {
+        return ESP_FAIL;
+    }
+    client->started = true;
+    net_schedule(NET_MQTT_CONNECT, 0)->session = client->session;
+    return ESP_OK;
+}
+
+esp_err_t esp_mqtt_client_reconnect(esp_mqtt_client_handle_t client)
+{
+    if (!client->started)
+    {
+        return ESP_FAIL;
+    }
+    // Skips the rest of the reconnect timeout, the scheduled reconnect finds the client connecting
+    if (!client->connected && !client->connecting)
+    {
+        net_schedule(NET_MQTT_CONNECT, 0)->session = client->session;
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_mqtt_client_disconnect(esp_mqtt_client_handle_t client)
+{
+    if (!client->started)
+    {
+        return ESP_FAIL;
+    }
+    mqtt_connection_lost(client);
+    return ESP_OK;
+}
+
+esp_err_t esp_mqtt_client_stop(esp_mqtt_client_handle_t client)
+{
+    client->started = false;
+    mqtt_connection_lost(client);
+    return ESP_OK;
+}
+
+int esp_mqtt_client_subscribe(esp_mqtt_client_handle_t client, const char *topic, int qos)
+{
+    (void) topic;
+    (void) qos;
+    return ++client->msg_id;
+}
+
+int esp_mqtt_client_unsubscribe(esp_mqtt_client_handle_t client, const char *topic)
+{
+    (void) topic;
+    return ++client->msg_id;
+}
+
+int esp_mqtt_client_publish(esp_mqtt_client_handle_t client, const char *topic, const char *data, int len, int qos, int retain)
+{
+    (void) retain;
+    if (client == NULL || topic == NULL)
+    {
+        return -1;
+    }
+    if (len == 0 && data != NULL)
+    {
+        len = strlen(data);
+    }
+    strncpy(net->last_publish.topic, topic, sizeof(net->last_publish.topic) - 1);
+    net->last_publish.len = len < (int) sizeof(net->last_publish.data) ? len : (int) sizeof(net->last_publish.data);
+    memcpy(net->last_publish.data, data, net->last_publish.len);
+    net->last_publish.qos = qos;
+    net->publish_count++;
+    if (!client->started)
+    {
+        return qos > 0 ? ++client->msg_id : 0;
+    }
+    if (!client->connected)
+    {
+        return -1;
+    }
+
+    // Arrives at the broker after half a round trip, the ack of QoS 1 takes the other half
+    int msg_id = qos > 0 ? ++client->msg_id : 0;
+    struct net_event *event = net_schedule(NET_BROKER_PUBLISH, net->broker.rtt_ms * 500);
+    event->session = client->session;
+    event->topic = copy_of(topic, strlen(topic));
+    event->data = copy_of(data, len);
+    event->len = len;
+    if (qos > 0)
+    {
+        event = net_schedule(NET_MQTT_EVENT, net->broker.rtt_ms * 1000);
+        event->mqtt_event = MQTT_EVENT_PUBLISHED;
+        event->session = client->session;
+        event->msg_id = msg_id;
+    }
+    return msg_id;
+}
+
+esp_err_t esp_mqtt_client_destroy(esp_mqtt_client_handle_t client)
+{
+    if (client == net->mqtt_client)
+    {
+        net->mqtt_client = NULL;
+    }
+    free(client);
+    return ESP_OK;
+}
+
+const struct fake_mqtt_message *fake_mqtt_last_publish(int *count)
+{
+    if (count != NULL)
+    {
+        *count = net->publish_count;
+    }
+    return &net->last_publish;
+}
+
+/* HTTP */
+
+void fake_http_server_set(const struct fake_http_server *server)
+{
+    net->http_server = *server;
+}
+
+void fake_http_server_drop(void)
+{
+    net->http_connection++;
+}
+
+/*! Blocks the calling task until the virtual time reaches due_us */
+static void http_wait_until(int64_t due_us)
+{
+    while (fake_os_wait(due_us))
+    {
+    }
+}
+
+/*! Returns true while the connection of the client is open, a dropped one is closed */
+static bool http_connected(esp_http_client_handle_t client)
+{
+    if (client->connected && (client->connection != net->http_connection || !net->wifi_connected))
+    {
+        client->connected = false;
+    }
+    return client->connected;
+}
+
+esp_http_client_handle_t esp_http_client_init(const esp_http_client_config_t *config)
+{
+    struct esp_http_client *client = calloc(1, sizeof(*client));
+    if (client != NULL)
+    {
+        strncpy(client->url, config->url, sizeof(client->url) - 1);
+        client->keep_alive = config->keep_alive_enable;
+        client->range_end = -1;
+    }
+    return client;
+}
+
+esp_err_t esp_http_client_set_header(esp_http_client_handle_t client, const char *key, const char *value)
+{
+    if (strcasecmp(key, "Range") == 0 && sscanf(value, "bytes=%d-%d", &client->range_start, &client->range_end) < 1)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_http_client_open(esp_http_client_handle_t client, int write_len)
+{
+    (void) write_len;
+    client->status = 0;
+    client->body = NULL;
+    client->body_len = 0;
+    client->read_len = 0;
+    if (net->http_server.get == NULL || !net->wifi_connected)
+    {
+        return ESP_FAIL;
+    }
+    // A kept alive connection saves the handshake
+    if (!http_connected(client))
+    {
+        http_wait_until(fake_os_now_us() + (int64_t) net->http_server.connect_ms * 1000);
+        if (!net->wifi_connected)
+        {
+            return ESP_FAIL;
+        }
+        client->connected = true;
+        client->connection = net->http_connection;
+    }
+    return ESP_OK;
+}
+
+int esp_http_client_fetch_headers(esp_http_client_handle_t client)
+{
+    if (!http_connected(client))
+    {
+        return ESP_FAIL;
+    }
+    // The request takes half a round trip to the server and the headers the other half
+    http_wait_until(fake_os_now_us() + (int64_t) net->http_server.rtt_ms * 1000);
+    if (!http_connected(client))
+    {
+        return ESP_FAIL;
+    }
+    client->status = net->http_server.get(client->url, client->range_start, client->range_end, &client->body, &client->body_len,
+                    net->http_server.ctx);
+    if (client->status == 0)
+    {
+        client->connected = false;
+        return ESP_FAIL;
+    }
+    client->body_us = fake_os_now_us();
+    return client->body_len;
+}
+
+int esp_http_client_get_status_code(esp_http_client_handle_t client)
+{
+    return client->status;
+}
+
+int esp_http_client_read(esp_http_client_handle_t client, char *buffer, int len)
+{
+    int n = client->body_len - client->read_len < len ? client->body_len - client->read_len : len;
+    if (!http_connected(client) || client->body == NULL)
+    {
+        return -1;
+    }
+    // The body streams in at the throughput of the server from the time of the headers
+    if (net->http_server.bytes_per_s != 0)
+    {
+        http_wait_until(client->body_us + (int64_t) (client->read_len + n) * 1000000 / net->http_server.bytes_per_s);
+        if (!http_connected(client))
+        {
+            return -1;
+        }
+    }
+    memcpy(buffer, client->body + client->read_len, n);
+    client->read_len += n;
+    if (client->read_len == client->body_len && !client->keep_alive)
+    {
+        client->connected = false;
+    }
+    return n;
+}
+
+esp_err_t esp_http_client_close(esp_http_client_handle_t client)
+{
+    client->connected = false;
+    return ESP_OK;
+}
+
+esp_err_t esp_http_client_cleanup(esp_http_client_handle_t client)
+{
+    free(client);
+    return ESP_OK;
+}
+
+/* SNTP */
+
+void sntp_setoperatingmode(uint8_t operating_mode)
+{
+    (void) operating_mode;
+}
+
+void sntp_setservername(uint8_t idx, const char *server)
+{
+    (void) idx;
+    (void) server;
+}
+
+void sntp_init(void)
+{
+}
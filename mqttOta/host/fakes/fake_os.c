@@ -0,0 +1,850 @@
+/**
+ * @file fake_os.c
+ * FreeRTOS, esp_timer, log and system services of the host build on a virtual clock.
+ *
+ * The benchmark calls the device code directly, nothing runs concurrently: a wait that can't be
+ * satisfied moves the clock to its timeout, running the esp_timer callbacks that fall due, and a
+ * wait without timeout aborts.
+ *
+ * The simulation runs the tasks with fake_os_run() instead, as coroutines on one host thread.
+ * A task runs until it blocks, it is resumed after any other task or timer changed a kernel
+ * object or when its timeout passed. The clock only moves when all tasks block, to the earliest
+ * timeout, so the device code takes no time except for the costs the fakes add to the clock. A task
+ * that spent such a cost, e.g. a flash erase, lets the other tasks run before it continues.
+ * The esp_timer callbacks run in a task of their own like on the device.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ucontext.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
+#include "freertos/event_groups.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "fake_host.h"
+#include "fake_state.h"
+
+#define FAKE_HEAP_SIZE (200 * 1024)
+
+/*! Stack of a task run by fake_os_run(), the host code needs more than the device */
+#define FAKE_TASK_STACK_SIZE (256 * 1024)
+
+struct fake_task
+{
+    char name[16];
+    TaskFunction_t code;
+    void *parameters;
+    uint32_t notify_count;
+    /* Coroutine of the task once fake_os_run() started it */
+    bool started;
+    bool deleted;
+    ucontext_t context;
+    void *stack;
+    /*! Timeout of the wait the task blocks in and the change count when it blocked */
+    int64_t wait_deadline_us;
+    uint64_t wait_change;
+    struct fake_task *next;
+};
+
+struct fake_semaphore
+{
+    UBaseType_t count;
+    UBaseType_t max_count;
+};
+
+struct fake_queue
+{
+    UBaseType_t length;
+    UBaseType_t item_size;
+    UBaseType_t head;
+    UBaseType_t count;
+    uint8_t items[];
+};
+
+struct fake_event_group
+{
+    EventBits_t bits;
+};
+
+struct esp_timer
+{
+    esp_timer_cb_t callback;
+    void *arg;
+    const char *name;
+    /*! Time the callback is due, -1 while stopped */
+    int64_t due_us;
+    uint64_t period_us;
+    struct esp_timer *next;
+};
+
+/* Clock, timers and tasks of one host, see fake_host_create() */
+struct fake_os
+{
+    int64_t now_us;
+    uint32_t random_state;
+    uint32_t free_heap;
+    uint32_t min_free_heap;
+    uint8_t chip_revision;
+    struct esp_timer *timers;
+
+    /*! Stands for the task calling in, it is never created */
+    struct fake_task main_task;
+
+    /* Scheduler of fake_os_run(), tasks in creation order */
+    struct fake_task *tasks;
+    struct fake_task *current_task;
+    bool running;
+    ucontext_t scheduler_context;
+    /*! Counts the changes of kernel objects, a blocked task is resumed when it moved */
+    uint64_t change_count;
+    /*! Set when a boot of a created host restarted or went to deep sleep, see fake_os_exit() */
+    int exit_status;
+};
+
+esp_log_level_t fake_log_level = ESP_LOG_INFO;
+
+#define FAKE_OS_INITIALIZER { .random_state = 1, .free_heap = FAKE_HEAP_SIZE, .min_free_heap = FAKE_HEAP_SIZE, \
+                .chip_revision = 1, .main_task = { .name = "main" } }
+
+static struct fake_os builtin_os = FAKE_OS_INITIALIZER;
+/*! Host of the calling thread */
+static __thread struct fake_os *os = &builtin_os;
+
+int64_t fake_os_now_us(void)
+{
+    return os->now_us;
+}
+
+static void yield(void);
+
+static struct esp_timer *next_due_timer(int64_t until_us)
+{
+    struct esp_timer *due = NULL;
+    for (struct esp_timer *timer = os->timers; timer != NULL; timer = timer->next)
+    {
+        if (timer->due_us >= 0 && timer->due_us <= until_us && (due == NULL || timer->due_us < due->due_us))
+        {
+            due = timer;
+        }
+    }
+    return due;
+}
+
+void fake_os_advance_us(int64_t us)
+{
+    if (os->running)
+    {
+        // A task keeps the CPU busy, then the tasks that became ready meanwhile get their turn like on a
+        // preemptive scheduler. The timer task runs the callbacks that fell due.
+        os->now_us += us;
+        yield();
+        return;
+    }
+
+    const int64_t target_us = os->now_us + us;
+    struct esp_timer *timer;
+    while ((timer = next_due_timer(target_us)) != NULL)
+    {
+        if (timer->due_us > os->now_us)
+        {
+            os->now_us = timer->due_us;
+        }
+        timer->due_us = timer->period_us != 0 ? timer->due_us + (int64_t) timer->period_us : -1;
+        timer->callback(timer->arg);
+    }
+    if (target_us > os->now_us)
+    {
+        os->now_us = target_us;
+    }
+}
+
+void fake_os_changed(void)
+{
+    os->change_count++;
+}
+
+/*! Switches from the running task to the scheduler until the task is resumed */
+static void switch_to_scheduler(int64_t deadline_us)
+{
+    struct fake_task *task = os->current_task;
+    task->wait_deadline_us = deadline_us;
+    task->wait_change = os->change_count;
+    swapcontext(&task->context, &os->scheduler_context);
+}
+
+/**
+ * @brief Waits for the state of a kernel object to change. Under fake_os_run() the task blocks
+ *        until another task changes something or the deadline passes. Otherwise only an esp_timer
+ *        callback can change anything, the clock moves to the next timer or the deadline,
+ *        whichever comes first.
+ *
+ * @return bool False once the deadline passed
+ */
+static bool block_until(int64_t deadline_us)
+{
+    if (os->now_us >= deadline_us)
+    {
+        return false;
+    }
+    if (os->current_task != NULL)
+    {
+        switch_to_scheduler(deadline_us);
+        return true;
+    }
+    struct esp_timer *timer = next_due_timer(deadline_us);
+    if (timer == NULL && deadline_us == INT64_MAX)
+    {
+        fprintf(stderr, "fake_os: wait without timeout would block forever\n");
+        abort();
+    }
+    fake_os_advance_us((timer != NULL ? timer->due_us : deadline_us) - os->now_us);
+    return true;
+}
+
+static int64_t deadline_of(TickType_t ticks)
+{
+    return ticks == portMAX_DELAY ? INT64_MAX : os->now_us + (int64_t) ticks * portTICK_PERIOD_MS * 1000;
+}
+
+bool fake_os_wait(int64_t deadline_us)
+{
+    return block_until(deadline_us);
+}
+
+/*! Lets the other tasks run, like a delay of 0 ticks */
+static void yield(void)
+{
+    if (os->current_task != NULL)
+    {
+        switch_to_scheduler(os->now_us);
+    }
+}
+
+/*! Runs the esp_timer callbacks when they fall due, like the esp_timer task of the device */
+static void timer_task(void *arg)
+{
+    (void) arg;
+    for (;;)
+    {
+        struct esp_timer *timer = next_due_timer(INT64_MAX);
+        if (timer != NULL && timer->due_us <= os->now_us)
+        {
+            timer->due_us = timer->period_us != 0 ? timer->due_us + (int64_t) timer->period_us : -1;
+            timer->callback(timer->arg);
+            continue;
+        }
+        block_until(timer != NULL ? timer->due_us : INT64_MAX);
+    }
+}
+
+static void task_main(void)
+{
+    os->current_task->code(os->current_task->parameters);
+    fprintf(stderr, "fake_os: task %s returned\n", os->current_task->name);
+    abort();
+}
+
+static bool task_runnable(const struct fake_task *task)
+{
+    return !task->deleted && (!task->started || task->wait_change != os->change_count
+                    || os->now_us >= task->wait_deadline_us);
+}
+
+static void run_task(struct fake_task *task)
+{
+    if (!task->started)
+    {
+        task->stack = malloc(FAKE_TASK_STACK_SIZE);
+        if (task->stack == NULL)
+        {
+            fprintf(stderr, "fake_os: no memory for the stack of %s\n", task->name);
+            abort();
+        }
+        getcontext(&task->context);
+        task->context.uc_stack.ss_sp = task->stack;
+        task->context.uc_stack.ss_size = FAKE_TASK_STACK_SIZE;
+        task->context.uc_link = NULL;
+        makecontext(&task->context, task_main, 0);
+        task->started = true;
+    }
+    os->current_task = task;
+    swapcontext(&os->scheduler_context, &task->context);
+    os->current_task = NULL;
+    if (task->deleted)
+    {
+        free(task->stack);
+        task->stack = NULL;
+    }
+}
+
+bool fake_os_run(int64_t until_us)
+{
+    if (!os->running)
+    {
+        os->running = true;
+        xTaskCreate(timer_task, "esp_timer", 4096, NULL, 22, NULL);
+    }
+
+    while (os->now_us < until_us)
+    {
+        bool ran = false;
+        for (struct fake_task *task = os->tasks; task != NULL; task = task->next)
+        {
+            if (task_runnable(task))
+            {
+                run_task(task);
+                ran = true;
+            }
+            if (os->exit_status != 0)
+            {
+                return true;
+            }
+        }
+        if (ran)
+        {
+            continue;
+        }
+
+        // All tasks block, move the clock to the first timeout
+        int64_t next_us = INT64_MAX;
+        for (struct fake_task *task = os->tasks; task != NULL; task = task->next)
+        {
+            if (!task->deleted && task->wait_deadline_us < next_us)
+            {
+                next_us = task->wait_deadline_us;
+            }
+        }
+        if (next_us == INT64_MAX)
+        {
+            fprintf(stderr, "fake_os: all tasks wait without timeout\n");
+            return false;
+        }
+        os->now_us = next_us < until_us ? next_us : until_us;
+    }
+    return true;
+}
+
+void fake_os_exit(int status)
+{
+    fflush(stdout);
+    if (os == &builtin_os || os->current_task == NULL)
+    {
+        exit(status);
+    }
+    // The boot of a created host ends in its own fake_os_run(), the task is never resumed
+    os->exit_status = status;
+    for (;;)
+    {
+        swapcontext(&os->current_task->context, &os->scheduler_context);
+    }
+}
+
+struct fake_os *fake_os_create(void)
+{
+    struct fake_os *new_os = malloc(sizeof(*new_os));
+    if (new_os == NULL)
+    {
+        abort();
+    }
+    *new_os = (struct fake_os) FAKE_OS_INITIALIZER;
+    return new_os;
+}
+
+void fake_os_use(struct fake_os *new_os)
+{
+    os = new_os != NULL ? new_os : &builtin_os;
+}
+
+int fake_os_exit_status(const struct fake_os *host_os)
+{
+    return host_os->exit_status;
+}
+
+void fake_os_destroy(struct fake_os *host_os)
+{
+    while (host_os->tasks != NULL)
+    {
+        struct fake_task *task = host_os->tasks;
+        host_os->tasks = task->next;
+        free(task->stack);
+        free(task);
+    }
+    while (host_os->timers != NULL)
+    {
+        struct esp_timer *timer = host_os->timers;
+        host_os->timers = timer->next;
+        free(timer);
+    }
+    free(host_os);
+}
+
+void fake_os_seed(uint32_t seed)
+{
+    os->random_state = seed != 0 ? seed : 1;
+}
+
+void fake_os_set_free_heap(uint32_t heap)
+{
+    os->free_heap = heap;
+    if (heap < os->min_free_heap)
+    {
+        os->min_free_heap = heap;
+    }
+}
+
+void fake_os_set_chip_revision(uint8_t revision)
+{
+    os->chip_revision = revision;
+}
+
+/* Log */
+
+void esp_log_level_set(const char *tag, esp_log_level_t level)
+{
+    if (strcmp(tag, "*") == 0)
+    {
+        fake_log_level = level;
+    }
+}
+
+uint32_t esp_log_timestamp(void)
+{
+    return (uint32_t) (os->now_us / 1000);
+}
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...)
+{
+    (void) level;
+    (void) tag;
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+}
+
+/* System */
+
+const char *esp_err_to_name(esp_err_t code)
+{
+    switch (code)
+    {
+    case ESP_OK:
+        return "ESP_OK";
+    case ESP_FAIL:
+        return "ESP_FAIL";
+    case ESP_ERR_NO_MEM:
+        return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG:
+        return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE:
+        return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_INVALID_SIZE:
+        return "ESP_ERR_INVALID_SIZE";
+    case ESP_ERR_NOT_FOUND:
+        return "ESP_ERR_NOT_FOUND";
+    case ESP_ERR_NOT_SUPPORTED:
+        return "ESP_ERR_NOT_SUPPORTED";
+    case ESP_ERR_TIMEOUT:
+        return "ESP_ERR_TIMEOUT";
+    case ESP_ERR_NVS_NOT_FOUND:
+        return "ESP_ERR_NVS_NOT_FOUND";
+    case ESP_ERR_NVS_NOT_ENOUGH_SPACE:
+        return "ESP_ERR_NVS_NOT_ENOUGH_SPACE";
+    case ESP_ERR_NVS_INVALID_LENGTH:
+        return "ESP_ERR_NVS_INVALID_LENGTH";
+    case ESP_ERR_OTA_VALIDATE_FAILED:
+        return "ESP_ERR_OTA_VALIDATE_FAILED";
+    case ESP_ERR_OTA_ROLLBACK_FAILED:
+        return "ESP_ERR_OTA_ROLLBACK_FAILED";
+    default:
+        return "UNKNOWN ERROR";
+    }
+}
+
+void _esp_error_check_failed(esp_err_t rc, const char *file, int line, const char *function, const char *expression)
+{
+    fprintf(stderr, "ESP_ERROR_CHECK failed: esp_err_t 0x%x (%s) at %s:%d in %s: %s\n", rc, esp_err_to_name(rc), file, line,
+                    function, expression);
+    abort();
+}
+
+void esp_restart(void)
+{
+    struct fake_storage *s = fake_storage();
+    s->wakeup_cause = ESP_SLEEP_WAKEUP_UNDEFINED;
+    s->boot_end_us = os->now_us;
+    if (fake_log_level >= ESP_LOG_INFO)
+    {
+        printf("I (%u) fake_os: Restarting\n", esp_log_timestamp());
+    }
+    fake_os_exit(FAKE_EXIT_RESTART);
+}
+
+uint32_t esp_random(void)
+{
+    // xorshift32, the same sequence for the same seed
+    os->random_state ^= os->random_state << 13;
+    os->random_state ^= os->random_state >> 17;
+    os->random_state ^= os->random_state << 5;
+    return os->random_state;
+}
+
+uint32_t esp_get_free_heap_size(void)
+{
+    return os->free_heap;
+}
+
+uint32_t esp_get_minimum_free_heap_size(void)
+{
+    return os->min_free_heap;
+}
+
+void esp_chip_info(esp_chip_info_t *out_info)
+{
+    memset(out_info, 0, sizeof(*out_info));
+    out_info->model = CHIP_ESP32;
+    out_info->cores = 2;
+    out_info->revision = os->chip_revision;
+}
+
+/* esp_timer */
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *create_args, esp_timer_handle_t *out_handle)
+{
+    if (create_args == NULL || create_args->callback == NULL || out_handle == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    struct esp_timer *timer = calloc(1, sizeof(*timer));
+    if (timer == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    timer->callback = create_args->callback;
+    timer->arg = create_args->arg;
+    timer->name = create_args->name;
+    timer->due_us = -1;
+    timer->next = os->timers;
+    os->timers = timer;
+    *out_handle = timer;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    if (timer->due_us >= 0)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->due_us = os->now_us + (int64_t) timeout_us;
+    timer->period_us = 0;
+    fake_os_changed();
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period)
+{
+    if (timer->due_us >= 0)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->due_us = os->now_us + (int64_t) period;
+    timer->period_us = period;
+    fake_os_changed();
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    if (timer->due_us < 0)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->due_us = -1;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer)
+{
+    for (struct esp_timer **link = &os->timers; *link != NULL; link = &(*link)->next)
+    {
+        if (*link == timer)
+        {
+            *link = timer->next;
+            free(timer);
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_INVALID_ARG;
+}
+
+int64_t esp_timer_get_time(void)
+{
+    return os->now_us;
+}
+
+/* Tasks */
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t pvTaskCode, const char *pcName, uint32_t usStackDepth, void *pvParameters,
+                UBaseType_t uxPriority, TaskHandle_t *pvCreatedTask, BaseType_t xCoreID)
+{
+    (void) usStackDepth;
+    (void) uxPriority;
+    (void) xCoreID;
+    struct fake_task *task = calloc(1, sizeof(*task));
+    if (task == NULL)
+    {
+        return pdFAIL;
+    }
+    strncpy(task->name, pcName, sizeof(task->name) - 1);
+    task->code = pvTaskCode;
+    task->parameters = pvParameters;
+    // The task only runs under fake_os_run(), the benchmark drives the code it measures itself
+    struct fake_task **link = &os->tasks;
+    while (*link != NULL)
+    {
+        link = &(*link)->next;
+    }
+    *link = task;
+    if (pvCreatedTask != NULL)
+    {
+        *pvCreatedTask = task;
+    }
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t xTaskToDelete)
+{
+    struct fake_task *task = xTaskToDelete != NULL ? xTaskToDelete : xTaskGetCurrentTaskHandle();
+    if (task == &os->main_task)
+    {
+        return;
+    }
+    // Kept in the list, the stack is freed once the task isn't running
+    task->deleted = true;
+    fake_os_changed();
+    if (task == os->current_task)
+    {
+        swapcontext(&task->context, &os->scheduler_context);
+    } else if (task->stack != NULL)
+    {
+        free(task->stack);
+        task->stack = NULL;
+    }
+}
+
+void vTaskDelay(const TickType_t xTicksToDelay)
+{
+    if (xTicksToDelay == 0)
+    {
+        yield();
+        return;
+    }
+    const int64_t deadline_us = deadline_of(xTicksToDelay);
+    while (block_until(deadline_us))
+    {
+    }
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    return (TickType_t) (os->now_us / (portTICK_PERIOD_MS * 1000));
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    return os->current_task != NULL ? os->current_task : &os->main_task;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t xTaskToNotify)
+{
+    xTaskToNotify->notify_count++;
+    fake_os_changed();
+    return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t xClearCountOnExit, TickType_t xTicksToWait)
+{
+    struct fake_task *task = xTaskGetCurrentTaskHandle();
+    const int64_t deadline_us = deadline_of(xTicksToWait);
+    while (task->notify_count == 0 && block_until(deadline_us))
+    {
+    }
+    uint32_t count = task->notify_count;
+    if (count != 0)
+    {
+        task->notify_count = xClearCountOnExit ? 0 : count - 1;
+    }
+    return count;
+}
+
+void taskYIELD(void)
+{
+    yield();
+}
+
+/* Semaphores */
+
+static SemaphoreHandle_t semaphore_create(UBaseType_t max_count, UBaseType_t initial_count)
+{
+    struct fake_semaphore *semaphore = calloc(1, sizeof(*semaphore));
+    if (semaphore != NULL)
+    {
+        semaphore->max_count = max_count;
+        semaphore->count = initial_count;
+    }
+    return semaphore;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    return semaphore_create(1, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return semaphore_create(1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t uxMaxCount, UBaseType_t uxInitialCount)
+{
+    return semaphore_create(uxMaxCount, uxInitialCount);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t xSemaphore, TickType_t xBlockTime)
+{
+    const int64_t deadline_us = deadline_of(xBlockTime);
+    while (xSemaphore->count == 0)
+    {
+        if (!block_until(deadline_us))
+        {
+            return pdFALSE;
+        }
+    }
+    xSemaphore->count--;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t xSemaphore)
+{
+    if (xSemaphore->count >= xSemaphore->max_count)
+    {
+        return pdFALSE;
+    }
+    xSemaphore->count++;
+    fake_os_changed();
+    return pdTRUE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t xSemaphore)
+{
+    free(xSemaphore);
+}
+
+/* Queues */
+
+QueueHandle_t xQueueCreate(UBaseType_t uxQueueLength, UBaseType_t uxItemSize)
+{
+    struct fake_queue *queue = calloc(1, sizeof(*queue) + uxQueueLength * uxItemSize);
+    if (queue != NULL)
+    {
+        queue->length = uxQueueLength;
+        queue->item_size = uxItemSize;
+    }
+    return queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t xQueue, const void *pvItemToQueue, TickType_t xTicksToWait)
+{
+    const int64_t deadline_us = deadline_of(xTicksToWait);
+    while (xQueue->count == xQueue->length)
+    {
+        if (!block_until(deadline_us))
+        {
+            return pdFALSE;
+        }
+    }
+    UBaseType_t tail = (xQueue->head + xQueue->count) % xQueue->length;
+    memcpy(xQueue->items + tail * xQueue->item_size, pvItemToQueue, xQueue->item_size);
+    xQueue->count++;
+    fake_os_changed();
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t xQueue, void *pvBuffer, TickType_t xTicksToWait)
+{
+    const int64_t deadline_us = deadline_of(xTicksToWait);
+    while (xQueue->count == 0)
+    {
+        if (!block_until(deadline_us))
+        {
+            return pdFALSE;
+        }
+    }
+    memcpy(pvBuffer, xQueue->items + xQueue->head * xQueue->item_size, xQueue->item_size);
+    xQueue->head = (xQueue->head + 1) % xQueue->length;
+    xQueue->count--;
+    fake_os_changed();
+    return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t xQueue)
+{
+    return xQueue->count;
+}
+
+void vQueueDelete(QueueHandle_t xQueue)
+{
+    free(xQueue);
+}
+
+/* Event groups */
+
+EventGroupHandle_t xEventGroupCreate(void)
+{
+    return calloc(1, sizeof(struct fake_event_group));
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t xEventGroup, const EventBits_t uxBitsToSet)
+{
+    xEventGroup->bits |= uxBitsToSet;
+    fake_os_changed();
+    return xEventGroup->bits;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t xEventGroup, const EventBits_t uxBitsToClear)
+{
+    EventBits_t bits = xEventGroup->bits;
+    xEventGroup->bits &= ~uxBitsToClear;
+    return bits;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t xEventGroup, const EventBits_t uxBitsToWaitFor, const BaseType_t xClearOnExit,
+                const BaseType_t xWaitForAllBits, TickType_t xTicksToWait)
+{
+    const int64_t deadline_us = deadline_of(xTicksToWait);
+    for (;;)
+    {
+        EventBits_t bits = xEventGroup->bits;
+        bool satisfied = xWaitForAllBits ? (bits & uxBitsToWaitFor) == uxBitsToWaitFor : (bits & uxBitsToWaitFor) != 0;
+        if (satisfied)
+        {
+            if (xClearOnExit)
+            {
+                xEventGroup->bits &= ~uxBitsToWaitFor;
+            }
+            return bits;
+        }
+        if (!block_until(deadline_us))
+        {
+            return bits;
+        }
+    }
+}
@@ -0,0 +1,48 @@
+/**
+ * @file fake_state.h
+ * State of one host in each of the fakes, combined by fake_host_create(). The fakes work on the state
+ * selected for the calling thread, the built-in one unless fake_host_use() selected another.
+ */
+
+#ifndef PRJ_FAKE_STATE_MODULE
+#define PRJ_FAKE_STATE_MODULE
+
+#include "fake_host.h"
+
+struct fake_os;
+struct fake_flash;
+struct fake_net;
+
+/*! Returns a new scheduler, clock and random generator, with no tasks */
+struct fake_os *fake_os_create(void);
+
+/*! Selects the scheduler of the calling thread, NULL for the built-in one */
+void fake_os_use(struct fake_os *os);
+
+/*! Returns the FAKE_EXIT status a boot of the scheduler ended with, 0 while it runs */
+int fake_os_exit_status(const struct fake_os *os);
+
+/*! Frees the scheduler with its tasks and timers, it must not run */
+void fake_os_destroy(struct fake_os *os);
+
+/*! Ends the boot: exits the process on the built-in scheduler, else returns from fake_os_run() */
+void fake_os_exit(int status) __attribute__((noreturn));
+
+/*! Returns new partitions and NVS handles on the given storage */
+struct fake_flash *fake_flash_create(struct fake_storage *storage);
+
+/*! Selects the flash of the calling thread, NULL for the built-in one */
+void fake_flash_use(struct fake_flash *flash);
+
+void fake_flash_destroy(struct fake_flash *flash);
+
+/*! Returns a new network with the default access point, broker and HTTP server */
+struct fake_net *fake_net_create(void);
+
+/*! Selects the network of the calling thread, NULL for the built-in one */
+void fake_net_use(struct fake_net *net);
+
+/*! Frees the network with its pending events and MQTT client */
+void fake_net_destroy(struct fake_net *net);
+
+#endif
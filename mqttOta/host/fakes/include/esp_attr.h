@@ -0,0 +1,16 @@
+/**
+ * @file esp_attr.h
+ * Host version of the ESP-IDF placement attributes.
+ */
+
+#ifndef PRJ_FAKE_ESP_ATTR_MODULE
+#define PRJ_FAKE_ESP_ATTR_MODULE
+
+#define IRAM_ATTR
+#define DRAM_ATTR
+
+/*! Variables kept in the RTC memory over deep sleep, see fake_rtc_save() */
+#define RTC_DATA_ATTR __attribute__((section("fake_rtc_data")))
+#define RTC_NOINIT_ATTR __attribute__((section("fake_rtc_data")))
+
+#endif
@@ -0,0 +1,17 @@
+/**
+ * @file esp_crt_bundle.h
+ * Host version of the ESP-IDF certificate bundle, the fake transports don't use TLS.
+ */
+
+#ifndef PRJ_FAKE_ESP_CRT_BUNDLE_MODULE
+#define PRJ_FAKE_ESP_CRT_BUNDLE_MODULE
+
+#include "esp_err.h"
+
+static inline esp_err_t esp_crt_bundle_attach(void *conf)
+{
+    (void) conf;
+    return ESP_OK;
+}
+
+#endif
@@ -0,0 +1,58 @@
+/**
+ * @file esp_err.h
+ * Host version of the ESP-IDF error codes used by the example.
+ */
+
+#ifndef PRJ_FAKE_ESP_ERR_MODULE
+#define PRJ_FAKE_ESP_ERR_MODULE
+
+#include <stdint.h>
+#include "sdkconfig.h"
+
+typedef int esp_err_t;
+
+#define ESP_OK 0
+#define ESP_FAIL -1
+
+#define ESP_ERR_NO_MEM 0x101
+#define ESP_ERR_INVALID_ARG 0x102
+#define ESP_ERR_INVALID_STATE 0x103
+#define ESP_ERR_INVALID_SIZE 0x104
+#define ESP_ERR_NOT_FOUND 0x105
+#define ESP_ERR_NOT_SUPPORTED 0x106
+#define ESP_ERR_TIMEOUT 0x107
+#define ESP_ERR_INVALID_RESPONSE 0x108
+#define ESP_ERR_INVALID_CRC 0x109
+
+#define ESP_ERR_NVS_BASE 0x1100
+#define ESP_ERR_NVS_NOT_INITIALIZED (ESP_ERR_NVS_BASE + 0x01)
+#define ESP_ERR_NVS_NOT_FOUND (ESP_ERR_NVS_BASE + 0x02)
+#define ESP_ERR_NVS_INVALID_LENGTH (ESP_ERR_NVS_BASE + 0x0c)
+#define ESP_ERR_NVS_NO_FREE_PAGES (ESP_ERR_NVS_BASE + 0x0d)
+#define ESP_ERR_NVS_NOT_ENOUGH_SPACE (ESP_ERR_NVS_BASE + 0x05)
+
+#define ESP_ERR_OTA_BASE 0x1500
+#define ESP_ERR_OTA_PARTITION_CONFLICT (ESP_ERR_OTA_BASE + 0x01)
+#define ESP_ERR_OTA_SELECT_INFO_INVALID (ESP_ERR_OTA_BASE + 0x02)
+#define ESP_ERR_OTA_VALIDATE_FAILED (ESP_ERR_OTA_BASE + 0x03)
+#define ESP_ERR_OTA_ROLLBACK_FAILED (ESP_ERR_OTA_BASE + 0x05)
+
+const char *esp_err_to_name(esp_err_t code);
+
+void _esp_error_check_failed(esp_err_t rc, const char *file, int line, const char *function, const char *expression)
+                __attribute__((noreturn));
+
+#define __ASSERT_FUNC __func__
+
+#define ESP_ERROR_CHECK(x)                                                    \
+    do                                                                        \
+    {                                                                         \
+        esp_err_t __err_rc = (x);                                             \
+        if (__err_rc != ESP_OK)                                               \
+        {                                                                     \
+            _esp_error_check_failed(__err_rc, __FILE__, __LINE__,             \
+                                    __ASSERT_FUNC, #x);                       \
+        }                                                                     \
+    } while (0)
+
+#endif
@@ -0,0 +1,72 @@
+/**
+ * @file esp_event_loop.h
+ * Host version of the legacy ESP-IDF system event loop.
+ */
+
+#ifndef PRJ_FAKE_ESP_EVENT_LOOP_MODULE
+#define PRJ_FAKE_ESP_EVENT_LOOP_MODULE
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+typedef struct
+{
+    uint32_t addr;
+} ip4_addr_t;
+
+typedef struct
+{
+    ip4_addr_t ip;
+    ip4_addr_t netmask;
+    ip4_addr_t gw;
+} tcpip_adapter_ip_info_t;
+
+typedef enum
+{
+    SYSTEM_EVENT_WIFI_READY = 0,
+    SYSTEM_EVENT_SCAN_DONE,
+    SYSTEM_EVENT_STA_START,
+    SYSTEM_EVENT_STA_STOP,
+    SYSTEM_EVENT_STA_CONNECTED,
+    SYSTEM_EVENT_STA_DISCONNECTED,
+    SYSTEM_EVENT_STA_AUTHMODE_CHANGE,
+    SYSTEM_EVENT_STA_GOT_IP,
+    SYSTEM_EVENT_STA_LOST_IP
+} system_event_id_t;
+
+typedef struct
+{
+    uint8_t ssid[32];
+    uint8_t ssid_len;
+    uint8_t bssid[6];
+    uint8_t reason;
+} system_event_sta_disconnected_t;
+
+typedef struct
+{
+    tcpip_adapter_ip_info_t ip_info;
+    bool ip_changed;
+} system_event_sta_got_ip_t;
+
+typedef union
+{
+    system_event_sta_disconnected_t disconnected;
+    system_event_sta_got_ip_t got_ip;
+} system_event_info_t;
+
+typedef struct
+{
+    system_event_id_t event_id;
+    system_event_info_t event_info;
+} system_event_t;
+
+typedef esp_err_t (*system_event_cb_t)(void *ctx, system_event_t *event);
+
+esp_err_t esp_event_loop_init(system_event_cb_t cb, void *ctx);
+
+void tcpip_adapter_init(void);
+
+char *ip4addr_ntoa(const ip4_addr_t *addr);
+
+#endif
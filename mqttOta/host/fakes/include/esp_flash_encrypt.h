@@ -0,0 +1,16 @@
+/**
+ * @file esp_flash_encrypt.h
+ * Host version of the ESP-IDF flash encryption status, the fake flash is never encrypted.
+ */
+
+#ifndef PRJ_FAKE_ESP_FLASH_ENCRYPT_MODULE
+#define PRJ_FAKE_ESP_FLASH_ENCRYPT_MODULE
+
+#include <stdbool.h>
+
+static inline bool esp_flash_encryption_enabled(void)
+{
+    return false;
+}
+
+#endif
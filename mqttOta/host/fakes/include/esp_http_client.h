@@ -0,0 +1,34 @@
+/**
+ * @file esp_http_client.h
+ * Host version of the ESP-IDF HTTP client, the server side is given by fake_http_server.
+ */
+
+#ifndef PRJ_FAKE_ESP_HTTP_CLIENT_MODULE
+#define PRJ_FAKE_ESP_HTTP_CLIENT_MODULE
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+typedef struct esp_http_client *esp_http_client_handle_t;
+
+typedef struct
+{
+    const char *url;
+    int timeout_ms;
+    bool keep_alive_enable;
+    const char *cert_pem;
+    esp_err_t (*crt_bundle_attach)(void *conf);
+    int buffer_size;
+} esp_http_client_config_t;
+
+esp_http_client_handle_t esp_http_client_init(const esp_http_client_config_t *config);
+esp_err_t esp_http_client_set_header(esp_http_client_handle_t client, const char *key, const char *value);
+esp_err_t esp_http_client_open(esp_http_client_handle_t client, int write_len);
+int esp_http_client_fetch_headers(esp_http_client_handle_t client);
+int esp_http_client_get_status_code(esp_http_client_handle_t client);
+int esp_http_client_read(esp_http_client_handle_t client, char *buffer, int len);
+esp_err_t esp_http_client_close(esp_http_client_handle_t client);
+esp_err_t esp_http_client_cleanup(esp_http_client_handle_t client);
+
+#endif
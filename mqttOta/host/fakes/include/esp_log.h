@@ -0,0 +1,47 @@
+/**
+ * @file esp_log.h
+ * Host version of the ESP-IDF log, written to stdout with the virtual time stamp.
+ */
+
+#ifndef PRJ_FAKE_ESP_LOG_MODULE
+#define PRJ_FAKE_ESP_LOG_MODULE
+
+#include <stdint.h>
+#include "sdkconfig.h"
+
+typedef enum
+{
+    ESP_LOG_NONE,
+    ESP_LOG_ERROR,
+    ESP_LOG_WARN,
+    ESP_LOG_INFO,
+    ESP_LOG_DEBUG,
+    ESP_LOG_VERBOSE
+} esp_log_level_t;
+
+/*! Only the "*" tag is supported, it sets the level of all tags */
+void esp_log_level_set(const char *tag, esp_log_level_t level);
+
+uint32_t esp_log_timestamp(void);
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...) __attribute__((format(printf, 3, 4)));
+
+/*! Current level, the arguments of a suppressed message aren't evaluated */
+extern esp_log_level_t fake_log_level;
+
+#define ESP_LOG_LEVEL(level, letter, tag, format, ...)                                                      \
+    do                                                                                                      \
+    {                                                                                                       \
+        if (fake_log_level >= (level))                                                                      \
+        {                                                                                                   \
+            esp_log_write((level), (tag), #letter " (%u) %s: " format "\n", esp_log_timestamp(), (tag), ##__VA_ARGS__); \
+        }                                                                                                   \
+    } while (0)
+
+#define ESP_LOGE(tag, format, ...) ESP_LOG_LEVEL(ESP_LOG_ERROR, E, tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) ESP_LOG_LEVEL(ESP_LOG_WARN, W, tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) ESP_LOG_LEVEL(ESP_LOG_INFO, I, tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) ESP_LOG_LEVEL(ESP_LOG_DEBUG, D, tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...) ESP_LOG_LEVEL(ESP_LOG_VERBOSE, V, tag, format, ##__VA_ARGS__)
+
+#endif
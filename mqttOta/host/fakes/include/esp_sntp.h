@@ -0,0 +1,17 @@
+/**
+ * @file esp_sntp.h
+ * Host version of the SNTP client, the virtual clock is set on sntp_init().
+ */
+
+#ifndef PRJ_FAKE_ESP_SNTP_MODULE
+#define PRJ_FAKE_ESP_SNTP_MODULE
+
+#include <stdint.h>
+
+#define SNTP_OPMODE_POLL 0
+
+void sntp_setoperatingmode(uint8_t operating_mode);
+void sntp_setservername(uint8_t idx, const char *server);
+void sntp_init(void);
+
+#endif
@@ -0,0 +1,38 @@
+/**
+ * @file esp_system.h
+ * Host version of the ESP-IDF system functions.
+ */
+
+#ifndef PRJ_FAKE_ESP_SYSTEM_MODULE
+#define PRJ_FAKE_ESP_SYSTEM_MODULE
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_attr.h"
+
+typedef enum
+{
+    CHIP_ESP32 = 1
+} esp_chip_model_t;
+
+typedef struct
+{
+    esp_chip_model_t model;
+    uint32_t features;
+    uint8_t cores;
+    uint8_t revision;
+} esp_chip_info_t;
+
+/*! Ends the current boot, see fake_os_on_restart() */
+void esp_restart(void) __attribute__((noreturn));
+
+/*! Pseudo random numbers of the seed given to fake_os_seed() */
+uint32_t esp_random(void);
+
+uint32_t esp_get_free_heap_size(void);
+uint32_t esp_get_minimum_free_heap_size(void);
+
+void esp_chip_info(esp_chip_info_t *out_info);
+
+#endif
@@ -0,0 +1,77 @@
+/**
+ * @file esp_wifi.h
+ * Host version of the ESP-IDF Wi-Fi station, the access point side is given by fake_wifi_ap.
+ */
+
+#ifndef PRJ_FAKE_ESP_WIFI_MODULE
+#define PRJ_FAKE_ESP_WIFI_MODULE
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+typedef enum
+{
+    WIFI_MODE_NULL = 0,
+    WIFI_MODE_STA
+} wifi_mode_t;
+
+typedef enum
+{
+    ESP_IF_WIFI_STA = 0
+} esp_interface_t;
+
+typedef enum
+{
+    WIFI_STORAGE_FLASH,
+    WIFI_STORAGE_RAM
+} wifi_storage_t;
+
+typedef enum
+{
+    WIFI_FAST_SCAN = 0,
+    WIFI_ALL_CHANNEL_SCAN
+} wifi_scan_method_t;
+
+typedef struct
+{
+    uint8_t ssid[32];
+    uint8_t password[64];
+    wifi_scan_method_t scan_method;
+    bool bssid_set;
+    uint8_t bssid[6];
+    uint8_t channel;
+} wifi_sta_config_t;
+
+typedef union
+{
+    wifi_sta_config_t sta;
+} wifi_config_t;
+
+typedef struct
+{
+    uint8_t bssid[6];
+    uint8_t ssid[33];
+    uint8_t primary;
+    int8_t rssi;
+} wifi_ap_record_t;
+
+typedef struct
+{
+    int magic;
+} wifi_init_config_t;
+
+#define WIFI_INIT_CONFIG_DEFAULT() { .magic = 0x1F2F3F4F }
+
+esp_err_t esp_wifi_init(const wifi_init_config_t *config);
+esp_err_t esp_wifi_set_storage(wifi_storage_t storage);
+esp_err_t esp_wifi_set_mode(wifi_mode_t mode);
+esp_err_t esp_wifi_get_config(esp_interface_t interface, wifi_config_t *conf);
+esp_err_t esp_wifi_set_config(esp_interface_t interface, wifi_config_t *conf);
+esp_err_t esp_wifi_get_mac(esp_interface_t ifx, uint8_t mac[6]);
+esp_err_t esp_wifi_start(void);
+esp_err_t esp_wifi_stop(void);
+esp_err_t esp_wifi_connect(void);
+esp_err_t esp_wifi_sta_get_ap_info(wifi_ap_record_t *ap_info);
+
+#endif
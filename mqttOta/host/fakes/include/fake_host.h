@@ -0,0 +1,227 @@
+/**
+ * @file fake_host.h
+ * Controls of the host versions of the ESP-IDF services, used by the benchmark and the simulations to set up
+ * and inspect the device. All device time is virtual, it only moves forward when a task
+ * blocks or fake_os_advance_us() is called.
+ */
+
+#ifndef PRJ_FAKE_HOST_MODULE
+#define PRJ_FAKE_HOST_MODULE
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_ota_ops.h"
+#include "esp_sleep.h"
+
+/*! Exit status of a boot that ended with esp_restart() */
+#define FAKE_EXIT_RESTART 10
+/*! Exit status of a boot that ended with esp_deep_sleep_start() */
+#define FAKE_EXIT_DEEP_SLEEP 11
+
+/*! Virtual time since boot in microseconds */
+int64_t fake_os_now_us(void);
+
+/*! Advances the virtual clock, the esp_timer callbacks that fall due run on the way */
+void fake_os_advance_us(int64_t us);
+
+/**
+ * @brief Runs the created tasks and the esp_timer callbacks until the clock reaches until_us,
+ *        see fake_os.c. A boot ends earlier with exit(), see FAKE_EXIT_RESTART, or by returning on a
+ *        host of fake_host_create().
+ *
+ * @return bool False if all tasks wait without timeout
+ */
+bool fake_os_run(int64_t until_us);
+
+/**
+ * @brief Blocks the calling task of fake_os_run() until a kernel object changes or the deadline
+ *        passes, for the fakes of services that wait. The caller checks its condition again.
+ *
+ * @return bool False once the deadline passed
+ */
+bool fake_os_wait(int64_t deadline_us);
+
+/*! Resumes the tasks blocked in a wait, after a fake changed what they may wait for */
+void fake_os_changed(void);
+
+/*! Seeds esp_random() */
+void fake_os_seed(uint32_t seed);
+
+/*! Sets the value returned by esp_get_free_heap_size() */
+void fake_os_set_free_heap(uint32_t free_heap);
+
+/*! Sets the chip revision reported by esp_chip_info() */
+void fake_os_set_chip_revision(uint8_t revision);
+
+/* Flash layout of the fake storage, the partition table of the two OTA slots plus a data partition */
+#define FAKE_FLASH_SIZE 0x350000
+#define FAKE_NVS_MAX_ENTRIES 64
+#define FAKE_NVS_MAX_VALUE 1024
+#define FAKE_RTC_DATA_SIZE 8192
+
+/*! One key of the fake NVS */
+struct fake_nvs_entry
+{
+    char namespace_name[16];
+    char key[16];
+    uint8_t type;
+    size_t len;
+    uint8_t value[FAKE_NVS_MAX_VALUE];
+};
+
+/**
+ * @brief Everything that survives a reboot: the flash, the NVS and the boot selection of the
+ *        bootloader, plus the RTC memory that survives deep sleep.
+ */
+struct fake_storage
+{
+    uint8_t flash[FAKE_FLASH_SIZE];
+    struct fake_nvs_entry nvs[FAKE_NVS_MAX_ENTRIES];
+    /*! OTA slot selected for the next boot, -1 for the factory app */
+    int boot_slot;
+    esp_ota_img_states_t slot_state[2];
+    /*! Wi-Fi station config saved with WIFI_STORAGE_FLASH */
+    bool wifi_config_valid;
+    uint8_t wifi_ssid[32];
+    uint8_t wifi_password[64];
+    /*! RTC memory and the cause of the next wake-up */
+    bool rtc_valid;
+    size_t rtc_size;
+    uint8_t rtc_data[FAKE_RTC_DATA_SIZE];
+    esp_sleep_wakeup_cause_t wakeup_cause;
+    /*! Deep sleep time requested with esp_sleep_enable_timer_wakeup() */
+    uint64_t sleep_us;
+    /*! Uptime when the last boot restarted or went to deep sleep */
+    int64_t boot_end_us;
+};
+
+/*! Returns the storage of the device, all zero but the erased flash until the first boot */
+struct fake_storage *fake_storage(void);
+
+/*! Uses the given storage instead of the built-in one, e.g. one shared by the boots of a simulation */
+void fake_storage_use(struct fake_storage *storage);
+
+/*! Erases the flash and NVS of the storage */
+void fake_storage_format(struct fake_storage *storage);
+
+/**
+ * @brief Runs the bootloader: selects the app of the next boot and applies the rollback of an
+ *        image that wasn't marked valid, then restores the RTC memory on a timer wake-up and
+ *        resets it to its initial contents otherwise.
+ *
+ * @return const esp_partition_t* Partition the app runs from
+ */
+const esp_partition_t *fake_boot(void);
+
+/*! Copies the RTC variables of the device to the storage before deep sleep */
+void fake_rtc_save(void);
+
+/**
+ * @brief Hosts of several devices in one process: each has its own scheduler and clock, flash, NVS
+ *        and network, the fakes use the host selected for the calling thread. A boot of a host ends
+ *        with fake_os_run() returning and fake_host_exit_status() set. The RTC memory of the device
+ *        code is shared by all hosts, so hosts that run at the same time run configurations without
+ *        the duty cycle.
+ */
+struct fake_host;
+
+/*! Returns a host on the given storage, formatted by the caller */
+struct fake_host *fake_host_create(struct fake_storage *storage);
+
+/*! Selects the host of the calling thread, NULL for the built-in one of the single device simulations */
+void fake_host_use(struct fake_host *host);
+
+/*! Returns FAKE_EXIT_RESTART or FAKE_EXIT_DEEP_SLEEP once a boot of the host ended, else 0 */
+int fake_host_exit_status(const struct fake_host *host);
+
+/*! Frees the host, its tasks don't run again. The storage stays with the caller */
+void fake_host_destroy(struct fake_host *host);
+
+/*! Last message published by the device */
+struct fake_mqtt_message
+{
+    char topic[128];
+    char data[4096];
+    int len;
+    int qos;
+};
+
+/*! Returns the last publish of the device and the number of publishes since the start */
+const struct fake_mqtt_message *fake_mqtt_last_publish(int *count);
+
+/* Network of the simulation, it only delivers events under fake_os_run() */
+
+/*! Access point the station connects to */
+struct fake_wifi_ap
+{
+    bool available;
+    uint8_t channel;
+    /*! Time from esp_wifi_connect() to the IP address with a scan */
+    uint32_t connect_ms;
+    /*! Time to the IP address with the BSSID and channel set, without a scan */
+    uint32_t direct_connect_ms;
+};
+
+/*! Sets the access point for the connects that follow */
+void fake_wifi_ap_set(const struct fake_wifi_ap *ap);
+
+/*! Disconnects the station from the access point, and the MQTT client with it */
+void fake_wifi_ap_drop(void);
+
+/*! Returns true while the station is connected to the access point */
+bool fake_wifi_connected(void);
+
+/* Broker the MQTT client connects to */
+struct fake_mqtt_broker
+{
+    /*! Returns the time to the CONNACK in ms, or the negative time until a connect to uri fails */
+    int (*connect)(const char *uri, void *ctx);
+    /*! Called when a publish of the device arrives at the broker */
+    void (*publish)(const char *topic, const char *data, int len, void *ctx);
+    void *ctx;
+    /*! Time to the CONNACK if there is no connect callback */
+    uint32_t connect_ms;
+    uint32_t rtt_ms;
+    /*! Throughput of the messages to the device, 0 for no limit */
+    uint32_t downlink_bytes_per_s;
+};
+
+/*! Sets the broker for the connects and publishes that follow */
+void fake_mqtt_broker_set(const struct fake_mqtt_broker *broker);
+
+/*! Sends a message from the broker to the device, it is lost if the connection drops on its way */
+void fake_mqtt_broker_send(const char *topic, const void *data, int len);
+
+/*! Like fake_mqtt_broker_send() for a message the broker sent at sent_us, e.g. at the end of its queue */
+void fake_mqtt_broker_send_at(int64_t sent_us, const char *topic, const void *data, int len);
+
+/*! Drops the MQTT connection, the client reconnects after its reconnect timeout */
+void fake_mqtt_broker_drop(void);
+
+/*! Returns true while the MQTT client is connected */
+bool fake_mqtt_connected(void);
+
+/* Server the HTTP client downloads from */
+struct fake_http_server
+{
+    /**
+     * Answers a GET of url for the bytes [start, end], end -1 for the rest of the resource. Returns the
+     * status code and sets the body of the response, or 0 if the connection fails.
+     */
+    int (*get)(const char *url, int start, int end, const uint8_t **body, int *len, void *ctx);
+    void *ctx;
+    /*! Time to open a connection, the TCP and TLS handshakes */
+    uint32_t connect_ms;
+    uint32_t rtt_ms;
+    /*! Throughput of the response bodies, 0 for no limit */
+    uint32_t bytes_per_s;
+};
+
+/*! Sets the server for the requests that follow */
+void fake_http_server_set(const struct fake_http_server *server);
+
+/*! Drops the open HTTP connections, a read on them fails */
+void fake_http_server_drop(void);
+
+#endif
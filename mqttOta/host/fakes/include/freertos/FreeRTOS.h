@@ -0,0 +1,68 @@
+/**
+ * @file FreeRTOS.h
+ * Host version of the FreeRTOS types, one tick is one millisecond of virtual time.
+ */
+
+#ifndef PRJ_FAKE_FREERTOS_MODULE
+#define PRJ_FAKE_FREERTOS_MODULE
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "sdkconfig.h"
+#include "esp_err.h"
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+typedef uint32_t StackType_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS pdTRUE
+#define pdFAIL pdFALSE
+
+#define portMAX_DELAY ((TickType_t) 0xffffffffUL)
+#define configTICK_RATE_HZ 1000
+#define portTICK_PERIOD_MS ((TickType_t) 1000 / configTICK_RATE_HZ)
+#define pdMS_TO_TICKS(xTimeInMs) ((TickType_t) (((TickType_t) (xTimeInMs) * (TickType_t) configTICK_RATE_HZ) / (TickType_t) 1000))
+
+#define configMAX_PRIORITIES 25
+#define tskIDLE_PRIORITY 0
+#define tskNO_AFFINITY 0x7FFFFFFF
+#define portNUM_PROCESSORS 2
+
+/*! Tasks are cooperative on the host, a critical section needs no lock */
+typedef struct
+{
+    int owner;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED { 0 }
+#define portMUX_INITIALIZE(mux) ((mux)->owner = 0)
+#define portENTER_CRITICAL(mux) ((void) (mux))
+#define portEXIT_CRITICAL(mux) ((void) (mux))
+#define portENTER_CRITICAL_ISR(mux) ((void) (mux))
+#define portEXIT_CRITICAL_ISR(mux) ((void) (mux))
+
+#define BIT0 0x00000001
+#define BIT1 0x00000002
+#define BIT2 0x00000004
+#define BIT3 0x00000008
+#define BIT4 0x00000010
+#define BIT5 0x00000020
+#define BIT6 0x00000040
+#define BIT7 0x00000080
+#define BIT8 0x00000100
+#define BIT9 0x00000200
+#define BIT10 0x00000400
+#define BIT11 0x00000800
+#define BIT12 0x00001000
+#define BIT13 0x00002000
+#define BIT14 0x00004000
+#define BIT15 0x00008000
+
+#endif
@@ -0,0 +1,22 @@
+/**
+ * @file event_groups.h
+ * Host version of the FreeRTOS event groups.
+ */
+
+#ifndef PRJ_FAKE_FREERTOS_EVENT_GROUPS_MODULE
+#define PRJ_FAKE_FREERTOS_EVENT_GROUPS_MODULE
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct fake_event_group *EventGroupHandle_t;
+typedef TickType_t EventBits_t;
+
+EventGroupHandle_t xEventGroupCreate(void);
+EventBits_t xEventGroupSetBits(EventGroupHandle_t xEventGroup, const EventBits_t uxBitsToSet);
+EventBits_t xEventGroupClearBits(EventGroupHandle_t xEventGroup, const EventBits_t uxBitsToClear);
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t xEventGroup, const EventBits_t uxBitsToWaitFor, const BaseType_t xClearOnExit,
+                const BaseType_t xWaitForAllBits, TickType_t xTicksToWait);
+
+#define xEventGroupGetBits(xEventGroup) xEventGroupClearBits((xEventGroup), 0)
+
+#endif
@@ -0,0 +1,19 @@
+/**
+ * @file queue.h
+ * Host version of the FreeRTOS queues.
+ */
+
+#ifndef PRJ_FAKE_FREERTOS_QUEUE_MODULE
+#define PRJ_FAKE_FREERTOS_QUEUE_MODULE
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct fake_queue *QueueHandle_t;
+
+QueueHandle_t xQueueCreate(UBaseType_t uxQueueLength, UBaseType_t uxItemSize);
+BaseType_t xQueueSend(QueueHandle_t xQueue, const void *pvItemToQueue, TickType_t xTicksToWait);
+BaseType_t xQueueReceive(QueueHandle_t xQueue, void *pvBuffer, TickType_t xTicksToWait);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t xQueue);
+void vQueueDelete(QueueHandle_t xQueue);
+
+#endif
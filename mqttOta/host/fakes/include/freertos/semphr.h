@@ -0,0 +1,20 @@
+/**
+ * @file semphr.h
+ * Host version of the FreeRTOS semaphores and mutexes.
+ */
+
+#ifndef PRJ_FAKE_FREERTOS_SEMPHR_MODULE
+#define PRJ_FAKE_FREERTOS_SEMPHR_MODULE
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct fake_semaphore *SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+SemaphoreHandle_t xSemaphoreCreateBinary(void);
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t uxMaxCount, UBaseType_t uxInitialCount);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t xSemaphore, TickType_t xBlockTime);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t xSemaphore);
+void vSemaphoreDelete(SemaphoreHandle_t xSemaphore);
+
+#endif
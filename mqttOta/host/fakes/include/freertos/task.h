@@ -0,0 +1,30 @@
+/**
+ * @file task.h
+ * Host version of the FreeRTOS tasks.
+ */
+
+#ifndef PRJ_FAKE_FREERTOS_TASK_MODULE
+#define PRJ_FAKE_FREERTOS_TASK_MODULE
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct fake_task *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t pvTaskCode, const char *pcName, uint32_t usStackDepth, void *pvParameters,
+                UBaseType_t uxPriority, TaskHandle_t *pvCreatedTask, BaseType_t xCoreID);
+
+#define xTaskCreate(code, name, stack, params, priority, handle) \
+    xTaskCreatePinnedToCore((code), (name), (stack), (params), (priority), (handle), tskNO_AFFINITY)
+
+void vTaskDelete(TaskHandle_t xTaskToDelete);
+void vTaskDelay(const TickType_t xTicksToDelay);
+TickType_t xTaskGetTickCount(void);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+
+BaseType_t xTaskNotifyGive(TaskHandle_t xTaskToNotify);
+uint32_t ulTaskNotifyTake(BaseType_t xClearCountOnExit, TickType_t xTicksToWait);
+
+void taskYIELD(void);
+
+#endif
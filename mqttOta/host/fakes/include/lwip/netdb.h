@@ -0,0 +1 @@
+/* Host build: the example uses no lwIP API of this header */
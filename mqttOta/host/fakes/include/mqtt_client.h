@@ -0,0 +1,100 @@
+/**
+ * @file mqtt_client.h
+ * Host version of the esp-mqtt client, the broker side is given by fake_mqtt_broker.
+ */
+
+#ifndef PRJ_FAKE_MQTT_CLIENT_MODULE
+#define PRJ_FAKE_MQTT_CLIENT_MODULE
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+typedef struct esp_mqtt_client *esp_mqtt_client_handle_t;
+
+typedef enum
+{
+    MQTT_EVENT_ANY = -1,
+    MQTT_EVENT_ERROR = 0,
+    MQTT_EVENT_CONNECTED,
+    MQTT_EVENT_DISCONNECTED,
+    MQTT_EVENT_SUBSCRIBED,
+    MQTT_EVENT_UNSUBSCRIBED,
+    MQTT_EVENT_PUBLISHED,
+    MQTT_EVENT_DATA,
+    MQTT_EVENT_BEFORE_CONNECT,
+    MQTT_EVENT_DELETED
+} esp_mqtt_event_id_t;
+
+typedef enum
+{
+    MQTT_TRANSPORT_UNKNOWN = 0x0,
+    MQTT_TRANSPORT_OVER_TCP,
+    MQTT_TRANSPORT_OVER_SSL
+} esp_mqtt_transport_t;
+
+typedef struct esp_mqtt_error_codes
+{
+    esp_err_t esp_tls_last_esp_err;
+    int esp_tls_stack_err;
+    int error_type;
+    int connect_return_code;
+} esp_mqtt_error_codes_t;
+
+typedef struct esp_mqtt_event_t
+{
+    esp_mqtt_event_id_t event_id;
+    esp_mqtt_client_handle_t client;
+    void *user_context;
+    char *data;
+    int data_len;
+    int total_data_len;
+    int current_data_offset;
+    char *topic;
+    int topic_len;
+    int msg_id;
+    int session_present;
+    esp_mqtt_error_codes_t *error_handle;
+    bool retain;
+} esp_mqtt_event_t;
+
+typedef esp_mqtt_event_t *esp_mqtt_event_handle_t;
+
+typedef esp_err_t (*mqtt_event_callback_t)(esp_mqtt_event_handle_t event);
+
+typedef struct
+{
+    mqtt_event_callback_t event_handle;
+    const char *host;
+    const char *uri;
+    uint32_t port;
+    const char *client_id;
+    const char *username;
+    const char *password;
+    int keepalive;
+    bool disable_auto_reconnect;
+    void *user_context;
+    int task_prio;
+    int task_stack;
+    int buffer_size;
+    const char *cert_pem;
+    size_t cert_len;
+    esp_mqtt_transport_t transport;
+    esp_err_t (*crt_bundle_attach)(void *conf);
+    int reconnect_timeout_ms;
+    int network_timeout_ms;
+} esp_mqtt_client_config_t;
+
+esp_mqtt_client_handle_t esp_mqtt_client_init(const esp_mqtt_client_config_t *config);
+esp_err_t esp_mqtt_client_set_uri(esp_mqtt_client_handle_t client, const char *uri);
+esp_err_t esp_mqtt_client_start(esp_mqtt_client_handle_t client);
+esp_err_t esp_mqtt_client_reconnect(esp_mqtt_client_handle_t client);
+esp_err_t esp_mqtt_client_disconnect(esp_mqtt_client_handle_t client);
+esp_err_t esp_mqtt_client_stop(esp_mqtt_client_handle_t client);
+int esp_mqtt_client_subscribe(esp_mqtt_client_handle_t client, const char *topic, int qos);
+int esp_mqtt_client_unsubscribe(esp_mqtt_client_handle_t client, const char *topic);
+int esp_mqtt_client_publish(esp_mqtt_client_handle_t client, const char *topic, const char *data, int len, int qos, int retain);
+esp_err_t esp_mqtt_client_destroy(esp_mqtt_client_handle_t client);
+
+#endif
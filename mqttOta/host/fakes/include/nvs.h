@@ -0,0 +1,35 @@
+/**
+ * @file nvs.h
+ * Host version of the ESP-IDF non-volatile storage on the entries of fake_storage().
+ */
+
+#ifndef PRJ_FAKE_NVS_MODULE
+#define PRJ_FAKE_NVS_MODULE
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+typedef uint32_t nvs_handle_t;
+typedef nvs_handle_t nvs_handle;
+
+typedef enum
+{
+    NVS_READONLY,
+    NVS_READWRITE
+} nvs_open_mode_t;
+typedef nvs_open_mode_t nvs_open_mode;
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle);
+void nvs_close(nvs_handle_t handle);
+esp_err_t nvs_commit(nvs_handle_t handle);
+
+esp_err_t nvs_get_str(nvs_handle_t handle, const char *key, char *out_value, size_t *length);
+esp_err_t nvs_set_str(nvs_handle_t handle, const char *key, const char *value);
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length);
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length);
+esp_err_t nvs_get_u32(nvs_handle_t handle, const char *key, uint32_t *out_value);
+esp_err_t nvs_set_u32(nvs_handle_t handle, const char *key, uint32_t value);
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key);
+
+#endif
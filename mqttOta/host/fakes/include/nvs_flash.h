@@ -0,0 +1,14 @@
+/**
+ * @file nvs_flash.h
+ * Host version of the ESP-IDF NVS initialization.
+ */
+
+#ifndef PRJ_FAKE_NVS_FLASH_MODULE
+#define PRJ_FAKE_NVS_FLASH_MODULE
+
+#include "nvs.h"
+
+esp_err_t nvs_flash_init(void);
+esp_err_t nvs_flash_erase(void);
+
+#endif
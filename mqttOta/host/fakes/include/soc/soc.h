@@ -0,0 +1,14 @@
+/**
+ * @file soc.h
+ * Address ranges of the ESP32 flash mapping.
+ */
+
+#ifndef PRJ_FAKE_SOC_MODULE
+#define PRJ_FAKE_SOC_MODULE
+
+#define SOC_IROM_LOW 0x400D0000
+#define SOC_IROM_HIGH 0x40400000
+#define SOC_DROM_LOW 0x3F400000
+#define SOC_DROM_HIGH 0x3F800000
+
+#endif
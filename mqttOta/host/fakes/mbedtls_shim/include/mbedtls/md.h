@@ -0,0 +1,38 @@
+/**
+ * @file md.h
+ * Message digest API of mbedtls on the host's OpenSSL, used when mbedtls isn't installed.
+ */
+
+#ifndef PRJ_FAKE_MBEDTLS_MD_MODULE
+#define PRJ_FAKE_MBEDTLS_MD_MODULE
+
+#include <stddef.h>
+
+#define MBEDTLS_ERR_MD_BAD_INPUT_DATA -0x5100
+#define MBEDTLS_ERR_MD_ALLOC_FAILED -0x5180
+
+typedef enum
+{
+    MBEDTLS_MD_NONE = 0,
+    MBEDTLS_MD_SHA256 = 6
+} mbedtls_md_type_t;
+
+typedef struct mbedtls_md_info_t mbedtls_md_info_t;
+
+typedef struct
+{
+    const mbedtls_md_info_t *md_info;
+    void *md_ctx;
+    void *hmac_ctx;
+} mbedtls_md_context_t;
+
+const mbedtls_md_info_t *mbedtls_md_info_from_type(mbedtls_md_type_t md_type);
+void mbedtls_md_init(mbedtls_md_context_t *ctx);
+void mbedtls_md_free(mbedtls_md_context_t *ctx);
+int mbedtls_md_setup(mbedtls_md_context_t *ctx, const mbedtls_md_info_t *md_info, int hmac);
+int mbedtls_md_clone(mbedtls_md_context_t *dst, const mbedtls_md_context_t *src);
+int mbedtls_md_starts(mbedtls_md_context_t *ctx);
+int mbedtls_md_update(mbedtls_md_context_t *ctx, const unsigned char *input, size_t ilen);
+int mbedtls_md_finish(mbedtls_md_context_t *ctx, unsigned char *output);
+
+#endif
@@ -0,0 +1,75 @@
+/**
+ * @file md.c
+ * SHA-256 of the mbedtls message digest API implemented with OpenSSL.
+ */
+
+#include <string.h>
+#include <openssl/evp.h>
+
+#include "mbedtls/md.h"
+
+struct mbedtls_md_info_t
+{
+    mbedtls_md_type_t type;
+};
+
+static const mbedtls_md_info_t sha256_info = { MBEDTLS_MD_SHA256 };
+
+const mbedtls_md_info_t *mbedtls_md_info_from_type(mbedtls_md_type_t md_type)
+{
+    return md_type == MBEDTLS_MD_SHA256 ? &sha256_info : NULL;
+}
+
+void mbedtls_md_init(mbedtls_md_context_t *ctx)
+{
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+void mbedtls_md_free(mbedtls_md_context_t *ctx)
+{
+    if (ctx == NULL)
+    {
+        return;
+    }
+    EVP_MD_CTX_free(ctx->md_ctx);
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+int mbedtls_md_setup(mbedtls_md_context_t *ctx, const mbedtls_md_info_t *md_info, int hmac)
+{
+    if (md_info == NULL || hmac != 0)
+    {
+        return MBEDTLS_ERR_MD_BAD_INPUT_DATA;
+    }
+    ctx->md_ctx = EVP_MD_CTX_new();
+    if (ctx->md_ctx == NULL)
+    {
+        return MBEDTLS_ERR_MD_ALLOC_FAILED;
+    }
+    ctx->md_info = md_info;
+    return 0;
+}
+
+int mbedtls_md_clone(mbedtls_md_context_t *dst, const mbedtls_md_context_t *src)
+{
+    if (dst->md_ctx == NULL || src->md_ctx == NULL || EVP_MD_CTX_copy_ex(dst->md_ctx, src->md_ctx) != 1)
+    {
+        return MBEDTLS_ERR_MD_BAD_INPUT_DATA;
+    }
+    return 0;
+}
+
+int mbedtls_md_starts(mbedtls_md_context_t *ctx)
+{
+    return ctx->md_ctx != NULL && EVP_DigestInit_ex(ctx->md_ctx, EVP_sha256(), NULL) == 1 ? 0 : MBEDTLS_ERR_MD_BAD_INPUT_DATA;
+}
+
+int mbedtls_md_update(mbedtls_md_context_t *ctx, const unsigned char *input, size_t ilen)
+{
+    return ctx->md_ctx != NULL && EVP_DigestUpdate(ctx->md_ctx, input, ilen) == 1 ? 0 : MBEDTLS_ERR_MD_BAD_INPUT_DATA;
+}
+
+int mbedtls_md_finish(mbedtls_md_context_t *ctx, unsigned char *output)
+{
+    return ctx->md_ctx != NULL && EVP_DigestFinal_ex(ctx->md_ctx, output, NULL) == 1 ? 0 : MBEDTLS_ERR_MD_BAD_INPUT_DATA;
+}
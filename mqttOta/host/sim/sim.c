@@ -0,0 +1,779 @@
+/**
+ * @file sim.c
+ * Boots of the simulated device and the ThingsBoard they talk to, see sim.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "esp_log.h"
+#include "nvs.h"
+#include "esp_partition.h"
+#include "mbedtls/md.h"
+#include "mqttOta.h"
+#include "broker.h"
+#include "tb_request.h"
+#include "ota_erase.h"
+#include "image_verify.h"
+#include "trace.h"
+#include "sim.h"
+
+/*! Load address of the segment of the firmware images, in DRAM so it needs no alignment to a flash page */
+#define SIM_FW_LOAD_ADDR 0x3FFB0000
+/*! Image header, segment header, checksum padding and appended SHA-256 around a 16 byte aligned segment */
+#define SIM_FW_OVERHEAD (24 + 8 + 16 + 32)
+
+bool sim_verbose = false;
+
+/*! Simulation of the running boot, for the broker callbacks and the wrapped functions */
+static __thread struct sim *boot_sim;
+
+/* Set of the blocks allocated during a boot, what is left at its end is freed like the RAM of a restart */
+struct boot_heap
+{
+    void **slots;
+    /*! Size of slots, a power of two, and the blocks in it */
+    size_t size;
+    size_t count;
+};
+
+/*! Heap of the running boot */
+static __thread struct boot_heap *boot_heap;
+
+void app_main(void);
+
+static void tb_fault(struct sim_tb *tb, int len);
+
+/* Functions of the device the simulation observes, see the --wrap link options */
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+static size_t heap_slot(const struct boot_heap *heap, const void *ptr)
+{
+    return (size_t) ((((uint64_t) (uintptr_t) ptr >> 4) * 0x9E3779B97F4A7C15ULL) >> 32) & (heap->size - 1);
+}
+
+static void heap_add(struct boot_heap *heap, void *ptr)
+{
+    if (2 * (heap->count + 1) > heap->size)
+    {
+        // Rehashed into twice the slots, kept at most half full for short probes
+        struct boot_heap grown = { .size = heap->size != 0 ? 2 * heap->size : 1024 };
+        grown.slots = __real_calloc(grown.size, sizeof(void*));
+        if (grown.slots == NULL)
+        {
+            abort();
+        }
+        for (size_t i = 0; i < heap->size; i++)
+        {
+            if (heap->slots[i] != NULL)
+            {
+                heap_add(&grown, heap->slots[i]);
+            }
+        }
+        __real_free(heap->slots);
+        *heap = grown;
+    }
+    size_t slot = heap_slot(heap, ptr);
+    while (heap->slots[slot] != NULL)
+    {
+        slot = (slot + 1) & (heap->size - 1);
+    }
+    heap->slots[slot] = ptr;
+    heap->count++;
+}
+
+/*! Removes the block if the boot allocated it, blocks of the simulation aren't in the set */
+static void heap_remove(struct boot_heap *heap, const void *ptr)
+{
+    if (heap->count == 0)
+    {
+        return;
+    }
+    size_t slot = heap_slot(heap, ptr);
+    while (heap->slots[slot] != ptr)
+    {
+        if (heap->slots[slot] == NULL)
+        {
+            return;
+        }
+        slot = (slot + 1) & (heap->size - 1);
+    }
+    // Moves the later blocks of the probe sequence back into the gap
+    size_t gap = slot;
+    for (size_t next = (gap + 1) & (heap->size - 1); heap->slots[next] != NULL; next = (next + 1) & (heap->size - 1))
+    {
+        size_t home = heap_slot(heap, heap->slots[next]);
+        if (((next - home) & (heap->size - 1)) >= ((next - gap) & (heap->size - 1)))
+        {
+            heap->slots[gap] = heap->slots[next];
+            gap = next;
+        }
+    }
+    heap->slots[gap] = NULL;
+    heap->count--;
+}
+
+void *__wrap_malloc(size_t size)
+{
+    void *ptr = __real_malloc(size);
+    if (boot_heap != NULL && ptr != NULL)
+    {
+        heap_add(boot_heap, ptr);
+    }
+    return ptr;
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    void *ptr = __real_calloc(nmemb, size);
+    if (boot_heap != NULL && ptr != NULL)
+    {
+        heap_add(boot_heap, ptr);
+    }
+    return ptr;
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    if (boot_heap == NULL)
+    {
+        return __real_realloc(ptr, size);
+    }
+    if (ptr != NULL)
+    {
+        heap_remove(boot_heap, ptr);
+    }
+    void *new_ptr = __real_realloc(ptr, size);
+    if (new_ptr != NULL || (ptr != NULL && size != 0))
+    {
+        // The old block stays valid if the realloc failed
+        heap_add(boot_heap, new_ptr != NULL ? new_ptr : ptr);
+    }
+    return new_ptr;
+}
+
+void __wrap_free(void *ptr)
+{
+    if (boot_heap != NULL && ptr != NULL)
+    {
+        heap_remove(boot_heap, ptr);
+    }
+    __real_free(ptr);
+}
+
+esp_err_t __real_nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle);
+
+esp_err_t __wrap_nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle)
+{
+    if (boot_sim != NULL)
+    {
+        boot_sim->device.nvs_opens++;
+        if (strcmp(name, NVS_KEY_MQTT_ENDPOINTS) == 0)
+        {
+            boot_sim->device.endpoint_list_reads++;
+        }
+    }
+    return __real_nvs_open(name, open_mode, out_handle);
+}
+
+esp_err_t __real_ota_erase_start(struct ota_erase *erase, const esp_partition_t *partition, size_t image_size);
+
+esp_err_t __wrap_ota_erase_start(struct ota_erase *erase, const esp_partition_t *partition, size_t image_size)
+{
+    if (boot_sim != NULL && boot_sim->device.pre_erase_fails)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    return __real_ota_erase_start(erase, partition, image_size);
+}
+
+/*! Returns true if the esp_ota_write() call the device is about to make is the one that fails */
+static bool ota_write_fails(void)
+{
+    if (boot_sim == NULL || ++boot_sim->device.ota_writes != boot_sim->device.ota_write_fails)
+    {
+        return false;
+    }
+    tb_fault(&boot_sim->tb, 0);
+    return true;
+}
+
+esp_err_t __real_esp_ota_write(esp_ota_handle_t handle, const void *data, size_t size);
+
+esp_err_t __wrap_esp_ota_write(esp_ota_handle_t handle, const void *data, size_t size)
+{
+    return ota_write_fails() ? ESP_FAIL : __real_esp_ota_write(handle, data, size);
+}
+
+esp_err_t __real_esp_ota_write_with_offset(esp_ota_handle_t handle, const void *data, size_t size, uint32_t offset);
+
+esp_err_t __wrap_esp_ota_write_with_offset(esp_ota_handle_t handle, const void *data, size_t size, uint32_t offset)
+{
+    return ota_write_fails() ? ESP_FAIL : __real_esp_ota_write_with_offset(handle, data, size, offset);
+}
+
+#ifdef CONFIG_OTA_STREAMING_VERIFY
+esp_err_t __real_image_verify_start(struct image_verify *verify, size_t max_len);
+
+esp_err_t __wrap_image_verify_start(struct image_verify *verify, size_t max_len)
+{
+    if (boot_sim != NULL && boot_sim->device.verify_start_fails)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    return __real_image_verify_start(verify, max_len);
+}
+#endif
+
+#ifdef CONFIG_OTA_TRACE
+/*! Counts the entry into a state and drops the connection on the one the simulation chose */
+static void state_entered(struct sim *sim, enum trace_event id, int state)
+{
+    struct sim_device *device = &sim->device;
+    bool task = id == TRACE_TASK_STATE;
+    if (state < 0 || state >= SIM_MAX_STATES)
+    {
+        return;
+    }
+    uint32_t entries = ++(task ? device->task_state_entries : device->ota_state_entries)[state];
+    if (state != (task ? device->drop_task_state : device->drop_ota_state) || entries != device->drop_entry)
+    {
+        return;
+    }
+    if (device->drop_wifi ? !fake_wifi_connected() : !fake_mqtt_connected())
+    {
+        return;
+    }
+    device->drops++;
+    tb_fault(&sim->tb, 0);
+    if (device->drop_wifi)
+    {
+        fake_wifi_ap_drop();
+    } else
+    {
+        fake_mqtt_broker_drop();
+    }
+}
+
+void __real_trace_record(struct trace *trace, enum trace_event id, int32_t arg0, int32_t arg1, int32_t arg2);
+
+/*! Times the chunk writes between their trace points, notes the end of the download and the states entered */
+void __wrap_trace_record(struct trace *trace, enum trace_event id, int32_t arg0, int32_t arg1, int32_t arg2)
+{
+    static __thread int64_t write_begin_us = -1;
+
+    if (boot_sim != NULL && id == TRACE_CHUNK_WRITE_BEGIN)
+    {
+        write_begin_us = fake_os_now_us();
+    } else if (boot_sim != NULL && id == TRACE_CHUNK_WRITE_END && write_begin_us >= 0)
+    {
+        struct sim_device *device = &boot_sim->device;
+        if (device->chunk_writes < SIM_MAX_CHUNK_WRITES)
+        {
+            device->chunk_write_us[device->chunk_writes] = fake_os_now_us() - write_begin_us;
+        }
+        device->chunk_writes++;
+        write_begin_us = -1;
+    } else if (boot_sim != NULL && id == TRACE_OTA_STATE && arg0 == STATE_OTA_DOWNLOADED)
+    {
+        boot_sim->device.downloaded_us = fake_os_now_us();
+    }
+    if (boot_sim != NULL && (id == TRACE_TASK_STATE || id == TRACE_OTA_STATE))
+    {
+        state_entered(boot_sim, id, arg0);
+    }
+    __real_trace_record(trace, id, arg0, arg1, arg2);
+}
+#endif
+
+/*! The RTC keeps the time over deep sleep, the device's clock runs on the virtual time of all boots */
+int __wrap_gettimeofday(struct timeval *tv, void *tz)
+{
+    (void) tz;
+    int64_t us = (boot_sim != NULL ? boot_sim->elapsed_us : 0) + fake_os_now_us();
+    tv->tv_sec = SIM_EPOCH_S + us / 1000000;
+    tv->tv_usec = us % 1000000;
+    return 0;
+}
+
+time_t __wrap_time(time_t *t)
+{
+    struct timeval tv;
+    __wrap_gettimeofday(&tv, NULL);
+    if (t != NULL)
+    {
+        *t = tv.tv_sec;
+    }
+    return tv.tv_sec;
+}
+
+/* ThingsBoard */
+
+/*! Returns true if the host of uri is in the comma separated list */
+static bool host_listed(const char *uri, const char *list)
+{
+    const char *host = strstr(uri, "://");
+    host = host != NULL ? host + 3 : uri;
+    size_t host_len = strcspn(host, ":/");
+    while (*list != 0)
+    {
+        size_t len = strcspn(list, ",");
+        if (len == host_len && strncmp(list, host, len) == 0)
+        {
+            return true;
+        }
+        list += list[len] == ',' ? len + 1 : len;
+    }
+    return false;
+}
+
+static int tb_connect(const char *uri, void *ctx)
+{
+    struct sim_tb *tb = ctx;
+    tb->connects++;
+    snprintf(tb->last_connect_uri, sizeof(tb->last_connect_uri), "%s", uri);
+    if (host_listed(uri, tb->unreachable))
+    {
+        return -SIM_CONNECT_TIMEOUT_MS;
+    }
+    if (host_listed(uri, tb->slow))
+    {
+        tb->slow_connects++;
+        return tb->slow_connect_ms;
+    }
+    return tb->connect_ms;
+}
+
+static void tb_telemetry(struct sim_tb *tb, const char *data, int len)
+{
+    tb->telemetry_messages++;
+    cJSON *telemetry = cJSON_ParseWithLength(data, len);
+    if (cJSON_IsArray(telemetry))
+    {
+        tb->telemetry_entries += cJSON_GetArraySize(telemetry);
+    } else if (telemetry != NULL)
+    {
+        cJSON *fw_state = cJSON_GetObjectItem(telemetry, TB_CLIENT_ATTR_FIELD_FW_STATE);
+        if (cJSON_IsString(fw_state))
+        {
+            snprintf(tb->fw_state, sizeof(tb->fw_state), "%s", fw_state->valuestring);
+            tb->fw_failures += strcmp(fw_state->valuestring, "FAILED") == 0;
+        }
+        static const char *const jitter_keys[2][3] = {
+            { "loop_jitter_count", "loop_jitter_avg_us", "loop_jitter_max_us" },
+            { "loop_jitter_dl_count", "loop_jitter_dl_avg_us", "loop_jitter_dl_max_us" }
+        };
+        for (int i = 0; i < 2; i++)
+        {
+            cJSON *count = cJSON_GetObjectItem(telemetry, jitter_keys[i][0]);
+            cJSON *avg = cJSON_GetObjectItem(telemetry, jitter_keys[i][1]);
+            cJSON *max = cJSON_GetObjectItem(telemetry, jitter_keys[i][2]);
+            if (cJSON_IsNumber(count) && cJSON_IsNumber(avg) && cJSON_IsNumber(max))
+            {
+                struct sim_loop_jitter *jitter = &tb->loop_jitter[i];
+                jitter->count += count->valueint;
+                jitter->total_us += (int64_t) avg->valuedouble * count->valueint;
+                jitter->max_us = max->valuedouble > jitter->max_us ? (int64_t) max->valuedouble : jitter->max_us;
+            }
+        }
+    }
+    cJSON_Delete(telemetry);
+}
+
+/*! Counts a fault that costs the response of len bytes */
+static void tb_fault(struct sim_tb *tb, int len)
+{
+    tb->fault_count++;
+    tb->fault_bytes += len;
+    if (tb->fault_us < 0)
+    {
+        tb->fault_us = fake_os_now_us();
+    }
+}
+
+/*! Ends the recovery from the faults since the last delivered chunk, if there were any */
+static void tb_recovered(struct sim_tb *tb)
+{
+    if (tb->fault_us < 0)
+    {
+        return;
+    }
+    int64_t recover_us = fake_os_now_us() - tb->fault_us;
+    tb->fault_us = -1;
+    tb->recoveries++;
+    tb->recover_total_us += recover_us;
+    tb->recover_max_us = recover_us > tb->recover_max_us ? recover_us : tb->recover_max_us;
+}
+
+/*! Returns true if the chunk response is lost to the faults of the simulation */
+static bool tb_chunk_lost(struct sim_tb *tb, int chunk)
+{
+    struct sim_faults *faults = &tb->faults;
+    if (faults->lose_from_chunk >= 0 && chunk >= faults->lose_from_chunk)
+    {
+        return true;
+    }
+    if (faults->chunk_loss_per_mille == 0)
+    {
+        return false;
+    }
+    faults->random = faults->random * 1103515245 + 12345;
+    return (faults->random >> 16) % 1000 < faults->chunk_loss_per_mille;
+}
+
+/*! Answers a request of a firmware chunk, the payload is the chunk size */
+static void tb_fw_chunk(struct sim_tb *tb, int request_id, int chunk, const char *data, int len)
+{
+    char size_string[16];
+    char response_topic[64];
+
+    snprintf(size_string, sizeof(size_string), "%.*s", len, data);
+    int size = atoi(size_string);
+    tb->chunk_requests++;
+    tb->last_chunk_request_us = fake_os_now_us();
+    if (tb->boot_chunk_requests < SIM_MAX_CHUNK_REQUESTS)
+    {
+        tb->chunk_request_us[tb->boot_chunk_requests] = tb->last_chunk_request_us;
+    }
+    tb->boot_chunk_requests++;
+    if (tb->fw_request_us < 0)
+    {
+        tb->fw_request_us = fake_os_now_us();
+    }
+    if (size <= 0 || chunk < 0 || (int64_t) chunk * size >= tb->fw_size)
+    {
+        return;
+    }
+    int offset = chunk * size;
+    int chunk_len = tb->fw_size - offset < size ? tb->fw_size - offset : size;
+    struct sim_faults *faults = &tb->faults;
+    if (faults->reorder_request_id >= 0 && chunk != faults->reorder_chunk)
+    {
+        // The held response arrives late, while the device waits for another chunk
+        int held_offset = faults->reorder_chunk * size;
+        int held_len = tb->fw_size - held_offset < size ? tb->fw_size - held_offset : size;
+        snprintf(response_topic, sizeof(response_topic), "v2/fw/response/%d/chunk/%d", faults->reorder_request_id,
+                        faults->reorder_chunk);
+        fake_mqtt_broker_send(response_topic, tb->fw + held_offset, held_len);
+        faults->reorder_request_id = -1;
+        faults->reorder_chunk = -1;
+    }
+    snprintf(response_topic, sizeof(response_topic), "v2/fw/response/%d/chunk/%d", request_id, chunk);
+    tb->chunk_bytes += chunk_len;
+    if (tb_chunk_lost(tb, chunk))
+    {
+        tb_fault(tb, chunk_len);
+        return;
+    }
+    if (chunk == faults->reorder_chunk && faults->reorder_request_id < 0)
+    {
+        faults->reorder_request_id = request_id;
+        tb_fault(tb, chunk_len);
+        return;
+    }
+    fake_mqtt_broker_send(response_topic, tb->fw + offset, chunk_len);
+
+    if (chunk == faults->drop_after_chunk)
+    {
+        // The response on its way is lost with the connection
+        faults->drop_after_chunk = -1;
+        tb_fault(tb, chunk_len);
+        fake_mqtt_broker_drop();
+    } else if (chunk == faults->offer_after_chunk)
+    {
+        // The update arrives together with the chunk, the device has to drop both the download and the chunk
+        faults->offer_after_chunk = -1;
+        tb_fault(tb, 0);
+        char version[16];
+        snprintf(version, sizeof(version), "V%d", tb->fault_count + 1);
+        sim_offer_firmware(boot_sim, version, faults->offer_size, NULL);
+        fake_mqtt_broker_send(TB_ATTRIBUTES_TOPIC, tb->shared, strlen(tb->shared));
+    } else if (chunk == faults->duplicate_chunk)
+    {
+        // The device takes the first one and has to ignore the copy
+        faults->duplicate_chunk = -1;
+        tb->chunk_bytes += chunk_len;
+        tb_fault(tb, chunk_len);
+        fake_mqtt_broker_send(response_topic, tb->fw + offset, chunk_len);
+    } else if (chunk == faults->update_after_chunk)
+    {
+        // The same target again, e.g. after an unrelated change of the shared attributes
+        faults->update_after_chunk = -1;
+        tb_fault(tb, 0);
+        fake_mqtt_broker_send(TB_ATTRIBUTES_TOPIC, tb->shared, strlen(tb->shared));
+    } else
+    {
+        tb_recovered(tb);
+    }
+}
+
+static void tb_publish(const char *topic, const char *data, int len, void *ctx)
+{
+    struct sim_tb *tb = ctx;
+    const size_t request_prefix_len = strlen(TB_ATTRIBUTES_REQUEST_TOPIC_PREFIX);
+    int request_id;
+    int chunk;
+
+    if (strncmp(topic, TB_ATTRIBUTES_REQUEST_TOPIC_PREFIX, request_prefix_len) == 0)
+    {
+        char response_topic[96];
+        static char response[sizeof(tb->shared) + 16];
+        tb->attribute_requests++;
+        bool config_request = len == strlen(TB_SHARED_ATTR_KEYS_REQUEST)
+                        && memcmp(data, TB_SHARED_ATTR_KEYS_REQUEST, len) == 0;
+        tb->config_requests += config_request;
+        snprintf(response_topic, sizeof(response_topic), TB_ATTRIBUTES_RESPONSE_TOPIC_PREFIX "%s",
+                        topic + request_prefix_len);
+        int response_len = snprintf(response, sizeof(response), "{\"shared\":%s}", tb->shared);
+        fake_mqtt_broker_send(response_topic, response, response_len);
+        if (config_request && tb->faults.drop_after_config_requests > 0)
+        {
+            // The response on its way is lost with the connection
+            tb->faults.drop_after_config_requests--;
+            fake_mqtt_broker_drop();
+        }
+    } else if (strcmp(topic, TB_TELEMETRY_TOPIC) == 0)
+    {
+        tb_telemetry(tb, data, len);
+    } else if (sscanf(topic, "v2/fw/request/%d/chunk/%d", &request_id, &chunk) == 2)
+    {
+        tb_fw_chunk(tb, request_id, chunk, data, len);
+    }
+}
+
+/*! HTTP server of the firmware at fw_url, on the same hosts as the brokers */
+static int tb_http_get(const char *url, int start, int end, const uint8_t **body, int *len, void *ctx)
+{
+    struct sim_tb *tb = ctx;
+
+    if (tb->fw_request_us < 0)
+    {
+        tb->fw_request_us = fake_os_now_us();
+    }
+    if (host_listed(url, tb->unreachable))
+    {
+        return 0;
+    }
+    tb->http_requests++;
+    if (tb->fw_url[0] == 0 || strcmp(url, tb->fw_url) != 0)
+    {
+        return 404;
+    }
+    bool range = start != 0 || end >= 0;
+    if (end < 0 || end >= tb->fw_size)
+    {
+        end = tb->fw_size - 1;
+    }
+    if (start < 0 || start > end)
+    {
+        return 416;
+    }
+    *body = tb->fw + start;
+    *len = end - start + 1;
+    tb->http_bytes += *len;
+    return range ? 206 : 200;
+}
+
+static void sha256(const uint8_t *data, size_t len, uint8_t digest[32])
+{
+    mbedtls_md_context_t md_ctx;
+    mbedtls_md_init(&md_ctx);
+    mbedtls_md_setup(&md_ctx, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0);
+    mbedtls_md_starts(&md_ctx);
+    mbedtls_md_update(&md_ctx, data, len);
+    mbedtls_md_finish(&md_ctx, digest);
+    mbedtls_md_free(&md_ctx);
+}
+
+void sim_offer_firmware(struct sim *sim, const char *version, int size, const char *url)
+{
+    struct sim_tb *tb = &sim->tb;
+    uint8_t *image = tb->fw;
+
+    if (size % 16 != 0 || size < SIM_FW_OVERHEAD + (int) sizeof(esp_app_desc_t) || size > SIM_FW_MAX_SIZE)
+    {
+        fprintf(stderr, "Invalid firmware size %d\n", size);
+        exit(EXIT_FAILURE);
+    }
+
+    // One segment that starts with the app description, checksummed and hashed like by esptool
+    const uint32_t segment_header[2] = { SIM_FW_LOAD_ADDR, size - SIM_FW_OVERHEAD };
+    uint8_t *segment = image + 24 + sizeof(segment_header);
+    memset(image, 0, size);
+    image[0] = 0xE9;
+    image[1] = 1;
+    image[12] = CONFIG_IDF_FIRMWARE_CHIP_ID & 0xff;
+    image[13] = CONFIG_IDF_FIRMWARE_CHIP_ID >> 8;
+    image[23] = 1;
+    memcpy(image + 24, segment_header, sizeof(segment_header));
+    uint32_t random = (uint32_t) size;
+    for (uint32_t i = 0; i < segment_header[1]; i++)
+    {
+        random = random * 1103515245 + 12345;
+        segment[i] = random >> 24;
+    }
+    esp_app_desc_t app_desc = { .magic_word = ESP_APP_DESC_MAGIC_WORD };
+    snprintf(app_desc.version, sizeof(app_desc.version), "%s", version);
+    snprintf(app_desc.project_name, sizeof(app_desc.project_name), "mqttOta");
+    memcpy(segment, &app_desc, sizeof(app_desc));
+    uint8_t checksum = 0xEF;
+    for (uint32_t i = 0; i < segment_header[1]; i++)
+    {
+        checksum ^= segment[i];
+    }
+    image[size - 32 - 1] = checksum;
+    sha256(image, size - 32, image + size - 32);
+
+    uint8_t digest[32];
+    char checksum_string[65];
+    sha256(image, size, digest);
+    for (int i = 0; i < 32; i++)
+    {
+        snprintf(checksum_string + 2 * i, 3, "%02x", digest[i]);
+    }
+    tb->fw_size = size;
+    snprintf(tb->fw_url, sizeof(tb->fw_url), "%s", url != NULL ? url : "");
+    snprintf(tb->shared, sizeof(tb->shared), "{\"" TB_SHARED_ATTR_FIELD_FW_TITLE "\":\"mqttOta\",\"" TB_SHARED_ATTR_FIELD_FW_VER
+                    "\":\"%s\",\"" TB_SHARED_ATTR_FIELD_FW_SIZE "\":%d,\"" TB_SHARED_ATTR_FIELD_FW_CHECKSUM_ALGORITHM
+                    "\":\"SHA256\",\"" TB_SHARED_ATTR_FIELD_FW_CHECKSUM "\":\"%s\",\"" TB_SHARED_ATTR_FIELD_TARGET_FW_URL
+                    "\":\"%s\"}", version, size, checksum_string, tb->fw_url);
+}
+
+void sim_offer_firmware_of(struct sim *sim, const struct sim *from)
+{
+    memcpy(sim->tb.fw, from->tb.fw, from->tb.fw_size);
+    sim->tb.fw_size = from->tb.fw_size;
+    snprintf(sim->tb.fw_url, sizeof(sim->tb.fw_url), "%s", from->tb.fw_url);
+    snprintf(sim->tb.shared, sizeof(sim->tb.shared), "%s", from->tb.shared);
+}
+
+/* Boots */
+
+struct sim *sim_create(void)
+{
+    struct sim *sim = calloc(1, sizeof(*sim));
+    if (sim == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    fake_storage_format(&sim->storage);
+    strcpy(sim->tb.shared, "{}");
+    sim->tb.connect_ms = 300;
+    sim->tb.rtt_ms = 50;
+    sim->tb.http_rtt_ms = 50;
+    sim->tb.faults.lose_from_chunk = -1;
+    sim->tb.faults.drop_after_chunk = -1;
+    sim->tb.faults.offer_after_chunk = -1;
+    sim->tb.faults.duplicate_chunk = -1;
+    sim->tb.faults.reorder_chunk = -1;
+    sim->tb.faults.reorder_request_id = -1;
+    sim->tb.faults.update_after_chunk = -1;
+    sim->tb.fault_us = -1;
+    sim->device.drop_task_state = -1;
+    sim->device.drop_ota_state = -1;
+    return sim;
+}
+
+struct sim_boot_result sim_boot(struct sim *sim, const struct fake_wifi_ap *ap, int64_t time_limit_us)
+{
+    struct sim_boot_result result = { .exit_status = -1 };
+
+    struct boot_heap heap = { 0 };
+    boot_heap = &heap;
+    struct fake_host *host = fake_host_create(&sim->storage);
+    fake_host_use(host);
+    boot_sim = sim;
+    fake_log_level = sim_verbose ? ESP_LOG_INFO : ESP_LOG_NONE;
+    fake_os_seed(sim->seed + sim->boots + 1);
+    fake_wifi_ap_set(ap);
+    const struct fake_mqtt_broker broker = { .connect = tb_connect, .publish = tb_publish, .ctx = &sim->tb,
+                    .rtt_ms = sim->tb.rtt_ms, .downlink_bytes_per_s = sim->tb.downlink_bytes_per_s };
+    fake_mqtt_broker_set(&broker);
+    // Plain HTTP, the connect takes one round trip
+    const struct fake_http_server http_server = { .get = tb_http_get, .ctx = &sim->tb, .connect_ms = sim->tb.http_rtt_ms,
+                    .rtt_ms = sim->tb.http_rtt_ms, .bytes_per_s = sim->tb.http_bytes_per_s };
+    fake_http_server_set(&http_server);
+    sim->tb.fw_request_us = -1;
+    sim->tb.boot_chunk_requests = 0;
+    sim->device.chunk_writes = 0;
+    sim->device.downloaded_us = -1;
+    sim->device.ota_writes = 0;
+    memset(sim->device.task_state_entries, 0, sizeof(sim->device.task_state_entries));
+    memset(sim->device.ota_state_entries, 0, sizeof(sim->device.ota_state_entries));
+
+    fake_boot();
+    app_main();
+    bool ran = fake_os_run(time_limit_us);
+    result.exit_status = fake_host_exit_status(host);
+    if (result.exit_status == 0)
+    {
+        result.exit_status = ran ? SIM_EXIT_TIME_LIMIT : SIM_EXIT_DEADLOCK;
+        sim->storage.boot_end_us = fake_os_now_us();
+    }
+    fflush(stdout);
+    boot_sim = NULL;
+    fake_host_use(NULL);
+    fake_host_destroy(host);
+    // The context of the device and its kernel objects live as long as its tasks
+    for (size_t i = 0; i < heap.size; i++)
+    {
+        __real_free(heap.slots[i]);
+    }
+    __real_free(heap.slots);
+    boot_heap = NULL;
+
+    result.uptime_us = sim->storage.boot_end_us;
+    sim->storage.boot_end_us = 0;
+    sim->elapsed_us += result.uptime_us;
+    if (result.exit_status == FAKE_EXIT_DEEP_SLEEP)
+    {
+        sim->elapsed_us += sim->storage.sleep_us;
+    }
+    sim->boots++;
+    return result;
+}
+
+bool sim_firmware_staged(struct sim *sim)
+{
+    static uint8_t staged[SIM_FW_MAX_SIZE];
+
+    if (sim->storage.boot_slot < 0 || sim->tb.fw_size == 0)
+    {
+        return false;
+    }
+    fake_storage_use(&sim->storage);
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_APP,
+                    ESP_PARTITION_SUBTYPE_APP_OTA_0 + sim->storage.boot_slot, NULL);
+    return partition != NULL && esp_partition_read(partition, 0, staged, sim->tb.fw_size) == ESP_OK
+                    && memcmp(staged, sim->tb.fw, sim->tb.fw_size) == 0;
+}
+
+void sim_destroy(struct sim *sim)
+{
+    free(sim);
+}
+
+bool sim_parse_args(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-v") == 0)
+        {
+            sim_verbose = true;
+        } else
+        {
+            fprintf(stderr, "Usage: %s [-v]\n", argv[0]);
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,227 @@
+/**
+ * @file sim.h
+ * Simulation of the device on the fakes of the host build: each boot runs the tasks of app_main()
+ * on a host of its own, see fake_host_create(), on the virtual clock until it restarts or goes to
+ * deep sleep, against the access point and a ThingsBoard of the simulation. The flash, NVS, RTC
+ * memory and the state of ThingsBoard live in struct sim and outlast the boots.
+ */
+
+#ifndef PRJ_SIM_MODULE
+#define PRJ_SIM_MODULE
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "fake_host.h"
+
+/*! Exit status of a boot that was still running at the time limit of sim_boot() */
+#define SIM_EXIT_TIME_LIMIT 12
+/*! Exit status of a boot whose tasks all waited without timeout */
+#define SIM_EXIT_DEADLOCK 13
+
+/*! Time until a connect to an unreachable broker fails */
+#define SIM_CONNECT_TIMEOUT_MS 10000
+
+/*! Wall clock of the device at the start of the simulation, 2023-11-14 22:13:20 UTC */
+#define SIM_EPOCH_S 1700000000LL
+
+/*! Chunk requests of a boot whose time struct sim_tb keeps, the later ones are only counted */
+#define SIM_MAX_CHUNK_REQUESTS 256
+
+/*! Max size of the firmware ThingsBoard offers, see sim_offer_firmware() */
+#define SIM_FW_MAX_SIZE (1024 * 1024)
+
+/* Faults ThingsBoard injects into the chunk download, none with the values of sim_create() */
+struct sim_faults
+{
+    /*! State of the generator of the lost responses, set to the seed of the scenario */
+    uint32_t random;
+    /*! Chance in per mille that a chunk response is lost */
+    uint32_t chunk_loss_per_mille;
+    /*! Chunk from which on every response is lost, -1 for none */
+    int lose_from_chunk;
+    /*! Chunk whose response is lost with the connection the broker drops after it, -1 for none */
+    int drop_after_chunk;
+    /*! Chunk after whose response a new firmware of offer_size is offered, -1 for none */
+    int offer_after_chunk;
+    int offer_size;
+    /*! Chunk whose response is sent twice, -1 for none */
+    int duplicate_chunk;
+    /*! Chunk whose first response is held back until the device requests another chunk, -1 for none */
+    int reorder_chunk;
+    /*! Request id of the held response, -1 while none is held */
+    int reorder_request_id;
+    /*! Chunk after whose response the same shared attributes are sent again, -1 for none */
+    int update_after_chunk;
+    /*! Config requests whose response is lost with the connection the broker drops after it, counts down */
+    uint32_t drop_after_config_requests;
+};
+
+/* Wake-ups of the loop of the example application, from its jitter reports */
+struct sim_loop_jitter
+{
+    uint32_t count;
+    int64_t total_us;
+    int64_t max_us;
+};
+
+/* ThingsBoard of the simulation */
+struct sim_tb
+{
+    /*! Shared attributes of the device, a JSON object */
+    char shared[1024];
+    /*! Comma separated hosts that don't answer a connect */
+    char unreachable[256];
+    /*! Comma separated hosts that take slow_connect_ms to answer a connect instead of connect_ms */
+    char slow[256];
+    uint32_t slow_connect_ms;
+    uint32_t connect_ms;
+    uint32_t rtt_ms;
+    /*! Throughput of the messages to the device, 0 for no limit */
+    uint32_t downlink_bytes_per_s;
+
+    /* Counters since the start of the simulation */
+    uint32_t connects;
+    uint32_t slow_connects;
+    char last_connect_uri[128];
+    uint32_t attribute_requests;
+    /*! Attributes requests of the whole OTA config */
+    uint32_t config_requests;
+    uint32_t telemetry_messages;
+    /*! Entries of the telemetry arrays, as batched by the duty cycle */
+    uint32_t telemetry_entries;
+    char fw_state[32];
+    /*! Loop jitter of the example application, [0] idle and [1] during a download */
+    struct sim_loop_jitter loop_jitter[2];
+
+    /* Firmware offered with the shared attributes */
+    uint8_t fw[SIM_FW_MAX_SIZE];
+    int fw_size;
+    /*! URL the HTTP server of the simulation serves the firmware at, empty if it doesn't */
+    char fw_url[128];
+    /*! Round trip and throughput of the HTTP server, 0 for no limit */
+    uint32_t http_rtt_ms;
+    uint32_t http_bytes_per_s;
+    /*! Uptime of the first chunk or range request of the firmware in its boot, -1 before */
+    int64_t fw_request_us;
+    uint32_t chunk_requests;
+    /*! Bytes of the firmware sent in chunks and in HTTP responses */
+    uint32_t chunk_bytes;
+    uint32_t http_requests;
+    uint32_t http_bytes;
+
+    struct sim_faults faults;
+    /*! fw_state FAILED reports */
+    uint32_t fw_failures;
+    /*! Uptime of the last chunk request in its boot */
+    int64_t last_chunk_request_us;
+    /*! Uptime of each chunk request of the running boot */
+    int64_t chunk_request_us[SIM_MAX_CHUNK_REQUESTS];
+    uint32_t boot_chunk_requests;
+    /*! Faults injected and the chunk responses lost to them */
+    uint32_t fault_count;
+    uint32_t fault_bytes;
+    /*! Uptime of the first fault not followed by a delivered chunk yet, -1 if none */
+    int64_t fault_us;
+    /*! Times from a fault until the next chunk was delivered */
+    uint32_t recoveries;
+    int64_t recover_total_us;
+    int64_t recover_max_us;
+};
+
+/*! Chunk writes of a boot kept by struct sim_device, the later ones are only counted */
+#define SIM_MAX_CHUNK_WRITES 256
+
+/*! States of the OTA task and of its download counted by struct sim_device, see enum state and STATE_OTA_WRITE */
+#define SIM_MAX_STATES 16
+
+/* Counters of the device side since the start of the simulation, and the fallbacks and faults it is forced into */
+struct sim_device
+{
+    uint32_t nvs_opens;
+    /*! Opens of the namespace of the broker endpoint list */
+    uint32_t endpoint_list_reads;
+    /*! Set to fail ota_erase_start(), the download then erases each sector when its first write reaches it */
+    bool pre_erase_fails;
+    /*! Set to fail image_verify_start(), esp_ota_end() then reads the image back to verify it */
+    bool verify_start_fails;
+    /*! Uptime the running boot finished the download of the firmware at, -1 before */
+    int64_t downloaded_us;
+    /*! Chunk writes of the running boot and the time each took, from the trace points of the device */
+    uint32_t chunk_writes;
+    int64_t chunk_write_us[SIM_MAX_CHUNK_WRITES];
+    /*! esp_ota_write() calls of the running boot, and the one that fails, 1 for the first, 0 for none */
+    uint32_t ota_writes;
+    uint32_t ota_write_fails;
+    /*! Entries of the running boot into the states of the OTA task and of the download, from the trace points */
+    uint32_t task_state_entries[SIM_MAX_STATES];
+    uint32_t ota_state_entries[SIM_MAX_STATES];
+    /*! State of the OTA task or of the download whose drop_entry-th entry drops the connection, -1 for none */
+    int drop_task_state;
+    int drop_ota_state;
+    uint32_t drop_entry;
+    /*! Set to drop the Wi-Fi instead of the MQTT connection */
+    bool drop_wifi;
+    /*! Connections dropped on the entry into the state, not if the link was already down */
+    uint32_t drops;
+};
+
+/* Everything a boot leaves for the next ones and for the simulation */
+struct sim
+{
+    struct fake_storage storage;
+    struct sim_tb tb;
+    struct sim_device device;
+    uint32_t boots;
+    /*! Seed of the random numbers of the device, the boots of a simulation add to it */
+    uint32_t seed;
+    /*! Virtual time of the boots and deep sleeps before the running boot */
+    int64_t elapsed_us;
+};
+
+/* Result of one boot */
+struct sim_boot_result
+{
+    /*! FAKE_EXIT_RESTART, FAKE_EXIT_DEEP_SLEEP, SIM_EXIT_TIME_LIMIT or SIM_EXIT_DEADLOCK */
+    int exit_status;
+    /*! Virtual time from the boot until it ended */
+    int64_t uptime_us;
+};
+
+/*! Prints the logs of the device, set by the -v option of the simulations */
+extern bool sim_verbose;
+
+/*! Returns a simulation with an erased flash */
+struct sim *sim_create(void);
+
+/**
+ * @brief Boots the device and runs it until it restarts, goes to deep sleep or reaches the time limit.
+ *
+ * @param sim Simulation of sim_create()
+ * @param ap Access point during the boot
+ * @param time_limit_us Virtual time after which the boot is stopped
+ * @return struct sim_boot_result How the boot ended
+ */
+struct sim_boot_result sim_boot(struct sim *sim, const struct fake_wifi_ap *ap, int64_t time_limit_us);
+
+/**
+ * @brief Builds a firmware image the device accepts and offers it as the only shared attributes,
+ *        with targetFwUrl if url isn't NULL. The HTTP server of the simulation serves it at url.
+ *
+ * @param size Size of the image, a multiple of 16 up to SIM_FW_MAX_SIZE
+ */
+void sim_offer_firmware(struct sim *sim, const char *version, int size, const char *url);
+
+/*! Offers the firmware sim_offer_firmware() built for another simulation, without building it again */
+void sim_offer_firmware_of(struct sim *sim, const struct sim *from);
+
+/*! Returns true if the partition selected for the next boot holds the firmware offered by sim_offer_firmware() */
+bool sim_firmware_staged(struct sim *sim);
+
+/*! Frees the simulation of sim_create() */
+void sim_destroy(struct sim *sim);
+
+/*! Parses the common options of the simulations, returns false on an unknown one */
+bool sim_parse_args(int argc, char **argv);
+
+#endif
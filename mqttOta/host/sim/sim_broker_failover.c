@@ -0,0 +1,95 @@
+/**
+ * @file sim_broker_failover.c
+ * Simulation of the endpoint selection of the broker failover with three brokers: the configured one is down,
+ * one of the mqtt_endpoints is slow to connect and one fast. The first boot receives the list, the second
+ * one loses its connection after a few config responses and has to settle on the fast broker from the
+ * latencies of its own connects, the device doesn't probe the endpoints.
+ *
+ * Usage: sim_broker_failover [-v]
+ *   -v  prints the logs of the device
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mqttOta.h"
+#include "broker.h"
+#include "sim.h"
+
+#define SIM_PRIMARY_HOST "192.168.0.118"
+#define SIM_SLOW_URI "mqtt://slow.local:1883"
+#define SIM_FAST_URI "mqtt://fast.local:1883"
+#define SIM_SLOW_CONNECT_MS 3000
+/*! Connections the broker drops in the second boot, one per config response */
+#define SIM_DROPS 5
+/*! Time for the first boot to fetch the list, and for the second to go through the drops */
+#define SIM_LIST_BOOT_US (30 * 1000000LL)
+#define SIM_FAILOVER_BOOT_US (5 * 60 * 1000000LL)
+
+/* Order of the endpoint list of one case */
+struct failover_case
+{
+    const char *name;
+    const char *endpoints;
+};
+
+static const struct failover_case cases[] =
+{
+    { "slow listed first", SIM_SLOW_URI "," SIM_FAST_URI },
+    { "fast listed first", SIM_FAST_URI "," SIM_SLOW_URI },
+};
+
+static bool failed = false;
+
+static void check(bool ok, const struct failover_case *failover, const char *what)
+{
+    if (!ok)
+    {
+        printf("FAILED %s: %s\n", failover->name, what);
+        failed = true;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const struct fake_wifi_ap ap = { .available = true, .channel = 6, .connect_ms = 2500, .direct_connect_ms = 400 };
+
+    if (!sim_parse_args(argc, argv))
+    {
+        return EXIT_FAILURE;
+    }
+
+    printf("Broker %s down, %s connects in %d ms, %s in 300 ms, %d connections dropped\n\n", SIM_PRIMARY_HOST,
+                    SIM_SLOW_URI, SIM_SLOW_CONNECT_MS, SIM_FAST_URI, SIM_DROPS);
+    printf("case                connects  slow connects  connected at the end\n");
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        const struct failover_case *failover = &cases[i];
+        struct sim *sim = sim_create();
+        sim->tb.slow_connect_ms = SIM_SLOW_CONNECT_MS;
+        snprintf(sim->tb.slow, sizeof(sim->tb.slow), "slow.local");
+        snprintf(sim->tb.shared, sizeof(sim->tb.shared), "{\"" TB_SHARED_ATTR_FIELD_MQTT_ENDPOINTS "\":\"%s\"}",
+                        failover->endpoints);
+        struct sim_boot_result result = sim_boot(sim, &ap, SIM_LIST_BOOT_US);
+        check(result.exit_status == SIM_EXIT_TIME_LIMIT, failover, "the first boot didn't keep running");
+
+        snprintf(sim->tb.unreachable, sizeof(sim->tb.unreachable), SIM_PRIMARY_HOST);
+        sim->tb.faults.drop_after_config_requests = SIM_DROPS;
+        sim->tb.connects = 0;
+        sim->tb.slow_connects = 0;
+        result = sim_boot(sim, &ap, SIM_FAILOVER_BOOT_US);
+        printf("%-18s  %8u  %13u  %s\n", failover->name, sim->tb.connects, sim->tb.slow_connects,
+                        sim->tb.last_connect_uri);
+
+        check(result.exit_status == SIM_EXIT_TIME_LIMIT, failover, "the second boot didn't keep running");
+        check(sim->tb.faults.drop_after_config_requests == 0, failover, "the device didn't reconnect after each drop");
+        // Measuring the slow broker takes one connect, after it the device stays with the fast one
+        check(sim->tb.slow_connects == 1, failover, "the slow broker wasn't measured exactly once");
+        check(strcmp(sim->tb.last_connect_uri, SIM_FAST_URI) == 0, failover, "the device didn't settle on the fast broker");
+        sim_destroy(sim);
+    }
+
+    printf("%s\n", failed ? "FAILED" : "PASSED");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,165 @@
+/**
+ * @file sim_duty_cycle.c
+ * Simulation of the wake/sleep schedule of CONFIG_DUTY_CYCLE_MODE: a cold boot, timer wakes on
+ * the state kept in RTC memory, a broker that fails so the endpoint of the last cycle has to
+ * fail over to the list in NVS, cycles without broker or AP that end at the max awake time, and
+ * the delivery of their telemetry in the next cycle.
+ *
+ * Usage: sim_duty_cycle [-v]
+ *   -v  prints the logs of the device
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mqttOta.h"
+#include "sim.h"
+
+#define SIM_CYCLES 30
+#define SIM_PRIMARY_HOST "192.168.0.118"
+#define SIM_BACKUP_URI "mqtt://tb-backup.local:1883"
+/*! A boot still awake after this long never goes to sleep */
+#define SIM_BOOT_LIMIT_US (10 * 60 * 1000000LL)
+/*! Margin of the max awake time for the OTA task to notice it */
+#define SIM_AWAKE_MARGIN_US 1000000LL
+
+/* Conditions of a cycle */
+struct cycle_condition
+{
+    int cycle;
+    const char *name;
+    bool ap_available;
+    /*! Hosts that don't answer a connect */
+    const char *unreachable;
+};
+
+static const struct cycle_condition conditions[] =
+{
+    { 3, "primary broker down", true, SIM_PRIMARY_HOST },
+    { 5, "all brokers down", true, SIM_PRIMARY_HOST ",tb-backup.local" },
+    { 6, "no access point", false, "" },
+};
+
+static const struct cycle_condition normal = { 0, "normal", true, "" };
+
+static const struct cycle_condition *condition_of(int cycle)
+{
+    for (size_t i = 0; i < sizeof(conditions) / sizeof(conditions[0]); i++)
+    {
+        if (conditions[i].cycle == cycle)
+        {
+            return &conditions[i];
+        }
+    }
+    return &normal;
+}
+
+static bool failed = false;
+
+static void check(bool ok, int cycle, const char *what)
+{
+    if (!ok)
+    {
+        printf("FAILED cycle %d: %s\n", cycle, what);
+        failed = true;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (!sim_parse_args(argc, argv))
+    {
+        return EXIT_FAILURE;
+    }
+
+    struct sim *sim = sim_create();
+    // The first fetch gives the device a second broker to fail over to
+    snprintf(sim->tb.shared, sizeof(sim->tb.shared), "{\"mqtt_endpoints\":\"%s\"}", SIM_BACKUP_URI);
+
+    // Sleep and awake time are the same for every cycle
+    int64_t cold_awake_us = 0;
+    int64_t fast_awake_total_us = 0;
+    int fast_awake_count = 0;
+    int64_t awake_total_us = 0;
+    // What the device is expected to do, modeled on the RTC state of duty_cycle.c
+    uint32_t cycles_since_config = 0;
+    uint32_t pending_entries = 0;
+
+    printf("Duty cycle: sleep %d s, max awake %d s, config fetch every %d cycles\n\n", CONFIG_DUTY_CYCLE_SLEEP_S,
+                    CONFIG_DUTY_CYCLE_MAX_AWAKE_S, CONFIG_DUTY_CYCLE_CONFIG_FETCH_CYCLES);
+    printf("cycle  wake   condition             awake ms  broker                        fetch  nvs  list  sent\n");
+    for (int cycle = 1; cycle <= SIM_CYCLES; cycle++)
+    {
+        const struct cycle_condition *condition = condition_of(cycle);
+        const bool cold = cycle == 1;
+        const bool reachable = condition->ap_available && strcmp(condition->unreachable, SIM_PRIMARY_HOST ",tb-backup.local") != 0;
+        const struct fake_wifi_ap ap = { .available = condition->ap_available, .channel = 6, .connect_ms = 2500,
+                        .direct_connect_ms = 400 };
+        snprintf(sim->tb.unreachable, sizeof(sim->tb.unreachable), "%s", condition->unreachable);
+
+        const struct sim_tb tb = sim->tb;
+        const struct sim_device device = sim->device;
+        struct sim_boot_result result = sim_boot(sim, &ap, SIM_BOOT_LIMIT_US);
+        const uint32_t fetches = sim->tb.config_requests - tb.config_requests;
+        const uint32_t sent = sim->tb.telemetry_entries - tb.telemetry_entries;
+        const uint32_t nvs_opens = sim->device.nvs_opens - device.nvs_opens;
+        const uint32_t list_reads = sim->device.endpoint_list_reads - device.endpoint_list_reads;
+        const char *broker = sim->tb.connects != tb.connects ? sim->tb.last_connect_uri : "-";
+
+        printf("%5d  %-5s  %-20s  %8lld  %-28s  %-5s  %3u  %4u  %4u\n", cycle, cold ? "cold" : "timer", condition->name,
+                        (long long) result.uptime_us / 1000, reachable ? broker : "-", fetches != 0 ? "yes" : "no",
+                        nvs_opens, list_reads, sent);
+
+        check(result.exit_status == FAKE_EXIT_DEEP_SLEEP, cycle, "the boot didn't end in deep sleep");
+        awake_total_us += result.uptime_us;
+
+        // Each cycle queues a sample, a timer wake also the awake time of the cycle before
+        pending_entries += cold ? 1 : 2;
+        cycles_since_config = cold ? 1 : cycles_since_config + 1;
+        const bool fetch_expected = cold || cycles_since_config > CONFIG_DUTY_CYCLE_CONFIG_FETCH_CYCLES;
+        if (!reachable)
+        {
+            check(result.uptime_us >= CONFIG_DUTY_CYCLE_MAX_AWAKE_S * 1000000LL
+                            && result.uptime_us < CONFIG_DUTY_CYCLE_MAX_AWAKE_S * 1000000LL + SIM_AWAKE_MARGIN_US, cycle,
+                            "the device didn't sleep at the max awake time");
+            check(sent == 0 && fetches == 0, cycle, "data was delivered without a connection");
+            continue;
+        }
+
+        check(result.uptime_us < CONFIG_DUTY_CYCLE_MAX_AWAKE_S * 1000000LL, cycle, "the device stayed awake too long");
+        check(sent == pending_entries, cycle, "the queued telemetry wasn't delivered");
+        check((fetches != 0) == fetch_expected, cycle, fetch_expected ? "the config wasn't fetched" : "the config was fetched");
+        pending_entries = 0;
+        if (fetches != 0)
+        {
+            cycles_since_config = 0;
+        }
+        if (cold)
+        {
+            cold_awake_us = result.uptime_us;
+        } else if (condition == &normal && fetches == 0)
+        {
+            // The endpoint of the last cycle is used without the list in NVS
+            check(list_reads == 0, cycle, "the endpoint list was read on a timer wake");
+            fast_awake_total_us += result.uptime_us;
+            fast_awake_count++;
+        }
+        if (strcmp(condition->unreachable, SIM_PRIMARY_HOST) == 0)
+        {
+            check(list_reads != 0 && strcmp(broker, SIM_BACKUP_URI) == 0, cycle,
+                            "the endpoint of the last cycle didn't fail over to the list");
+        }
+    }
+
+    int64_t fast_awake_us = fast_awake_count != 0 ? fast_awake_total_us / fast_awake_count : 0;
+    int64_t total_us = awake_total_us + (int64_t) SIM_CYCLES * CONFIG_DUTY_CYCLE_SLEEP_S * 1000000LL;
+    printf("\nAwake: cold boot %lld ms, timer wake %lld ms on average (%d cycles)\n", (long long) cold_awake_us / 1000,
+                    (long long) fast_awake_us / 1000, fast_awake_count);
+    printf("Duty cycle: awake %.2f %% of %.1f h\n", 100.0 * awake_total_us / total_us, total_us / 3600e6);
+    check(fast_awake_us < cold_awake_us, 0, "a timer wake isn't shorter than the cold boot");
+    sim_destroy(sim);
+
+    printf("%s\n", failed ? "FAILED" : "PASSED");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,497 @@
+/**
+ * @file sim_fleet.c
+ * Simulation of a fleet that downloads a firmware in MQTT chunks through one shared broker, for growing
+ * device counts. All devices run in this process, each on its own host of fake_host_create(), spread over
+ * a pool of threads. The threads run the devices for a window of virtual time that is shorter than the
+ * way from a device to the broker, then the broker serves the publishes that arrived in the window in
+ * the order of their arrival: each costs it a fixed time plus the time of its response on the egress
+ * link all devices share. A response can't reach a device before the window it was sent in ended, so
+ * the devices of a window don't depend on each other.
+ *
+ * Usage: sim_fleet [-v] [-t threads] [-n max_devices]
+ *   -v  prints the logs of the devices
+ *   -t  threads of the pool, the number of CPUs by default
+ *   -n  largest fleet, it doubles from SIM_MIN_DEVICES up to it
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "cJSON.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "mqttOta.h"
+#include "tb_request.h"
+#include "sim.h"
+
+#define SIM_FW_VERSION "V1.1"
+#define SIM_FW_SIZE (300 * 1024)
+#define SIM_MIN_DEVICES 8
+#define SIM_MAX_DEVICES 128
+/*! Round trip between a device and the broker, the window is half of it */
+#define SIM_RTT_MS 50
+#define SIM_WINDOW_US (SIM_RTT_MS * 500LL)
+/*! Throughput of the last mile of each device */
+#define SIM_DEVICE_BYTES_PER_S 250000
+/*! Time the broker spends on each message it receives or sends */
+#define SIM_BROKER_MESSAGE_US 200
+/*! Throughput of the egress link the responses of all devices share */
+#define SIM_BROKER_EGRESS_BYTES_PER_S 500000
+/*! A device not updated after this long failed */
+#define SIM_TIME_LIMIT_US (20 * 60 * 1000000LL)
+
+/* Publish of a device that arrived at the broker in the running window */
+struct fleet_message
+{
+    struct fleet_device *device;
+    int64_t arrival_us;
+    char *topic;
+    char *data;
+    int len;
+};
+
+/* One device of the fleet, run by thread index % threads */
+struct fleet_device
+{
+    uint32_t index;
+    struct fake_storage *storage;
+    struct fake_host *host;
+    /*! Publishes of the running window, only the thread of the device adds to them */
+    struct fleet_message *outbox;
+    size_t outbox_len;
+    size_t outbox_size;
+    char fw_state[32];
+    bool done;
+    bool updated;
+    /*! Uptime of the restart into the firmware */
+    int64_t update_us;
+};
+
+/* Fleet of one run and the broker they share */
+struct fleet
+{
+    struct sim *sim;
+    struct fleet_device *devices;
+    uint32_t device_count;
+    uint32_t thread_count;
+    pthread_barrier_t window_done;
+    pthread_barrier_t window_start;
+    /*! End of the running window, set by the broker between windows */
+    int64_t window_end_us;
+    bool finished;
+
+    /*! Time the broker and its egress link are busy until */
+    int64_t broker_free_us;
+    int64_t egress_free_us;
+    uint32_t messages;
+    /*! Publishes of all devices in the window, sorted by arrival */
+    struct fleet_message *queue;
+    size_t queue_size;
+};
+
+/* Result of one run */
+struct fleet_result
+{
+    uint32_t updated;
+    /*! Uptime of the last restart into the firmware */
+    int64_t makespan_us;
+    int64_t p50_us;
+    int64_t p99_us;
+    uint32_t messages;
+    double wall_s;
+};
+
+/* Worker of the pool */
+struct fleet_thread
+{
+    struct fleet *fleet;
+    uint32_t index;
+};
+
+static bool failed = false;
+
+void app_main(void);
+
+static void check(bool ok, uint32_t devices, const char *what)
+{
+    if (!ok)
+    {
+        printf("FAILED %u devices: %s\n", devices, what);
+        failed = true;
+    }
+}
+
+static char *copy_of(const char *data, int len)
+{
+    char *copy = malloc(len + 1);
+    if (copy == NULL)
+    {
+        abort();
+    }
+    memcpy(copy, data, len);
+    copy[len] = 0;
+    return copy;
+}
+
+/*! Broker callback on the thread of the device, the message waits for the end of the window */
+static void fleet_publish(const char *topic, const char *data, int len, void *ctx)
+{
+    struct fleet_device *device = ctx;
+
+    if (device->outbox_len == device->outbox_size)
+    {
+        device->outbox_size = device->outbox_size != 0 ? device->outbox_size * 2 : 8;
+        device->outbox = realloc(device->outbox, device->outbox_size * sizeof(*device->outbox));
+        if (device->outbox == NULL)
+        {
+            abort();
+        }
+    }
+    device->outbox[device->outbox_len++] = (struct fleet_message) { .device = device, .arrival_us = fake_os_now_us(),
+                    .topic = copy_of(topic, strlen(topic)), .data = copy_of(data, len), .len = len };
+
+    // The state is kept at once, the restart into the firmware can follow before the end of the window
+    if (strcmp(topic, TB_TELEMETRY_TOPIC) == 0)
+    {
+        cJSON *telemetry = cJSON_ParseWithLength(data, len);
+        cJSON *fw_state = cJSON_GetObjectItem(telemetry, TB_CLIENT_ATTR_FIELD_FW_STATE);
+        if (cJSON_IsString(fw_state))
+        {
+            snprintf(device->fw_state, sizeof(device->fw_state), "%s", fw_state->valuestring);
+        }
+        cJSON_Delete(telemetry);
+    }
+}
+
+/*! Sends a response the broker starts on at start_us, it leaves once the egress link sent the ones before it */
+static void fleet_respond(struct fleet *fleet, struct fleet_device *device, int64_t start_us, const char *topic,
+                const void *data, int len)
+{
+    fleet->messages++;
+    fleet->broker_free_us = start_us + SIM_BROKER_MESSAGE_US;
+    int64_t egress_start_us = fleet->broker_free_us > fleet->egress_free_us ? fleet->broker_free_us
+                    : fleet->egress_free_us;
+    fleet->egress_free_us = egress_start_us + (int64_t) len * 1000000 / SIM_BROKER_EGRESS_BYTES_PER_S;
+    fake_host_use(device->host);
+    fake_mqtt_broker_send_at(fleet->egress_free_us, topic, data, len);
+    fake_host_use(NULL);
+}
+
+/*! Serves one publish of a device once it arrived and the broker is done with the ones before it */
+static void fleet_serve(struct fleet *fleet, const struct fleet_message *message)
+{
+    struct fleet_device *device = message->device;
+    const struct sim_tb *tb = &fleet->sim->tb;
+    const size_t request_prefix_len = strlen(TB_ATTRIBUTES_REQUEST_TOPIC_PREFIX);
+    char response_topic[96];
+    int request_id;
+    int chunk;
+
+    fleet->messages++;
+    int64_t start_us = message->arrival_us > fleet->broker_free_us ? message->arrival_us : fleet->broker_free_us;
+    fleet->broker_free_us = start_us + SIM_BROKER_MESSAGE_US;
+    if (strncmp(message->topic, TB_ATTRIBUTES_REQUEST_TOPIC_PREFIX, request_prefix_len) == 0)
+    {
+        char response[sizeof(tb->shared) + 16];
+        snprintf(response_topic, sizeof(response_topic), TB_ATTRIBUTES_RESPONSE_TOPIC_PREFIX "%s",
+                        message->topic + request_prefix_len);
+        int response_len = snprintf(response, sizeof(response), "{\"shared\":%s}", tb->shared);
+        fleet_respond(fleet, device, fleet->broker_free_us, response_topic, response, response_len);
+    } else if (sscanf(message->topic, "v2/fw/request/%d/chunk/%d", &request_id, &chunk) == 2)
+    {
+        int size = atoi(message->data);
+        if (size <= 0 || chunk < 0 || (int64_t) chunk * size >= tb->fw_size)
+        {
+            return;
+        }
+        int offset = chunk * size;
+        int chunk_len = tb->fw_size - offset < size ? tb->fw_size - offset : size;
+        snprintf(response_topic, sizeof(response_topic), "v2/fw/response/%d/chunk/%d", request_id, chunk);
+        fleet_respond(fleet, device, fleet->broker_free_us, response_topic, tb->fw + offset, chunk_len);
+    }
+}
+
+static int compare_arrival(const void *a, const void *b)
+{
+    const struct fleet_message *message_a = a;
+    const struct fleet_message *message_b = b;
+    if (message_a->arrival_us != message_b->arrival_us)
+    {
+        return message_a->arrival_us < message_b->arrival_us ? -1 : 1;
+    }
+    return message_a->device->index < message_b->device->index ? -1
+                    : message_a->device->index > message_b->device->index;
+}
+
+/*! Serves the publishes of the window that ended, on the one thread the barrier chose */
+static void fleet_broker(struct fleet *fleet)
+{
+    size_t count = 0;
+    bool running = false;
+    for (uint32_t i = 0; i < fleet->device_count; i++)
+    {
+        count += fleet->devices[i].outbox_len;
+        running |= !fleet->devices[i].done;
+    }
+    if (count > fleet->queue_size)
+    {
+        fleet->queue_size = count * 2;
+        fleet->queue = realloc(fleet->queue, fleet->queue_size * sizeof(*fleet->queue));
+        if (fleet->queue == NULL)
+        {
+            abort();
+        }
+    }
+    count = 0;
+    for (uint32_t i = 0; i < fleet->device_count; i++)
+    {
+        struct fleet_device *device = &fleet->devices[i];
+        memcpy(fleet->queue + count, device->outbox, device->outbox_len * sizeof(*device->outbox));
+        count += device->outbox_len;
+        device->outbox_len = 0;
+    }
+    qsort(fleet->queue, count, sizeof(*fleet->queue), compare_arrival);
+    for (size_t i = 0; i < count; i++)
+    {
+        fleet_serve(fleet, &fleet->queue[i]);
+        free(fleet->queue[i].topic);
+        free(fleet->queue[i].data);
+    }
+
+    fleet->window_end_us += SIM_WINDOW_US;
+    fleet->finished = !running || fleet->window_end_us > SIM_TIME_LIMIT_US;
+}
+
+/*! Returns true if the partition the device boots next holds the firmware of the simulation */
+static bool fleet_firmware_staged(const struct fleet *fleet, const struct fleet_device *device)
+{
+    const struct sim_tb *tb = &fleet->sim->tb;
+    static __thread uint8_t staged[SIM_FW_SIZE];
+
+    if (device->storage->boot_slot < 0)
+    {
+        return false;
+    }
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_APP,
+                    ESP_PARTITION_SUBTYPE_APP_OTA_0 + device->storage->boot_slot, NULL);
+    return partition != NULL && esp_partition_read(partition, 0, staged, tb->fw_size) == ESP_OK
+                    && memcmp(staged, tb->fw, tb->fw_size) == 0;
+}
+
+/*! Boots a device of the thread, on its own host */
+static void fleet_boot(struct fleet_device *device)
+{
+    const struct fake_wifi_ap ap = { .available = true, .channel = 6, .connect_ms = 2500, .direct_connect_ms = 400 };
+    const struct fake_mqtt_broker broker = { .publish = fleet_publish, .ctx = device, .connect_ms = 300,
+                    .rtt_ms = SIM_RTT_MS, .downlink_bytes_per_s = SIM_DEVICE_BYTES_PER_S };
+
+    device->storage = malloc(sizeof(*device->storage));
+    if (device->storage == NULL)
+    {
+        abort();
+    }
+    fake_storage_format(device->storage);
+    device->host = fake_host_create(device->storage);
+    fake_host_use(device->host);
+    fake_os_seed(device->index * 1000 + 1);
+    fake_wifi_ap_set(&ap);
+    fake_mqtt_broker_set(&broker);
+    fake_boot();
+    app_main();
+    fake_host_use(NULL);
+}
+
+static void *fleet_thread(void *arg)
+{
+    struct fleet_thread *thread = arg;
+    struct fleet *fleet = thread->fleet;
+
+    for (uint32_t i = thread->index; i < fleet->device_count; i += fleet->thread_count)
+    {
+        fleet_boot(&fleet->devices[i]);
+    }
+    pthread_barrier_wait(&fleet->window_start);
+    while (!fleet->finished)
+    {
+        for (uint32_t i = thread->index; i < fleet->device_count; i += fleet->thread_count)
+        {
+            struct fleet_device *device = &fleet->devices[i];
+            if (device->done)
+            {
+                continue;
+            }
+            fake_host_use(device->host);
+            bool ran = fake_os_run(fleet->window_end_us);
+            int exit_status = fake_host_exit_status(device->host);
+            if (exit_status != 0 || !ran)
+            {
+                // One boot per device, the restart into the firmware ends it
+                device->done = true;
+                device->updated = exit_status == FAKE_EXIT_RESTART
+                                && strcmp(device->fw_state, TB_CLIENT_STATE_UPDATED) == 0
+                                && fleet_firmware_staged(fleet, device);
+                device->update_us = fake_os_now_us();
+            }
+            fake_host_use(NULL);
+        }
+        if (pthread_barrier_wait(&fleet->window_done) == PTHREAD_BARRIER_SERIAL_THREAD)
+        {
+            fleet_broker(fleet);
+        }
+        pthread_barrier_wait(&fleet->window_start);
+    }
+    return NULL;
+}
+
+static int compare_us(const void *a, const void *b)
+{
+    int64_t us_a = *(const int64_t *) a;
+    int64_t us_b = *(const int64_t *) b;
+    return us_a < us_b ? -1 : us_a > us_b;
+}
+
+/*! Runs a fleet of device_count devices on thread_count threads until all of them restarted */
+static void run_fleet(struct sim *sim, uint32_t device_count, uint32_t thread_count, struct fleet_result *result)
+{
+    struct fleet fleet = { .sim = sim, .device_count = device_count, .window_end_us = SIM_WINDOW_US };
+    fleet.thread_count = thread_count < device_count ? thread_count : device_count;
+    fleet.devices = calloc(device_count, sizeof(*fleet.devices));
+    struct fleet_thread *threads = calloc(fleet.thread_count, sizeof(*threads));
+    pthread_t *thread_ids = calloc(fleet.thread_count, sizeof(*thread_ids));
+    int64_t *update_us = calloc(device_count, sizeof(*update_us));
+    if (fleet.devices == NULL || threads == NULL || thread_ids == NULL || update_us == NULL)
+    {
+        abort();
+    }
+    for (uint32_t i = 0; i < device_count; i++)
+    {
+        fleet.devices[i].index = i;
+    }
+    pthread_barrier_init(&fleet.window_done, NULL, fleet.thread_count);
+    pthread_barrier_init(&fleet.window_start, NULL, fleet.thread_count);
+
+    struct timespec wall_start;
+    struct timespec wall_end;
+    clock_gettime(CLOCK_MONOTONIC, &wall_start);
+    for (uint32_t i = 0; i < fleet.thread_count; i++)
+    {
+        threads[i] = (struct fleet_thread) { .fleet = &fleet, .index = i };
+        if (pthread_create(&thread_ids[i], NULL, fleet_thread, &threads[i]) != 0)
+        {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (uint32_t i = 0; i < fleet.thread_count; i++)
+    {
+        pthread_join(thread_ids[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
+
+    memset(result, 0, sizeof(*result));
+    result->wall_s = (wall_end.tv_sec - wall_start.tv_sec) + (wall_end.tv_nsec - wall_start.tv_nsec) / 1e9;
+    result->messages = fleet.messages;
+    for (uint32_t i = 0; i < device_count; i++)
+    {
+        struct fleet_device *device = &fleet.devices[i];
+        if (device->updated)
+        {
+            update_us[result->updated++] = device->update_us;
+        }
+        fake_host_destroy(device->host);
+        free(device->storage);
+        free(device->outbox);
+    }
+    qsort(update_us, result->updated, sizeof(*update_us), compare_us);
+    if (result->updated != 0)
+    {
+        result->makespan_us = update_us[result->updated - 1];
+        result->p50_us = update_us[(result->updated - 1) / 2];
+        result->p99_us = update_us[(result->updated - 1) * 99 / 100];
+    }
+
+    pthread_barrier_destroy(&fleet.window_done);
+    pthread_barrier_destroy(&fleet.window_start);
+    free(fleet.queue);
+    free(update_us);
+    free(thread_ids);
+    free(threads);
+    free(fleet.devices);
+}
+
+int main(int argc, char **argv)
+{
+    long thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    long max_devices = SIM_MAX_DEVICES;
+    int option;
+
+    while ((option = getopt(argc, argv, "vt:n:")) != -1)
+    {
+        if (option == 'v')
+        {
+            sim_verbose = true;
+        } else if (option == 't')
+        {
+            thread_count = strtol(optarg, NULL, 10);
+        } else if (option == 'n')
+        {
+            max_devices = strtol(optarg, NULL, 10);
+        } else
+        {
+            fprintf(stderr, "Usage: %s [-v] [-t threads] [-n max_devices]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (thread_count < 1 || max_devices < 1)
+    {
+        fprintf(stderr, "Invalid thread or device count\n");
+        return EXIT_FAILURE;
+    }
+    if (!sim_verbose)
+    {
+        fake_log_level = ESP_LOG_NONE;
+    }
+
+    // One firmware offered to all devices, the fleet only reads it
+    struct sim *sim = sim_create();
+    sim_offer_firmware(sim, SIM_FW_VERSION, SIM_FW_SIZE, NULL);
+
+    printf("Fleets offered a firmware of %d KB in chunks of %d B at the same time, on %ld threads\n", SIM_FW_SIZE / 1024,
+                    CHUNK_SIZE, thread_count);
+    printf("The broker takes %d us per message and shares %d KB/s of egress, each device has %d KB/s and %d ms of RTT\n",
+                    SIM_BROKER_MESSAGE_US, SIM_BROKER_EGRESS_BYTES_PER_S / 1000, SIM_DEVICE_BYTES_PER_S / 1000, SIM_RTT_MS);
+    printf("Update is the time from the boot to the restart into the firmware, throughput the firmware bytes of the\n"
+                    "fleet over the time until the last restart, msg/s the messages the broker received and sent over it\n\n");
+    printf("devices  updated  throughput KB/s  p50 update s  p99 update s  broker msg/s  wall s\n");
+
+    struct fleet_result smallest = { 0 };
+    for (long devices = SIM_MIN_DEVICES < max_devices ? SIM_MIN_DEVICES : max_devices; devices <= max_devices;
+                    devices *= 2)
+    {
+        struct fleet_result result;
+        run_fleet(sim, devices, thread_count, &result);
+        double makespan_s = result.makespan_us / 1e6;
+        printf("%7ld  %7u  %15.0f  %12.1f  %12.1f  %12.0f  %6.2f\n", devices, result.updated,
+                        makespan_s > 0 ? (double) result.updated * SIM_FW_SIZE / 1024 / makespan_s : 0,
+                        result.p50_us / 1e6, result.p99_us / 1e6, makespan_s > 0 ? result.messages / makespan_s : 0,
+                        result.wall_s);
+
+        check(result.updated == devices, devices, "not every device was updated");
+        if (smallest.updated == 0)
+        {
+            smallest = result;
+        } else
+        {
+            // The shared egress link queues the chunks of the larger fleets
+            check(result.p99_us >= smallest.p99_us, devices, "the tail update time shrank with more devices");
+        }
+    }
+    sim_destroy(sim);
+
+    printf("%s\n", failed ? "FAILED" : "PASSED");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
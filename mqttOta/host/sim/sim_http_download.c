@@ -0,0 +1,129 @@
+/**
+ * @file sim_http_download.c
+ * Simulation of a firmware download with MQTT chunks and with HTTP range requests from targetFwUrl
+ * over the same links, and of the fall back to MQTT chunks when the HTTP server is unreachable.
+ * Each download runs on a fresh device until it restarts into the new image.
+ *
+ * Usage: sim_http_download [-v]
+ *   -v  prints the logs of the device
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mqttOta.h"
+#include "http_download.h"
+#include "sim.h"
+
+#define SIM_FW_VERSION "V1.1"
+#define SIM_FW_SIZE (900 * 1024)
+#define SIM_FW_HOST "fw.local"
+#define SIM_FW_URL "http://" SIM_FW_HOST "/mqttOta.bin"
+/*! A download still running after this long failed */
+#define SIM_BOOT_LIMIT_US (10 * 60 * 1000000LL)
+
+/* Link between the device and ThingsBoard, the broker and the HTTP server share it */
+struct link_profile
+{
+    const char *name;
+    uint32_t rtt_ms;
+    uint32_t bytes_per_s;
+};
+
+static const struct link_profile profiles[] =
+{
+    { "LAN", 5, 2000000 },
+    { "Wi-Fi to cloud", 60, 500000 },
+    { "cellular", 250, 100000 },
+};
+
+/* Result of one download */
+struct download
+{
+    bool ok;
+    /*! From the first chunk or range request until the restart into the image */
+    int64_t time_us;
+    uint32_t chunk_bytes;
+    uint32_t http_bytes;
+};
+
+static bool failed = false;
+
+static void check(bool ok, const char *link, const char *what)
+{
+    if (!ok)
+    {
+        printf("FAILED %s: %s\n", link, what);
+        failed = true;
+    }
+}
+
+/*! Boots a fresh device that downloads the firmware offered with url over the link */
+static struct download run_download(const struct link_profile *link, const char *url, const char *unreachable)
+{
+    const struct fake_wifi_ap ap = { .available = true, .channel = 6, .connect_ms = 2500, .direct_connect_ms = 400 };
+    struct download download = { false };
+
+    struct sim *sim = sim_create();
+    sim->tb.rtt_ms = link->rtt_ms;
+    sim->tb.downlink_bytes_per_s = link->bytes_per_s;
+    sim->tb.http_rtt_ms = link->rtt_ms;
+    sim->tb.http_bytes_per_s = link->bytes_per_s;
+    snprintf(sim->tb.unreachable, sizeof(sim->tb.unreachable), "%s", unreachable);
+    sim_offer_firmware(sim, SIM_FW_VERSION, SIM_FW_SIZE, url);
+
+    struct sim_boot_result result = sim_boot(sim, &ap, SIM_BOOT_LIMIT_US);
+    download.ok = result.exit_status == FAKE_EXIT_RESTART && strcmp(sim->tb.fw_state, TB_CLIENT_STATE_UPDATED) == 0
+                    && sim_firmware_staged(sim);
+    download.time_us = sim->tb.fw_request_us >= 0 ? result.uptime_us - sim->tb.fw_request_us : 0;
+    download.chunk_bytes = sim->tb.chunk_bytes;
+    download.http_bytes = sim->tb.http_bytes;
+    sim_destroy(sim);
+    return download;
+}
+
+static double kb_per_s(const struct download *download)
+{
+    return download->time_us > 0 ? SIM_FW_SIZE / 1024.0 / (download->time_us / 1e6) : 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (!sim_parse_args(argc, argv))
+    {
+        return EXIT_FAILURE;
+    }
+
+    printf("Firmware of %d KB: MQTT chunks of %d B, HTTP ranges of %d B with %d downloaded ahead\n", SIM_FW_SIZE / 1024,
+                    CHUNK_SIZE, HTTP_DOWNLOAD_RANGE_SIZE, CONFIG_OTA_HTTP_RANGES_IN_FLIGHT);
+    printf("Time from the first request to the restart into the image, the flash writes included\n\n");
+    printf("link              rtt ms  link KB/s    MQTT s  MQTT KB/s    HTTP s  HTTP KB/s  speed-up\n");
+    for (size_t i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++)
+    {
+        const struct link_profile *link = &profiles[i];
+        struct download mqtt = run_download(link, NULL, "");
+        struct download http = run_download(link, SIM_FW_URL, "");
+
+        printf("%-16s  %6u  %9u  %8.1f  %9.1f  %8.1f  %9.1f  %7.1fx\n", link->name, link->rtt_ms, link->bytes_per_s / 1024,
+                        mqtt.time_us / 1e6, kb_per_s(&mqtt), http.time_us / 1e6, kb_per_s(&http),
+                        http.time_us > 0 ? (double) mqtt.time_us / http.time_us : 0);
+
+        check(mqtt.ok && mqtt.chunk_bytes == SIM_FW_SIZE && mqtt.http_bytes == 0, link->name,
+                        "the MQTT download didn't stage the image");
+        check(http.ok && http.http_bytes == SIM_FW_SIZE && http.chunk_bytes == 0, link->name,
+                        "the HTTP download didn't stage the image");
+        check(http.time_us < mqtt.time_us, link->name, "the HTTP download isn't faster");
+    }
+
+    // The retries of the HTTP download come first, then the whole image is downloaded with MQTT chunks
+    const struct link_profile *link = &profiles[1];
+    struct download fallback = run_download(link, SIM_FW_URL, SIM_FW_HOST);
+    printf("\nHTTP server unreachable on %s: %.1f s to the restart, %u B with MQTT chunks\n", link->name,
+                    fallback.time_us / 1e6, fallback.chunk_bytes);
+    check(fallback.ok && fallback.chunk_bytes == SIM_FW_SIZE && fallback.http_bytes == 0, "fallback",
+                    "the download didn't fall back to MQTT chunks");
+
+    printf("%s\n", failed ? "FAILED" : "PASSED");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,113 @@
+/**
+ * @file sim_loop_jitter.c
+ * Simulation of the wake-up jitter of the 1 s loop of the example application without and during a firmware
+ * download, from its loop_jitter telemetry. The simulation runs all tasks on one CPU and stalls it for each flash
+ * operation, as the cache is disabled on both cores of an ESP32 meanwhile, so the jitter is the flash time
+ * the loop waits for. The CPU time of the device code isn't modeled, nor the core a task is pinned to.
+ *
+ * Usage: sim_loop_jitter [-v]
+ *   -v  prints the logs of the device
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mqttOta.h"
+#include "sim.h"
+
+#define SIM_FW_VERSION "V1.1"
+#define SIM_FW_SIZE (900 * 1024)
+#define SIM_FW_HOST "fw.local"
+#define SIM_FW_URL "http://" SIM_FW_HOST "/mqttOta.bin"
+/*! Run time of the device without a firmware, and the limit of a download */
+#define SIM_IDLE_US (2 * 60 * 1000000LL)
+#define SIM_BOOT_LIMIT_US (10 * 60 * 1000000LL)
+/*! Longest the loop may wait for the flash: one chunk written at once and a sector erase */
+#define SIM_MAX_JITTER_US 150000
+
+/* Download of one case */
+struct jitter_case
+{
+    const char *name;
+    bool download;
+    /*! NULL for MQTT chunks */
+    const char *url;
+    bool pre_erase;
+};
+
+static const struct jitter_case cases[] =
+{
+    { "no download", false, NULL, true },
+    { "MQTT, pre-erase", true, NULL, true },
+    { "MQTT, lazy erase", true, NULL, false },
+    { "HTTP, pre-erase", true, SIM_FW_URL, true },
+    { "HTTP, lazy erase", true, SIM_FW_URL, false },
+};
+
+static bool failed = false;
+
+static void check(bool ok, const struct jitter_case *jitter_case, const char *what)
+{
+    if (!ok)
+    {
+        printf("FAILED %s: %s\n", jitter_case->name, what);
+        failed = true;
+    }
+}
+
+static double avg_ms(const struct sim_loop_jitter *jitter)
+{
+    return jitter->count != 0 ? jitter->total_us / 1e3 / jitter->count : 0;
+}
+
+int main(int argc, char **argv)
+{
+    const struct fake_wifi_ap ap = { .available = true, .channel = 6, .connect_ms = 2500, .direct_connect_ms = 400 };
+
+    if (!sim_parse_args(argc, argv))
+    {
+        return EXIT_FAILURE;
+    }
+
+    printf("Wake-up jitter of the 1 s application loop, a firmware of %d KB downloaded over a LAN\n\n", SIM_FW_SIZE / 1024);
+    printf("case              idle loops  idle avg ms  idle max ms  download loops  download avg ms  download max ms\n");
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        const struct jitter_case *jitter_case = &cases[i];
+        struct sim *sim = sim_create();
+        // A seed whose start jitter lets the loop run idle before the download starts
+        sim->seed = 2;
+        sim->tb.rtt_ms = 5;
+        sim->tb.http_rtt_ms = 5;
+        sim->tb.http_bytes_per_s = 2000000;
+        sim->device.pre_erase_fails = !jitter_case->pre_erase;
+        if (jitter_case->download)
+        {
+            sim_offer_firmware(sim, SIM_FW_VERSION, SIM_FW_SIZE, jitter_case->url);
+        }
+
+        struct sim_boot_result result = sim_boot(sim, &ap, jitter_case->download ? SIM_BOOT_LIMIT_US : SIM_IDLE_US);
+        const struct sim_loop_jitter *idle = &sim->tb.loop_jitter[0];
+        const struct sim_loop_jitter *download = &sim->tb.loop_jitter[1];
+        printf("%-16s  %10u  %11.1f  %11.1f  %14u  %15.1f  %15.1f\n", jitter_case->name, idle->count, avg_ms(idle),
+                        idle->max_us / 1e3, download->count, avg_ms(download), download->max_us / 1e3);
+
+        check(idle->count != 0, jitter_case, "the idle loop wasn't reported");
+        if (jitter_case->download)
+        {
+            check(result.exit_status == FAKE_EXIT_RESTART && sim_firmware_staged(sim), jitter_case,
+                            "the image wasn't staged");
+            check(download->count != 0, jitter_case, "the loop didn't run during the download");
+            check(download->max_us <= SIM_MAX_JITTER_US, jitter_case, "the loop waited longer than one flash operation");
+        } else
+        {
+            check(result.exit_status == SIM_EXIT_TIME_LIMIT && download->count == 0, jitter_case,
+                            "the device didn't stay idle");
+        }
+        sim_destroy(sim);
+    }
+
+    printf("%s\n", failed ? "FAILED" : "PASSED");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,506 @@
+/**
+ * @file sim_ota_faults.c
+ * Simulation of a firmware download with MQTT chunks under faults ThingsBoard injects with a seed:
+ * lost chunk responses, a connection dropped mid-download, a new firmware offered while a chunk is
+ * on its way, and chunks that never arrive until the device gives up after CONFIG_OTA_MAX_ATTEMPTS.
+ * Each scenario runs on a fresh device, the same seed gives the same run.
+ *
+ * A second part generates scenarios of a smaller image for each seed: a Wi-Fi and an MQTT drop on the
+ * entry into every state of the OTA task and of the download that a run without faults went through,
+ * a failed esp_ota_write(), a duplicated and a reordered chunk response, and the same shared attributes
+ * sent again mid-download. It prints the recovery per fault and state, and the scenarios per second.
+ *
+ * Usage: sim_ota_faults [-v] [-s seeds]
+ *   -v  prints the logs of the device
+ *   -s  seeds of the generated scenarios, SIM_MATRIX_SEEDS by default
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mqttOta.h"
+#include "sim.h"
+
+#define SIM_FW_VERSION "V1.1"
+#define SIM_FW_SIZE (900 * 1024)
+#define SIM_FW_CHUNKS ((SIM_FW_SIZE + CHUNK_SIZE - 1) / CHUNK_SIZE)
+/*! A download still running after this long failed */
+#define SIM_BOOT_LIMIT_US (15 * 60 * 1000000LL)
+/*! Margin of the recovery from a lost chunk over its timeout, the OTA task notices it in its next loop */
+#define SIM_RECOVER_MARGIN_US 2000000LL
+
+/*! Image of the generated scenarios, three and a half chunks so that the last one is short */
+#define SIM_MATRIX_FW_SIZE ((7 * CHUNK_SIZE / 2) & ~15)
+#define SIM_MATRIX_FW_CHUNKS ((SIM_MATRIX_FW_SIZE + CHUNK_SIZE - 1) / CHUNK_SIZE)
+#define SIM_MATRIX_SEEDS 8
+
+/* Faults of one scenario */
+struct scenario
+{
+    const char *name;
+    uint32_t seed;
+    uint32_t chunk_loss_per_mille;
+    int lose_from_chunk;
+    int drop_after_chunk;
+    int offer_after_chunk;
+    /*! false if the device has to give up instead of staging the image */
+    bool recovers;
+};
+
+static const struct scenario scenarios[] =
+{
+    { "no faults", 0, 0, -1, -1, -1, true },
+    { "lost chunks 10%", 1, 100, -1, -1, -1, true },
+    { "lost chunks 10%", 2, 100, -1, -1, -1, true },
+    { "lost chunks 10%", 3, 100, -1, -1, -1, true },
+    { "reconnect mid-download", 0, 0, -1, SIM_FW_CHUNKS / 2, -1, true },
+    { "new target mid-download", 0, 0, -1, -1, SIM_FW_CHUNKS / 2, true },
+    { "no chunks after half", 0, 0, SIM_FW_CHUNKS / 2, -1, -1, false },
+};
+
+/* Faults of the generated scenarios */
+enum fault_kind
+{
+    FAULT_WIFI_DROP,
+    FAULT_MQTT_DROP,
+    FAULT_OTA_WRITE,
+    FAULT_DUPLICATE_CHUNK,
+    FAULT_REORDERED_CHUNK,
+    FAULT_ATTRIBUTES_UPDATE,
+    FAULT_KIND_COUNT
+};
+
+static const char *const fault_names[FAULT_KIND_COUNT] =
+{
+    [FAULT_WIFI_DROP] = "Wi-Fi drop",
+    [FAULT_MQTT_DROP] = "MQTT drop",
+    [FAULT_OTA_WRITE] = "esp_ota_write fails",
+    [FAULT_DUPLICATE_CHUNK] = "duplicated chunk",
+    [FAULT_REORDERED_CHUNK] = "reordered chunk",
+    [FAULT_ATTRIBUTES_UPDATE] = "same attributes again",
+};
+
+static const char *const task_state_names[SIM_MAX_STATES] =
+{
+    [STATE_INITIAL] = "INITIAL",
+    [STATE_WAIT_WIFI] = "WAIT_WIFI",
+    [STATE_WIFI_CONNECTED] = "WIFI_CONNECTED",
+    [STATE_WAIT_MQTT] = "WAIT_MQTT",
+    [STATE_MQTT_CONNECTED] = "MQTT_CONNECTED",
+    [STATE_WAIT_OTA_CONFIG_FETCHED] = "WAIT_OTA_CONFIG_FETCHED",
+    [STATE_OTA_CONFIG_FETCHED] = "OTA_CONFIG_FETCHED",
+    [STATE_APP_LOOP] = "APP_LOOP",
+};
+
+static const char *const ota_state_names[SIM_MAX_STATES] =
+{
+    [STATE_OTA_WRITE] = "OTA_WRITE",
+    [STATE_OTA_REQUEST_NEXT_CHUNK] = "OTA_REQUEST_NEXT_CHUNK",
+    [STATE_OTA_DOWNLOADED] = "OTA_DOWNLOADED",
+    [STATE_OTA_END] = "OTA_END",
+    [STATE_OTA_SET_BOOT] = "OTA_SET_BOOT",
+    [STATE_IMAGE_UPDATED] = "IMAGE_UPDATED",
+    [STATE_OTA_ERROR] = "OTA_ERROR",
+    [STATE_EXIT] = "EXIT",
+    [STATE_OTA_WAIT_APPLY] = "OTA_WAIT_APPLY",
+    [STATE_OTA_NEXT_IMAGE] = "OTA_NEXT_IMAGE",
+};
+
+/* A generated scenario: the fault, the state of a drop and the seed */
+struct matrix_scenario
+{
+    enum fault_kind kind;
+    /*! For the drops, true for a state of the download instead of the OTA task */
+    bool ota_state;
+    int state;
+    uint32_t seed;
+};
+
+/* Generated scenarios of one fault, or of one drop in one state */
+struct matrix_row
+{
+    uint32_t scenarios;
+    /*! Scenarios in which the fault happened, a drop doesn't in a state in which the link is down */
+    uint32_t injected;
+    uint32_t faults;
+    uint32_t wasted;
+    uint32_t recoveries;
+    int64_t recover_total_us;
+    int64_t recover_max_us;
+};
+
+/* Result of one scenario */
+struct run
+{
+    int exit_status;
+    bool staged;
+    /*! From the first chunk request until the boot ended */
+    int64_t time_us;
+    uint32_t chunk_requests;
+    uint32_t chunk_bytes;
+    /*! Size of the image staged at the end */
+    int fw_size;
+    uint32_t fw_failures;
+    /*! Uptime of the first and the last chunk request */
+    int64_t first_chunk_request_us;
+    int64_t last_chunk_request_us;
+    uint32_t faults;
+    uint32_t fault_bytes;
+    /*! Recoveries, a fault during one ends with it */
+    uint32_t recoveries;
+    int64_t recover_total_us;
+    int64_t recover_max_us;
+    /*! Set if no chunk was delivered after the last fault and the image wasn't staged */
+    bool unrecovered;
+    /*! Connections the device's state dropped, and the esp_ota_write() calls of the boot */
+    uint32_t drops;
+    uint32_t ota_writes;
+    /*! Entries into the states of the OTA task and of the download */
+    uint32_t task_state_entries[SIM_MAX_STATES];
+    uint32_t ota_state_entries[SIM_MAX_STATES];
+};
+
+static bool failed = false;
+
+static void check(bool ok, const struct scenario *scenario, const char *what)
+{
+    if (!ok)
+    {
+        printf("FAILED %s (seed %u): %s\n", scenario->name, scenario->seed, what);
+        failed = true;
+    }
+}
+
+/*! Returns a fresh device that is offered a firmware of size, without faults */
+static struct sim *create_sim(uint32_t seed, int size)
+{
+    // The image of each size is built once, the generated scenarios offer the same one thousands of times
+    static struct sim *offers[2];
+    struct sim **offer = &offers[size == SIM_FW_SIZE];
+    if (*offer == NULL)
+    {
+        *offer = sim_create();
+        sim_offer_firmware(*offer, SIM_FW_VERSION, size, NULL);
+    }
+
+    struct sim *sim = sim_create();
+    sim->tb.faults.random = seed;
+    // A smaller image, so none of its chunks is confused with the ones of the first image
+    sim->tb.faults.offer_size = size - 64 * 1024;
+    sim_offer_firmware_of(sim, *offer);
+    return sim;
+}
+
+/*! Boots the device until it restarts into the downloaded image or the time limit, then destroys it */
+static struct run run_download(struct sim *sim)
+{
+    const struct fake_wifi_ap ap = { .available = true, .channel = 6, .connect_ms = 2500, .direct_connect_ms = 400 };
+    struct run run = { 0 };
+
+    struct sim_boot_result result = sim_boot(sim, &ap, SIM_BOOT_LIMIT_US);
+    run.exit_status = result.exit_status;
+    run.staged = result.exit_status == FAKE_EXIT_RESTART && strcmp(sim->tb.fw_state, TB_CLIENT_STATE_UPDATED) == 0
+                    && sim_firmware_staged(sim);
+    run.time_us = sim->tb.fw_request_us >= 0 ? result.uptime_us - sim->tb.fw_request_us : 0;
+    run.chunk_requests = sim->tb.chunk_requests;
+    run.chunk_bytes = sim->tb.chunk_bytes;
+    run.fw_size = sim->tb.fw_size;
+    run.fw_failures = sim->tb.fw_failures;
+    run.first_chunk_request_us = sim->tb.fw_request_us;
+    run.last_chunk_request_us = sim->tb.last_chunk_request_us;
+    run.faults = sim->tb.fault_count;
+    run.fault_bytes = sim->tb.fault_bytes;
+    run.recoveries = sim->tb.recoveries;
+    run.recover_total_us = sim->tb.recover_total_us;
+    run.recover_max_us = sim->tb.recover_max_us;
+    if (sim->tb.fault_us >= 0 && run.staged)
+    {
+        // A fault after the last chunk ends with the restart into the staged image
+        int64_t recover_us = result.uptime_us - sim->tb.fault_us;
+        run.recoveries++;
+        run.recover_total_us += recover_us;
+        run.recover_max_us = recover_us > run.recover_max_us ? recover_us : run.recover_max_us;
+    } else
+    {
+        run.unrecovered = sim->tb.fault_us >= 0;
+    }
+    run.drops = sim->device.drops;
+    run.ota_writes = sim->device.ota_writes;
+    memcpy(run.task_state_entries, sim->device.task_state_entries, sizeof(run.task_state_entries));
+    memcpy(run.ota_state_entries, sim->device.ota_state_entries, sizeof(run.ota_state_entries));
+    sim_destroy(sim);
+    return run;
+}
+
+/*! Boots a fresh device that downloads the firmware under the faults of the scenario */
+static struct run run_scenario(const struct scenario *scenario)
+{
+    struct sim *sim = create_sim(scenario->seed, SIM_FW_SIZE);
+    sim->tb.faults.chunk_loss_per_mille = scenario->chunk_loss_per_mille;
+    sim->tb.faults.lose_from_chunk = scenario->lose_from_chunk;
+    sim->tb.faults.drop_after_chunk = scenario->drop_after_chunk;
+    sim->tb.faults.offer_after_chunk = scenario->offer_after_chunk;
+    return run_download(sim);
+}
+
+/*! Entry of a state the drop of a scenario happens on, from the entries of the run without faults of its seed */
+static uint32_t drop_entry(const struct run *reference, const struct matrix_scenario *scenario)
+{
+    uint32_t entries = (scenario->ota_state ? reference->ota_state_entries : reference->task_state_entries)[scenario->state];
+    return 1 + scenario->seed % entries;
+}
+
+/*! Boots a fresh device that downloads the small image under the fault of the generated scenario */
+static struct run run_matrix_scenario(const struct matrix_scenario *scenario, const struct run *reference)
+{
+    struct sim *sim = create_sim(scenario->seed, SIM_MATRIX_FW_SIZE);
+    sim->seed = scenario->seed;
+    switch (scenario->kind)
+    {
+    case FAULT_WIFI_DROP:
+    case FAULT_MQTT_DROP:
+        sim->device.drop_wifi = scenario->kind == FAULT_WIFI_DROP;
+        *(scenario->ota_state ? &sim->device.drop_ota_state : &sim->device.drop_task_state) = scenario->state;
+        sim->device.drop_entry = drop_entry(reference, scenario);
+        break;
+    case FAULT_OTA_WRITE:
+        sim->device.ota_write_fails = 1 + scenario->seed % reference->ota_writes;
+        break;
+    case FAULT_DUPLICATE_CHUNK:
+        sim->tb.faults.duplicate_chunk = scenario->seed % SIM_MATRIX_FW_CHUNKS;
+        break;
+    case FAULT_REORDERED_CHUNK:
+        // The held response needs a later chunk to arrive with
+        sim->tb.faults.reorder_chunk = scenario->seed % (SIM_MATRIX_FW_CHUNKS - 1);
+        break;
+    case FAULT_ATTRIBUTES_UPDATE:
+        sim->tb.faults.update_after_chunk = scenario->seed % SIM_MATRIX_FW_CHUNKS;
+        break;
+    default:
+        break;
+    }
+    return run_download(sim);
+}
+
+static void check_matrix(bool ok, const char *fault, const char *state, uint32_t seed, const char *what)
+{
+    if (!ok)
+    {
+        printf("FAILED %s%s%s (seed %u): %s\n", fault, state[0] != 0 ? " in " : "", state, seed, what);
+        failed = true;
+    }
+}
+
+/*! Runs the generated scenarios of one seed and adds them to the rows, returns the number of scenarios */
+static uint32_t run_matrix_seed(uint32_t seed, struct matrix_row rows[FAULT_KIND_COUNT][2][SIM_MAX_STATES])
+{
+    // The seed also drives the random numbers of the device, e.g. the start jitter of the rollout
+    struct sim *sim = create_sim(seed, SIM_MATRIX_FW_SIZE);
+    sim->seed = seed;
+    struct run reference = run_download(sim);
+    uint32_t count = 1;
+
+    check_matrix(reference.staged && reference.faults == 0 && reference.chunk_bytes == SIM_MATRIX_FW_SIZE, "no faults", "",
+                    seed, "the download without faults didn't stage the image");
+    if (!reference.staged)
+    {
+        return count;
+    }
+
+    for (int kind = 0; kind < FAULT_KIND_COUNT; kind++)
+    {
+        bool drop = kind == FAULT_WIFI_DROP || kind == FAULT_MQTT_DROP;
+        for (int ota_state = 0; ota_state < (drop ? 2 : 1); ota_state++)
+        {
+            for (int state = 0; state < (drop ? SIM_MAX_STATES : 1); state++)
+            {
+                const uint32_t *entries = ota_state ? reference.ota_state_entries : reference.task_state_entries;
+                if (drop && entries[state] == 0)
+                {
+                    continue;
+                }
+                const struct matrix_scenario scenario = { .kind = kind, .ota_state = ota_state, .state = state, .seed = seed };
+                const char *state_name = !drop ? "" : ota_state ? ota_state_names[state] : task_state_names[state];
+                struct run run = run_matrix_scenario(&scenario, &reference);
+                uint32_t wasted = run.staged ? run.chunk_bytes - run.fw_size : run.chunk_bytes;
+                bool injected = drop ? run.drops != 0 : run.faults != 0;
+                count++;
+
+                struct matrix_row *row = &rows[kind][ota_state][state];
+                row->scenarios++;
+                row->injected += injected;
+                row->faults += run.faults;
+                row->wasted += wasted;
+                row->recoveries += run.recoveries;
+                row->recover_total_us += run.recover_total_us;
+                row->recover_max_us = run.recover_max_us > row->recover_max_us ? run.recover_max_us : row->recover_max_us;
+
+                check_matrix(run.staged, fault_names[kind], state_name, seed, "the image wasn't staged");
+                check_matrix(!run.unrecovered, fault_names[kind], state_name, seed, "the device didn't recover");
+                check_matrix(run.fw_failures == (kind == FAULT_OTA_WRITE ? 1 : 0), fault_names[kind], state_name, seed,
+                                "the device reported FAILED other than for the failed write");
+                if (drop)
+                {
+                    // At most the response on its way is lost with the connection, the download resumes after it
+                    check_matrix(wasted <= CHUNK_SIZE, fault_names[kind], state_name, seed, "the download started over");
+                } else if (kind == FAULT_OTA_WRITE)
+                {
+                    // The next attempt starts over, the chunks written before the failure are lost
+                    check_matrix(injected && wasted <= (uint32_t) run.fw_size, fault_names[kind], state_name, seed,
+                                    "more than the image was downloaded again");
+                } else
+                {
+                    // The extra responses are ignored and the download goes on
+                    check_matrix(injected && wasted == run.fault_bytes, fault_names[kind], state_name, seed,
+                                    "a chunk was downloaded again");
+                }
+            }
+        }
+    }
+    return count;
+}
+
+/*! Runs the generated scenarios for the seeds 1 to seeds and prints their results */
+static void run_matrix(uint32_t seeds)
+{
+    static struct matrix_row rows[FAULT_KIND_COUNT][2][SIM_MAX_STATES];
+    struct timespec wall_start;
+    struct timespec wall_end;
+    uint32_t count = 0;
+
+    printf("\nGenerated scenarios of a %d KB image in %d chunks, %u seeds, a drop happens on the entry into the state\n",
+                    SIM_MATRIX_FW_SIZE / 1024, SIM_MATRIX_FW_CHUNKS, seeds);
+    clock_gettime(CLOCK_MONOTONIC, &wall_start);
+    for (uint32_t seed = 1; seed <= seeds; seed++)
+    {
+        count += run_matrix_seed(seed, rows);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
+    double wall_s = (wall_end.tv_sec - wall_start.tv_sec) + (wall_end.tv_nsec - wall_start.tv_nsec) / 1e9;
+
+    printf("fault                  state                    scenarios  injected  recover avg s  recover max s  wasted B/fault\n");
+    for (int kind = 0; kind < FAULT_KIND_COUNT; kind++)
+    {
+        for (int ota_state = 0; ota_state < 2; ota_state++)
+        {
+            for (int state = 0; state < SIM_MAX_STATES; state++)
+            {
+                const struct matrix_row *row = &rows[kind][ota_state][state];
+                bool drop = kind == FAULT_WIFI_DROP || kind == FAULT_MQTT_DROP;
+                if (row->scenarios == 0)
+                {
+                    continue;
+                }
+                printf("%-21s  %-23s  %9u  %8u  %13.1f  %13.1f  %14u\n", fault_names[kind],
+                                !drop ? "-" : ota_state ? ota_state_names[state] : task_state_names[state], row->scenarios,
+                                row->injected, row->recoveries != 0 ? row->recover_total_us / 1e6 / row->recoveries : 0,
+                                row->recover_max_us / 1e6, row->faults != 0 ? row->wasted / row->faults : row->wasted);
+            }
+        }
+    }
+    printf("%u scenarios in %.2f s, %.0f scenarios/s\n", count, wall_s, count / wall_s);
+}
+
+int main(int argc, char **argv)
+{
+    long seeds = SIM_MATRIX_SEEDS;
+    int option;
+
+    while ((option = getopt(argc, argv, "vs:")) != -1)
+    {
+        if (option == 'v')
+        {
+            sim_verbose = true;
+        } else if (option == 's')
+        {
+            seeds = strtol(optarg, NULL, 10);
+        } else
+        {
+            fprintf(stderr, "Usage: %s [-v] [-s seeds]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (seeds < 1)
+    {
+        fprintf(stderr, "Invalid seed count\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("Firmware of %d KB in %d chunks of %d B: chunk timeout %d ms, %d retries, %d attempts\n", SIM_FW_SIZE / 1024,
+                    SIM_FW_CHUNKS, CHUNK_SIZE, CONFIG_OTA_CHUNK_TIMEOUT_MS, CONFIG_OTA_CHUNK_RETRIES, CONFIG_OTA_MAX_ATTEMPTS);
+    printf("Recovery is the time from a fault until the next chunk is delivered, or the restart into the staged image\n"
+                    "after the last one, faults in the meantime included.\n");
+    printf("Wasted bytes are sent beyond the staged image\n\n");
+    printf("scenario                 seed  faults  recover avg s  recover max s  wasted B/fault  requests   total s  result\n");
+    struct run baseline = { 0 };
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++)
+    {
+        const struct scenario *scenario = &scenarios[i];
+        struct run run = run_scenario(scenario);
+        // A device that gives up used none of the bytes
+        uint32_t wasted = run.staged ? run.chunk_bytes - run.fw_size : run.chunk_bytes;
+
+        printf("%-23s  %4u  %6u  %13.1f  %13.1f  %14u  %8u  %8.1f  %s\n", scenario->name, scenario->seed, run.faults,
+                        run.recoveries != 0 ? run.recover_total_us / 1e6 / run.recoveries : 0, run.recover_max_us / 1e6,
+                        run.faults != 0 ? wasted / run.faults : wasted, run.chunk_requests, run.time_us / 1e6,
+                        run.staged ? "updated" : run.exit_status == SIM_EXIT_TIME_LIMIT ? "gave up" : "crashed");
+
+        if (i == 0)
+        {
+            baseline = run;
+            check(run.staged && run.faults == 0 && wasted == 0, scenario, "the download without faults didn't stage the image");
+        } else if (scenario->recovers)
+        {
+            check(run.staged, scenario, "the image wasn't staged");
+            check(run.fw_failures == 0, scenario, "the device reported FAILED");
+            check(!run.unrecovered, scenario, "the last fault wasn't followed by a delivered chunk");
+        }
+        if (scenario->chunk_loss_per_mille != 0)
+        {
+            // Each lost chunk costs one timeout and is requested again, nothing else is downloaded twice
+            check(run.faults != 0, scenario, "no chunk was lost");
+            check(run.recover_total_us < (int64_t) run.faults * (CONFIG_OTA_CHUNK_TIMEOUT_MS * 1000LL + SIM_RECOVER_MARGIN_US),
+                            scenario, "a lost chunk wasn't requested again after the chunk timeout");
+            check(wasted == run.fault_bytes, scenario, "chunks were downloaded twice");
+            check(run.time_us - baseline.time_us
+                            < (int64_t) run.faults * (CONFIG_OTA_CHUNK_TIMEOUT_MS * 1000LL + SIM_RECOVER_MARGIN_US), scenario,
+                            "the lost chunks cost more than their timeouts");
+
+            // The seed gives the same run again
+            struct run again = run_scenario(scenario);
+            check(again.time_us == run.time_us && again.chunk_requests == run.chunk_requests
+                            && again.faults == run.faults && again.recover_total_us == run.recover_total_us, scenario,
+                            "the run isn't deterministic");
+        }
+        if (scenario->drop_after_chunk >= 0)
+        {
+            // The download resumes at the lost chunk right after the reconnect instead of starting over
+            check(wasted == run.fault_bytes, scenario, "the download didn't resume at the lost chunk");
+            check(run.recover_max_us < CONFIG_MQTT_RECONNECT_TIMEOUT_MS * 1000LL + SIM_RECOVER_MARGIN_US, scenario,
+                            "the chunk wasn't requested again after the reconnect");
+        }
+        if (scenario->offer_after_chunk >= 0)
+        {
+            check(run.fw_size != SIM_FW_SIZE, scenario, "the new target wasn't downloaded");
+        }
+        if (!scenario->recovers)
+        {
+            // Every attempt fails on the first lost chunk, then the device stops requesting
+            check(run.exit_status == SIM_EXIT_TIME_LIMIT, scenario, "the device didn't keep running");
+            check(run.fw_failures == CONFIG_OTA_MAX_ATTEMPTS, scenario, "the attempts didn't end at the limit");
+            check(run.chunk_requests == CONFIG_OTA_MAX_ATTEMPTS * (scenario->lose_from_chunk + 1 + CONFIG_OTA_CHUNK_RETRIES),
+                            scenario, "the device didn't stop requesting chunks");
+            printf("%-23s  gave up %.1f s after the first request, %.1f s before the end of the boot\n", "",
+                            (run.last_chunk_request_us - run.first_chunk_request_us) / 1e6,
+                            (SIM_BOOT_LIMIT_US - run.last_chunk_request_us) / 1e6);
+        }
+    }
+
+    run_matrix(seeds);
+
+    printf("%s\n", failed ? "FAILED" : "PASSED");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
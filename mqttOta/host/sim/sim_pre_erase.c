@@ -0,0 +1,141 @@
+/**
+ * @file sim_pre_erase.c
+ * Simulation of the chunk writes of a firmware download with the partition erased ahead by the erase task and
+ * with each sector erased when the first write reaches it, as when ota_erase_start() fails. The flash model
+ * charges the erase of a sector and the write of each KB, the download runs until the restart into the image.
+ *
+ * Usage: sim_pre_erase [-v]
+ *   -v  prints the logs of the device
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mqttOta.h"
+#include "http_download.h"
+#include "ota_erase.h"
+#include "sim.h"
+
+#define SIM_FW_VERSION "V1.1"
+#define SIM_FW_SIZE (900 * 1024)
+#define SIM_FW_HOST "fw.local"
+#define SIM_FW_URL "http://" SIM_FW_HOST "/mqttOta.bin"
+/*! A download still running after this long failed */
+#define SIM_BOOT_LIMIT_US (10 * 60 * 1000000LL)
+
+/* Download of the firmware over a link */
+struct link_profile
+{
+    const char *name;
+    /*! NULL for MQTT chunks */
+    const char *url;
+    uint32_t rtt_ms;
+    uint32_t bytes_per_s;
+};
+
+static const struct link_profile profiles[] =
+{
+    { "MQTT Wi-Fi to cloud", NULL, 60, 500000 },
+    { "HTTP Wi-Fi to cloud", SIM_FW_URL, 60, 500000 },
+    { "HTTP LAN", SIM_FW_URL, 5, 2000000 },
+};
+
+/* Result of one download */
+struct download
+{
+    bool ok;
+    /*! From the first chunk or range request until the restart into the image */
+    int64_t time_us;
+    uint32_t writes;
+    int64_t write_avg_us;
+    int64_t write_p95_us;
+    int64_t write_max_us;
+};
+
+static bool failed = false;
+
+static void check(bool ok, const char *link, const char *what)
+{
+    if (!ok)
+    {
+        printf("FAILED %s: %s\n", link, what);
+        failed = true;
+    }
+}
+
+static int compare_us(const void *a, const void *b)
+{
+    int64_t diff = *(const int64_t*) a - *(const int64_t*) b;
+    return diff < 0 ? -1 : diff > 0;
+}
+
+/*! Boots a fresh device that downloads the firmware over the link */
+static struct download run_download(const struct link_profile *link, bool pre_erase)
+{
+    const struct fake_wifi_ap ap = { .available = true, .channel = 6, .connect_ms = 2500, .direct_connect_ms = 400 };
+    struct download download = { false };
+
+    struct sim *sim = sim_create();
+    sim->tb.rtt_ms = link->rtt_ms;
+    sim->tb.downlink_bytes_per_s = link->bytes_per_s;
+    sim->tb.http_rtt_ms = link->rtt_ms;
+    sim->tb.http_bytes_per_s = link->bytes_per_s;
+    sim->device.pre_erase_fails = !pre_erase;
+    sim_offer_firmware(sim, SIM_FW_VERSION, SIM_FW_SIZE, link->url);
+
+    struct sim_boot_result result = sim_boot(sim, &ap, SIM_BOOT_LIMIT_US);
+    download.ok = result.exit_status == FAKE_EXIT_RESTART && strcmp(sim->tb.fw_state, TB_CLIENT_STATE_UPDATED) == 0
+                    && sim_firmware_staged(sim);
+    download.time_us = sim->tb.fw_request_us >= 0 ? result.uptime_us - sim->tb.fw_request_us : 0;
+    download.writes = sim->device.chunk_writes < SIM_MAX_CHUNK_WRITES ? sim->device.chunk_writes : SIM_MAX_CHUNK_WRITES;
+    if (download.writes != 0)
+    {
+        int64_t *write_us = sim->device.chunk_write_us;
+        int64_t total_us = 0;
+        qsort(write_us, download.writes, sizeof(write_us[0]), compare_us);
+        for (uint32_t i = 0; i < download.writes; i++)
+        {
+            total_us += write_us[i];
+        }
+        download.write_avg_us = total_us / download.writes;
+        download.write_p95_us = write_us[(download.writes * 95 + 99) / 100 - 1];
+        download.write_max_us = write_us[download.writes - 1];
+    }
+    sim_destroy(sim);
+    return download;
+}
+
+int main(int argc, char **argv)
+{
+    if (!sim_parse_args(argc, argv))
+    {
+        return EXIT_FAILURE;
+    }
+
+    printf("Firmware of %d KB: MQTT chunks of %d B, HTTP ranges of %d B\n", SIM_FW_SIZE / 1024, CHUNK_SIZE,
+                    HTTP_DOWNLOAD_RANGE_SIZE);
+    printf("Write is the time of esp_ota_write() for one chunk or range, waiting for the erase task included.\n");
+    printf("The erase task erases %d KB per step, the download time ends with the restart\n\n", OTA_ERASE_STEP_SIZE / 1024);
+    printf("link                 erase    writes  write avg ms  write p95 ms  write max ms  download s\n");
+    for (size_t i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++)
+    {
+        const struct link_profile *link = &profiles[i];
+        struct download ahead = run_download(link, true);
+        struct download lazy = run_download(link, false);
+
+        printf("%-19s  %-7s  %6u  %12.1f  %12.1f  %12.1f  %10.1f\n", link->name, "ahead", ahead.writes,
+                        ahead.write_avg_us / 1e3, ahead.write_p95_us / 1e3, ahead.write_max_us / 1e3, ahead.time_us / 1e6);
+        printf("%-19s  %-7s  %6u  %12.1f  %12.1f  %12.1f  %10.1f\n", "", "lazy", lazy.writes, lazy.write_avg_us / 1e3,
+                        lazy.write_p95_us / 1e3, lazy.write_max_us / 1e3, lazy.time_us / 1e6);
+
+        check(ahead.ok && ahead.writes != 0, link->name, "the download with pre-erase didn't stage the image");
+        check(lazy.ok && lazy.writes == ahead.writes, link->name, "the download without pre-erase didn't stage the image");
+        // The writes that reach a sector the erase task already erased skip the erase, the first ones wait for it
+        check(ahead.write_avg_us < lazy.write_avg_us, link->name, "pre-erase doesn't shorten the chunk writes");
+        check(ahead.time_us < lazy.time_us, link->name, "pre-erase doesn't shorten the download");
+    }
+
+    printf("%s\n", failed ? "FAILED" : "PASSED");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
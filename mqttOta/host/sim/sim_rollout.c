@@ -0,0 +1,214 @@
+/**
+ * @file sim_rollout.c
+ * Simulation of the load a fleet puts on ThingsBoard when a firmware is assigned to all its devices at once,
+ * with the rollout controls of the shared attributes: ota_start_jitter, ota_max_rate and ota_window.
+ * Each device boots on its own seed and downloads the firmware with MQTT chunks. The devices don't share the
+ * broker, so the chunk requests of all of them are merged into the requests per second ThingsBoard serves.
+ *
+ * Usage: sim_rollout [-v]
+ *   -v  prints the logs of the devices
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mqttOta.h"
+#include "rollout.h"
+#include "sim.h"
+
+#define SIM_FW_VERSION "V1.1"
+#define SIM_FW_SIZE (900 * 1024)
+#define SIM_DEVICES 40
+/*! A download still running after this long failed */
+#define SIM_BOOT_LIMIT_US (15 * 60 * 1000000LL)
+/*! Time over which the peak load is averaged, the requests of single seconds vary with the chunk timing */
+#define SIM_PEAK_S 10
+/*! Width of a column of the load curve */
+#define SIM_CURVE_STEP_S 20
+#define SIM_CURVE_STEPS 16
+/*! Seconds from the start of the simulation to the opening of the maintenance window, 22:15 UTC */
+#define SIM_WINDOW_OPEN_S 100
+#define SIM_WINDOW "22:15-23:15"
+
+/* Rollout controls of one case */
+struct rollout_case
+{
+    const char *name;
+    uint32_t start_jitter_s;
+    uint32_t max_rate;
+    const char *window;
+};
+
+static const struct rollout_case cases[] =
+{
+    { "no controls", 0, 0, "" },
+    { "jitter 120 s", 120, 0, "" },
+    { "max rate 10 KB/s", 0, 10000, "" },
+    { "jitter + max rate", 120, 10000, "" },
+    { "window", 0, 0, SIM_WINDOW },
+    { "window + jitter", 120, 0, SIM_WINDOW },
+};
+
+/* Load of the fleet in one case */
+struct fleet
+{
+    uint32_t updated;
+    /*! Chunk requests in each second since the start */
+    uint32_t requests_per_s[SIM_BOOT_LIMIT_US / 1000000];
+    /*! Most chunk requests per second over SIM_PEAK_S */
+    double peak_per_s;
+    /*! Uptime of the first chunk request of the fleet and of the last restart into the image */
+    int64_t first_request_us;
+    int64_t done_us;
+    /*! Sum over the devices of the time from their first chunk request to their restart */
+    int64_t download_total_us;
+};
+
+static bool failed = false;
+
+static void check(bool ok, const struct rollout_case *rollout, const char *what)
+{
+    if (!ok)
+    {
+        printf("FAILED %s: %s\n", rollout->name, what);
+        failed = true;
+    }
+}
+
+/*! Boots each device of the fleet, which is offered the firmware with the rollout controls of the case */
+static void run_fleet(const struct rollout_case *rollout, struct fleet *fleet)
+{
+    const struct fake_wifi_ap ap = { .available = true, .channel = 6, .connect_ms = 2500, .direct_connect_ms = 400 };
+
+    memset(fleet, 0, sizeof(*fleet));
+    fleet->first_request_us = -1;
+    struct sim *sim = sim_create();
+    for (uint32_t device = 0; device < SIM_DEVICES; device++)
+    {
+        fake_storage_format(&sim->storage);
+        sim->seed = device * 1000;
+        sim->boots = 0;
+        sim->elapsed_us = 0;
+        sim_offer_firmware(sim, SIM_FW_VERSION, SIM_FW_SIZE, NULL);
+        // The rollout keys join the firmware keys in the shared attributes
+        size_t len = strlen(sim->tb.shared);
+        snprintf(sim->tb.shared + len - 1, sizeof(sim->tb.shared) - len + 1,
+                        ",\"" TB_SHARED_ATTR_FIELD_OTA_START_JITTER "\":%u,\"" TB_SHARED_ATTR_FIELD_OTA_MAX_RATE
+                        "\":%u,\"" TB_SHARED_ATTR_FIELD_OTA_WINDOW "\":\"%s\"}", rollout->start_jitter_s,
+                        rollout->max_rate, rollout->window);
+
+        struct sim_boot_result result = sim_boot(sim, &ap, SIM_BOOT_LIMIT_US);
+        if (result.exit_status == FAKE_EXIT_RESTART && strcmp(sim->tb.fw_state, TB_CLIENT_STATE_UPDATED) == 0
+                        && sim_firmware_staged(sim))
+        {
+            fleet->updated++;
+            fleet->download_total_us += result.uptime_us - sim->tb.fw_request_us;
+            fleet->done_us = result.uptime_us > fleet->done_us ? result.uptime_us : fleet->done_us;
+        }
+        uint32_t requests = sim->tb.boot_chunk_requests < SIM_MAX_CHUNK_REQUESTS ? sim->tb.boot_chunk_requests
+                        : SIM_MAX_CHUNK_REQUESTS;
+        for (uint32_t i = 0; i < requests; i++)
+        {
+            int64_t request_us = sim->tb.chunk_request_us[i];
+            fleet->requests_per_s[request_us / 1000000]++;
+            if (fleet->first_request_us < 0 || request_us < fleet->first_request_us)
+            {
+                fleet->first_request_us = request_us;
+            }
+        }
+    }
+    sim_destroy(sim);
+
+    const size_t seconds = sizeof(fleet->requests_per_s) / sizeof(fleet->requests_per_s[0]);
+    for (size_t start = 0; start + SIM_PEAK_S <= seconds; start++)
+    {
+        uint32_t requests = 0;
+        for (size_t s = start; s < start + SIM_PEAK_S; s++)
+        {
+            requests += fleet->requests_per_s[s];
+        }
+        if ((double) requests / SIM_PEAK_S > fleet->peak_per_s)
+        {
+            fleet->peak_per_s = (double) requests / SIM_PEAK_S;
+        }
+    }
+}
+
+/*! Prints the average requests per second of each column of the load curve */
+static void print_curve(const struct rollout_case *rollout, const struct fleet *fleet)
+{
+    printf("%-18s", rollout->name);
+    for (int step = 0; step < SIM_CURVE_STEPS; step++)
+    {
+        uint32_t requests = 0;
+        for (int s = step * SIM_CURVE_STEP_S; s < (step + 1) * SIM_CURVE_STEP_S; s++)
+        {
+            requests += fleet->requests_per_s[s];
+        }
+        printf(" %4.1f", (double) requests / SIM_CURVE_STEP_S);
+    }
+    printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+    static struct fleet fleets[sizeof(cases) / sizeof(cases[0])];
+
+    if (!sim_parse_args(argc, argv))
+    {
+        return EXIT_FAILURE;
+    }
+
+    printf("%d devices offered a firmware of %d KB in chunks of %d B at the same time, the window opens after %d s\n",
+                    SIM_DEVICES, SIM_FW_SIZE / 1024, CHUNK_SIZE, SIM_WINDOW_OPEN_S);
+    printf("Peak is the most chunk requests per second ThingsBoard serves over %d s, download the average time of a\n"
+                    "device from its first chunk request to its restart, done the time until the whole fleet restarted\n\n",
+                    SIM_PEAK_S);
+    printf("case                updated  peak req/s  peak KB/s  download s  first req s  done s\n");
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        const struct rollout_case *rollout = &cases[i];
+        struct fleet *fleet = &fleets[i];
+        run_fleet(rollout, fleet);
+
+        printf("%-18s  %7u  %10.1f  %9.0f  %10.1f  %11.1f  %6.1f\n", rollout->name, fleet->updated, fleet->peak_per_s,
+                        fleet->peak_per_s * CHUNK_SIZE / 1024,
+                        fleet->updated != 0 ? fleet->download_total_us / 1e6 / fleet->updated : 0,
+                        fleet->first_request_us / 1e6, fleet->done_us / 1e6);
+
+        check(fleet->updated == SIM_DEVICES, rollout, "not every device was updated");
+        if (rollout->max_rate != 0)
+        {
+            // The token bucket allows one second of burst, then one chunk per CHUNK_SIZE / max_rate seconds
+            double device_peak = ((double) rollout->max_rate * (SIM_PEAK_S + 1) / CHUNK_SIZE + 1) / SIM_PEAK_S;
+            check(fleet->peak_per_s <= SIM_DEVICES * device_peak, rollout, "the rate cap was exceeded");
+        }
+        if (strlen(rollout->window) != 0)
+        {
+            check(fleet->first_request_us >= SIM_WINDOW_OPEN_S * 1000000LL, rollout,
+                            "a chunk was requested outside of the window");
+        }
+    }
+
+    const struct fleet *uncontrolled = &fleets[0];
+    check(fleets[1].peak_per_s * 2 < uncontrolled->peak_per_s, &cases[1], "the jitter doesn't spread the load");
+    check(fleets[2].peak_per_s < uncontrolled->peak_per_s, &cases[2], "the rate cap doesn't lower the peak");
+    // The jitter runs from the offer, the devices whose start time passed before the window opened start together
+    check(fleets[5].peak_per_s < fleets[4].peak_per_s, &cases[5], "the jitter doesn't spread the window opening");
+
+    printf("\nChunk requests per second, average of each %d s since the start\n\n", SIM_CURVE_STEP_S);
+    printf("%-18s", "case");
+    for (int step = 0; step < SIM_CURVE_STEPS; step++)
+    {
+        printf(" %4d", step * SIM_CURVE_STEP_S);
+    }
+    printf("\n");
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        print_curve(&cases[i], &fleets[i]);
+    }
+
+    printf("%s\n", failed ? "FAILED" : "PASSED");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,91 @@
+/**
+ * @file sim_streaming_verify.c
+ * Simulation of the end of a firmware download with the image verified while it is streamed and with the read
+ * back of esp_ota_end(), as when image_verify_start() fails. The flash model charges the reads, so the time from
+ * the last chunk to the restart into the image shows the read back saved. esp_ota_set_boot_partition() reads the
+ * image back in both cases.
+ *
+ * Usage: sim_streaming_verify [-v]
+ *   -v  prints the logs of the device
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mqttOta.h"
+#include "sim.h"
+
+#define SIM_FW_VERSION "V1.1"
+/*! A download still running after this long failed */
+#define SIM_BOOT_LIMIT_US (10 * 60 * 1000000LL)
+
+static const int image_sizes[] = { 256 * 1024, 900 * 1024 };
+
+/* Result of one download */
+struct download
+{
+    bool ok;
+    /*! From the first chunk request until the restart into the image */
+    int64_t time_us;
+    /*! From the end of the download until the restart into the image */
+    int64_t finish_us;
+};
+
+static bool failed = false;
+
+static void check(bool ok, int size, const char *what)
+{
+    if (!ok)
+    {
+        printf("FAILED %d KB: %s\n", size / 1024, what);
+        failed = true;
+    }
+}
+
+/*! Boots a fresh device that downloads a firmware of the size with MQTT chunks */
+static struct download run_download(int size, bool streaming_verify)
+{
+    const struct fake_wifi_ap ap = { .available = true, .channel = 6, .connect_ms = 2500, .direct_connect_ms = 400 };
+    struct download download = { false };
+
+    struct sim *sim = sim_create();
+    sim->device.verify_start_fails = !streaming_verify;
+    sim_offer_firmware(sim, SIM_FW_VERSION, size, NULL);
+
+    struct sim_boot_result result = sim_boot(sim, &ap, SIM_BOOT_LIMIT_US);
+    download.ok = result.exit_status == FAKE_EXIT_RESTART && strcmp(sim->tb.fw_state, TB_CLIENT_STATE_UPDATED) == 0
+                    && sim_firmware_staged(sim) && sim->device.downloaded_us >= 0;
+    download.time_us = sim->tb.fw_request_us >= 0 ? result.uptime_us - sim->tb.fw_request_us : 0;
+    download.finish_us = sim->device.downloaded_us >= 0 ? result.uptime_us - sim->device.downloaded_us : 0;
+    sim_destroy(sim);
+    return download;
+}
+
+int main(int argc, char **argv)
+{
+    if (!sim_parse_args(argc, argv))
+    {
+        return EXIT_FAILURE;
+    }
+
+    printf("Finish is the time from the last chunk to the restart into the image: the verification, the state\n");
+    printf("reports and esp_ota_set_boot_partition(), which reads the image back with either verification\n\n");
+    printf("image KB  verification  download s  finish ms\n");
+    for (size_t i = 0; i < sizeof(image_sizes) / sizeof(image_sizes[0]); i++)
+    {
+        int size = image_sizes[i];
+        struct download streaming = run_download(size, true);
+        struct download read_back = run_download(size, false);
+
+        printf("%8d  %-12s  %10.1f  %9.1f\n", size / 1024, "streaming", streaming.time_us / 1e6, streaming.finish_us / 1e3);
+        printf("%8s  %-12s  %10.1f  %9.1f\n", "", "read back", read_back.time_us / 1e6, read_back.finish_us / 1e3);
+
+        check(streaming.ok, size, "the download with streaming verification didn't stage the image");
+        check(read_back.ok, size, "the download verified by esp_ota_end() didn't stage the image");
+        check(streaming.finish_us < read_back.finish_us, size, "streaming verification doesn't shorten the finish");
+    }
+
+    printf("%s\n", failed ? "FAILED" : "PASSED");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,383 @@
+/**
+ * @file broker.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "nvs.h"
+
+#include "mqttOta.h"
+#include "broker.h"
+
+/*! Max length of the stored endpoint list */
+#define BROKER_LIST_MAX_LENGTH 512
+
+/*! Weight of a new latency sample in percent */
+#define BROKER_LATENCY_WEIGHT 25
+
+/**
+ * @brief Adds an endpoint to the table, the port is made part of the URI so switching with
+ *        esp_mqtt_client_set_uri() doesn't keep the port of the previous endpoint.
+ */
+static bool add_endpoint(struct broker_endpoint *table, int *count, const char *uri, size_t uri_len, uint32_t port)
+{
+    if (*count == CONFIG_MQTT_MAX_ENDPOINTS || uri_len == 0)
+    {
+        return false;
+    }
+
+    char buf[BROKER_URI_MAX_LENGTH + 1];
+    if (uri_len >= sizeof(buf))
+    {
+        ESP_LOGE(TAG, "Broker URI too long: %.*s", (int) uri_len, uri);
+        return false;
+    }
+    memcpy(buf, uri, uri_len);
+    buf[uri_len] = 0;
+
+    const char *host = strstr(buf, "://");
+    host = host != NULL ? host + 3 : buf;
+    const char *port_sep = strchr(host, ':');
+    const char *path = strchr(host, '/');
+    struct broker_endpoint *endpoint = &table[*count];
+    memset(endpoint, 0, sizeof(*endpoint));
+    if (port_sep != NULL && (path == NULL || port_sep < path))
+    {
+        endpoint->port = atoi(port_sep + 1);
+        strcpy(endpoint->uri, buf);
+    } else
+    {
+        if (port == 0)
+        {
+            port = strncmp(buf, "mqtts", 5) == 0 ? 8883 : 1883;
+        }
+        int host_len = path != NULL ? path - buf : strlen(buf);
+        if (snprintf(endpoint->uri, sizeof(endpoint->uri), "%.*s:%u%s", host_len, buf, port, path != NULL ? path : "")
+                        >= sizeof(endpoint->uri))
+        {
+            ESP_LOGE(TAG, "Broker URI too long: %s", buf);
+            return false;
+        }
+        endpoint->port = port;
+    }
+
+    // The primary URL may be part of the list already
+    for (int i = 0; i < *count; i++)
+    {
+        if (strcmp(table[i].uri, endpoint->uri) == 0)
+        {
+            return false;
+        }
+    }
+    (*count)++;
+    return true;
+}
+
+/*! Fills the table with the comma separated list and the primary endpoint behind it */
+static int build_endpoints(const struct broker *broker, struct broker_endpoint *table, const char *list)
+{
+    int count = 0;
+    while (*list != 0)
+    {
+        const char *end = strchr(list, ',');
+        size_t len = end != NULL ? end - list : strlen(list);
+        while (len > 0 && *list == ' ')
+        {
+            list++;
+            len--;
+        }
+        add_endpoint(table, &count, list, len, 0);
+        list += len;
+        if (*list == ',')
+        {
+            list++;
+        }
+    }
+    add_endpoint(table, &count, broker->primary_url, strlen(broker->primary_url), broker->primary_port);
+    return count;
+}
+
+/**
+ * @brief Replaces the endpoints by the table, the ones in both keep their health, the table
+ *        is overwritten. Must be called with the lock taken once the client is started.
+ *
+ * @return int Index of the current endpoint in the new table, -1 if it isn't part of it
+ */
+static int replace_endpoints_locked(struct broker *broker, struct broker_endpoint *table, int count)
+{
+    int new_current = -1;
+    for (int i = 0; i < count; i++)
+    {
+        for (int j = 0; j < broker->endpoint_count && j < CONFIG_MQTT_MAX_ENDPOINTS; j++)
+        {
+            if (strcmp(table[i].uri, broker->endpoints[j].uri) == 0)
+            {
+                table[i] = broker->endpoints[j];
+                new_current = j == broker->current ? i : new_current;
+            }
+        }
+    }
+    memcpy(broker->endpoints, table, count * sizeof(table[0]));
+    broker->endpoint_count = count;
+    broker->current = new_current >= 0 ? new_current : 0;
+    broker->list_loaded = true;
+    return new_current;
+}
+
+/*! Reads the endpoint list saved by broker_parse_config(), an empty string if there is none */
+static void read_endpoint_list(char *list, size_t size)
+{
+    nvs_handle handle;
+
+    list[0] = 0;
+    if (nvs_open(NVS_KEY_MQTT_ENDPOINTS, NVS_READONLY, &handle) == ESP_OK)
+    {
+        if (nvs_get_str(handle, NVS_KEY_MQTT_ENDPOINTS, list, &size) != ESP_OK)
+        {
+            list[0] = 0;
+        }
+        nvs_close(handle);
+    }
+}
+
+void broker_init(struct broker *broker, const char *url, uint32_t port, const char *last_endpoint)
+{
+    assert(url != NULL);
+
+    portMUX_INITIALIZE(&broker->lock);
+    broker->endpoint_count = 0;
+    broker->current = 0;
+    broker->primary_url = url;
+    broker->primary_port = port;
+    broker->list_loaded = false;
+    broker->list_received = false;
+    if (last_endpoint != NULL
+                    && add_endpoint(broker->endpoints, &broker->endpoint_count, last_endpoint, strlen(last_endpoint), 0))
+    {
+        ESP_LOGI(TAG, "MQTT endpoint of the last cycle: %s", broker->endpoints[0].uri);
+        return;
+    }
+
+    char list[BROKER_LIST_MAX_LENGTH];
+    read_endpoint_list(list, sizeof(list));
+    broker->endpoint_count = build_endpoints(broker, broker->endpoints, list);
+    broker->list_loaded = true;
+    for (int i = 0; i < broker->endpoint_count; i++)
+    {
+        ESP_LOGI(TAG, "MQTT endpoint %d: %s", i, broker->endpoints[i].uri);
+    }
+}
+
+/*! Order in which the endpoints are selected: not tried yet, measured, and failed without ever connecting */
+static int endpoint_class(const struct broker_endpoint *endpoint)
+{
+    if (endpoint->latency_ms != 0)
+    {
+        return 1;
+    }
+    return endpoint->failures == 0 ? 0 : 2;
+}
+
+/**
+ * @brief Index of the endpoint to connect to next, must be called with the lock taken.
+ *        There is no active probing, the latency of an endpoint is measured by connecting to it for
+ *        real. So the endpoints not tried yet come first in list order, each reconnect measures one
+ *        more, then the healthy one with the lowest latency. Endpoints that only failed come last.
+ */
+static int best_endpoint_locked(const struct broker *broker)
+{
+    int64_t now = esp_timer_get_time();
+    int best = -1;
+    int oldest_hold = 0;
+
+    for (int i = 0; i < broker->endpoint_count; i++)
+    {
+        if (broker->endpoints[i].hold_until_us < broker->endpoints[oldest_hold].hold_until_us)
+        {
+            oldest_hold = i;
+        }
+        if (broker->endpoints[i].hold_until_us > now)
+        {
+            continue;
+        }
+        const struct broker_endpoint *endpoint = &broker->endpoints[i];
+        int endpoint_order = endpoint_class(endpoint);
+        int best_order = best >= 0 ? endpoint_class(&broker->endpoints[best]) : 3;
+        if (endpoint_order < best_order || (endpoint_order == 1 && best_order == 1
+                        && endpoint->latency_ms < broker->endpoints[best].latency_ms))
+        {
+            best = i;
+        }
+    }
+    // All endpoints failed recently, retry the one that is on hold the shortest
+    return best >= 0 ? best : oldest_hold;
+}
+
+const char* broker_select(struct broker *broker, uint32_t *port)
+{
+    assert(broker->endpoint_count > 0);
+
+    portENTER_CRITICAL(&broker->lock);
+    broker->current = best_endpoint_locked(broker);
+    broker->connect_failed = false;
+    broker->reconnect_pending = false;
+    portEXIT_CRITICAL(&broker->lock);
+
+    *port = broker->endpoints[broker->current].port;
+    return broker->endpoints[broker->current].uri;
+}
+
+const char* broker_current(struct broker *broker)
+{
+    return broker->endpoints[broker->current].uri;
+}
+
+void broker_connect_started(struct broker *broker)
+{
+    portENTER_CRITICAL(&broker->lock);
+    broker->connect_started_us = esp_timer_get_time();
+    portEXIT_CRITICAL(&broker->lock);
+}
+
+void broker_connected(struct broker *broker)
+{
+    portENTER_CRITICAL(&broker->lock);
+    struct broker_endpoint *endpoint = &broker->endpoints[broker->current];
+    uint32_t latency_ms = (esp_timer_get_time() - broker->connect_started_us) / 1000;
+    if (latency_ms == 0)
+    {
+        latency_ms = 1;
+    }
+    if (endpoint->latency_ms == 0)
+    {
+        endpoint->latency_ms = latency_ms;
+    } else
+    {
+        endpoint->latency_ms = (endpoint->latency_ms * (100 - BROKER_LATENCY_WEIGHT) + latency_ms * BROKER_LATENCY_WEIGHT) / 100;
+    }
+    endpoint->failures = 0;
+    endpoint->hold_until_us = 0;
+    broker->connected = true;
+    broker->reconnect_pending = false;
+    portEXIT_CRITICAL(&broker->lock);
+
+    ESP_LOGI(TAG, "Connected to %s in %d ms, smoothed latency %d ms", endpoint->uri, latency_ms, endpoint->latency_ms);
+}
+
+void broker_disconnected(struct broker *broker)
+{
+    portENTER_CRITICAL(&broker->lock);
+    if (!broker->connected)
+    {
+        // The connect failed, hold the endpoint back longer after each failure in a row
+        struct broker_endpoint *endpoint = &broker->endpoints[broker->current];
+        uint32_t failures = endpoint->failures < 6 ? endpoint->failures : 6;
+        endpoint->failures++;
+        endpoint->hold_until_us = esp_timer_get_time() + ((int64_t) CONFIG_MQTT_ENDPOINT_HOLD_S * 1000000 << failures);
+        broker->connect_failed = true;
+    }
+    broker->connected = false;
+    broker->reconnect_pending = true;
+    portEXIT_CRITICAL(&broker->lock);
+}
+
+void broker_poll(struct broker *broker, esp_mqtt_client_handle_t client)
+{
+    // The endpoint of the last cycle failed, fail over to the list like after a cold boot
+    struct broker_endpoint loaded[CONFIG_MQTT_MAX_ENDPOINTS];
+    int loaded_count = 0;
+    bool load_list = !broker->list_loaded && broker->connect_failed;
+    if (load_list)
+    {
+        char list[BROKER_LIST_MAX_LENGTH];
+        read_endpoint_list(list, sizeof(list));
+        loaded_count = build_endpoints(broker, loaded, list);
+    }
+
+    portENTER_CRITICAL(&broker->lock);
+    if (!broker->reconnect_pending)
+    {
+        portEXIT_CRITICAL(&broker->lock);
+        return;
+    }
+    broker->reconnect_pending = false;
+    broker->connect_failed = false;
+    int previous = broker->current;
+    bool replaced = false;
+    if (broker->list_received)
+    {
+        // A list received while connected is applied now that the client reconnects
+        previous = replace_endpoints_locked(broker, broker->received, broker->received_count);
+        broker->list_received = false;
+        replaced = true;
+    } else if (load_list)
+    {
+        previous = replace_endpoints_locked(broker, loaded, loaded_count);
+        replaced = true;
+    }
+    int next = best_endpoint_locked(broker);
+    broker->current = next;
+    portEXIT_CRITICAL(&broker->lock);
+
+    if (replaced)
+    {
+        ESP_LOGI(TAG, "Using the MQTT endpoint list, %d endpoints", broker->endpoint_count);
+    }
+    if (next == previous)
+    {
+        // The client reconnects to the same endpoint by itself
+        return;
+    }
+
+    ESP_LOGW(TAG, "Reconnecting to %s", broker->endpoints[next].uri);
+    if (esp_mqtt_client_set_uri(client, broker->endpoints[next].uri) == ESP_OK)
+    {
+        esp_mqtt_client_reconnect(client);
+    }
+}
+
+void broker_parse_config(struct broker *broker, const cJSON *object)
+{
+    if (object == NULL)
+    {
+        return;
+    }
+
+    cJSON *list = cJSON_GetObjectItem(object, TB_SHARED_ATTR_FIELD_MQTT_ENDPOINTS);
+    if (!cJSON_IsString(list) || list->valuestring == NULL || strlen(list->valuestring) >= BROKER_LIST_MAX_LENGTH)
+    {
+        return;
+    }
+
+    // Switching endpoints would drop a working connection, the list is applied at the next reconnect
+    struct broker_endpoint table[CONFIG_MQTT_MAX_ENDPOINTS];
+    int count = build_endpoints(broker, table, list->valuestring);
+    portENTER_CRITICAL(&broker->lock);
+    memcpy(broker->received, table, count * sizeof(table[0]));
+    broker->received_count = count;
+    broker->list_received = true;
+    portEXIT_CRITICAL(&broker->lock);
+
+    char stored[BROKER_LIST_MAX_LENGTH];
+    size_t stored_len = sizeof(stored);
+    nvs_handle handle;
+    if (nvs_open(NVS_KEY_MQTT_ENDPOINTS, NVS_READWRITE, &handle) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Unable to save the MQTT endpoint list");
+        return;
+    }
+    // Avoid a flash write for every config fetch
+    if (nvs_get_str(handle, NVS_KEY_MQTT_ENDPOINTS, stored, &stored_len) != ESP_OK || strcmp(stored, list->valuestring) != 0)
+    {
+        if (nvs_set_str(handle, NVS_KEY_MQTT_ENDPOINTS, list->valuestring) == ESP_OK)
+        {
+            nvs_commit(handle);
+            ESP_LOGI(TAG, "Received MQTT endpoint list: %s", list->valuestring);
+        }
+    }
+    nvs_close(handle);
+}
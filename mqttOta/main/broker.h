@@ -0,0 +1,100 @@
+/**
+ * @file broker.h
+ */
+
+#ifndef PRJ_BROKER_MODULE
+#define PRJ_BROKER_MODULE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "mqtt_client.h"
+#include "cJSON.h"
+#include "freertos/FreeRTOS.h"
+
+/*! NVS storage key where the MQTT broker endpoint list is saved */
+#define NVS_KEY_MQTT_ENDPOINTS "mqtt_endpoints"
+
+/*! Shared attribute key of the endpoint list, comma separated broker URIs in order of preference */
+#define TB_SHARED_ATTR_FIELD_MQTT_ENDPOINTS "mqtt_endpoints"
+
+/*! Max length of an endpoint URI, the same as the broker URL of the device */
+#define BROKER_URI_MAX_LENGTH 256
+
+/* One broker endpoint and its health */
+struct broker_endpoint
+{
+    char uri[BROKER_URI_MAX_LENGTH + 1];
+    uint32_t port;
+    /*! Smoothed connect latency in ms, 0 if never connected */
+    uint32_t latency_ms;
+    /*! Failed connects in a row */
+    uint32_t failures;
+    /*! Time in us until which the endpoint is not selected after a failure */
+    int64_t hold_until_us;
+};
+
+/* Broker endpoints of one device and the health of its connection */
+struct broker
+{
+    struct broker_endpoint endpoints[CONFIG_MQTT_MAX_ENDPOINTS];
+    int endpoint_count;
+    int current;
+
+    /*! Broker URL and port of the device, the last endpoint of the list */
+    const char *primary_url;
+    uint32_t primary_port;
+    /*! False while only the endpoint of the last cycle is known */
+    bool list_loaded;
+    /*! Endpoints of a list received from ThingsBoard, applied at the next reconnect */
+    struct broker_endpoint received[CONFIG_MQTT_MAX_ENDPOINTS];
+    int received_count;
+    bool list_received;
+
+    portMUX_TYPE lock;
+    int64_t connect_started_us;
+    bool connected;
+    bool connect_failed;
+    /*! Set by a failed connect or a lost connection, the next endpoint is selected in broker_poll() */
+    bool reconnect_pending;
+};
+
+/**
+ * @brief Loads the endpoint list from NVS. The broker URL and port of the device are used
+ *        as the last endpoint, and as the only one if no list was received from ThingsBoard.
+ *
+ * @param last_endpoint Endpoint connected to before deep sleep, NULL on a cold boot. It is used alone
+ *        without reading NVS, the list is loaded when a connect to it fails.
+ */
+void broker_init(struct broker *broker, const char *url, uint32_t port, const char *last_endpoint);
+
+/**
+ * @brief Selects the endpoint to connect to: the endpoints not tried yet in list order, then the
+ *        healthy one with the lowest connect latency, see best_endpoint_locked().
+ *
+ * @param port Port of the endpoint, it is part of the returned URI as well
+ * @return const char* URI of the endpoint
+ */
+const char* broker_select(struct broker *broker, uint32_t *port);
+
+/*! Returns the URI of the endpoint the client connects or is connected to */
+const char* broker_current(struct broker *broker);
+
+/*! Called on MQTT_EVENT_BEFORE_CONNECT, starts the latency measurement of the connect */
+void broker_connect_started(struct broker *broker);
+
+/*! Called on MQTT_EVENT_CONNECTED */
+void broker_connected(struct broker *broker);
+
+/*! Called on MQTT_EVENT_DISCONNECTED, a failed connect puts the endpoint on hold */
+void broker_disconnected(struct broker *broker);
+
+/**
+ * @brief Switches the client to the best endpoint after a failed connect or a lost connection,
+ *        with a received endpoint list applied first. Called from the OTA task loop.
+ */
+void broker_poll(struct broker *broker, esp_mqtt_client_handle_t client);
+
+/*! Saves an endpoint list found in a shared attributes object to NVS, it is used from the next reconnect */
+void broker_parse_config(struct broker *broker, const cJSON *object);
+
+#endif
@@ -3,4 +3,9 @@
 #
 # (Uses default behaviour of compiling all source files in directory, adding 'include' to include path.)
 
-# COMPONENT_EMBED_TXTFILES :=  ${PROJECT_PATH}/server_certs/ca_cert.pem
+ifdef CONFIG_MQTT_TLS_CUSTOM_CA
+ifeq ($(wildcard ${PROJECT_PATH}/server_certs/ca_cert.pem),)
+$(error MQTT_TLS_CUSTOM_CA is enabled but server_certs/ca_cert.pem is missing, place the PEM CA certificate of the broker there, see server_certs/README.md)
+endif
+COMPONENT_EMBED_TXTFILES :=  ${PROJECT_PATH}/server_certs/ca_cert.pem
+endif
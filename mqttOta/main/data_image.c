@@ -0,0 +1,142 @@
+/**
+ * @file data_image.c
+ */
+
+#include <string.h>
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "nvs.h"
+
+#include "mqttOta.h"
+#include "data_image.h"
+
+/*! Removes the saved title and version, ESP_OK if there were none */
+static esp_err_t clear_version(void)
+{
+    nvs_handle handle;
+    esp_err_t err = nvs_open(NVS_KEY_SW_VERSION, NVS_READWRITE, &handle);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+    err = nvs_erase_key(handle, NVS_KEY_SW_VERSION);
+    if (err == ESP_OK || err == ESP_ERR_NVS_NOT_FOUND)
+    {
+        err = nvs_erase_key(handle, NVS_KEY_SW_TITLE);
+    }
+    if (err == ESP_OK || err == ESP_ERR_NVS_NOT_FOUND)
+    {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    return err;
+}
+
+esp_err_t data_image_begin(struct data_image *data, const char *label, size_t image_size)
+{
+    assert(label != NULL);
+
+    data->partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+    if (data->partition == NULL)
+    {
+        ESP_LOGE(TAG, "Data partition %s not found", label);
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (image_size == 0 || image_size > data->partition->size)
+    {
+        ESP_LOGE(TAG, "Image size %d doesn't fit partition %s", image_size, label);
+        data->partition = NULL;
+        return ESP_ERR_INVALID_SIZE;
+    }
+    // The first write erases the old image, it must not be reported as installed from then on
+    esp_err_t err = clear_version();
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Clearing the data image version failed (%s)", esp_err_to_name(err));
+        data->partition = NULL;
+        return err;
+    }
+
+    ESP_LOGI(TAG, "Writing to data partition %s at offset 0x%x", label, data->partition->address);
+    data->size = image_size;
+    data->written_end = 0;
+    data->erased_end = 0;
+    return ESP_OK;
+}
+
+esp_err_t data_image_write(struct data_image *data, const void *buf, size_t len)
+{
+    if (data->partition == NULL || data->written_end + len > data->size)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    size_t end = (data->written_end + len + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+    if (end > data->erased_end)
+    {
+        esp_err_t err = esp_partition_erase_range(data->partition, data->erased_end, end - data->erased_end);
+        if (err != ESP_OK)
+        {
+            return err;
+        }
+        data->erased_end = end;
+    }
+
+    esp_err_t err = esp_partition_write(data->partition, data->written_end, buf, len);
+    if (err == ESP_OK)
+    {
+        data->written_end += len;
+    }
+    return err;
+}
+
+esp_err_t data_image_finish(struct data_image *data, const char *title, const char *version)
+{
+    assert(title != NULL && version != NULL);
+
+    if (data->partition == NULL || data->written_end != data->size)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    data->partition = NULL;
+
+    nvs_handle handle;
+    esp_err_t err = nvs_open(NVS_KEY_SW_VERSION, NVS_READWRITE, &handle);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+    err = nvs_set_str(handle, NVS_KEY_SW_TITLE, title);
+    if (err == ESP_OK)
+    {
+        err = nvs_set_str(handle, NVS_KEY_SW_VERSION, version);
+    }
+    if (err == ESP_OK)
+    {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    return err;
+}
+
+void data_image_get_version(char *title, size_t title_size, char *version, size_t version_size)
+{
+    nvs_handle handle;
+
+    title[0] = 0;
+    version[0] = 0;
+    if (nvs_open(NVS_KEY_SW_VERSION, NVS_READONLY, &handle) != ESP_OK)
+    {
+        return;
+    }
+    if (nvs_get_str(handle, NVS_KEY_SW_VERSION, version, &version_size) != ESP_OK)
+    {
+        version[0] = 0;
+    }
+    // Images written before the title was saved have none
+    if (nvs_get_str(handle, NVS_KEY_SW_TITLE, title, &title_size) != ESP_OK)
+    {
+        title[0] = 0;
+    }
+    nvs_close(handle);
+}
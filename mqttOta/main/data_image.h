@@ -0,0 +1,47 @@
+/**
+ * @file data_image.h
+ */
+
+#ifndef PRJ_DATA_IMAGE_MODULE
+#define PRJ_DATA_IMAGE_MODULE
+
+#include <stddef.h>
+#include "esp_err.h"
+#include "esp_partition.h"
+
+/*! NVS storage key where the version of the data image is saved */
+#define NVS_KEY_SW_VERSION "sw_version"
+
+/*! NVS key of the title of the data image, in the namespace of @ref NVS_KEY_SW_VERSION */
+#define NVS_KEY_SW_TITLE "sw_title"
+
+/* Data image one device is writing */
+struct data_image
+{
+    /*! NULL while no image is written */
+    const esp_partition_t *partition;
+    size_t size;
+    size_t written_end;
+    size_t erased_end;
+};
+
+/**
+ * @brief Prepares writing an image into a data partition, e.g. a SPIFFS image.
+ *        The partition is overwritten in place, the application must not use it until the restart.
+ *        The saved version is cleared first, a partition left half written isn't reported as that version.
+ *
+ * @param label Label of the data partition
+ * @param image_size Size of the image, it has to fit the partition
+ */
+esp_err_t data_image_begin(struct data_image *data, const char *label, size_t image_size);
+
+/*! Writes the next part of the image, erasing the sectors ahead of it */
+esp_err_t data_image_write(struct data_image *data, const void *buf, size_t len);
+
+/*! Saves the title and version of the completely written image */
+esp_err_t data_image_finish(struct data_image *data, const char *title, const char *version);
+
+/*! Gets the title and version of the data image saved by @ref data_image_finish, empty if none was written yet */
+void data_image_get_version(char *title, size_t title_size, char *version, size_t version_size);
+
+#endif
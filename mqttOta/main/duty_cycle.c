@@ -0,0 +1,280 @@
+/**
+ * @file duty_cycle.c
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_sleep.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "esp_attr.h"
+
+#include "mqttOta.h"
+#include "duty_cycle.h"
+#include "rollout.h"
+
+#ifdef CONFIG_DUTY_CYCLE_MODE
+
+#define DUTY_CYCLE_MAGIC 0x44435954
+
+/* State kept in RTC slow memory across deep sleep */
+struct duty_cycle_rtc
+{
+    uint32_t magic;
+    uint32_t cycle;
+    uint32_t awake_ms;
+
+    bool wifi_hint_valid;
+    uint8_t bssid[6];
+    uint8_t channel;
+
+    bool connection_valid;
+    char mqtt_url[MAX_LENGTH_TB_URL + 1];
+    uint32_t mqtt_port;
+    char access_token[MAX_LENGTH_TB_ACCESS_TOKEN + 1];
+    /*! Endpoint connected to, a fast wake connects to it without reading the endpoint list from NVS */
+    char endpoint[MAX_LENGTH_TB_URL + 1];
+
+    bool attributes_valid;
+    uint32_t cycles_since_config;
+    struct shared_keys attributes;
+
+    /*! Comma separated telemetry entries, sent as a JSON array */
+    size_t telemetry_len;
+    char telemetry[CONFIG_DUTY_CYCLE_TELEMETRY_BUFFER];
+};
+
+/*! The RTC memory of the chip, the one piece of state that isn't part of a device context */
+static RTC_DATA_ATTR struct duty_cycle_rtc rtc;
+
+static void awake_timeout(void *arg)
+{
+    struct duty_cycle *cycle = arg;
+
+    // Sleeping from the esp_timer task would cut off the OTA task in the middle of a flash write
+    cycle->timeout_cb(cycle->timeout_ctx);
+}
+
+void duty_cycle_init(struct duty_cycle *cycle, duty_cycle_timeout_t timeout, void *ctx)
+{
+    assert(timeout != NULL);
+
+    cycle->telemetry_lock = xSemaphoreCreateMutex();
+    cycle->timeout_cb = timeout;
+    cycle->timeout_ctx = ctx;
+
+    cycle->fast_wake = esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_TIMER && rtc.magic == DUTY_CYCLE_MAGIC;
+    if (!cycle->fast_wake)
+    {
+        memset(&rtc, 0, sizeof(rtc));
+        rtc.magic = DUTY_CYCLE_MAGIC;
+    }
+    rtc.cycle++;
+    rtc.cycles_since_config++;
+    ESP_LOGI(TAG, "Duty cycle %d, %s wake", rtc.cycle, cycle->fast_wake ? "timer" : "cold");
+
+    if (cycle->fast_wake)
+    {
+        char values[48];
+        snprintf(values, sizeof(values), "{\"" TB_TELEMETRY_FIELD_AWAKE_MS "\":%u}", rtc.awake_ms);
+        duty_cycle_add_telemetry(cycle, values);
+    }
+
+    const esp_timer_create_args_t timer_args = { .callback = awake_timeout, .arg = cycle, .name = "awake" };
+    if (esp_timer_create(&timer_args, &cycle->awake_timer) == ESP_OK)
+    {
+        esp_timer_start_periodic(cycle->awake_timer, CONFIG_DUTY_CYCLE_MAX_AWAKE_S * 1000000ULL);
+    }
+}
+
+bool duty_cycle_fast_wake(const struct duty_cycle *cycle)
+{
+    return cycle->fast_wake;
+}
+
+uint32_t duty_cycle_count(void)
+{
+    return rtc.cycle;
+}
+
+bool duty_cycle_get_wifi_hint(const struct duty_cycle *cycle, uint8_t bssid[6], uint8_t *channel)
+{
+    if (!cycle->fast_wake || !rtc.wifi_hint_valid)
+    {
+        return false;
+    }
+    memcpy(bssid, rtc.bssid, sizeof(rtc.bssid));
+    *channel = rtc.channel;
+    return true;
+}
+
+void duty_cycle_save_wifi_hint(const uint8_t bssid[6], uint8_t channel)
+{
+    memcpy(rtc.bssid, bssid, sizeof(rtc.bssid));
+    rtc.channel = channel;
+    rtc.wifi_hint_valid = true;
+}
+
+void duty_cycle_clear_wifi_hint(void)
+{
+    rtc.wifi_hint_valid = false;
+}
+
+bool duty_cycle_get_connection(const struct duty_cycle *cycle, const char **url, uint32_t *port,
+                const char **access_token)
+{
+    if (!cycle->fast_wake || !rtc.connection_valid)
+    {
+        return false;
+    }
+    *url = rtc.mqtt_url;
+    *port = rtc.mqtt_port;
+    *access_token = rtc.access_token;
+    return true;
+}
+
+void duty_cycle_save_connection(const char *url, uint32_t port, const char *access_token)
+{
+    if (strlen(url) >= sizeof(rtc.mqtt_url) || strlen(access_token) >= sizeof(rtc.access_token))
+    {
+        return;
+    }
+    strcpy(rtc.mqtt_url, url);
+    rtc.mqtt_port = port;
+    strcpy(rtc.access_token, access_token);
+    rtc.connection_valid = true;
+}
+
+const char* duty_cycle_get_endpoint(const struct duty_cycle *cycle)
+{
+    return cycle->fast_wake && rtc.endpoint[0] != 0 ? rtc.endpoint : NULL;
+}
+
+void duty_cycle_save_endpoint(const char *uri)
+{
+    if (strlen(uri) < sizeof(rtc.endpoint))
+    {
+        strcpy(rtc.endpoint, uri);
+    }
+}
+
+bool duty_cycle_get_attributes(const struct duty_cycle *cycle, struct shared_keys *attributes)
+{
+    // Attribute updates sent while sleeping are missed, the config is fetched again every few cycles
+    if (!cycle->fast_wake || !rtc.attributes_valid || rtc.cycles_since_config > CONFIG_DUTY_CYCLE_CONFIG_FETCH_CYCLES)
+    {
+        return false;
+    }
+    *attributes = rtc.attributes;
+    return true;
+}
+
+void duty_cycle_save_attributes(const struct shared_keys *attributes)
+{
+    rtc.attributes = *attributes;
+    rtc.attributes_valid = true;
+    rtc.cycles_since_config = 0;
+}
+
+bool duty_cycle_add_telemetry(struct duty_cycle *cycle, const char *values)
+{
+    char entry[256];
+    struct timeval now;
+    struct tm timeinfo;
+
+    // The RTC keeps the system time in deep sleep, it is valid once SNTP synchronized it
+    gettimeofday(&now, NULL);
+    gmtime_r(&now.tv_sec, &timeinfo);
+    int len;
+    if (timeinfo.tm_year + 1900 >= ROLLOUT_MIN_VALID_YEAR)
+    {
+        len = snprintf(entry, sizeof(entry), "{\"ts\":%lld,\"values\":%s}", (long long) now.tv_sec * 1000 + now.tv_usec / 1000,
+                        values);
+    } else
+    {
+        len = snprintf(entry, sizeof(entry), "%s", values);
+    }
+    if (len >= sizeof(entry))
+    {
+        return false;
+    }
+
+    bool added = false;
+    xSemaphoreTake(cycle->telemetry_lock, portMAX_DELAY);
+    // One more byte for the separating comma
+    if (rtc.telemetry_len + len + 1 < sizeof(rtc.telemetry))
+    {
+        if (rtc.telemetry_len != 0)
+        {
+            rtc.telemetry[rtc.telemetry_len++] = ',';
+        }
+        memcpy(rtc.telemetry + rtc.telemetry_len, entry, len);
+        rtc.telemetry_len += len;
+        added = true;
+    } else
+    {
+        ESP_LOGW(TAG, "Telemetry buffer full, dropping %s", values);
+    }
+    xSemaphoreGive(cycle->telemetry_lock);
+    return added;
+}
+
+void duty_cycle_flush_telemetry(struct duty_cycle *cycle, esp_mqtt_client_handle_t client)
+{
+    char *payload = cycle->payload;
+
+    xSemaphoreTake(cycle->telemetry_lock, portMAX_DELAY);
+    if (cycle->inflight_msg_id == 0 && rtc.telemetry_len != 0)
+    {
+        payload[0] = '[';
+        memcpy(payload + 1, rtc.telemetry, rtc.telemetry_len);
+        payload[rtc.telemetry_len + 1] = ']';
+        int msg_id = esp_mqtt_client_publish(client, TB_TELEMETRY_TOPIC, payload, rtc.telemetry_len + 2, 1, 0);
+        if (msg_id > 0)
+        {
+            cycle->inflight_msg_id = msg_id;
+            cycle->inflight_len = rtc.telemetry_len;
+        }
+    }
+    xSemaphoreGive(cycle->telemetry_lock);
+}
+
+bool duty_cycle_telemetry_delivered(const struct duty_cycle *cycle)
+{
+    return cycle->inflight_msg_id == 0 && rtc.telemetry_len == 0;
+}
+
+void duty_cycle_notify_published(struct duty_cycle *cycle, int msg_id)
+{
+    if (cycle->telemetry_lock == NULL)
+    {
+        return;
+    }
+
+    xSemaphoreTake(cycle->telemetry_lock, portMAX_DELAY);
+    if (cycle->inflight_msg_id != 0 && msg_id == cycle->inflight_msg_id)
+    {
+        // Entries added during the publish stay queued, together with their comma
+        size_t sent = cycle->inflight_len < rtc.telemetry_len ? cycle->inflight_len + 1 : cycle->inflight_len;
+        memmove(rtc.telemetry, rtc.telemetry + sent, rtc.telemetry_len - sent);
+        rtc.telemetry_len -= sent;
+        cycle->inflight_msg_id = 0;
+    }
+    xSemaphoreGive(cycle->telemetry_lock);
+}
+
+void duty_cycle_sleep(void)
+{
+    rtc.awake_ms = esp_timer_get_time() / 1000;
+    ESP_LOGI(TAG, "Cycle %d was awake for %d ms, sleeping for %d s", rtc.cycle, rtc.awake_ms, CONFIG_DUTY_CYCLE_SLEEP_S);
+    esp_wifi_stop();
+    esp_sleep_enable_timer_wakeup(CONFIG_DUTY_CYCLE_SLEEP_S * 1000000ULL);
+    esp_deep_sleep_start();
+}
+
+#endif
@@ -0,0 +1,115 @@
+/**
+ * @file duty_cycle.h
+ */
+
+#ifndef PRJ_DUTY_CYCLE_MODULE
+#define PRJ_DUTY_CYCLE_MODULE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "mqtt_client.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+struct shared_keys;
+
+/*! Telemetry key of the time the previous cycle was awake */
+#define TB_TELEMETRY_FIELD_AWAKE_MS "awake_ms"
+
+/**
+ * @brief Called in the esp_timer task every CONFIG_DUTY_CYCLE_MAX_AWAKE_S, the task that owns the
+ *        connection decides whether to go to sleep.
+ */
+typedef void (*duty_cycle_timeout_t)(void *ctx);
+
+#ifdef CONFIG_DUTY_CYCLE_MODE
+
+/**
+ * @brief Duty cycle of one device while it is awake. The state kept across deep sleep is in the RTC memory
+ *        of the chip, the functions without a context work on it alone.
+ */
+struct duty_cycle
+{
+    bool fast_wake;
+    SemaphoreHandle_t telemetry_lock;
+    /*! Message id and length of the telemetry publish in flight, 0 if none */
+    int inflight_msg_id;
+    size_t inflight_len;
+
+    duty_cycle_timeout_t timeout_cb;
+    void *timeout_ctx;
+    esp_timer_handle_t awake_timer;
+
+    /*! The queued telemetry as a JSON array */
+    char payload[CONFIG_DUTY_CYCLE_TELEMETRY_BUFFER + 2];
+};
+
+#else
+
+/* The device stays awake */
+struct duty_cycle
+{
+    char unused;
+};
+
+#endif
+
+/**
+ * @brief Detects a timer wake with valid state from the last cycle, queues the awake time of that
+ *        cycle and arms the max awake time. Called once at start.
+ */
+void duty_cycle_init(struct duty_cycle *cycle, duty_cycle_timeout_t timeout, void *ctx);
+
+/*! Returns true if this boot is a timer wake with valid state from the last cycle */
+bool duty_cycle_fast_wake(const struct duty_cycle *cycle);
+
+/*! Returns the cycle number, counted since the last power on or reset */
+uint32_t duty_cycle_count(void);
+
+/*! Returns the AP of the last cycle, false if there is none or it failed since */
+bool duty_cycle_get_wifi_hint(const struct duty_cycle *cycle, uint8_t bssid[6], uint8_t *channel);
+void duty_cycle_save_wifi_hint(const uint8_t bssid[6], uint8_t channel);
+void duty_cycle_clear_wifi_hint(void);
+
+/*! Returns the MQTT connection parameters of the last cycle, false unless this is a fast wake */
+bool duty_cycle_get_connection(const struct duty_cycle *cycle, const char **url, uint32_t *port,
+                const char **access_token);
+void duty_cycle_save_connection(const char *url, uint32_t port, const char *access_token);
+
+/*! Returns the broker endpoint connected to in the last cycle, NULL unless this is a fast wake */
+const char* duty_cycle_get_endpoint(const struct duty_cycle *cycle);
+
+/*! Saves the broker endpoint connected to for the next cycles */
+void duty_cycle_save_endpoint(const char *uri);
+
+/**
+ * @brief Returns the OTA config of the last cycle, false unless this is a fast wake
+ *        or if the config is to be fetched from ThingsBoard again in this cycle.
+ */
+bool duty_cycle_get_attributes(const struct duty_cycle *cycle, struct shared_keys *attributes);
+
+/*! Saves the OTA config received from ThingsBoard for the next cycles */
+void duty_cycle_save_attributes(const struct shared_keys *attributes);
+
+/**
+ * @brief Queues a telemetry object (JSON text) in RTC memory, it's sent in this or a later cycle.
+ *        Entries are timestamped once the system time is set.
+ *
+ * @return false If the buffer is full
+ */
+bool duty_cycle_add_telemetry(struct duty_cycle *cycle, const char *values);
+
+/*! Publishes the queued telemetry in one message unless a publish is in flight */
+void duty_cycle_flush_telemetry(struct duty_cycle *cycle, esp_mqtt_client_handle_t client);
+
+/*! Returns true when all queued telemetry was acknowledged by the broker */
+bool duty_cycle_telemetry_delivered(const struct duty_cycle *cycle);
+
+/*! Called on MQTT_EVENT_PUBLISHED to drop the acknowledged telemetry */
+void duty_cycle_notify_published(struct duty_cycle *cycle, int msg_id);
+
+/*! Saves the awake time of this cycle and enters deep sleep for CONFIG_DUTY_CYCLE_SLEEP_S */
+void duty_cycle_sleep(void) __attribute__((noreturn));
+
+#endif
@@ -0,0 +1,243 @@
+/**
+ * @file fw_state.c
+ */
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+
+#include "cJSON.h"
+#include "mqttOta.h"
+#include "fw_state.h"
+#include "tb_proto.h"
+
+static void copy_field(char *dst, size_t dst_size, const char *src)
+{
+    if (src == NULL)
+    {
+        dst[0] = 0;
+        return;
+    }
+    strncpy(dst, src, dst_size - 1);
+    dst[dst_size - 1] = 0;
+}
+
+static int publish_state_msg(struct fw_state *fw_state, const struct fw_state_msg *msg, bool sw)
+{
+    ESP_LOGI(TAG, "Publish %s state: %s", sw ? "sw" : "fw", msg->state);
+#ifdef CONFIG_TB_PAYLOAD_PROTOBUF
+    uint8_t payload[TB_PROTO_TELEMETRY_MAX_SIZE];
+    const char *error = msg->error[0] != 0 ? msg->error : NULL;
+    struct tb_proto_telemetry telemetry = {
+        .current_fw_title = sw ? NULL : msg->title,
+        .current_fw_version = sw ? NULL : msg->version,
+        .fw_state = sw ? NULL : msg->state,
+        .fw_error = sw ? NULL : error,
+        .current_sw_title = sw ? msg->title : NULL,
+        .current_sw_version = sw ? msg->version : NULL,
+        .sw_state = sw ? msg->state : NULL,
+        .sw_error = sw ? error : NULL
+    };
+    int len = tb_proto_encode_telemetry(payload, sizeof(payload), &telemetry);
+    if (len < 0)
+    {
+        return -1;
+    }
+    return esp_mqtt_client_publish(fw_state->client, TB_TELEMETRY_TOPIC, (const char*) payload, len, 1, 0);
+#else
+    cJSON *current_fw = cJSON_CreateObject();
+    cJSON_AddStringToObject(current_fw, sw ? TB_CLIENT_ATTR_FIELD_CURRENT_SW_TITLE : TB_CLIENT_ATTR_FIELD_CURRENT_FW_TITLE,
+                    msg->title);
+    cJSON_AddStringToObject(current_fw, sw ? TB_CLIENT_ATTR_FIELD_CURRENT_SW : TB_CLIENT_ATTR_FIELD_CURRENT_FW, msg->version);
+    cJSON_AddStringToObject(current_fw, sw ? TB_CLIENT_ATTR_FIELD_SW_STATE : TB_CLIENT_ATTR_FIELD_FW_STATE, msg->state);
+    if (msg->error[0] != 0)
+    {
+        cJSON_AddStringToObject(current_fw, sw ? TB_CLIENT_ATTR_FIELD_SW_ERROR : TB_CLIENT_ATTR_FIELD_FW_ERROR, msg->error);
+    }
+    char *current_fw_attribute = cJSON_PrintUnformatted(current_fw);
+    cJSON_Delete(current_fw);
+    int msg_id = esp_mqtt_client_publish(fw_state->client, TB_TELEMETRY_TOPIC, current_fw_attribute, 0, 1, 0);
+    // Free is intentional, it's client responsibility to free the result of cJSON_Print
+    free(current_fw_attribute);
+    return msg_id;
+#endif
+}
+
+/**
+ * @brief Publishes the pending state of the slot unless it equals the last published one.
+ *        Must be called with the lock of fw_state taken.
+ *
+ * @return int Message id of the publish, 0 if nothing was sent, -1 on error
+ */
+static int publish_pending_locked(struct fw_state *fw_state, struct fw_state_slot *slot)
+{
+    if (!slot->pending_valid)
+    {
+        return 0;
+    }
+    slot->pending_valid = false;
+
+    if (slot->published_valid && memcmp(&slot->pending_state, &slot->published_state, sizeof(slot->pending_state)) == 0)
+    {
+        ESP_LOGD(TAG, "Skipping state %s, already reported", slot->pending_state.state);
+        return 0;
+    }
+
+    int msg_id = publish_state_msg(fw_state, &slot->pending_state, slot->sw);
+    if (msg_id < 0)
+    {
+        ESP_LOGE(TAG, "Unable to publish state %s", slot->pending_state.state);
+        // Keep the state queued, it is retried on the next poll
+        slot->pending_valid = true;
+        return -1;
+    }
+
+    slot->published_state = slot->pending_state;
+    slot->published_valid = true;
+    slot->published_msg_id = msg_id;
+    // The ack may be handled by the MQTT task before the publish call returns
+    slot->published_acked = fw_state->acked_msg_id == msg_id;
+    return msg_id;
+}
+
+/*! Returns true if the broker acknowledged the last published state of every slot */
+static bool all_delivered(struct fw_state *fw_state)
+{
+    for (size_t i = 0; i < FW_STATE_SLOTS; i++)
+    {
+        if (fw_state->slots[i].published_valid && !fw_state->slots[i].published_acked)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void report(struct fw_state *fw_state, struct fw_state_slot *slot, const char *title, const char *version,
+                const char *state, const char *error_msg)
+{
+    assert(fw_state->lock != NULL && state != NULL);
+
+    xSemaphoreTake(fw_state->lock, portMAX_DELAY);
+    if (slot->pending_valid)
+    {
+        ESP_LOGD(TAG, "State %s superseded by %s", slot->pending_state.state, state);
+    }
+    copy_field(slot->pending_state.title, sizeof(slot->pending_state.title), title);
+    copy_field(slot->pending_state.version, sizeof(slot->pending_state.version), version);
+    copy_field(slot->pending_state.state, sizeof(slot->pending_state.state), state);
+    copy_field(slot->pending_state.error, sizeof(slot->pending_state.error), error_msg);
+    slot->pending_valid = true;
+    slot->pending_since = xTaskGetTickCount();
+
+    if (error_msg != NULL)
+    {
+        publish_pending_locked(fw_state, slot);
+    }
+    xSemaphoreGive(fw_state->lock);
+}
+
+void fw_state_init(struct fw_state *fw_state, esp_mqtt_client_handle_t client)
+{
+    if (fw_state->lock == NULL)
+    {
+        fw_state->lock = xSemaphoreCreateMutex();
+        fw_state->delivered = xSemaphoreCreateBinary();
+        fw_state->slots[0].published_msg_id = -1;
+        fw_state->slots[1].sw = true;
+        fw_state->slots[1].published_msg_id = -1;
+        fw_state->acked_msg_id = -1;
+    }
+    fw_state->client = client;
+}
+
+void fw_state_report(struct fw_state *fw_state, const char *title, const char *version, const char *state,
+                const char *error_msg)
+{
+    report(fw_state, &fw_state->slots[0], title, version, state, error_msg);
+}
+
+void fw_state_report_sw(struct fw_state *fw_state, const char *title, const char *version, const char *state,
+                const char *error_msg)
+{
+    report(fw_state, &fw_state->slots[1], title, version, state, error_msg);
+}
+
+void fw_state_poll(struct fw_state *fw_state)
+{
+    if (fw_state->lock == NULL)
+    {
+        return;
+    }
+
+    xSemaphoreTake(fw_state->lock, portMAX_DELAY);
+    for (size_t i = 0; i < FW_STATE_SLOTS; i++)
+    {
+        struct fw_state_slot *slot = &fw_state->slots[i];
+        if (slot->pending_valid && (xTaskGetTickCount() - slot->pending_since) >= pdMS_TO_TICKS(FW_STATE_COALESCE_MS))
+        {
+            publish_pending_locked(fw_state, slot);
+        }
+    }
+    xSemaphoreGive(fw_state->lock);
+}
+
+bool fw_state_flush(struct fw_state *fw_state, uint32_t timeout_ms)
+{
+    assert(fw_state->lock != NULL);
+
+    xSemaphoreTake(fw_state->lock, portMAX_DELAY);
+    // Drop acknowledgements of earlier messages
+    xSemaphoreTake(fw_state->delivered, 0);
+    // A state equal to the last published one isn't sent again, but its publish may still wait for the ack
+    int result = 0;
+    for (size_t i = 0; i < FW_STATE_SLOTS; i++)
+    {
+        if (publish_pending_locked(fw_state, &fw_state->slots[i]) < 0)
+        {
+            result = -1;
+        }
+    }
+    bool delivered = all_delivered(fw_state);
+    xSemaphoreGive(fw_state->lock);
+
+    if (result < 0 || delivered || timeout_ms == 0)
+    {
+        return result >= 0 && delivered;
+    }
+
+    // Acknowledgements of other messages wake us up as well, wait until ours arrive
+    const TickType_t deadline = xTaskGetTickCount() + pdMS_TO_TICKS(timeout_ms);
+    while (!delivered)
+    {
+        TickType_t now = xTaskGetTickCount();
+        if ((int32_t) (deadline - now) <= 0 || xSemaphoreTake(fw_state->delivered, deadline - now) != pdTRUE)
+        {
+            break;
+        }
+        delivered = all_delivered(fw_state);
+    }
+    if (!delivered)
+    {
+        ESP_LOGW(TAG, "States were not acknowledged within %d ms", timeout_ms);
+    }
+    return delivered;
+}
+
+void fw_state_notify_published(struct fw_state *fw_state, int msg_id)
+{
+    if (fw_state->delivered != NULL)
+    {
+        fw_state->acked_msg_id = msg_id;
+        for (size_t i = 0; i < FW_STATE_SLOTS; i++)
+        {
+            if (msg_id == fw_state->slots[i].published_msg_id)
+            {
+                fw_state->slots[i].published_acked = true;
+            }
+        }
+        xSemaphoreGive(fw_state->delivered);
+    }
+}
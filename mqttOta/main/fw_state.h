@@ -0,0 +1,85 @@
+/**
+ * @file fw_state.h
+ */
+
+#ifndef PRJ_FW_STATE_MODULE
+#define PRJ_FW_STATE_MODULE
+
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "mqtt_client.h"
+
+/*! Time a reported state may be replaced by a newer one before it is published */
+#define FW_STATE_COALESCE_MS CONFIG_FW_STATE_COALESCE_MS
+
+/*! Max time to wait for ThingsBoard to acknowledge the final state before a restart */
+#define FW_STATE_DELIVERY_TIMEOUT_MS CONFIG_FW_STATE_DELIVERY_TIMEOUT_MS
+
+/*! Images with a state of their own, the firmware and the data image */
+#define FW_STATE_SLOTS 2
+
+/* Saves one fw_state or sw_state message as it is sent to ThingsBoard */
+struct fw_state_msg
+{
+    char title[256];
+    char version[32];
+    char state[16];
+    char error[128];
+};
+
+/* States of one image, the firmware reports fw_state and the data image sw_state */
+struct fw_state_slot
+{
+    /*! true for the sw_* keys of the software package */
+    bool sw;
+    struct fw_state_msg pending_state;
+    struct fw_state_msg published_state;
+    bool pending_valid;
+    bool published_valid;
+    TickType_t pending_since;
+    /*! Message id of the last published state and whether the broker acknowledged it */
+    volatile int published_msg_id;
+    volatile bool published_acked;
+};
+
+/* State reports of one device, zeroed until @ref fw_state_init */
+struct fw_state
+{
+    esp_mqtt_client_handle_t client;
+    SemaphoreHandle_t lock;
+    SemaphoreHandle_t delivered;
+    /*! fw_state of the firmware and sw_state of the data image */
+    struct fw_state_slot slots[FW_STATE_SLOTS];
+    /*! Message id of the latest publish acknowledged by the broker */
+    volatile int acked_msg_id;
+};
+
+void fw_state_init(struct fw_state *fw_state, esp_mqtt_client_handle_t client);
+
+/**
+ * @brief Queue the firmware state for ThingsBoard.
+ *        A state equal to the last published one is dropped, a state replaced by a newer one
+ *        within @ref FW_STATE_COALESCE_MS is never sent. States carrying an error are sent at once.
+ */
+void fw_state_report(struct fw_state *fw_state, const char *title, const char *version, const char *state, const char *error_msg);
+
+/*! Queues the sw_state of the data image like @ref fw_state_report, it is coalesced independently of fw_state */
+void fw_state_report_sw(struct fw_state *fw_state, const char *title, const char *version, const char *state, const char *error_msg);
+
+/*! Publishes the queued state when it is older than @ref FW_STATE_COALESCE_MS, called from the OTA task loop */
+void fw_state_poll(struct fw_state *fw_state);
+
+/**
+ * @brief Publish the queued state now and wait until the broker acknowledges it.
+ *        A state already published is waited for as well if its acknowledgement is outstanding.
+ *
+ * @param timeout_ms Max time to wait for the acknowledgement, 0 doesn't wait
+ * @return true If nothing was published or the last published state was acknowledged in time
+ */
+bool fw_state_flush(struct fw_state *fw_state, uint32_t timeout_ms);
+
+/*! Called on MQTT_EVENT_PUBLISHED to complete @ref fw_state_flush */
+void fw_state_notify_published(struct fw_state *fw_state, int msg_id);
+
+#endif
@@ -0,0 +1,352 @@
+/**
+ * @file gateway.c
+ */
+
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+
+#include "mqttOta.h"
+#include "gateway.h"
+#include "rollout.h"
+
+#ifdef CONFIG_TB_GATEWAY_MODE
+
+static struct gateway_device* find_device(struct gateway *gateway, const char *name)
+{
+    for (int i = 0; i < CONFIG_TB_GATEWAY_MAX_DEVICES; i++)
+    {
+        if (gateway->devices[i].used && strcmp(gateway->devices[i].name, name) == 0)
+        {
+            return &gateway->devices[i];
+        }
+    }
+    return NULL;
+}
+
+static void publish_device(struct gateway *gateway, const char *topic, const struct gateway_device *device)
+{
+    cJSON *msg = cJSON_CreateObject();
+    cJSON_AddStringToObject(msg, "device", device->name);
+    if (device->type[0] != 0)
+    {
+        cJSON_AddStringToObject(msg, "type", device->type);
+    }
+    char *msg_string = cJSON_PrintUnformatted(msg);
+    cJSON_Delete(msg);
+    esp_mqtt_client_publish(gateway->client, topic, msg_string, 0, 1, 0);
+    // Free is intentional, it's client responsibility to free the result of cJSON_Print
+    free(msg_string);
+}
+
+/*! Registers the device or updates its registration, returns NULL if all slots are used. Must be called with the lock taken. */
+static struct gateway_device* store_device(struct gateway *gateway, const char *name, const char *type,
+                gateway_attributes_handler_t handler, void *ctx)
+{
+    struct gateway_device *device = find_device(gateway, name);
+    for (int i = 0; device == NULL && i < CONFIG_TB_GATEWAY_MAX_DEVICES; i++)
+    {
+        if (!gateway->devices[i].used)
+        {
+            device = &gateway->devices[i];
+        }
+    }
+    if (device == NULL)
+    {
+        ESP_LOGE(TAG, "Unable to add sub-device %s, %d devices registered already", name, CONFIG_TB_GATEWAY_MAX_DEVICES);
+        return NULL;
+    }
+    strcpy(device->name, name);
+    strcpy(device->type, type != NULL ? type : "");
+    device->handler = handler;
+    device->ctx = ctx;
+    device->used = true;
+    return device;
+}
+
+/**
+ * @brief Registers the sub-devices of CONFIG_TB_GATEWAY_DEVICES, "name" or "name:type" separated by commas.
+ *        They are connected on ThingsBoard by gateway_on_connected().
+ */
+static void add_configured_devices(struct gateway *gateway)
+{
+    char list[] = CONFIG_TB_GATEWAY_DEVICES;
+    char *save;
+    for (char *entry = strtok_r(list, ",", &save); entry != NULL; entry = strtok_r(NULL, ",", &save))
+    {
+        char *type = strchr(entry, ':');
+        if (type != NULL)
+        {
+            *type++ = 0;
+        }
+        if (entry[0] == 0 || strlen(entry) > GATEWAY_MAX_DEVICE_NAME
+                        || (type != NULL && strlen(type) > GATEWAY_MAX_DEVICE_NAME))
+        {
+            ESP_LOGE(TAG, "Invalid sub-device \"%s\" in the configured list", entry);
+            continue;
+        }
+        store_device(gateway, entry, type, NULL, NULL);
+    }
+}
+
+/*! Drops the oldest entry of the batch, entries without a timestamp first. Must be called with the lock taken. */
+static void drop_oldest_entry(struct gateway *gateway)
+{
+    cJSON *oldest = NULL;
+    double oldest_ts = 0;
+    for (cJSON *entries = gateway->telemetry_batch->child; entries != NULL; entries = entries->next)
+    {
+        if (entries->child == NULL)
+        {
+            continue;
+        }
+        // Entries of a device are in the order they were queued
+        cJSON *ts = cJSON_GetObjectItem(cJSON_GetArrayItem(entries, 0), "ts");
+        double entry_ts = cJSON_IsNumber(ts) ? ts->valuedouble : 0;
+        if (oldest == NULL || entry_ts < oldest_ts)
+        {
+            oldest = entries;
+            oldest_ts = entry_ts;
+        }
+    }
+    if (oldest == NULL)
+    {
+        return;
+    }
+    cJSON_DeleteItemFromArray(oldest, 0);
+    if (cJSON_GetArraySize(oldest) == 0)
+    {
+        cJSON_DeleteItemFromObject(gateway->telemetry_batch, oldest->string);
+    }
+    gateway->batch_entries--;
+}
+
+/*! Returns the time in ms since epoch, 0 while the system time is not set */
+static int64_t timestamp_ms(void)
+{
+    struct timeval now;
+    struct tm timeinfo;
+    gettimeofday(&now, NULL);
+    gmtime_r(&now.tv_sec, &timeinfo);
+    if (timeinfo.tm_year + 1900 < ROLLOUT_MIN_VALID_YEAR)
+    {
+        return 0;
+    }
+    return (int64_t) now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+void gateway_init(struct gateway *gateway, esp_mqtt_client_handle_t client)
+{
+    if (gateway->lock == NULL)
+    {
+        gateway->lock = xSemaphoreCreateMutex();
+    }
+    gateway->client = client;
+
+    xSemaphoreTake(gateway->lock, portMAX_DELAY);
+    add_configured_devices(gateway);
+    xSemaphoreGive(gateway->lock);
+}
+
+esp_err_t gateway_add_device(struct gateway *gateway, const char *name, const char *type,
+                gateway_attributes_handler_t handler, void *ctx)
+{
+    assert(gateway->lock != NULL && name != NULL);
+
+    if (strlen(name) > GATEWAY_MAX_DEVICE_NAME || (type != NULL && strlen(type) > GATEWAY_MAX_DEVICE_NAME))
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    esp_err_t err = ESP_ERR_NO_MEM;
+    xSemaphoreTake(gateway->lock, portMAX_DELAY);
+    struct gateway_device *device = store_device(gateway, name, type, handler, ctx);
+    if (device != NULL)
+    {
+        // Publishing while offline fails, the device is connected by gateway_on_connected then
+        publish_device(gateway, TB_GATEWAY_CONNECT_TOPIC, device);
+        err = ESP_OK;
+    }
+    xSemaphoreGive(gateway->lock);
+    return err;
+}
+
+esp_err_t gateway_remove_device(struct gateway *gateway, const char *name)
+{
+    assert(gateway->lock != NULL && name != NULL);
+
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+    xSemaphoreTake(gateway->lock, portMAX_DELAY);
+    struct gateway_device *device = find_device(gateway, name);
+    if (device != NULL)
+    {
+        publish_device(gateway, TB_GATEWAY_DISCONNECT_TOPIC, device);
+        device->used = false;
+        cJSON *entries = gateway->telemetry_batch != NULL ? cJSON_DetachItemFromObject(gateway->telemetry_batch, name)
+                        : NULL;
+        if (entries != NULL)
+        {
+            gateway->batch_entries -= cJSON_GetArraySize(entries);
+            cJSON_Delete(entries);
+        }
+        err = ESP_OK;
+    }
+    xSemaphoreGive(gateway->lock);
+    return err;
+}
+
+esp_err_t gateway_send_telemetry(struct gateway *gateway, const char *name, cJSON *values)
+{
+    assert(gateway->lock != NULL && name != NULL && values != NULL);
+
+    xSemaphoreTake(gateway->lock, portMAX_DELAY);
+    if (find_device(gateway, name) == NULL)
+    {
+        xSemaphoreGive(gateway->lock);
+        cJSON_Delete(values);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    if (gateway->telemetry_batch == NULL)
+    {
+        gateway->telemetry_batch = cJSON_CreateObject();
+        gateway->batch_since = xTaskGetTickCount();
+    }
+    cJSON *entries = cJSON_GetObjectItem(gateway->telemetry_batch, name);
+    if (entries == NULL)
+    {
+        entries = cJSON_CreateArray();
+        cJSON_AddItemToObject(gateway->telemetry_batch, name, entries);
+    }
+
+    int64_t ts = timestamp_ms();
+    if (ts != 0 || cJSON_GetArraySize(entries) == 0)
+    {
+        // While publishes fail the batch keeps growing, the oldest values are dropped to bound its memory
+        if (gateway->batch_entries >= CONFIG_TB_GATEWAY_MAX_BATCH_ENTRIES)
+        {
+            ESP_LOGW(TAG, "Sub-device telemetry batch full, dropping the oldest entry");
+            drop_oldest_entry(gateway);
+            if (cJSON_GetObjectItem(gateway->telemetry_batch, name) == NULL)
+            {
+                cJSON_AddItemToObject(gateway->telemetry_batch, name, entries = cJSON_CreateArray());
+            }
+        }
+        gateway->batch_entries++;
+    }
+    if (ts != 0)
+    {
+        cJSON *entry = cJSON_CreateObject();
+        cJSON_AddNumberToObject(entry, "ts", ts);
+        cJSON_AddItemToObject(entry, "values", values);
+        cJSON_AddItemToArray(entries, entry);
+    } else
+    {
+        // Without a timestamp ThingsBoard stores the batch at its arrival time, later values replace earlier ones
+        cJSON *entry = cJSON_GetArrayItem(entries, 0);
+        if (entry == NULL)
+        {
+            cJSON_AddItemToArray(entries, values);
+        } else
+        {
+            cJSON *value = values->child;
+            while (value != NULL)
+            {
+                cJSON *next = value->next;
+                cJSON_DeleteItemFromObject(entry, value->string);
+                cJSON_AddItemToObject(entry, value->string, cJSON_DetachItemViaPointer(values, value));
+                value = next;
+            }
+            cJSON_Delete(values);
+        }
+    }
+    xSemaphoreGive(gateway->lock);
+    return ESP_OK;
+}
+
+void gateway_poll(struct gateway *gateway)
+{
+    if (gateway->lock == NULL)
+    {
+        return;
+    }
+
+    xSemaphoreTake(gateway->lock, portMAX_DELAY);
+    if (gateway->telemetry_batch != NULL
+                    && (xTaskGetTickCount() - gateway->batch_since) >= pdMS_TO_TICKS(CONFIG_TB_GATEWAY_FLUSH_MS))
+    {
+        char *batch_string = cJSON_PrintUnformatted(gateway->telemetry_batch);
+        if (esp_mqtt_client_publish(gateway->client, TB_GATEWAY_TELEMETRY_TOPIC, batch_string, 0, 1, 0) >= 0)
+        {
+            cJSON_Delete(gateway->telemetry_batch);
+            gateway->telemetry_batch = NULL;
+            gateway->batch_entries = 0;
+        } else
+        {
+            // Keep the batch, it is retried on the next poll
+            ESP_LOGW(TAG, "Unable to publish the sub-device telemetry");
+        }
+        // Free is intentional, it's client responsibility to free the result of cJSON_Print
+        free(batch_string);
+    }
+    xSemaphoreGive(gateway->lock);
+}
+
+void gateway_on_connected(struct gateway *gateway)
+{
+    if (gateway->lock == NULL)
+    {
+        return;
+    }
+
+    esp_mqtt_client_subscribe(gateway->client, TB_GATEWAY_ATTRIBUTES_TOPIC, 1);
+    xSemaphoreTake(gateway->lock, portMAX_DELAY);
+    for (int i = 0; i < CONFIG_TB_GATEWAY_MAX_DEVICES; i++)
+    {
+        if (gateway->devices[i].used)
+        {
+            publish_device(gateway, TB_GATEWAY_CONNECT_TOPIC, &gateway->devices[i]);
+        }
+    }
+    xSemaphoreGive(gateway->lock);
+}
+
+void gateway_handle_attributes(struct gateway *gateway, const char *data)
+{
+    cJSON *msg = cJSON_Parse(data);
+    cJSON *name = cJSON_GetObjectItem(msg, "device");
+    cJSON *attributes = cJSON_GetObjectItem(msg, "data");
+    if (!cJSON_IsString(name) || !cJSON_IsObject(attributes))
+    {
+        ESP_LOGE(TAG, "Unexpected sub-device attributes message: %s", data);
+        cJSON_Delete(msg);
+        return;
+    }
+
+    gateway_attributes_handler_t handler = NULL;
+    void *ctx = NULL;
+    xSemaphoreTake(gateway->lock, portMAX_DELAY);
+    struct gateway_device *device = find_device(gateway, name->valuestring);
+    if (device != NULL)
+    {
+        handler = device->handler;
+        ctx = device->ctx;
+    }
+    xSemaphoreGive(gateway->lock);
+
+    // The handler is called without the lock, it may send telemetry
+    if (handler != NULL)
+    {
+        handler(name->valuestring, attributes, ctx);
+    } else if (device == NULL)
+    {
+        ESP_LOGW(TAG, "Attributes for unknown sub-device %s", name->valuestring);
+    }
+    cJSON_Delete(msg);
+}
+
+#endif
@@ -0,0 +1,98 @@
+/**
+ * @file gateway.h
+ */
+
+#ifndef PRJ_GATEWAY_MODULE
+#define PRJ_GATEWAY_MODULE
+
+#include <stdbool.h>
+#include "esp_err.h"
+#include "mqtt_client.h"
+#include "cJSON.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#define TB_GATEWAY_CONNECT_TOPIC "v1/gateway/connect"
+#define TB_GATEWAY_DISCONNECT_TOPIC "v1/gateway/disconnect"
+#define TB_GATEWAY_TELEMETRY_TOPIC "v1/gateway/telemetry"
+#define TB_GATEWAY_ATTRIBUTES_TOPIC "v1/gateway/attributes"
+
+/*! Max length of a sub-device name */
+#define GATEWAY_MAX_DEVICE_NAME 32
+
+/**
+ * @brief Called with the attributes ThingsBoard updated for a sub-device.
+ *        Runs in the MQTT task, the object is deleted after the call.
+ */
+typedef void (*gateway_attributes_handler_t)(const char *device, const cJSON *attributes, void *ctx);
+
+#ifdef CONFIG_TB_GATEWAY_MODE
+
+/* One logical device behind the gateway */
+struct gateway_device
+{
+    char name[GATEWAY_MAX_DEVICE_NAME + 1];
+    char type[GATEWAY_MAX_DEVICE_NAME + 1];
+    gateway_attributes_handler_t handler;
+    void *ctx;
+    bool used;
+};
+
+/* Sub-devices of one gateway and their telemetry batch, zeroed until @ref gateway_init */
+struct gateway
+{
+    esp_mqtt_client_handle_t client;
+    SemaphoreHandle_t lock;
+    struct gateway_device devices[CONFIG_TB_GATEWAY_MAX_DEVICES];
+
+    /*! Telemetry batch in the format of TB_GATEWAY_TELEMETRY_TOPIC, NULL when empty */
+    cJSON *telemetry_batch;
+    TickType_t batch_since;
+    /*! Number of entries in the batch, limited to CONFIG_TB_GATEWAY_MAX_BATCH_ENTRIES while publishes fail */
+    int batch_entries;
+};
+
+void gateway_init(struct gateway *gateway, esp_mqtt_client_handle_t client);
+
+/**
+ * @brief Registers a sub-device, it is connected on ThingsBoard now if the gateway is online
+ *        and again on every reconnect.
+ *
+ * @param type Device profile name on ThingsBoard, NULL for the default profile
+ * @param handler Called on shared attribute updates of the device, may be NULL
+ * @return esp_err_t ESP_ERR_NO_MEM if CONFIG_TB_GATEWAY_MAX_DEVICES are registered already
+ */
+esp_err_t gateway_add_device(struct gateway *gateway, const char *name, const char *type,
+                gateway_attributes_handler_t handler, void *ctx);
+
+/*! Disconnects a sub-device on ThingsBoard and forgets it */
+esp_err_t gateway_remove_device(struct gateway *gateway, const char *name);
+
+/**
+ * @brief Queues telemetry of a sub-device for the next batch, see @ref gateway_poll.
+ *        Takes ownership of values.
+ *
+ * @return esp_err_t ESP_ERR_NOT_FOUND if the device is not registered
+ */
+esp_err_t gateway_send_telemetry(struct gateway *gateway, const char *name, cJSON *values);
+
+/*! Publishes the queued telemetry of all sub-devices in one message every CONFIG_TB_GATEWAY_FLUSH_MS */
+void gateway_poll(struct gateway *gateway);
+
+/*! Called on MQTT_EVENT_CONNECTED, subscribes to the sub-device attributes and connects the sub-devices */
+void gateway_on_connected(struct gateway *gateway);
+
+/*! Routes a message received on @ref TB_GATEWAY_ATTRIBUTES_TOPIC to the handler of its device */
+void gateway_handle_attributes(struct gateway *gateway, const char *data);
+
+#else
+
+/* The device isn't a gateway */
+struct gateway
+{
+    char unused;
+};
+
+#endif
+
+#endif
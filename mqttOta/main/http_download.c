@@ -0,0 +1,260 @@
+/**
+ * @file http_download.c
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_http_client.h"
+#include "esp_crt_bundle.h"
+
+#include "mqttOta.h"
+#include "rollout.h"
+#include "http_download.h"
+
+#ifdef CONFIG_OTA_HTTP_DOWNLOAD
+
+/*! Time a full queue is waited on before the abort flag is checked again */
+#define HTTP_DOWNLOAD_QUEUE_WAIT_MS 100
+
+/*! Delay before the first retry of a failed range, doubled for each further retry */
+#define HTTP_DOWNLOAD_RETRY_DELAY_MS 1000
+
+#ifdef CONFIG_MQTT_TLS_CUSTOM_CA
+/*! Broker CA certificate embedded from server_certs/ca_cert.pem, the image is served by the same host */
+extern const char server_cert_pem_start[] asm("_binary_ca_cert_pem_start");
+#endif
+
+/**
+ * @brief Reads the bytes [offset + *received, offset + len) of the image into buf with one range request.
+ *        On return *received holds the bytes read so far, also on failure.
+ *
+ * @return ESP_ERR_NOT_SUPPORTED if the server doesn't answer with the requested range
+ */
+static esp_err_t fetch_range(struct http_download *download, esp_http_client_handle_t client, int offset, char *buf,
+                int len, int *received)
+{
+    char range[48];
+    snprintf(range, sizeof(range), "bytes=%d-%d", offset + *received, offset + len - 1);
+    esp_http_client_set_header(client, "Range", range);
+
+    // A connection kept alive by the previous range is reused
+    esp_err_t err = esp_http_client_open(client, 0);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+    int content_length = esp_http_client_fetch_headers(client);
+    if (content_length < 0)
+    {
+        // The connection failed before the response, the range is requested again
+        return ESP_FAIL;
+    }
+    int status = esp_http_client_get_status_code(client);
+    if (status != 206 || content_length != len - *received)
+    {
+        ESP_LOGE(TAG, "HTTP range %s answered with status %d, length %d", range, status, content_length);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    while (*received < len && !download->abort)
+    {
+        int read = esp_http_client_read(client, buf + *received, len - *received);
+        if (read <= 0)
+        {
+            return ESP_FAIL;
+        }
+        *received += read;
+    }
+    return *received == len ? ESP_OK : ESP_FAIL;
+}
+
+/**
+ * @brief Waits until the buffer of the next range leaves CONFIG_OTA_HTTP_MIN_FREE_HEAP_KB free, the ranges
+ *        ahead of the flash writes are written and freed meanwhile. With no range queued the buffer is
+ *        allocated anyway, the download then takes no more heap than with MQTT chunks.
+ *
+ * @return false If the download was stopped meanwhile
+ */
+static bool wait_for_heap(struct http_download *download, int len)
+{
+    while (!download->abort && esp_get_free_heap_size() < len + CONFIG_OTA_HTTP_MIN_FREE_HEAP_KB * 1024
+                    && uxQueueMessagesWaiting(download->queue) != 0)
+    {
+        // Woken early by http_download_stop()
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(HTTP_DOWNLOAD_QUEUE_WAIT_MS));
+    }
+    return !download->abort;
+}
+
+/*! Queues a range, false if the download was stopped meanwhile */
+static bool queue_range(struct http_download *download, struct http_range *range)
+{
+    while (!download->abort)
+    {
+        if (xQueueSend(download->queue, range, pdMS_TO_TICKS(HTTP_DOWNLOAD_QUEUE_WAIT_MS)) == pdTRUE)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void http_download_task(void *pvParameters)
+{
+    struct http_download *download = pvParameters;
+    int64_t started = esp_timer_get_time();
+    struct http_range range = { NULL, 0 };
+    int offset = 0;
+    int retries = 0;
+
+    esp_http_client_config_t config = { .url = download->url, .timeout_ms = CONFIG_OTA_HTTP_TIMEOUT_MS, .keep_alive_enable = true };
+#ifdef CONFIG_MQTT_TLS_CUSTOM_CA
+    config.cert_pem = server_cert_pem_start;
+#else
+    config.crt_bundle_attach = esp_crt_bundle_attach;
+#endif
+    esp_http_client_handle_t client = esp_http_client_init(&config);
+
+    while (client != NULL && !download->abort && offset < download->size)
+    {
+        int len = MIN(HTTP_DOWNLOAD_RANGE_SIZE, download->size - offset);
+        int received = 0;
+        if (!wait_for_heap(download, len))
+        {
+            break;
+        }
+        range.data = malloc(len);
+        if (range.data == NULL)
+        {
+            ESP_LOGE(TAG, "No memory for a %d byte HTTP range", len);
+            break;
+        }
+
+        // The ota_max_rate cap applies to the ranges as to the MQTT chunks, woken early by http_download_stop()
+        int64_t wait_us = rollout_reserve(download->rollout, len) - esp_timer_get_time();
+        if (wait_us > 0)
+        {
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(wait_us / 1000));
+        }
+
+        esp_err_t err = fetch_range(download, client, offset, range.data, len, &received);
+        while (err != ESP_OK && err != ESP_ERR_NOT_SUPPORTED && !download->abort && retries < CONFIG_OTA_HTTP_RETRIES)
+        {
+            // Resume from the first missing byte on a new connection
+            esp_http_client_close(client);
+            ESP_LOGW(TAG, "HTTP download interrupted at %d bytes (%s), resuming", offset + received, esp_err_to_name(err));
+            // Woken early by http_download_stop()
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(HTTP_DOWNLOAD_RETRY_DELAY_MS << retries));
+            retries++;
+            err = fetch_range(download, client, offset, range.data, len, &received);
+        }
+        if (err != ESP_OK)
+        {
+            free(range.data);
+            range.data = NULL;
+            break;
+        }
+
+        retries = 0;
+        range.len = len;
+        offset += len;
+        if (!queue_range(download, &range))
+        {
+            free(range.data);
+            range.data = NULL;
+            break;
+        }
+        range.data = NULL;
+    }
+
+    if (client != NULL)
+    {
+        esp_http_client_cleanup(client);
+    }
+    if (offset == download->size)
+    {
+        ESP_LOGI(TAG, "HTTP download of %d bytes took %d ms", download->size, (int) ((esp_timer_get_time() - started) / 1000));
+    } else
+    {
+        // The writer continues with MQTT chunks from offset
+        range.data = NULL;
+        range.len = 0;
+        queue_range(download, &range);
+    }
+    xSemaphoreGive(download->done);
+    vTaskDelete(NULL);
+}
+
+void http_download_init(struct http_download *download, struct rollout *rollout)
+{
+    download->rollout = rollout;
+    download->queue = xQueueCreate(CONFIG_OTA_HTTP_RANGES_IN_FLIGHT, sizeof(struct http_range));
+    download->done = xSemaphoreCreateBinary();
+}
+
+esp_err_t http_download_start(struct http_download *download, const char *url, int image_size)
+{
+    assert(url != NULL);
+
+    http_download_stop(download);
+
+    if (strlen(url) >= sizeof(download->url) || image_size <= 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    strcpy(download->url, url);
+    download->size = image_size;
+    download->abort = false;
+    xSemaphoreTake(download->done, 0);
+
+    // Kept off the application core with the OTA task
+    if (xTaskCreatePinnedToCore(&http_download_task, "http_download_task", 6144, download, tskIDLE_PRIORITY + 2,
+                    &download->task, TASK_CORE(CONFIG_OTA_TASK_CORE)) != pdPASS)
+    {
+        download->task = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+bool http_download_next(struct http_download *download, char **data, int *len)
+{
+    struct http_range range;
+
+    if (xQueueReceive(download->queue, &range, 0) != pdTRUE)
+    {
+        return false;
+    }
+    *data = range.data;
+    *len = range.len;
+    return true;
+}
+
+void http_download_stop(struct http_download *download)
+{
+    char *data;
+    int len;
+
+    if (download->task == NULL)
+    {
+        return;
+    }
+    download->abort = true;
+    xTaskNotifyGive(download->task);
+    xSemaphoreTake(download->done, portMAX_DELAY);
+    download->task = NULL;
+    while (http_download_next(download, &data, &len))
+    {
+        free(data);
+    }
+}
+
+#endif
@@ -0,0 +1,85 @@
+/**
+ * @file http_download.h
+ */
+
+#ifndef PRJ_HTTP_DOWNLOAD_MODULE
+#define PRJ_HTTP_DOWNLOAD_MODULE
+
+#include <stdbool.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "rollout.h"
+
+/*! Size of one range request, equal to the MQTT chunk size so a failed download continues with the next chunk */
+#define HTTP_DOWNLOAD_RANGE_SIZE CHUNK_SIZE
+
+/*! Max length of the image URL, the same as targetFwUrl */
+#define HTTP_DOWNLOAD_URL_MAX_LENGTH 256
+
+#ifdef CONFIG_OTA_HTTP_DOWNLOAD
+
+/* One downloaded range, data is NULL for the failure of the download */
+struct http_range
+{
+    char *data;
+    int len;
+};
+
+/* HTTP download of one device, set up by @ref http_download_init */
+struct http_download
+{
+    /*! Rate cap the ranges are requested under */
+    struct rollout *rollout;
+    char url[HTTP_DOWNLOAD_URL_MAX_LENGTH + 1];
+    int size;
+    volatile bool abort;
+    TaskHandle_t task;
+
+    /*! Downloaded ranges waiting to be written */
+    QueueHandle_t queue;
+    /*! Given when the download task is about to exit */
+    SemaphoreHandle_t done;
+};
+
+/*! Creates the range queue, the ranges are requested under the download rate cap of rollout */
+void http_download_init(struct http_download *download, struct rollout *rollout);
+
+/**
+ * @brief Starts downloading the image in a task with HTTP range requests over one keep-alive connection.
+ *        Up to CONFIG_OTA_HTTP_RANGES_IN_FLIGHT ranges are fetched ahead of the flash writes, as long as
+ *        the free heap stays above CONFIG_OTA_HTTP_MIN_FREE_HEAP_KB.
+ *        A dropped connection is resumed from the first missing byte.
+ *
+ * @param url http:// or https:// URL of the image
+ * @param image_size Size of the image in bytes
+ */
+esp_err_t http_download_start(struct http_download *download, const char *url, int image_size);
+
+/**
+ * @brief Takes the next downloaded range without blocking, in image order.
+ *
+ * @param data Set to the range the caller has to free, NULL if the download failed
+ * @return false If no range is downloaded yet
+ */
+bool http_download_next(struct http_download *download, char **data, int *len);
+
+/*! Stops the download, waits for its task to exit and frees the ranges not taken */
+void http_download_stop(struct http_download *download);
+
+#else
+
+/* Images are only downloaded with MQTT chunks */
+struct http_download
+{
+    char unused;
+};
+
+#define http_download_init(download, rollout) do { } while (0)
+#define http_download_stop(download) do { } while (0)
+
+#endif
+
+#endif
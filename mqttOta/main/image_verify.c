@@ -0,0 +1,258 @@
+/**
+ * @file image_verify.c
+ */
+
+#include <string.h>
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_system.h"
+#include "soc/soc.h"
+#include "mbedtls/md.h"
+
+#include "mqttOta.h"
+#include "image_verify.h"
+
+/*! Size of esp_image_header_t */
+#define IMAGE_HEADER_LEN 24
+/*! Offsets of the chip_id, min_chip_rev and hash_appended fields in esp_image_header_t */
+#define IMAGE_HEADER_CHIP_ID 12
+#define IMAGE_HEADER_MIN_CHIP_REV 14
+#define IMAGE_HEADER_HASH_APPENDED 23
+/*! Size of esp_image_segment_header_t */
+#define SEGMENT_HEADER_LEN 8
+/*! Initial value of the image checksum */
+#define IMAGE_CHECKSUM_INITIAL 0xEF
+/*! Flash MMU page size, a mapped segment has the same offset in its page on flash and in the address space */
+#define IMAGE_MMU_PAGE_SIZE 0x10000
+
+static uint32_t read_u32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/*! Returns true if the segment is mapped from flash by the MMU instead of loaded into RAM */
+static bool segment_is_mapped(uint32_t load_addr)
+{
+    return (load_addr >= SOC_IROM_LOW && load_addr < SOC_IROM_HIGH)
+                    || (load_addr >= SOC_DROM_LOW && load_addr < SOC_DROM_HIGH);
+}
+
+static void invalidate(struct image_verify *verify, const char *reason)
+{
+    ESP_LOGE(TAG, "Image verification failed at offset %d: %s", verify->image_len, reason);
+    verify->part = PART_INVALID;
+}
+
+/*! Size of the checksum part: zero padding to a 16 byte boundary including the checksum byte */
+static size_t checksum_part_len(const struct image_verify *verify)
+{
+    return 16 - (verify->image_len % 16);
+}
+
+static void begin_part(struct image_verify *verify, enum image_part next)
+{
+    verify->part = next;
+    verify->part_len = 0;
+    switch (next)
+    {
+    case PART_HEADER:
+        verify->part_left = IMAGE_HEADER_LEN;
+    break;
+    case PART_SEGMENT_HEADER:
+        verify->part_left = SEGMENT_HEADER_LEN;
+    break;
+    case PART_CHECKSUM:
+        verify->part_left = checksum_part_len(verify);
+    break;
+    case PART_HASH:
+        verify->part_left = IMAGE_HASH_LEN;
+    break;
+    default:
+        verify->part_left = 0;
+    break;
+    }
+}
+
+static void end_header(struct image_verify *verify)
+{
+    if (verify->part_buf[0] != IMAGE_VERIFY_MAGIC)
+    {
+        invalidate(verify, "invalid magic byte");
+        return;
+    }
+    verify->segment_count = verify->part_buf[1];
+    if (verify->segment_count == 0 || verify->segment_count > IMAGE_VERIFY_MAX_SEGMENTS)
+    {
+        invalidate(verify, "invalid segment count");
+        return;
+    }
+    // The bootloader refuses an image built for another chip or a newer chip revision
+    uint16_t chip_id = verify->part_buf[IMAGE_HEADER_CHIP_ID] | (verify->part_buf[IMAGE_HEADER_CHIP_ID + 1] << 8);
+    if (chip_id != CONFIG_IDF_FIRMWARE_CHIP_ID)
+    {
+        invalidate(verify, "image is built for another chip");
+        return;
+    }
+    esp_chip_info_t chip_info;
+    esp_chip_info(&chip_info);
+    if (verify->part_buf[IMAGE_HEADER_MIN_CHIP_REV] > chip_info.revision)
+    {
+        invalidate(verify, "image needs a newer chip revision");
+        return;
+    }
+    verify->hash_appended = verify->part_buf[IMAGE_HEADER_HASH_APPENDED] == 1;
+    verify->segments_done = 0;
+    begin_part(verify, PART_SEGMENT_HEADER);
+}
+
+static void end_segment_header(struct image_verify *verify)
+{
+    uint32_t load_addr = read_u32(verify->part_buf);
+    uint32_t data_len = read_u32(verify->part_buf + 4);
+    if (data_len % 4 != 0 || data_len >= verify->image_max_len)
+    {
+        invalidate(verify, "invalid segment length");
+        return;
+    }
+    // image_len is the offset of the segment data, the partition starts on an MMU page
+    if (segment_is_mapped(load_addr) && (verify->image_len % IMAGE_MMU_PAGE_SIZE) != (load_addr % IMAGE_MMU_PAGE_SIZE))
+    {
+        invalidate(verify, "mapped segment is not aligned to its load address");
+        return;
+    }
+    verify->part = PART_SEGMENT_DATA;
+    verify->part_left = data_len;
+    if (verify->part_left == 0)
+    {
+        verify->segments_done++;
+        begin_part(verify, verify->segments_done < verify->segment_count ? PART_SEGMENT_HEADER : PART_CHECKSUM);
+    }
+}
+
+static void end_checksum(struct image_verify *verify)
+{
+    if (verify->part_buf[verify->part_len - 1] != verify->checksum)
+    {
+        invalidate(verify, "checksum mismatch");
+        return;
+    }
+    // The image hash covers everything up to and including the checksum
+    mbedtls_md_finish(&verify->image_sha, verify->image_hash);
+    begin_part(verify, verify->hash_appended ? PART_HASH : PART_DONE);
+}
+
+static void end_hash(struct image_verify *verify)
+{
+    if (memcmp(verify->part_buf, verify->image_hash, IMAGE_HASH_LEN) != 0)
+    {
+        invalidate(verify, "appended SHA256 mismatch");
+        return;
+    }
+    begin_part(verify, PART_DONE);
+}
+
+esp_err_t image_verify_start(struct image_verify *verify, size_t max_len)
+{
+    if (verify->image_sha_started)
+    {
+        mbedtls_md_free(&verify->image_sha);
+    }
+    mbedtls_md_init(&verify->image_sha);
+    if (mbedtls_md_setup(&verify->image_sha, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0) != 0)
+    {
+        ESP_LOGW(TAG, "Unable to hash the streamed image, esp_ota_end() verifies it");
+        mbedtls_md_free(&verify->image_sha);
+        verify->image_sha_started = false;
+        return ESP_ERR_NO_MEM;
+    }
+    mbedtls_md_starts(&verify->image_sha);
+    verify->image_sha_started = true;
+
+    verify->image_len = 0;
+    verify->image_max_len = max_len;
+    verify->checksum = IMAGE_CHECKSUM_INITIAL;
+    begin_part(verify, PART_HEADER);
+    return ESP_OK;
+}
+
+esp_err_t image_verify_update(struct image_verify *verify, const uint8_t *data, size_t len)
+{
+    assert(data != NULL || len == 0);
+
+    while (len > 0 && verify->part != PART_DONE && verify->part != PART_INVALID)
+    {
+        size_t n = len < verify->part_left ? len : verify->part_left;
+
+        if (verify->part == PART_SEGMENT_DATA)
+        {
+            for (size_t i = 0; i < n; i++)
+            {
+                verify->checksum ^= data[i];
+            }
+        } else
+        {
+            // No parsed part is longer than part_buf
+            memcpy(verify->part_buf + verify->part_len, data, n);
+        }
+
+        if (verify->part != PART_HASH)
+        {
+            mbedtls_md_update(&verify->image_sha, data, n);
+            verify->image_len += n;
+        }
+        verify->part_len += n;
+        verify->part_left -= n;
+        data += n;
+        len -= n;
+
+        if (verify->part_left > 0)
+        {
+            continue;
+        }
+
+        switch (verify->part)
+        {
+        case PART_HEADER:
+            end_header(verify);
+        break;
+        case PART_SEGMENT_HEADER:
+            end_segment_header(verify);
+        break;
+        case PART_SEGMENT_DATA:
+            verify->segments_done++;
+            begin_part(verify, verify->segments_done < verify->segment_count ? PART_SEGMENT_HEADER : PART_CHECKSUM);
+        break;
+        case PART_CHECKSUM:
+            end_checksum(verify);
+        break;
+        case PART_HASH:
+            end_hash(verify);
+        break;
+        default:
+        break;
+        }
+    }
+
+    // Bytes after the image, e.g. a signature block, are not part of the verification
+    return verify->part == PART_INVALID ? ESP_ERR_OTA_VALIDATE_FAILED : ESP_OK;
+}
+
+esp_err_t image_verify_finish(struct image_verify *verify)
+{
+    if (verify->image_sha_started)
+    {
+        mbedtls_md_free(&verify->image_sha);
+        verify->image_sha_started = false;
+    }
+
+    if (verify->part != PART_DONE)
+    {
+        if (verify->part != PART_INVALID)
+        {
+            invalidate(verify, "image is truncated");
+        }
+        return ESP_ERR_OTA_VALIDATE_FAILED;
+    }
+    ESP_LOGI(TAG, "Image of %d bytes verified while streaming", verify->image_len);
+    return ESP_OK;
+}
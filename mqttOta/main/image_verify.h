@@ -0,0 +1,82 @@
+/**
+ * @file image_verify.h
+ */
+
+#ifndef PRJ_IMAGE_VERIFY_MODULE
+#define PRJ_IMAGE_VERIFY_MODULE
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "mbedtls/md.h"
+
+/*! Magic byte of an ESP app image header */
+#define IMAGE_VERIFY_MAGIC 0xE9
+
+/*! Max number of segments an app image may have */
+#define IMAGE_VERIFY_MAX_SEGMENTS 16
+
+#define IMAGE_HASH_LEN 32
+
+/* Parts of the image in the order they are streamed */
+enum image_part
+{
+    PART_HEADER,
+    PART_SEGMENT_HEADER,
+    PART_SEGMENT_DATA,
+    PART_CHECKSUM,
+    PART_HASH,
+    PART_DONE,
+    PART_INVALID
+};
+
+/* Verification of the image one device is downloading */
+struct image_verify
+{
+    enum image_part part;
+    /*! Bytes of the current part collected so far, for the parts that are parsed */
+    uint8_t part_buf[IMAGE_HASH_LEN];
+    size_t part_len;
+    /*! Bytes left in the current part */
+    size_t part_left;
+
+    size_t image_len;
+    size_t image_max_len;
+    uint8_t segment_count;
+    uint8_t segments_done;
+    bool hash_appended;
+    uint8_t checksum;
+
+    mbedtls_md_context_t image_sha;
+    bool image_sha_started;
+    uint8_t image_hash[IMAGE_HASH_LEN];
+};
+
+/**
+ * @brief Starts the verification of a new image.
+ *        The checks esp_ota_end() does on the written flash are done on the streamed bytes instead:
+ *        header magic, chip id and min chip revision, segment count and lengths, the flash offset of
+ *        MMU mapped segments against their load address, the checksum byte and the appended SHA256.
+ *        Secure boot signatures are not verified, esp_ota_set_boot_partition() still does that.
+ *
+ * @param max_len Size of the partition the image is written to
+ * @return ESP_OK if the verification started, esp_ota_end() has to verify the image otherwise
+ */
+esp_err_t image_verify_start(struct image_verify *verify, size_t max_len);
+
+/**
+ * @brief Feeds the next bytes of the image in download order.
+ *
+ * @return ESP_OK while the image looks valid, ESP_ERR_OTA_VALIDATE_FAILED as soon as it doesn't
+ */
+esp_err_t image_verify_update(struct image_verify *verify, const uint8_t *data, size_t len);
+
+/**
+ * @brief Completes the verification after the last byte was fed.
+ *
+ * @return ESP_OK if a whole valid image was received
+ */
+esp_err_t image_verify_finish(struct image_verify *verify);
+
+#endif
@@ -2,6 +2,7 @@
   * @mqttOta.c
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include <sys/param.h>
 #include "freertos/FreeRTOS.h"
@@ -9,6 +10,7 @@
 #include "esp_system.h"
 //#include "esp_event.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #include "lwip/err.h"
 #include "lwip/sockets.h"
@@ -19,6 +21,21 @@
 #include "cJSON.h"
 #include "mqttOta.h"
 #include "wifi.h"
+#include "fw_state.h"
+#include "ota_erase.h"
+#include "ota_digest.h"
+#include "image_verify.h"
+#include "rollout.h"
+#include "trace.h"
+#include "tb_proto.h"
+#include "gateway.h"
+#include "tb_request.h"
+#include "duty_cycle.h"
+#include "broker.h"
+#include "telemetry_agg.h"
+#include "http_download.h"
+#include "data_image.h"
+#include "self_test.h"
 
 #include "esp_ota_ops.h"
 #include "mqtt_client.h"
@@ -27,144 +44,238 @@
 #include "nvs_flash.h"
 
 #include "esp_ota_ops.h"
+#include "esp_flash_encrypt.h"
+#ifdef CONFIG_MQTT_USE_TLS
+#include "esp_crt_bundle.h"
+#endif
 #include "mbedtls/md.h"
 
-/* Chunk size must be a value low enough as to not cause memory shortages
- * but the larger the faster the download.  Note that CHUNK_SIZE is used
- * for the MQTT receive size and for temporarily saving the data, thus
- * the total used will be twice the chunk size.
- */
-#define CHUNK_SIZE 30000
-
-/*! Saves bit values used in application */
-static EventGroupHandle_t event_group;
-
-/* Saves OTA config received from ThingsBoard*/
-struct shared_keys
-{
-    int fw_size;
-    char fw_title[256];
-    char fw_checksum[520];
-    char fw_checksum_algorithm[32];
-    char fw_version[32];
-    char target_fw_url[32];
-} shared_attributes;
-
-/*! Buffer to save a received MQTT message */
-static char mqtt_msg[CHUNK_SIZE + 2];
-
-int chunkCounter = 0;
-int numChunks = 0;
-int totSize = 0;
-char fwTopic[32];
-char fwResponse[32];
-char cSize[10];
-char shaString[65];
-
-const char *rcvdChunk;
-int rcvdChunkSize = 0;
-
-char current_version[32];
-
-static esp_mqtt_client_handle_t mqtt_client;
-esp_ota_handle_t update_handle = 0;
-const esp_partition_t *update_partition = NULL;
-
-unsigned char shaResult[32];
-
-mbedtls_md_context_t ctx;
-mbedtls_md_type_t md_type = MBEDTLS_MD_SHA256;
-int calcInit = 0;
-
-static void publishState(char *title, char *version, char *state, char *errorMsg)
+#ifdef CONFIG_OTA_BACKGROUND_MODE
+/*! The restart into a verified image waits for the application's approval */
+#define STATE_OTA_VERIFIED STATE_OTA_WAIT_APPLY
+#else
+#define STATE_OTA_VERIFIED STATE_OTA_SET_BOOT
+#endif
+
+#ifdef CONFIG_DUTY_CYCLE_MODE
+/*! Period of the OTA task loop, short to keep the awake time of a cycle low */
+#define OTA_TASK_PERIOD_MS 100
+/*! The max awake time ends the connection waits of the OTA task as well */
+#define DUTY_CYCLE_EVENTS DUTY_CYCLE_SLEEP_EVENT
+#else
+#define OTA_TASK_PERIOD_MS 1000
+#define DUTY_CYCLE_EVENTS 0
+#endif
+
+#ifdef CONFIG_OTA_SELF_TEST
+/*! The connect timeout of the self-test ends the connection waits of the OTA task */
+#define SELF_TEST_EVENTS SELF_TEST_TIMEOUT_EVENT
+#else
+#define SELF_TEST_EVENTS 0
+#endif
+
+/*! Time the final state of an update waits for the MQTT client to reconnect before the restart */
+#define UPDATED_STATE_RECONNECT_MS (CONFIG_MQTT_RECONNECT_TIMEOUT_MS + 2 * FW_STATE_DELIVERY_TIMEOUT_MS)
+
+/*! Period of the OTA task loop while an HTTP download is written, the ranges are fetched ahead */
+#define OTA_HTTP_TASK_PERIOD_MS 10
+
+/*! Message digest used for the firmware checksum */
+static const mbedtls_md_type_t md_type = MBEDTLS_MD_SHA256;
+
+#ifdef CONFIG_MQTT_TLS_CUSTOM_CA
+/*! Broker CA certificate embedded from server_certs/ca_cert.pem */
+extern const char server_cert_pem_start[] asm("_binary_ca_cert_pem_start");
+#endif
+
+static void publishCurVer(struct ota_device *dev, char *title, char *version)
 {
-    ESP_LOGI(TAG, "Publish state: %s", state);
-    cJSON *current_fw = cJSON_CreateObject();
-    cJSON_AddStringToObject(current_fw, TB_CLIENT_ATTR_FIELD_CURRENT_FW_TITLE, title);
-    cJSON_AddStringToObject(current_fw, TB_CLIENT_ATTR_FIELD_CURRENT_FW, version);
-    cJSON_AddStringToObject(current_fw, TB_CLIENT_ATTR_FIELD_FW_STATE, state);
-    if (errorMsg != NULL)
+#ifdef CONFIG_TB_PAYLOAD_PROTOBUF
+    uint8_t payload[TB_PROTO_TELEMETRY_MAX_SIZE];
+    struct tb_proto_telemetry telemetry = {
+        .current_fw_title = title,
+        .current_fw_version = version,
+#ifdef CONFIG_OTA_DATA_IMAGE
+        .current_sw_title = dev->current_sw_title,
+        .current_sw_version = dev->current_sw_version
+#endif
+    };
+    int len = tb_proto_encode_telemetry(payload, sizeof(payload), &telemetry);
+    if (len >= 0)
     {
-        cJSON_AddStringToObject(current_fw, TB_CLIENT_ATTR_FIELD_FW_ERROR, errorMsg);
+        esp_mqtt_client_publish(dev->mqtt_client, TB_TELEMETRY_TOPIC, (const char*) payload, len, 1, 0);
     }
-    char *current_fw_attribute = cJSON_PrintUnformatted(current_fw);
-    cJSON_Delete(current_fw);
-    esp_mqtt_client_publish(mqtt_client, TB_TELEMETRY_TOPIC, current_fw_attribute, 0, 1, 0);
-    // Free is intentional, it's client responsibility to free the result of cJSON_Print
-    free(current_fw_attribute);
-
-}
-
-static void publishCurVer(char *title, char *version)
-{
+#else
     cJSON *current_fw = cJSON_CreateObject();
     cJSON_AddStringToObject(current_fw, TB_CLIENT_ATTR_FIELD_CURRENT_FW_TITLE, title);
     cJSON_AddStringToObject(current_fw, TB_CLIENT_ATTR_FIELD_CURRENT_FW, version);
+#ifdef CONFIG_OTA_DATA_IMAGE
+    cJSON_AddStringToObject(current_fw, TB_CLIENT_ATTR_FIELD_CURRENT_SW_TITLE, dev->current_sw_title);
+    cJSON_AddStringToObject(current_fw, TB_CLIENT_ATTR_FIELD_CURRENT_SW, dev->current_sw_version);
+#endif
     char *current_fw_attribute = cJSON_PrintUnformatted(current_fw);
     cJSON_Delete(current_fw);
-    esp_mqtt_client_publish(mqtt_client, TB_TELEMETRY_TOPIC, current_fw_attribute, 0, 1, 0);
+    esp_mqtt_client_publish(dev->mqtt_client, TB_TELEMETRY_TOPIC, current_fw_attribute, 0, 1, 0);
     // Free is intentional, it's client responsibility to free the result of cJSON_Print
     free(current_fw_attribute);
+#endif
     vTaskDelay(2000 / portTICK_PERIOD_MS);
 
 }
 
-static void publishFwChunkReq(void)
+static void send_chunk_request(struct ota_device *dev)
 {
     char cCounter[5];
+    char cSize[10];
+    dev->chunk_request_due = false;
     sprintf(cSize, "%d", CHUNK_SIZE);
-    sprintf(cCounter, "%d", chunkCounter);
-    ESP_LOGI(TAG, "Publish Chunk Request.  Chunk size: %d Chunk number: %s", CHUNK_SIZE, cCounter);
-    strcpy(fwTopic, TB_FW_REQUEST_TOPIC);
-    strcat(fwTopic, cCounter);
-    strcpy(fwResponse, TB_FW_RESPONSE_STRING);
-    strcat(fwResponse, cCounter);
-    esp_mqtt_client_publish(mqtt_client, fwTopic, cSize, 0, 1, 0);
+    sprintf(cCounter, "%d", dev->chunkCounter);
+    TRACE(&dev->trace, TRACE_CHUNK_REQUEST, dev->chunkCounter, CHUNK_SIZE, 0);
+    strcpy(dev->fwTopic, dev->image == OTA_IMAGE_DATA ? TB_SW_REQUEST_TOPIC : TB_FW_REQUEST_TOPIC);
+    strcat(dev->fwTopic, cCounter);
+    strcpy(dev->fwResponse, dev->image == OTA_IMAGE_DATA ? TB_SW_RESPONSE_STRING : TB_FW_RESPONSE_STRING);
+    strcat(dev->fwResponse, cCounter);
+    dev->chunk_requested_us = esp_timer_get_time();
+    esp_mqtt_client_publish(dev->mqtt_client, dev->fwTopic, cSize, 0, 1, 0);
+}
+
+/*! Sends the scheduled chunk request once its time has come, called from the OTA task loop */
+static void send_due_chunk_request(struct ota_device *dev)
+{
+    if (dev->chunk_request_due && esp_timer_get_time() >= dev->chunk_request_at_us)
+    {
+        send_chunk_request(dev);
+    }
+}
+
+/**
+ * @brief Requests the pending chunk. When the download rate cap or the CPU budget doesn't allow it yet,
+ *        the request is scheduled instead of blocking the OTA task.
+ */
+static void publishFwChunkReq(struct ota_device *dev)
+{
+    int64_t allowed_at = rollout_reserve(&dev->rollout, CHUNK_SIZE);
+    dev->chunk_request_at_us = allowed_at > dev->chunk_not_before_us ? allowed_at : dev->chunk_not_before_us;
+    dev->chunk_request_due = true;
+    send_due_chunk_request(dev);
 }
 
 static void hexToHexString(unsigned char *input, char *output, int input_len)
 {
+    static const char hex_digits[] = "0123456789abcdef";
     int loop = 0;
     int i = 0;
     while (loop < input_len)
     {
-        sprintf((char*) (output + i), "%02x", input[loop]);
+        output[i] = hex_digits[input[loop] >> 4];
+        output[i + 1] = hex_digits[input[loop] & 0x0f];
         loop += 1;
         i += 2;
     }
     output[i++] = '\0';
 }
 
-static void addChunk(void)
+#ifdef CONFIG_OTA_BACKGROUND_MODE
+/**
+ * @brief Keeps the download within CONFIG_OTA_BACKGROUND_CPU_BUDGET percent of its core by holding back
+ *        the next chunk in proportion to the time the current one took to hash and write.
+ */
+static void cpu_budget_delay(struct ota_device *dev)
 {
-    esp_err_t err;
-    int state = STATE_OTA_WRITE;
-    if (calcInit == 0)
+    int64_t now = esp_timer_get_time();
+    int64_t busy_us = now - dev->chunk_started_us;
+    dev->chunk_not_before_us = now + busy_us * (100 - CONFIG_OTA_BACKGROUND_CPU_BUDGET) / CONFIG_OTA_BACKGROUND_CPU_BUDGET;
+}
+#endif
+
+/*! Size of the image the chunks are written to */
+static int image_size(struct ota_device *dev)
+{
+    return dev->image == OTA_IMAGE_DATA ? dev->shared_attributes.sw_size : dev->shared_attributes.fw_size;
+}
+
+/*! Chunks of the image the chunks are written to, from its size rather than the last config received */
+static int image_chunks(struct ota_device *dev)
+{
+    return image_size(dev) / CHUNK_SIZE;
+}
+
+/*! Expected SHA256 of the image the chunks are written to */
+static const char* image_checksum(struct ota_device *dev)
+{
+    return dev->image == OTA_IMAGE_DATA ? dev->shared_attributes.sw_checksum : dev->shared_attributes.fw_checksum;
+}
+
+/**
+ * @brief Reports the state of the image being downloaded, sw_state for the data image.
+ *        A failed data image also fails the app image staged in the same session, it isn't booted without it.
+ */
+static void image_state_report(struct ota_device *dev, const char *state, const char *error_msg)
+{
+    if (dev->image != OTA_IMAGE_DATA)
     {
-        mbedtls_md_init(&ctx);
-        mbedtls_md_setup(&ctx, mbedtls_md_info_from_type(md_type), 0);
-        mbedtls_md_starts(&ctx);
-        calcInit = 1;
-        memset(shaString, 0, sizeof(shaString));
+        fw_state_report(&dev->fw_state, "UPDATE", dev->current_version, state, error_msg);
+        return;
     }
-    totSize += rcvdChunkSize;
-    mbedtls_md_update(&ctx, (const unsigned char*) rcvdChunk, rcvdChunkSize);
+    fw_state_report_sw(&dev->fw_state, dev->current_sw_title, dev->current_sw_version, state, error_msg);
+    if (error_msg != NULL && dev->app_staged)
+    {
+        fw_state_report(&dev->fw_state, "UPDATE", dev->current_version, state, "Data image update failed");
+    }
+}
+
+/*! State after the app image is staged, the data image of the session is downloaded before the restart */
+static int app_staged_state(struct ota_device *dev)
+{
+    dev->app_staged = true;
+    return dev->data_pending ? STATE_OTA_NEXT_IMAGE : STATE_OTA_VERIFIED;
+}
+
+/**
+ * @brief Runs the OTA states starting from the given one until STATE_EXIT.
+ *
+ * @param state STATE_OTA_WRITE for a received chunk, STATE_OTA_SET_BOOT for an image already staged
+ */
+static void run_ota_states(struct ota_device *dev, int state)
+{
+    esp_err_t err;
     while (1)
     {
+        TRACE(&dev->trace, TRACE_OTA_STATE, state, 0, 0);
         switch (state)
         {
         case STATE_OTA_WRITE:
         {
-            err = esp_ota_write(update_handle, (const void*) rcvdChunk, rcvdChunkSize);
-            if (rcvdChunk != NULL)
+            TRACE(&dev->trace, TRACE_CHUNK_WRITE_BEGIN, dev->chunkCounter, dev->rcvdChunkSize, 0);
+            if (dev->image == OTA_IMAGE_DATA)
+            {
+                err = data_image_write(&dev->data, dev->rcvdChunk, dev->rcvdChunkSize);
+            } else if (dev->pre_erase)
+            {
+                // The sectors are already erased, only program the pages
+                err = ota_erase_wait(&dev->erase, dev->totSize, OTA_ERASE_WAIT_TIMEOUT_MS);
+                if (err == ESP_OK)
+                {
+                    err = esp_ota_write_with_offset(dev->update_handle, (const void*) dev->rcvdChunk, dev->rcvdChunkSize, dev->totSize - dev->rcvdChunkSize);
+                }
+            } else
+            {
+                err = esp_ota_write(dev->update_handle, (const void*) dev->rcvdChunk, dev->rcvdChunkSize);
+            }
+            TRACE(&dev->trace, TRACE_CHUNK_WRITE_END, dev->chunkCounter, err, 0);
+            if (dev->rcvdChunk != NULL)
             {
-                free(rcvdChunk);
-                rcvdChunk = NULL;
+                free(dev->rcvdChunk);
+                dev->rcvdChunk = NULL;
             }
             if (err != ESP_OK)
             {
                 ESP_LOGE(TAG, "OTA write failed with error: %d ABORTING", err);
-                esp_ota_abort(update_handle);
+                if (dev->image == OTA_IMAGE_APP)
+                {
+                    esp_ota_abort(dev->update_handle);
+                }
+                image_state_report(dev, "FAILED", "Image write failed");
                 state = STATE_OTA_ERROR;
             } else
             {
@@ -174,10 +285,17 @@ static void addChunk(void)
         }
         case STATE_OTA_REQUEST_NEXT_CHUNK:
         {
-            if (totSize < shared_attributes.fw_size && chunkCounter < numChunks)
+            if (dev->totSize < image_size(dev) && dev->chunkCounter < image_chunks(dev))
             {
-                chunkCounter++;
-                publishFwChunkReq();
+                dev->chunkCounter++;
+#ifdef CONFIG_OTA_BACKGROUND_MODE
+                cpu_budget_delay(dev);
+#endif
+                // The ranges of an HTTP download are requested ahead by its task
+                if (!dev->http_download)
+                {
+                    publishFwChunkReq(dev);
+                }
                 state = STATE_EXIT;
             } else
             {
@@ -187,20 +305,30 @@ static void addChunk(void)
         }
         case STATE_OTA_DOWNLOADED:
         {
-            mbedtls_md_finish(&ctx, shaResult);
-            mbedtls_md_free(&ctx);
-            ESP_LOGI(TAG, "Download complete. Size received: %d", totSize);
-            publishState("UPDATE", current_version, "DOWNLOADED", NULL);
-            hexToHexString(shaResult, shaString, sizeof(shaResult));
-            chunkCounter = 0;
-            calcInit = 0;
-            totSize = 0;
-            ESP_LOGI(TAG, "SHA256: %s", shaString);
-            if (strcasecmp(shaString, shared_attributes.fw_checksum) != 0)
-            {
-                esp_ota_abort(update_handle);
+            ota_erase_stop(&dev->erase);
+            http_download_stop(&dev->download);
+            dev->http_download = false;
+#ifdef CONFIG_OTA_TRACE_DUMP_AFTER_DOWNLOAD
+            trace_dump(&dev->trace);
+#endif
+            mbedtls_md_finish(&dev->ctx, dev->shaResult);
+            mbedtls_md_free(&dev->ctx);
+            ESP_LOGI(TAG, "Download complete. Size received: %d", dev->totSize);
+            image_state_report(dev, "DOWNLOADED", NULL);
+            hexToHexString(dev->shaResult, dev->shaString, sizeof(dev->shaResult));
+            dev->downloading = false;
+            dev->chunkCounter = 0;
+            dev->calcInit = 0;
+            dev->totSize = 0;
+            ESP_LOGI(TAG, "SHA256: %s", dev->shaString);
+            if (strcasecmp(dev->shaString, image_checksum(dev)) != 0)
+            {
+                if (dev->image == OTA_IMAGE_APP)
+                {
+                    esp_ota_abort(dev->update_handle);
+                }
                 ESP_LOGE(TAG, "Checksums don't match, ABORTING.");
-                publishState("UPDATE", current_version, "FAILED", "Checksum failed.");
+                image_state_report(dev, "FAILED", "Checksum failed.");
                 state = STATE_OTA_ERROR;
             } else
             {
@@ -210,9 +338,43 @@ static void addChunk(void)
         }
         case STATE_OTA_END:
         {
-            publishState("UPDATE", current_version, "VERIFIED", NULL);
-            publishState("UPDATE", current_version, "UPDATING", NULL);
-            err = esp_ota_end(update_handle);
+            if (dev->image == OTA_IMAGE_DATA)
+            {
+                err = data_image_finish(&dev->data, dev->shared_attributes.sw_title, dev->shared_attributes.sw_version);
+                if (err != ESP_OK)
+                {
+                    ESP_LOGE(TAG, "data_image_finish failed (%s)!", esp_err_to_name(err));
+                    image_state_report(dev, "FAILED", "Data image write failed");
+                    state = STATE_OTA_ERROR;
+                } else
+                {
+                    image_state_report(dev, "VERIFIED", NULL);
+                    strcpy(dev->current_sw_title, dev->shared_attributes.sw_title);
+                    strcpy(dev->current_sw_version, dev->shared_attributes.sw_version);
+                    dev->data_staged = true;
+                    state = STATE_OTA_VERIFIED;
+                }
+                break;
+            }
+            fw_state_report(&dev->fw_state, "UPDATE", dev->current_version, "VERIFIED", NULL);
+#ifdef CONFIG_OTA_STREAMING_VERIFY
+            err = dev->streaming_verify ? image_verify_finish(&dev->verify) : ESP_OK;
+            if (dev->streaming_verify && !esp_flash_encryption_enabled())
+            {
+                // The image was verified while streaming, release the handle without the read back of esp_ota_end().
+                // esp_ota_set_boot_partition() still reads the image back to validate it, IDF has no way around that
+                esp_ota_abort(dev->update_handle);
+            } else if (err == ESP_OK)
+            {
+                // Reads the image back to verify it, or only writes the last encrypted block of a verified one
+                err = esp_ota_end(dev->update_handle);
+            } else
+            {
+                esp_ota_abort(dev->update_handle);
+            }
+#else
+            err = esp_ota_end(dev->update_handle);
+#endif
             if (err != ESP_OK)
             {
                 if (err == ESP_ERR_OTA_VALIDATE_FAILED)
@@ -220,21 +382,65 @@ static void addChunk(void)
                     ESP_LOGE(TAG, "Image validation failed, image is corrupted");
                 }
                 ESP_LOGE(TAG, "esp_ota_end failed (%s)!", esp_err_to_name(err));
-                publishState("UPDATE", current_version, "FAILED", "Image validation failed, image is corrupted");
+                fw_state_report(&dev->fw_state, "UPDATE", dev->current_version, "FAILED",
+                                "Image validation failed, image is corrupted");
                 state = STATE_OTA_ERROR;
             } else
             {
-                state = STATE_OTA_SET_BOOT;
+                // Only a validated image may be offered as staged by a later session
+                ota_digest_store(dev->update_partition, dev->shared_attributes.fw_size, dev->shaResult);
+                state = app_staged_state(dev);
+            }
+            break;
+        }
+#ifdef CONFIG_OTA_DATA_IMAGE
+        case STATE_OTA_NEXT_IMAGE:
+        {
+            // Continues the session without another attributes round trip or restart
+            dev->data_pending = false;
+            dev->image = OTA_IMAGE_DATA;
+            err = data_image_begin(&dev->data, CONFIG_OTA_DATA_PARTITION_LABEL, dev->shared_attributes.sw_size);
+            if (err != ESP_OK)
+            {
+                image_state_report(dev, "FAILED", "Data partition not usable");
+                state = STATE_OTA_ERROR;
+                break;
             }
+            ESP_LOGI(TAG, "Downloading data image version %s", dev->shared_attributes.sw_version);
+            image_state_report(dev, "DOWNLOADING", NULL);
+            snprintf(dev->download_checksum, sizeof(dev->download_checksum), "%s", image_checksum(dev));
+            dev->chunk_retries = 0;
+            dev->downloading = true;
+            publishFwChunkReq(dev);
+            state = STATE_EXIT;
+            break;
+        }
+#endif
+        case STATE_OTA_WAIT_APPLY:
+        {
+            ESP_LOGI(TAG, "Firmware update ready, waiting for the application to apply it.");
+            xEventGroupSetBits(dev->event_group, OTA_UPDATE_PENDING_EVENT);
+            state = STATE_EXIT;
             break;
         }
         case STATE_OTA_SET_BOOT:
         {
-            err = esp_ota_set_boot_partition(update_partition);
+            if (dev->app_staged)
+            {
+                fw_state_report(&dev->fw_state, "UPDATE", dev->current_version, "UPDATING", NULL);
+            }
+            if (dev->data_staged)
+            {
+                fw_state_report_sw(&dev->fw_state, dev->current_sw_title, dev->current_sw_version, "UPDATING", NULL);
+            }
+            // A session with only a data image restarts into the running app
+            err = dev->app_staged ? esp_ota_set_boot_partition(dev->update_partition) : ESP_OK;
             if (err != ESP_OK)
             {
                 ESP_LOGE(TAG, "esp_ota_set_boot_partition failed (%s)!", esp_err_to_name(err));
-                publishState("UPDATE", current_version, "FAILED", "Set Boot partition failed");
+                // Don't offer the rejected image as staged again
+                ota_digest_invalidate();
+                fw_state_report(&dev->fw_state, "UPDATE", dev->current_version, "FAILED", "Set Boot partition failed");
                 state = STATE_OTA_ERROR;
             } else
             {
@@ -244,28 +450,67 @@ static void addChunk(void)
         }
         case STATE_IMAGE_UPDATED:
         {
-            publishState("UPDATE", current_version, "UPDATING", NULL);
-            strcpy(current_version, shared_attributes.fw_version);
-            publishState(shared_attributes.fw_title, shared_attributes.fw_version,
-            TB_CLIENT_STATE_UPDATED, NULL);
+            if (dev->app_staged)
+            {
+                strcpy(dev->current_version, dev->shared_attributes.fw_version);
+                fw_state_report(&dev->fw_state, dev->shared_attributes.fw_title, dev->shared_attributes.fw_version,
+                TB_CLIENT_STATE_UPDATED, NULL);
+            }
+            if (dev->data_staged)
+            {
+                fw_state_report_sw(&dev->fw_state, dev->current_sw_title, dev->current_sw_version,
+                                TB_CLIENT_STATE_UPDATED, NULL);
+            }
+            // The final state has to reach ThingsBoard before the restart drops the connection, after a drop
+            // it waits for the reconnect of the MQTT client
+            int64_t reconnect_deadline_us = esp_timer_get_time() + UPDATED_STATE_RECONNECT_MS * 1000LL;
+            while (!fw_state_flush(&dev->fw_state, FW_STATE_DELIVERY_TIMEOUT_MS)
+                            && esp_timer_get_time() < reconnect_deadline_us)
+            {
+                vTaskDelay(OTA_TASK_PERIOD_MS / portTICK_PERIOD_MS);
+            }
             ESP_LOGI(TAG, "Firmware update success, restarting.");
-            vTaskDelay(3000 / portTICK_PERIOD_MS);
             esp_restart();
             break;
         }
         case STATE_OTA_ERROR:
         {
-            if (rcvdChunk != NULL)
+            dev->downloading = false;
+            dev->http_download = false;
+            dev->chunk_request_due = false;
+            dev->chunk_not_before_us = 0;
+            // The staged app image is only booted together with the data image of its session
+            dev->app_staged = false;
+            dev->data_staged = false;
+            dev->data_pending = false;
+            dev->image = OTA_IMAGE_APP;
+            ota_erase_stop(&dev->erase);
+            http_download_stop(&dev->download);
+            trace_dump(&dev->trace);
+            if (dev->rcvdChunk != NULL)
+            {
+                free(dev->rcvdChunk);
+                dev->rcvdChunk = NULL;
+            }
+            if (dev->calcInit)
             {
-                free(rcvdChunk);
-                rcvdChunk = NULL;
+                mbedtls_md_free(&dev->ctx);
+            }
+            dev->chunkCounter = 0;
+            dev->calcInit = 0;
+            dev->totSize = 0;
+            dev->fwResponse[0] = 0;
+            if (++dev->ota_attempts < CONFIG_OTA_MAX_ATTEMPTS)
+            {
+                ESP_LOGW(TAG, "OTA attempt %d of %d failed, retrying", dev->ota_attempts, CONFIG_OTA_MAX_ATTEMPTS);
+                rollout_schedule(&dev->rollout);
+                dev->ota_start_pending = true;
             }
             state = STATE_EXIT;
             break;
         }
         case STATE_EXIT:
         {
-        	ESP_LOGI(TAG, "Exiting add chunk.");
             return;
             break;
         }
@@ -273,101 +518,329 @@ static void addChunk(void)
     }
 }
 
-static void clearSharedAttributes(void)
+static void addChunk(struct ota_device *dev)
 {
-    shared_attributes.fw_size = 0;
-    memset(shared_attributes.fw_title, 0, sizeof(shared_attributes.fw_title));
-    memset(shared_attributes.fw_checksum, 0, sizeof(shared_attributes.fw_checksum));
-    memset(shared_attributes.fw_checksum_algorithm, 0, sizeof(shared_attributes.fw_checksum_algorithm));
-    memset(shared_attributes.fw_version, 0, sizeof(shared_attributes.fw_version));
+    dev->chunk_retries = 0;
+#ifdef CONFIG_OTA_BACKGROUND_MODE
+    dev->chunk_started_us = esp_timer_get_time();
+#endif
+    if (dev->calcInit == 0)
+    {
+        mbedtls_md_init(&dev->ctx);
+        mbedtls_md_setup(&dev->ctx, mbedtls_md_info_from_type(md_type), 0);
+        mbedtls_md_starts(&dev->ctx);
+        dev->calcInit = 1;
+        memset(dev->shaString, 0, sizeof(dev->shaString));
+    }
+    dev->totSize += dev->rcvdChunkSize;
+    mbedtls_md_update(&dev->ctx, (const unsigned char*) dev->rcvdChunk, dev->rcvdChunkSize);
+#ifdef CONFIG_OTA_STREAMING_VERIFY
+    if (dev->streaming_verify && dev->image == OTA_IMAGE_APP
+                    && image_verify_update(&dev->verify, (const uint8_t*) dev->rcvdChunk, dev->rcvdChunkSize) != ESP_OK)
+    {
+        // Don't download the rest of an image that can't be booted
+        ESP_LOGE(TAG, "Received image is invalid, ABORTING.");
+        esp_ota_abort(dev->update_handle);
+        image_verify_finish(&dev->verify);
+        mbedtls_md_free(&dev->ctx);
+        dev->chunkCounter = 0;
+        dev->calcInit = 0;
+        dev->totSize = 0;
+        fw_state_report(&dev->fw_state, "UPDATE", dev->current_version, "FAILED",
+                        "Image validation failed, image is corrupted");
+        run_ota_states(dev, STATE_OTA_ERROR);
+        return;
+    }
+#endif
+    run_ota_states(dev, STATE_OTA_WRITE);
 }
 
-static int parse_ota_config(const cJSON *object)
+static void clearSharedAttributes(struct ota_device *dev)
+{
+    dev->shared_attributes.fw_size = 0;
+    memset(dev->shared_attributes.fw_title, 0, sizeof(dev->shared_attributes.fw_title));
+    memset(dev->shared_attributes.fw_checksum, 0, sizeof(dev->shared_attributes.fw_checksum));
+    memset(dev->shared_attributes.fw_checksum_algorithm, 0, sizeof(dev->shared_attributes.fw_checksum_algorithm));
+    memset(dev->shared_attributes.fw_version, 0, sizeof(dev->shared_attributes.fw_version));
+    memset(dev->shared_attributes.target_fw_url, 0, sizeof(dev->shared_attributes.target_fw_url));
+    dev->shared_attributes.sw_size = 0;
+    memset(dev->shared_attributes.sw_checksum, 0, sizeof(dev->shared_attributes.sw_checksum));
+    memset(dev->shared_attributes.sw_title, 0, sizeof(dev->shared_attributes.sw_title));
+    memset(dev->shared_attributes.sw_version, 0, sizeof(dev->shared_attributes.sw_version));
+}
+
+/*! Clears the cached value of a shared attribute deleted on ThingsBoard */
+static void clear_shared_attribute(struct shared_keys *keys, const char *name)
+{
+    if (strcmp(name, TB_SHARED_ATTR_FIELD_FW_SIZE) == 0)
+    {
+        keys->fw_size = 0;
+    } else if (strcmp(name, TB_SHARED_ATTR_FIELD_FW_TITLE) == 0)
+    {
+        keys->fw_title[0] = 0;
+    } else if (strcmp(name, TB_SHARED_ATTR_FIELD_FW_CHECKSUM) == 0)
+    {
+        keys->fw_checksum[0] = 0;
+    } else if (strcmp(name, TB_SHARED_ATTR_FIELD_FW_CHECKSUM_ALGORITHM) == 0)
+    {
+        keys->fw_checksum_algorithm[0] = 0;
+    } else if (strcmp(name, TB_SHARED_ATTR_FIELD_FW_VER) == 0)
+    {
+        keys->fw_version[0] = 0;
+    } else if (strcmp(name, TB_SHARED_ATTR_FIELD_TARGET_FW_URL) == 0)
+    {
+        keys->target_fw_url[0] = 0;
+    } else if (strcmp(name, TB_SHARED_ATTR_FIELD_SW_SIZE) == 0)
+    {
+        keys->sw_size = 0;
+    } else if (strcmp(name, TB_SHARED_ATTR_FIELD_SW_CHECKSUM) == 0)
+    {
+        keys->sw_checksum[0] = 0;
+    } else if (strcmp(name, TB_SHARED_ATTR_FIELD_SW_TITLE) == 0)
+    {
+        keys->sw_title[0] = 0;
+    } else if (strcmp(name, TB_SHARED_ATTR_FIELD_SW_VER) == 0)
+    {
+        keys->sw_version[0] = 0;
+    }
+}
+
+/*! Returns true if the firmware or data image offered by ThingsBoard differs between the configs */
+static bool ota_target_changed(const struct shared_keys *previous, const struct shared_keys *current)
+{
+    return previous->fw_size != current->fw_size || strcmp(previous->fw_title, current->fw_title) != 0
+                    || strcmp(previous->fw_version, current->fw_version) != 0
+                    || strcasecmp(previous->fw_checksum, current->fw_checksum) != 0 || previous->sw_size != current->sw_size
+                    || strcmp(previous->sw_title, current->sw_title) != 0
+                    || strcmp(previous->sw_version, current->sw_version) != 0
+                    || strcasecmp(previous->sw_checksum, current->sw_checksum) != 0;
+}
+
+/**
+ * @brief Applies the OTA config of a shared attributes object to the cached attributes.
+ *
+ * @param merge false for an attributes response, it replaces the cache. true for an update on
+ *              TB_ATTRIBUTES_TOPIC, it only holds the changed keys and the "deleted" ones.
+ * @return int 0 if the offered firmware or data image changed, -1 otherwise
+ */
+static int parse_ota_config(struct ota_device *dev, const cJSON *object, bool merge)
 {
-    int rc = 0;
-    clearSharedAttributes();
+    struct shared_keys previous = dev->shared_attributes;
+    if (!merge)
+    {
+        clearSharedAttributes(dev);
+    }
     if (object != NULL)
     {
         cJSON *target_fw_size = cJSON_GetObjectItem(object,
         TB_SHARED_ATTR_FIELD_FW_SIZE);
         if (cJSON_IsNumber(target_fw_size))
         {
-            shared_attributes.fw_size = target_fw_size->valueint;
+            dev->shared_attributes.fw_size = target_fw_size->valueint;
 
-            numChunks = shared_attributes.fw_size / CHUNK_SIZE;
-            ESP_LOGI(TAG, "Received firmware size: %d NumChunks: %d", shared_attributes.fw_size, numChunks);
+            ESP_LOGI(TAG, "Received firmware size: %d NumChunks: %d", dev->shared_attributes.fw_size,
+                            dev->shared_attributes.fw_size / CHUNK_SIZE);
         }
 
         cJSON *target_fw_title_response = cJSON_GetObjectItem(object,
         TB_SHARED_ATTR_FIELD_FW_TITLE);
         if (cJSON_IsString(target_fw_title_response) && (target_fw_title_response->valuestring != NULL)
-                        && strlen(target_fw_title_response->valuestring) < sizeof(shared_attributes.fw_title))
+                        && strlen(target_fw_title_response->valuestring) < sizeof(dev->shared_attributes.fw_title))
         {
-            memcpy(shared_attributes.fw_title, target_fw_title_response->valuestring, strlen(target_fw_title_response->valuestring));
-            shared_attributes.fw_title[sizeof(shared_attributes.fw_title) - 1] = 0;
-            ESP_LOGI(TAG, "Received title: %s", shared_attributes.fw_title);
+            strcpy(dev->shared_attributes.fw_title, target_fw_title_response->valuestring);
+            ESP_LOGI(TAG, "Received title: %s", dev->shared_attributes.fw_title);
         }
 
         cJSON *target_fw_checksum_response = cJSON_GetObjectItem(object,
         TB_SHARED_ATTR_FIELD_FW_CHECKSUM);
         if (cJSON_IsString(target_fw_checksum_response) && (target_fw_checksum_response->valuestring != NULL)
-                        && strlen(target_fw_checksum_response->valuestring) < sizeof(shared_attributes.fw_checksum))
+                        && strlen(target_fw_checksum_response->valuestring) < sizeof(dev->shared_attributes.fw_checksum))
         {
-            memcpy(shared_attributes.fw_checksum, target_fw_checksum_response->valuestring,
-                            strlen(target_fw_checksum_response->valuestring));
-            shared_attributes.fw_checksum[sizeof(shared_attributes.fw_checksum) - 1] = 0;
-            ESP_LOGI(TAG, "Received firmware checksum: %s", shared_attributes.fw_checksum);
+            strcpy(dev->shared_attributes.fw_checksum, target_fw_checksum_response->valuestring);
+            ESP_LOGI(TAG, "Received firmware checksum: %s", dev->shared_attributes.fw_checksum);
         }
 
         cJSON *target_fw_checksum_algorithm_response = cJSON_GetObjectItem(object,
         TB_SHARED_ATTR_FIELD_FW_CHECKSUM_ALGORITHM);
         if (cJSON_IsString(target_fw_checksum_algorithm_response) && (target_fw_checksum_algorithm_response->valuestring != NULL)
-                        && strlen(target_fw_checksum_algorithm_response->valuestring) < sizeof(shared_attributes.fw_checksum_algorithm))
+                        && strlen(target_fw_checksum_algorithm_response->valuestring) < sizeof(dev->shared_attributes.fw_checksum_algorithm))
         {
-            memcpy(shared_attributes.fw_checksum_algorithm, target_fw_checksum_algorithm_response->valuestring,
-                            strlen(target_fw_checksum_algorithm_response->valuestring));
-            shared_attributes.fw_checksum_algorithm[sizeof(shared_attributes.fw_checksum_algorithm) - 1] = 0;
-            ESP_LOGI(TAG, "Received firmware checksum alogrithm: %s", shared_attributes.fw_checksum_algorithm);
+            strcpy(dev->shared_attributes.fw_checksum_algorithm, target_fw_checksum_algorithm_response->valuestring);
+            ESP_LOGI(TAG, "Received firmware checksum alogrithm: %s", dev->shared_attributes.fw_checksum_algorithm);
         }
 
         cJSON *fw_ver_response = cJSON_GetObjectItem(object,
         TB_SHARED_ATTR_FIELD_FW_VER);
         if (cJSON_IsString(fw_ver_response) && (fw_ver_response->valuestring != NULL)
-                        && strlen(fw_ver_response->valuestring) < sizeof(shared_attributes.fw_version))
+                        && strlen(fw_ver_response->valuestring) < sizeof(dev->shared_attributes.fw_version))
+        {
+            strcpy(dev->shared_attributes.fw_version, fw_ver_response->valuestring);
+            ESP_LOGI(TAG, "Received firmware version: %s", dev->shared_attributes.fw_version);
+        }
+
+        cJSON *target_fw_url_response = cJSON_GetObjectItem(object,
+        TB_SHARED_ATTR_FIELD_TARGET_FW_URL);
+        if (cJSON_IsString(target_fw_url_response) && (target_fw_url_response->valuestring != NULL)
+                        && strlen(target_fw_url_response->valuestring) < sizeof(dev->shared_attributes.target_fw_url))
+        {
+            strcpy(dev->shared_attributes.target_fw_url, target_fw_url_response->valuestring);
+            ESP_LOGI(TAG, "Received firmware URL: %s", dev->shared_attributes.target_fw_url);
+        }
+
+        cJSON *sw_size_response = cJSON_GetObjectItem(object,
+        TB_SHARED_ATTR_FIELD_SW_SIZE);
+        if (cJSON_IsNumber(sw_size_response))
+        {
+            dev->shared_attributes.sw_size = sw_size_response->valueint;
+            ESP_LOGI(TAG, "Received data image size: %d", dev->shared_attributes.sw_size);
+        }
+
+        cJSON *sw_checksum_response = cJSON_GetObjectItem(object,
+        TB_SHARED_ATTR_FIELD_SW_CHECKSUM);
+        if (cJSON_IsString(sw_checksum_response) && (sw_checksum_response->valuestring != NULL)
+                        && strlen(sw_checksum_response->valuestring) < sizeof(dev->shared_attributes.sw_checksum))
+        {
+            strcpy(dev->shared_attributes.sw_checksum, sw_checksum_response->valuestring);
+            ESP_LOGI(TAG, "Received data image checksum: %s", dev->shared_attributes.sw_checksum);
+        }
+
+        cJSON *sw_title_response = cJSON_GetObjectItem(object,
+        TB_SHARED_ATTR_FIELD_SW_TITLE);
+        if (cJSON_IsString(sw_title_response) && (sw_title_response->valuestring != NULL)
+                        && strlen(sw_title_response->valuestring) < sizeof(dev->shared_attributes.sw_title))
+        {
+            strcpy(dev->shared_attributes.sw_title, sw_title_response->valuestring);
+            ESP_LOGI(TAG, "Received data image title: %s", dev->shared_attributes.sw_title);
+        }
+
+        cJSON *sw_ver_response = cJSON_GetObjectItem(object,
+        TB_SHARED_ATTR_FIELD_SW_VER);
+        if (cJSON_IsString(sw_ver_response) && (sw_ver_response->valuestring != NULL)
+                        && strlen(sw_ver_response->valuestring) < sizeof(dev->shared_attributes.sw_version))
+        {
+            strcpy(dev->shared_attributes.sw_version, sw_ver_response->valuestring);
+            ESP_LOGI(TAG, "Received data image version: %s", dev->shared_attributes.sw_version);
+        }
+
+        cJSON *deleted = cJSON_GetObjectItem(object, "deleted");
+        for (cJSON *key = cJSON_IsArray(deleted) ? deleted->child : NULL; key != NULL; key = key->next)
         {
-            memcpy(shared_attributes.fw_version, fw_ver_response->valuestring, strlen(fw_ver_response->valuestring));
-            shared_attributes.fw_version[sizeof(shared_attributes.fw_version) - 1] = 0;
-            ESP_LOGI(TAG, "Received firmware version: %s", shared_attributes.fw_version);
+            if (cJSON_IsString(key) && key->valuestring != NULL)
+            {
+                ESP_LOGI(TAG, "Shared attribute deleted: %s", key->valuestring);
+                clear_shared_attribute(&dev->shared_attributes, key->valuestring);
+            }
         }
     }
-    if (shared_attributes.fw_size == 0)
+    return ota_target_changed(&previous, &dev->shared_attributes) ? 0 : -1;
+}
+
+/**
+ * @brief Completion of the shared attributes request, applies the OTA config of the response.
+ *        A request that timed out is sent again by the OTA task.
+ */
+static void shared_attributes_received(int id, const char *data, int data_len, void *ctx)
+{
+    struct ota_device *dev = ctx;
+
+    if (data == NULL)
+    {
+        if (id == dev->attributes_request_id)
+        {
+            dev->attributes_request_id = -1;
+        }
+        return;
+    }
+    dev->attributes_request_id = -1;
+
+#ifdef CONFIG_TB_PAYLOAD_PROTOBUF
+    // Wrapped into "shared" like the JSON response
+    cJSON *attributes = cJSON_CreateObject();
+    cJSON *decoded = tb_proto_decode_attributes_response((const uint8_t*) data, data_len);
+    if (decoded != NULL)
     {
-        rc = -1;
+        cJSON_AddItemToObject(attributes, "shared", decoded);
     }
-    return rc;
+#else
+    memcpy(dev->mqtt_msg, data, data_len);
+    dev->mqtt_msg[data_len] = 0;
+    cJSON *attributes = cJSON_Parse(dev->mqtt_msg);
+#endif
+    if (attributes != NULL)
+    {
+        cJSON *shared = cJSON_GetObjectItem(attributes, "shared");
+        rollout_parse_config(&dev->rollout, shared);
+        broker_parse_config(&dev->broker, shared);
+#ifdef CONFIG_TELEMETRY_AGGREGATION
+        telemetry_agg_parse_config(&dev->agg, shared);
+#endif
+        parse_ota_config(dev, shared, false);
+#ifdef CONFIG_DUTY_CYCLE_MODE
+        duty_cycle_save_attributes(&dev->shared_attributes);
+#endif
+    }
+
+    char *attributes_string = cJSON_Print(attributes);
+    cJSON_Delete(attributes);
+    ESP_LOGI(TAG, "Shared attributes response: %s", attributes_string);
+    // Free is intentional, it's client responsibility to free the result of cJSON_Print
+    free(attributes_string);
+
+    xEventGroupSetBits(dev->event_group, OTA_CONFIG_FETCHED_EVENT);
+}
+
+/*! Requests the shared attributes of the OTA config from ThingsBoard */
+static void request_shared_attributes(struct ota_device *dev)
+{
+#ifdef CONFIG_TB_PAYLOAD_PROTOBUF
+    uint8_t request[sizeof(TB_SHARED_ATTR_KEYS) + 8];
+    int request_len = tb_proto_encode_attributes_request(request, sizeof(request), TB_SHARED_ATTR_KEYS);
+    tb_request_attributes(&dev->requests, (const char*) request, request_len, TB_ATTRIBUTES_REQUEST_TIMEOUT_MS,
+                    shared_attributes_received, dev, &dev->attributes_request_id);
+#else
+    tb_request_attributes(&dev->requests, TB_SHARED_ATTR_KEYS_REQUEST, strlen(TB_SHARED_ATTR_KEYS_REQUEST),
+                    TB_ATTRIBUTES_REQUEST_TIMEOUT_MS, shared_attributes_received, dev, &dev->attributes_request_id);
+#endif
 }
 
 static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event)
 {
     assert(event != NULL);
+    struct ota_device *dev = event->user_context;
     char ddata[100];
     char dtopic[event->topic_len + 1];
     switch (event->event_id)
     {
     case MQTT_EVENT_CONNECTED:
-        xEventGroupClearBits(event_group, MQTT_DISCONNECTED_EVENT);
-        xEventGroupSetBits(event_group, MQTT_CONNECTED_EVENT);
+        broker_connected(&dev->broker);
+#ifdef CONFIG_DUTY_CYCLE_MODE
+        duty_cycle_save_endpoint(broker_current(&dev->broker));
+#endif
+        self_test_connected(&dev->self_test);
+        xEventGroupClearBits(dev->event_group, MQTT_DISCONNECTED_EVENT);
+        xEventGroupSetBits(dev->event_group, MQTT_CONNECTED_EVENT);
 
         ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
-        esp_mqtt_client_subscribe(mqtt_client,
+        esp_mqtt_client_subscribe(dev->mqtt_client,
         TB_ATTRIBUTES_SUBSCRIBE_TO_RESPONSE_TOPIC, 1);
-        esp_mqtt_client_subscribe(mqtt_client, TB_ATTRIBUTES_TOPIC, 1);
-        esp_mqtt_client_subscribe(mqtt_client, TB_FW_RESPONSE_TOPIC, 1);
+        esp_mqtt_client_subscribe(dev->mqtt_client, TB_ATTRIBUTES_TOPIC, 1);
+        esp_mqtt_client_subscribe(dev->mqtt_client, TB_FW_RESPONSE_TOPIC, 1);
+#ifdef CONFIG_OTA_DATA_IMAGE
+        esp_mqtt_client_subscribe(dev->mqtt_client, TB_SW_RESPONSE_TOPIC, 1);
+#endif
+#ifdef CONFIG_TB_PAYLOAD_JSON
+        esp_mqtt_client_subscribe(dev->mqtt_client, TB_RPC_SUBSCRIBE_TO_REQUEST_TOPIC, 1);
+#endif
         ESP_LOGI(TAG, "Subscribed to shared attributes updates");
+#ifdef CONFIG_TB_GATEWAY_MODE
+        gateway_on_connected(&dev->gateway);
+#endif
     break;
     case MQTT_EVENT_DISCONNECTED:
-        xEventGroupClearBits(event_group, MQTT_CONNECTED_EVENT);
-        xEventGroupSetBits(event_group, MQTT_DISCONNECTED_EVENT);
+        broker_disconnected(&dev->broker);
+        dev->disconnected_us = esp_timer_get_time();
+        xEventGroupClearBits(dev->event_group, MQTT_CONNECTED_EVENT);
+        xEventGroupSetBits(dev->event_group, MQTT_DISCONNECTED_EVENT);
         ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
     break;
     case MQTT_EVENT_SUBSCRIBED:
@@ -377,51 +850,58 @@ static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event)
         ESP_LOGI(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
     break;
     case MQTT_EVENT_PUBLISHED:
-        ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+        ESP_LOGD(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+        fw_state_notify_published(&dev->fw_state, event->msg_id);
+#ifdef CONFIG_DUTY_CYCLE_MODE
+        duty_cycle_notify_published(&dev->cycle, event->msg_id);
+#endif
     break;
     case MQTT_EVENT_DATA:
-        ESP_LOGD (TAG,"topic %s topic_len %d data_len %d total_data_len %d msg_id %d session_present %d data_offset %d\n\n\r", event->topic,
-                        event->topic_len, event->data_len, event->total_data_len, event->msg_id, event->session_present,
-                        event->current_data_offset);
+        TRACE(&dev->trace, TRACE_MQTT_DATA, event->msg_id, event->topic_len, event->data_len);
         memcpy(dtopic, event->topic, event->topic_len);
         dtopic[event->topic_len] = 0;
-        ESP_LOGD(TAG, "MQTT_EVENT_DATA, msg_id=%d, %s", event->msg_id, mqtt_msg);
-        if (event->data_len >= (sizeof(mqtt_msg) - 1))
+        if (event->data_len >= (sizeof(dev->mqtt_msg) - 1))
         {
-            ESP_LOGE(TAG, "Received MQTT message size [%d] more than expected [%d]", event->data_len, (sizeof(mqtt_msg) - 1));
+            ESP_LOGE(TAG, "Received MQTT message size [%d] more than expected [%d]", event->data_len, (sizeof(dev->mqtt_msg) - 1));
             return ESP_FAIL;
         }
 
-        if (strcmp(TB_ATTRIBUTES_RESPONSE_TOPIC, dtopic) == 0)
+        if (tb_request_handle_response(&dev->requests, dtopic, event->data, event->data_len))
         {
-            memcpy(mqtt_msg, event->data, event->data_len);
-            mqtt_msg[event->data_len] = 0;
-            cJSON *attributes = cJSON_Parse(mqtt_msg);
-            if (attributes != NULL)
-            {
-                cJSON *shared = cJSON_GetObjectItem(attributes, "shared");
-                parse_ota_config(shared);
-            }
-
-            char *attributes_string = cJSON_Print(attributes);
-            cJSON_Delete(attributes);
-            ESP_LOGI(TAG, "Shared attributes response: %s", attributes_string);
-            // Free is intentional, it's client responsibility to free the result of cJSON_Print
-            free(attributes_string);
-
-            xEventGroupSetBits(event_group, OTA_CONFIG_FETCHED_EVENT);
+            // Completed by shared_attributes_received()
+#ifdef CONFIG_TB_PAYLOAD_JSON
+        } else if (strncmp(TB_RPC_REQUEST_TOPIC_PREFIX, dtopic, strlen(TB_RPC_REQUEST_TOPIC_PREFIX)) == 0)
+        {
+            memcpy(dev->mqtt_msg, event->data, event->data_len);
+            dev->mqtt_msg[event->data_len] = 0;
+            tb_rpc_handle_request(&dev->requests, dtopic, dev->mqtt_msg);
+#endif
         } else if (strcmp(TB_ATTRIBUTES_TOPIC, dtopic) == 0)
         {
             int rc;
-            memcpy(mqtt_msg, event->data, MIN(event->data_len, sizeof(mqtt_msg)));
-            mqtt_msg[event->data_len] = 0;
-            cJSON *attributes = cJSON_Parse(mqtt_msg);
+#ifdef CONFIG_TB_PAYLOAD_PROTOBUF
+            cJSON *attributes = tb_proto_decode_attributes_update((const uint8_t*) event->data, event->data_len);
+            char *attributes_string = cJSON_Print(attributes);
+#else
+            memcpy(dev->mqtt_msg, event->data, MIN(event->data_len, sizeof(dev->mqtt_msg)));
+            dev->mqtt_msg[event->data_len] = 0;
+            cJSON *attributes = cJSON_Parse(dev->mqtt_msg);
             //cJSON *shared = cJSON_GetObjectItem(attributes, "update");
             char *attributes_string = cJSON_Print(attributes);
+#endif
 
-            if (strstr(attributes_string, "deleted") == NULL)
+            // Only a change of the offered images raises OTA_CONFIG_UPDATED_EVENT, other keys don't restart the download
+            if (attributes != NULL)
             {
-                rc = parse_ota_config(attributes);
+                rollout_parse_config(&dev->rollout, attributes);
+                broker_parse_config(&dev->broker, attributes);
+#ifdef CONFIG_TELEMETRY_AGGREGATION
+                telemetry_agg_parse_config(&dev->agg, attributes);
+#endif
+                rc = parse_ota_config(dev, attributes, true);
+#ifdef CONFIG_DUTY_CYCLE_MODE
+                duty_cycle_save_attributes(&dev->shared_attributes);
+#endif
             } else
             {
                 rc = -1;
@@ -433,20 +913,31 @@ static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event)
             free(attributes_string);
             if (rc == 0)
             {
-                xEventGroupSetBits(event_group, OTA_CONFIG_UPDATED_EVENT);
+                xEventGroupSetBits(dev->event_group, OTA_CONFIG_UPDATED_EVENT);
             }
-        } else if (strcmp(fwResponse, dtopic) == 0)
+#ifdef CONFIG_TB_GATEWAY_MODE
+        } else if (strcmp(TB_GATEWAY_ATTRIBUTES_TOPIC, dtopic) == 0)
         {
-            rcvdChunk = malloc(event->data_len);
-            rcvdChunkSize = event->data_len;
-            memcpy(rcvdChunk, event->data, event->data_len);
-            xEventGroupSetBits(event_group, MQTT_CHUNK_RECEIVED_EVENT);
+            memcpy(dev->mqtt_msg, event->data, event->data_len);
+            dev->mqtt_msg[event->data_len] = 0;
+            gateway_handle_attributes(&dev->gateway, dev->mqtt_msg);
+#endif
+        } else if (strcmp(dev->fwResponse, dtopic) == 0)
+        {
+            TRACE(&dev->trace, TRACE_CHUNK_RECEIVED, dev->chunkCounter, event->data_len, 0);
+            dev->rcvdChunk = malloc(event->data_len);
+            dev->rcvdChunkSize = event->data_len;
+            memcpy(dev->rcvdChunk, event->data, event->data_len);
+            // A duplicate or late response of the chunk is ignored
+            dev->fwResponse[0] = 0;
+            xEventGroupSetBits(dev->event_group, MQTT_CHUNK_RECEIVED_EVENT);
         }
     break;
     case MQTT_EVENT_ERROR:
         ESP_LOGI(TAG, "MQTT_EVENT_ERROR");
     break;
     case MQTT_EVENT_BEFORE_CONNECT:
+        broker_connect_started(&dev->broker);
         ESP_LOGI(TAG, "MQTT_EVENT_BEFORE_CONNECT");
     break;
     default:
@@ -455,6 +946,44 @@ static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event)
     return ESP_OK;
 }
 
+#if CONFIG_APP_JITTER_REPORT_S > 0
+/* How late the application loop woke up, kept apart for the iterations that ran during a download */
+struct loop_jitter
+{
+    int64_t max_us;
+    int64_t total_us;
+    uint32_t count;
+};
+
+/**
+ * @brief Logs the wake-up lateness of the application loop without and with an active download
+ *        and sends it as telemetry, then starts a new measurement window.
+ *
+ * @param dev Pointer to the OTA device
+ * @param jitter Jitter without [0] and with [1] an active download
+ */
+static void report_loop_jitter(struct ota_device *dev, struct loop_jitter jitter[2])
+{
+    int64_t avg_us[2];
+    for (int i = 0; i < 2; i++)
+    {
+        avg_us[i] = jitter[i].count > 0 ? jitter[i].total_us / jitter[i].count : 0;
+    }
+    ESP_LOGI(TAG, "Loop jitter: idle avg %lld us max %lld us (%u), downloading avg %lld us max %lld us (%u)",
+             avg_us[0], jitter[0].max_us, jitter[0].count, avg_us[1], jitter[1].max_us, jitter[1].count);
+
+#ifndef CONFIG_TB_PAYLOAD_PROTOBUF
+    char values[224];
+    snprintf(values, sizeof(values),
+             "{\"loop_jitter_avg_us\":%lld,\"loop_jitter_max_us\":%lld,\"loop_jitter_count\":%u,"
+             "\"loop_jitter_dl_avg_us\":%lld,\"loop_jitter_dl_max_us\":%lld,\"loop_jitter_dl_count\":%u}",
+             avg_us[0], jitter[0].max_us, jitter[0].count, avg_us[1], jitter[1].max_us, jitter[1].count);
+    esp_mqtt_client_publish(dev->mqtt_client, TB_TELEMETRY_TOPIC, values, 0, 1, 0);
+#endif
+    memset(jitter, 0, 2 * sizeof(struct loop_jitter));
+}
+#endif
+
 /**;
  * @brief Main application task, it sends counter value to ThingsBoard telemetry MQTT topic.
  *
@@ -462,23 +991,86 @@ static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event)
  */
 static void main_application_task(void *pvParameters)
 {
+    struct ota_device *dev = pvParameters;
     uint8_t counter = 0;
+#ifdef CONFIG_OTA_BACKGROUND_MODE
+    int64_t update_pending_since_us = 0;
+#endif
+#if CONFIG_APP_JITTER_REPORT_S > 0
+    struct loop_jitter jitter[2] = { 0 };
+    int64_t jitter_window_start_us = esp_timer_get_time();
+#endif
+
+#ifdef CONFIG_DUTY_CYCLE_MODE
+    // One sample per cycle, the OTA task sends it with the samples not delivered in earlier cycles
+    char values[32];
+    snprintf(values, sizeof(values), "{\"counter\":%u}", duty_cycle_count() % 4);
+    duty_cycle_add_telemetry(&dev->cycle, values);
+#endif
 
     while (1)
     {
-        xEventGroupWaitBits(event_group, OTA_TASK_IN_NORMAL_STATE_EVENT, false, true, portMAX_DELAY);
+        xEventGroupWaitBits(dev->event_group, OTA_TASK_IN_NORMAL_STATE_EVENT, false, true, portMAX_DELAY);
 
         counter = counter < 3 ? counter + 1 : 0;
 
+#if defined(CONFIG_TELEMETRY_AGGREGATION)
+        // Samples are sent as min/max/avg/count/last at the end of their window, or as they are in raw mode
+        telemetry_agg_add(&dev->agg, "counter", counter);
+        telemetry_agg_poll(&dev->agg, dev->mqtt_client);
+#elif defined(CONFIG_TB_PAYLOAD_PROTOBUF)
+        uint8_t post_data[TB_PROTO_TELEMETRY_MAX_SIZE];
+        struct tb_proto_telemetry telemetry = {
+            .has_counter = true,
+            .counter = counter
+        };
+        int post_len = tb_proto_encode_telemetry(post_data, sizeof(post_data), &telemetry);
+        //esp_mqtt_client_publish(dev->mqtt_client, TB_TELEMETRY_TOPIC, (const char*) post_data, post_len, 1, 0);
+        (void) post_len;
+#else
         cJSON *root = cJSON_CreateObject();
         cJSON_AddNumberToObject(root, "counter", counter);
         char *post_data = cJSON_PrintUnformatted(root);
-        //esp_mqtt_client_publish(mqtt_client, TB_TELEMETRY_TOPIC, post_data, 0, 1, 0);
+        //esp_mqtt_client_publish(dev->mqtt_client, TB_TELEMETRY_TOPIC, post_data, 0, 1, 0);
         cJSON_Delete(root);
         // Free is intentional, it's client responsibility to free the result of cJSON_Print
         free(post_data);
+#endif
+
+#ifdef CONFIG_OTA_BACKGROUND_MODE
+        // The safe point of the example is the end of a counter cycle, once the downloaded firmware
+        // was held back for CONFIG_APP_OTA_APPLY_HOLD_S, like an application that restarts only when idle
+        if (!ota_update_pending(dev))
+        {
+            update_pending_since_us = 0;
+        } else if (update_pending_since_us == 0)
+        {
+            update_pending_since_us = esp_timer_get_time();
+            ESP_LOGI(TAG, "Firmware downloaded, applying it at the next safe point");
+        } else if (counter == 3 && esp_timer_get_time() - update_pending_since_us >= CONFIG_APP_OTA_APPLY_HOLD_S * 1000000LL)
+        {
+            ota_apply_update(dev);
+        }
+#endif
 
+#if CONFIG_APP_JITTER_REPORT_S > 0
+        bool downloading = dev->downloading;
+        int64_t sleep_start_us = esp_timer_get_time();
         vTaskDelay(1000 / portTICK_PERIOD_MS);
+        int64_t now_us = esp_timer_get_time();
+        int64_t jitter_us = llabs(now_us - sleep_start_us - 1000 * 1000LL);
+        struct loop_jitter *window = &jitter[downloading || dev->downloading ? 1 : 0];
+        window->total_us += jitter_us;
+        window->max_us = MAX(window->max_us, jitter_us);
+        window->count++;
+        if (now_us - jitter_window_start_us >= CONFIG_APP_JITTER_REPORT_S * 1000000LL)
+        {
+            report_loop_jitter(dev, jitter);
+            jitter_window_start_us = now_us;
+        }
+#else
+        vTaskDelay(1000 / portTICK_PERIOD_MS);
+#endif
     }
 }
 
@@ -511,16 +1103,17 @@ static bool partition_is_factory(const char *running_partition_label, const char
  *        If running partition is not 'factory' ('ota_0' or 'ota_1') then MQTT broker URL from NVS is used.
  *        The application stops if running partition is not 'factory' and MQTT broker URL was not found in NVS.
  *
+ * @param dev Pointer to the OTA device, the URL is read into its buffer
  * @param running_partition_label Current running partition label
  * @return const char* MQTT broker URL
  */
-static const char* get_mqtt_url(const char *running_partition_label)
+static const char* get_mqtt_url(struct ota_device *dev, const char *running_partition_label)
 {
     nvs_handle handle;
     APP_ABORT_ON_ERROR(nvs_open(NVS_KEY_MQTT_URL, NVS_READWRITE, &handle));
 
-    static char mqtt_url[MAX_LENGTH_TB_URL + 1];
-    size_t mqtt_url_len = sizeof(mqtt_url);
+    char *mqtt_url = dev->mqtt_url;
+    size_t mqtt_url_len = sizeof(dev->mqtt_url);
 
     esp_err_t result_code = nvs_get_str(handle, NVS_KEY_MQTT_URL, mqtt_url, &mqtt_url_len);
     if (result_code == ESP_OK)
@@ -590,16 +1183,17 @@ static uint32_t get_mqtt_port(const char *running_partition_label)
  *        If running partition is not 'factory' ('ota_0' or 'ota_1') then MQTT broker access token from NVS is used.
  *        The application stops if running partition is not 'factory' and MQTT broker access token was not found in NVS.
  *
+ * @param dev Pointer to the OTA device, the access token is read into its buffer
  * @param running_partition_label Current running partition label
  * @return const char* MQTT broker access token
  */
-static const char* get_mqtt_access_token(const char *running_partition_label)
+static const char* get_mqtt_access_token(struct ota_device *dev, const char *running_partition_label)
 {
     nvs_handle handle;
     APP_ABORT_ON_ERROR(nvs_open(NVS_KEY_MQTT_ACCESS_TOKEN, NVS_READWRITE, &handle));
 
-    static char access_token[MAX_LENGTH_TB_ACCESS_TOKEN + 1];
-    size_t access_token_len = sizeof(access_token);
+    char *access_token = dev->access_token;
+    size_t access_token_len = sizeof(dev->access_token);
 
     esp_err_t result_code = nvs_get_str(handle, NVS_KEY_MQTT_ACCESS_TOKEN, access_token, &access_token_len);
     if (result_code == ESP_OK)
@@ -623,22 +1217,58 @@ static const char* get_mqtt_access_token(const char *running_partition_label)
     return access_token;
 }
 
-static void mqtt_app_start(const char *running_partition_label)
+static void mqtt_app_start(struct ota_device *dev, const char *running_partition_label)
 {
     assert(running_partition_label != NULL);
 
-    const char *mqtt_url = get_mqtt_url(running_partition_label);
-    const uint32_t mqtt_port = get_mqtt_port(running_partition_label);
-    const char *mqtt_access_token = get_mqtt_access_token(running_partition_label);
+    const char *mqtt_url;
+    uint32_t mqtt_port;
+    const char *mqtt_access_token;
+    const char *last_endpoint = NULL;
+#ifdef CONFIG_DUTY_CYCLE_MODE
+    bool cached = duty_cycle_get_connection(&dev->cycle, &mqtt_url, &mqtt_port, &mqtt_access_token);
+    if (cached)
+    {
+        last_endpoint = duty_cycle_get_endpoint(&dev->cycle);
+    }
+#else
+    bool cached = false;
+#endif
+    if (!cached)
+    {
+        mqtt_url = get_mqtt_url(dev, running_partition_label);
+        mqtt_port = get_mqtt_port(running_partition_label);
+        mqtt_access_token = get_mqtt_access_token(dev, running_partition_label);
+#ifdef CONFIG_DUTY_CYCLE_MODE
+        duty_cycle_save_connection(mqtt_url, mqtt_port, mqtt_access_token);
+#endif
+    }
+
+    broker_init(&dev->broker, mqtt_url, mqtt_port, last_endpoint);
+    mqtt_url = broker_select(&dev->broker, &mqtt_port);
 
     esp_mqtt_client_config_t mqtt_cfg =
                     { .uri = mqtt_url, .event_handle = mqtt_event_handler, .port = mqtt_port, .buffer_size = CHUNK_SIZE + 100, .username =
-                                    mqtt_access_token };
-
-    mqtt_client = esp_mqtt_client_init(&mqtt_cfg);
-    APP_ABORT_ON_ERROR(esp_mqtt_client_start(mqtt_client));
-
-    vTaskDelay(1000 / portTICK_PERIOD_MS);
+                                    mqtt_access_token, .user_context = dev };
+    mqtt_cfg.reconnect_timeout_ms = CONFIG_MQTT_RECONNECT_TIMEOUT_MS;
+#ifdef CONFIG_MQTT_TLS_CUSTOM_CA
+    mqtt_cfg.cert_pem = server_cert_pem_start;
+#elif defined(CONFIG_MQTT_USE_TLS)
+    mqtt_cfg.crt_bundle_attach = esp_crt_bundle_attach;
+#endif
+
+    dev->mqtt_client = esp_mqtt_client_init(&mqtt_cfg);
+    fw_state_init(&dev->fw_state, dev->mqtt_client);
+    tb_request_init(&dev->requests, dev->mqtt_client);
+#ifdef CONFIG_TB_GATEWAY_MODE
+    gateway_init(&dev->gateway, dev->mqtt_client);
+#endif
+    APP_ABORT_ON_ERROR(esp_mqtt_client_start(dev->mqtt_client));
+
+    if (!cached)
+    {
+        vTaskDelay(1000 / portTICK_PERIOD_MS);
+    }
 }
 
 static bool fw_versions_are_equal(const char *current_ver, const char *target_ver)
@@ -646,7 +1276,7 @@ static bool fw_versions_are_equal(const char *current_ver, const char *target_ve
     assert(current_ver != NULL && target_ver != NULL);
     if (strcasecmp(current_ver, target_ver) == 0)
     {
-        ESP_LOGI(TAG, "Skipping OTA, firmware versions are equal - current: %s, target: %s", current_version, shared_attributes.fw_version);
+        ESP_LOGI(TAG, "Skipping OTA, firmware versions are equal - current: %s, target: %s", current_ver, target_ver);
         return true;
     }
     return false;
@@ -669,36 +1299,279 @@ static bool ota_params_are_specified(struct shared_keys ota_config)
     return true;
 }
 
-static void start_ota(const char *current_ver, struct shared_keys ota_config)
+/*! Returns true if the software package offered by ThingsBoard differs from the data partition image */
+static bool data_update_needed(struct ota_device *dev)
 {
-    esp_err_t err;
-    assert(current_ver != NULL);
+#ifdef CONFIG_OTA_DATA_IMAGE
+    struct shared_keys *ota_config = &dev->shared_attributes;
+    return ota_config->sw_size > 0 && strlen(ota_config->sw_version) != 0
+                    && strcasecmp(dev->current_sw_version, ota_config->sw_version) != 0;
+#else
+    return false;
+#endif
+}
+
+/**
+ * @brief Check if the partition already holds the image offered by ThingsBoard,
+ *        e.g. when an update was interrupted after the image had been written.
+ */
+static bool image_already_staged(const esp_partition_t *partition, struct shared_keys ota_config)
+{
+    unsigned char digest[OTA_DIGEST_LEN];
+    char digest_string[OTA_DIGEST_LEN * 2 + 1];
+
+    if (strlen(ota_config.fw_checksum) != sizeof(digest_string) - 1
+                    || (strlen(ota_config.fw_checksum_algorithm) != 0 && strcasecmp(ota_config.fw_checksum_algorithm, "SHA256") != 0))
+    {
+        return false;
+    }
 
-    if (strcasecmp(current_ver, shared_attributes.fw_version) != 0)
+    if (ota_digest_get(partition, ota_config.fw_size, digest) != ESP_OK)
+    {
+        return false;
+    }
+    hexToHexString(digest, digest_string, sizeof(digest));
+    return strcasecmp(digest_string, ota_config.fw_checksum) == 0;
+}
+
+/*! Requests the first chunk, or starts the download from targetFwUrl if it is set */
+static void start_download(struct ota_device *dev)
+{
+    snprintf(dev->download_checksum, sizeof(dev->download_checksum), "%s", image_checksum(dev));
+    dev->chunk_retries = 0;
+#ifdef CONFIG_OTA_HTTP_DOWNLOAD
+    const char *url = dev->shared_attributes.target_fw_url;
+    dev->http_download = strlen(url) != 0
+                    && http_download_start(&dev->download, url, dev->shared_attributes.fw_size) == ESP_OK;
+    if (dev->http_download)
+    {
+        ESP_LOGI(TAG, "Downloading the firmware from %s", url);
+        return;
+    }
+#endif
+    publishFwChunkReq(dev);
+}
+
+#ifdef CONFIG_OTA_HTTP_DOWNLOAD
+/**
+ * @brief Writes the ranges downloaded from targetFwUrl so far. If the HTTP download failed
+ *        the firmware is downloaded with MQTT chunks from the first byte not received.
+ */
+static void http_download_step(struct ota_device *dev)
+{
+    char *data;
+    int len;
+
+    // The CPU budget of the background mode holds back the next range like the next chunk request
+    while (dev->http_download && esp_timer_get_time() >= dev->chunk_not_before_us
+                    && http_download_next(&dev->download, &data, &len))
+    {
+        if (data == NULL)
+        {
+            ESP_LOGW(TAG, "HTTP download failed at %d bytes, continuing with MQTT chunks", dev->totSize);
+            http_download_stop(&dev->download);
+            dev->http_download = false;
+            publishFwChunkReq(dev);
+            break;
+        }
+        TRACE(&dev->trace, TRACE_CHUNK_RECEIVED, dev->chunkCounter, len, 0);
+        dev->rcvdChunk = data;
+        dev->rcvdChunkSize = len;
+        addChunk(dev);
+    }
+}
+#endif
+
+/**
+ * @brief Drops the download in progress with its OTA handle, hash context and a received chunk
+ *        not yet written, chunks still arriving for it are ignored.
+ */
+static void abort_download(struct ota_device *dev)
+{
+    // Stop accepting the response first, a chunk already received is dropped with its event
+    dev->fwResponse[0] = 0;
+    xEventGroupClearBits(dev->event_group, MQTT_CHUNK_RECEIVED_EVENT);
+    if (dev->rcvdChunk != NULL)
+    {
+        free(dev->rcvdChunk);
+        dev->rcvdChunk = NULL;
+    }
+    http_download_stop(&dev->download);
+    ota_erase_stop(&dev->erase);
+    if (dev->downloading && dev->image == OTA_IMAGE_APP)
+    {
+        esp_ota_abort(dev->update_handle);
+    }
+    if (dev->calcInit)
+    {
+        mbedtls_md_free(&dev->ctx);
+    }
+    dev->downloading = false;
+    dev->http_download = false;
+    dev->chunk_request_due = false;
+    dev->chunk_not_before_us = 0;
+    dev->chunkCounter = 0;
+    dev->calcInit = 0;
+    dev->totSize = 0;
+}
+
+/**
+ * @brief Continues the download after a reconnect if ThingsBoard still offers the image being downloaded.
+ *
+ * @return false If no download is in progress or the target changed
+ */
+static bool resume_download(struct ota_device *dev)
+{
+    if (!dev->downloading || strcasecmp(image_checksum(dev), dev->download_checksum) != 0)
+    {
+        return false;
+    }
+    ESP_LOGI(TAG, "Resuming the download at %d bytes, %d ms after the disconnect", dev->totSize,
+                    (int) ((esp_timer_get_time() - dev->disconnected_us) / 1000));
+    dev->chunk_retries = 0;
+    // The response to the request sent before the disconnect may be lost, a chunk already received is written first
+    if (!dev->http_download && (xEventGroupGetBits(dev->event_group) & MQTT_CHUNK_RECEIVED_EVENT) == 0)
+    {
+        publishFwChunkReq(dev);
+    }
+    return true;
+}
+
+/**
+ * @brief Requests the pending chunk again if its response didn't arrive within CONFIG_OTA_CHUNK_TIMEOUT_MS,
+ *        the download fails after CONFIG_OTA_CHUNK_RETRIES requests more without response.
+ *        A request sent before an MQTT reconnect is repeated at once, the APP_LOOP state stays in place over it.
+ */
+static void check_chunk_timeout(struct ota_device *dev)
+{
+    if (!dev->downloading || dev->http_download || dev->chunk_request_due || dev->fwResponse[0] == 0
+                    || (xEventGroupGetBits(dev->event_group) & MQTT_CONNECTED_EVENT) == 0)
     {
-        ESP_LOGW(TAG, "Starting OTA, firmware versions are different - current: %s, target: %s", current_ver, ota_config.fw_version);
-        update_partition = esp_ota_get_next_update_partition(NULL);
-        ESP_LOGI(TAG, "Writing to partition subtype %d at offset 0x%x", update_partition->subtype, update_partition->address);
-        err = esp_ota_begin(update_partition, OTA_WITH_SEQUENTIAL_WRITES, &update_handle);
+        return;
+    }
+    if (dev->disconnected_us > dev->chunk_requested_us)
+    {
+        // The response was lost with the connection, that isn't a timeout of the chunk
+        ESP_LOGI(TAG, "Requesting chunk %d again after the reconnect", dev->chunkCounter);
+        publishFwChunkReq(dev);
+        return;
+    }
+    if (esp_timer_get_time() - dev->chunk_requested_us < (int64_t) CONFIG_OTA_CHUNK_TIMEOUT_MS * 1000)
+    {
+        return;
+    }
+    if (dev->chunk_retries >= CONFIG_OTA_CHUNK_RETRIES)
+    {
+        ESP_LOGE(TAG, "No response for chunk %d, ABORTING", dev->chunkCounter);
+        if (dev->image == OTA_IMAGE_APP)
+        {
+            esp_ota_abort(dev->update_handle);
+        }
+        image_state_report(dev, "FAILED", "Chunk request timed out");
+        run_ota_states(dev, STATE_OTA_ERROR);
+        return;
+    }
+    dev->chunk_retries++;
+    ESP_LOGW(TAG, "No response for chunk %d, requesting it again", dev->chunkCounter);
+    TRACE(&dev->trace, TRACE_CHUNK_RETRY, dev->chunkCounter, dev->chunk_retries, 0);
+    publishFwChunkReq(dev);
+}
+
+static void start_ota(struct ota_device *dev)
+{
+    esp_err_t err;
+    assert(dev != NULL);
+    const char *current_ver = dev->current_version;
+    struct shared_keys *ota_config = &dev->shared_attributes;
+
+    ota_erase_stop(&dev->erase);
+    http_download_stop(&dev->download);
+    dev->http_download = false;
+    dev->image = OTA_IMAGE_APP;
+    dev->app_staged = false;
+    dev->data_staged = false;
+    dev->data_pending = data_update_needed(dev);
+
+    if (ota_params_are_specified(*ota_config) && strcasecmp(current_ver, ota_config->fw_version) != 0)
+    {
+        ESP_LOGW(TAG, "Starting OTA, firmware versions are different - current: %s, target: %s", current_ver, ota_config->fw_version);
+        xEventGroupClearBits(dev->event_group, OTA_UPDATE_PENDING_EVENT | OTA_APPLY_REQUESTED_EVENT);
+        dev->update_partition = esp_ota_get_next_update_partition(NULL);
+        if (image_already_staged(dev->update_partition, *ota_config))
+        {
+            ESP_LOGI(TAG, "Partition %s already holds the target image, skipping download", dev->update_partition->label);
+            fw_state_report(&dev->fw_state, "UPDATE", dev->current_version, "VERIFIED", NULL);
+            run_ota_states(dev, app_staged_state(dev));
+            return;
+        }
+
+        // The partition is about to be erased, its cached digest becomes stale
+        ota_digest_invalidate();
+        ESP_LOGI(TAG, "Writing to partition subtype %d at offset 0x%x", dev->update_partition->subtype, dev->update_partition->address);
+        err = esp_ota_begin(dev->update_partition, OTA_WITH_SEQUENTIAL_WRITES, &dev->update_handle);
         if (err != ESP_OK)
         {
             ESP_LOGE(TAG, "esp_ota_begin failed (%s)", esp_err_to_name(err));
-            esp_ota_abort(update_handle);
+            esp_ota_abort(dev->update_handle);
             //  task_fatal_error();
         }
         else
         {
-            publishState("UPDATE", current_version, "DOWNLOADING", NULL);
+#ifdef CONFIG_OTA_PRE_ERASE
+            // esp_ota_write_with_offset() needs 16 byte aligned writes on encrypted flash, the last chunk may be shorter
+            dev->pre_erase = !esp_flash_encryption_enabled()
+                            && ota_erase_start(&dev->erase, dev->update_partition, ota_config->fw_size) == ESP_OK;
+#endif
+#ifdef CONFIG_OTA_STREAMING_VERIFY
+            dev->streaming_verify = image_verify_start(&dev->verify, dev->update_partition->size) == ESP_OK;
+#endif
+            fw_state_report(&dev->fw_state, "UPDATE", dev->current_version, "DOWNLOADING", NULL);
             vTaskDelay(2000 / portTICK_PERIOD_MS);
-            publishFwChunkReq();
+            dev->downloading = true;
+            start_download(dev);
         }
     }
+    else if (dev->data_pending)
+    {
+        ESP_LOGW(TAG, "Starting OTA of the data image - current: %s, target: %s", dev->current_sw_version, ota_config->sw_version);
+        xEventGroupClearBits(dev->event_group, OTA_UPDATE_PENDING_EVENT | OTA_APPLY_REQUESTED_EVENT);
+        run_ota_states(dev, STATE_OTA_NEXT_IMAGE);
+    }
     else
     {
-        ESP_LOGW(TAG, "Starting OTA, Update not required, firmware versions are same - current: %s, target: %s", current_ver, ota_config.fw_version);
+        ESP_LOGW(TAG, "Starting OTA, Update not required, firmware versions are same - current: %s, target: %s", current_ver, ota_config->fw_version);
     }
 }
 
+/**
+ * @brief Delays the start of the offered firmware download by a random time,
+ *        so a device group doesn't request chunks all at once.
+ */
+static void schedule_ota(struct ota_device *dev)
+{
+    bool app_update = ota_params_are_specified(dev->shared_attributes)
+                    && !fw_versions_are_equal(dev->current_version, dev->shared_attributes.fw_version);
+    // A rejected version offered again after another target is a new attempt. The attributes of the
+    // last duty cycle were checked when they were received, a timer wake doesn't open NVS for them.
+    if (ota_params_are_specified(dev->shared_attributes) && !dev->attributes_cached)
+    {
+        self_test_target_offered(dev->shared_attributes.fw_version);
+    }
+    if (app_update && self_test_rejected(dev->shared_attributes.fw_version))
+    {
+        ESP_LOGW(TAG, "Skipping OTA, firmware %s was rolled back by its self-test", dev->shared_attributes.fw_version);
+        app_update = false;
+    }
+    if (!app_update && !data_update_needed(dev))
+    {
+        dev->ota_start_pending = false;
+        return;
+    }
+    dev->ota_attempts = 0;
+    rollout_schedule(&dev->rollout);
+    dev->ota_start_pending = true;
+}
+
 static enum state connection_state(BaseType_t actual_event, const char *current_state_name)
 {
     assert(current_state_name != NULL);
@@ -718,6 +1591,86 @@ static enum state connection_state(BaseType_t actual_event, const char *current_
     return STATE_CONNECTION_IS_OK;
 }
 
+#ifdef CONFIG_DUTY_CYCLE_MODE
+/*! Returns true while a firmware is downloaded, waits to be applied or the running one waits for its self-test */
+static bool device_busy(void *ctx)
+{
+    struct ota_device *dev = ctx;
+    return dev->downloading || ota_update_pending(dev) || self_test_pending(&dev->self_test);
+}
+
+/**
+ * @brief Sends the queued telemetry and goes to deep sleep once it is delivered and no update is in progress.
+ *        An update scheduled to start later keeps the device awake at most CONFIG_DUTY_CYCLE_MAX_AWAKE_S.
+ */
+static void duty_cycle_step(struct ota_device *dev)
+{
+    duty_cycle_flush_telemetry(&dev->cycle, dev->mqtt_client);
+    if (!duty_cycle_telemetry_delivered(&dev->cycle) || device_busy(dev) || dev->ota_start_pending)
+    {
+        return;
+    }
+    fw_state_flush(&dev->fw_state, FW_STATE_DELIVERY_TIMEOUT_MS);
+    duty_cycle_sleep();
+}
+
+/*! Called in the esp_timer task at the max awake time, the OTA task goes to sleep */
+static void awake_time_reached(void *ctx)
+{
+    struct ota_device *dev = ctx;
+    xEventGroupSetBits(dev->event_group, DUTY_CYCLE_SLEEP_EVENT);
+}
+
+/**
+ * @brief Goes to deep sleep if the max awake time was reached, unless an update is in progress.
+ *        Checked on every iteration of the OTA task, also while it waits for Wi-Fi or MQTT.
+ */
+static void check_awake_time(struct ota_device *dev)
+{
+    if ((xEventGroupClearBits(dev->event_group, DUTY_CYCLE_SLEEP_EVENT) & DUTY_CYCLE_SLEEP_EVENT) == 0)
+    {
+        return;
+    }
+    if (device_busy(dev))
+    {
+        ESP_LOGW(TAG, "Max awake time reached, staying awake until the update is done");
+        return;
+    }
+    ESP_LOGW(TAG, "Max awake time reached, going back to sleep");
+    duty_cycle_sleep();
+}
+#endif
+
+#ifdef CONFIG_OTA_SELF_TEST
+/*! Called in the esp_timer task when a new image didn't connect in time, the OTA task rolls it back */
+static void self_test_timed_out(void *ctx)
+{
+    struct ota_device *dev = ctx;
+    xEventGroupSetBits(dev->event_group, SELF_TEST_TIMEOUT_EVENT);
+}
+
+/*! Rolls back the new image after the connect timeout of the self-test, checked on every iteration of the OTA task */
+static void check_self_test_timeout(struct ota_device *dev)
+{
+    if (xEventGroupClearBits(dev->event_group, SELF_TEST_TIMEOUT_EVENT) & SELF_TEST_TIMEOUT_EVENT)
+    {
+        self_test_connect_timeout(&dev->self_test);
+    }
+}
+#endif
+
+/*! Time until the next iteration of the OTA task loop, a scheduled chunk request shortens it */
+static uint32_t ota_task_period_ms(struct ota_device *dev)
+{
+    int64_t period_ms = dev->http_download ? OTA_HTTP_TASK_PERIOD_MS : OTA_TASK_PERIOD_MS;
+    if (dev->chunk_request_due)
+    {
+        int64_t due_ms = (dev->chunk_request_at_us - esp_timer_get_time() + 999) / 1000;
+        period_ms = due_ms < period_ms ? due_ms : period_ms;
+    }
+    return period_ms > 0 ? period_ms : 0;
+}
+
 /**
  * @brief OTA task, it handles the shared attributes updates and starts OTA if the config received from ThingsBoard is valid.
  *
@@ -725,8 +1678,10 @@ static enum state connection_state(BaseType_t actual_event, const char *current_
  */
 static void ota_task(void *pvParameters)
 {
+    struct ota_device *dev = pvParameters;
     enum state current_connection_state = STATE_CONNECTION_IS_OK;
     enum state state = STATE_INITIAL;
+    enum state traced_state = STATE_CONNECTION_IS_OK;
     BaseType_t ota_events;
     BaseType_t actual_event = 0x00;
     char running_partition_label[sizeof(((esp_partition_t*) 0)->label)];
@@ -737,13 +1692,31 @@ static void ota_task(void *pvParameters)
         {
             if (state != STATE_APP_LOOP)
             {
-                xEventGroupClearBits(event_group,
+                xEventGroupClearBits(dev->event_group,
                 OTA_TASK_IN_NORMAL_STATE_EVENT);
             }
 
-            actual_event = xEventGroupWaitBits(event_group,
-            WIFI_CONNECTED_EVENT | WIFI_DISCONNECTED_EVENT | MQTT_CONNECTED_EVENT | MQTT_DISCONNECTED_EVENT | OTA_CONFIG_FETCHED_EVENT,
-                            false, false, portMAX_DELAY);
+            actual_event = xEventGroupWaitBits(dev->event_group,
+            WIFI_CONNECTED_EVENT | WIFI_DISCONNECTED_EVENT | MQTT_CONNECTED_EVENT | MQTT_DISCONNECTED_EVENT | OTA_CONFIG_FETCHED_EVENT
+                            | DUTY_CYCLE_EVENTS | SELF_TEST_EVENTS, false, false, portMAX_DELAY);
+        }
+#ifdef CONFIG_DUTY_CYCLE_MODE
+        check_awake_time(dev);
+#endif
+#ifdef CONFIG_OTA_SELF_TEST
+        check_self_test_timeout(dev);
+#endif
+        actual_event &= ~(DUTY_CYCLE_EVENTS | SELF_TEST_EVENTS);
+        if (actual_event == 0 && state != STATE_INITIAL && state != STATE_APP_LOOP)
+        {
+            // Woken up by the max awake time while an update keeps the device awake, or by a self-test timeout
+            // that came after the connect
+            continue;
+        }
+        if (state != traced_state)
+        {
+            TRACE(&dev->trace, TRACE_TASK_STATE, state, 0, 0);
+            traced_state = state;
         }
         switch (state)
         {
@@ -765,7 +1738,14 @@ static void ota_task(void *pvParameters)
             strncpy(running_partition_label, running_partition->label, sizeof(running_partition_label));
             ESP_LOGI(TAG, "Running partition: %s", running_partition_label);
 
-            initialise_wifi(running_partition_label);
+#ifdef CONFIG_OTA_DATA_IMAGE
+            data_image_get_version(dev->current_sw_title, sizeof(dev->current_sw_title), dev->current_sw_version,
+                            sizeof(dev->current_sw_version));
+            ESP_LOGI(TAG, "Data image: %s %s", dev->current_sw_title, dev->current_sw_version);
+#endif
+            initialise_wifi(dev, running_partition_label);
+            rollout_init(&dev->rollout);
+            self_test_init(&dev->self_test, &dev->fw_state, &dev->requests, self_test_timed_out, dev);
             state = STATE_WAIT_WIFI;
             break;
         }
@@ -780,7 +1760,11 @@ static void ota_task(void *pvParameters)
 
             if (actual_event & WIFI_CONNECTED_EVENT)
             {
-                mqtt_app_start(running_partition_label);
+                // After a Wi-Fi drop the MQTT client reconnects by itself
+                if (dev->mqtt_client == NULL)
+                {
+                    mqtt_app_start(dev, running_partition_label);
+                }
                 state = STATE_WAIT_MQTT;
                 break;
             }
@@ -802,11 +1786,20 @@ static void ota_task(void *pvParameters)
             {
                 ESP_LOGI(TAG, "Connected to MQTT broker %s, on port %d", CONFIG_MQTT_BROKER_URL, CONFIG_MQTT_BROKER_PORT);
 
+#ifdef CONFIG_DUTY_CYCLE_MODE
+                // The version was reported and the config fetched in an earlier cycle
+                if (duty_cycle_get_attributes(&dev->cycle, &dev->shared_attributes))
+                {
+                    ESP_LOGI(TAG, "Using the shared attributes of the last cycle");
+                    dev->attributes_cached = true;
+                    xEventGroupSetBits(dev->event_group, OTA_CONFIG_FETCHED_EVENT);
+                    state = STATE_WAIT_OTA_CONFIG_FETCHED;
+                    break;
+                }
+#endif
                 // Send the current firmware version to ThingsBoard
-                publishCurVer("UPDATE", current_version);
-                esp_mqtt_client_publish(mqtt_client,
-                TB_ATTRIBUTES_REQUEST_TOPIC,
-                TB_SHARED_ATTR_KEYS_REQUEST, 0, 1, 0);
+                publishCurVer(dev, "UPDATE", dev->current_version);
+                request_shared_attributes(dev);
                 ESP_LOGI(TAG, "Waiting for shared attributes response");
 
                 state = STATE_WAIT_OTA_CONFIG_FETCHED;
@@ -819,9 +1812,6 @@ static void ota_task(void *pvParameters)
         }
         case STATE_WAIT_OTA_CONFIG_FETCHED:
         {
-            char cSize[10];
-            sprintf(cSize, "%d", CHUNK_SIZE);
-
             current_connection_state = connection_state(actual_event, "WAIT_OTA_CONFIG_FETCHED");
             if (current_connection_state != STATE_CONNECTION_IS_OK)
             {
@@ -834,10 +1824,15 @@ static void ota_task(void *pvParameters)
                 if (actual_event & OTA_CONFIG_FETCHED_EVENT)
                 {
                     ESP_LOGI(TAG, "Shared attributes were fetched from ThingsBoard");
-                    xEventGroupClearBits(event_group, OTA_CONFIG_FETCHED_EVENT);
+                    xEventGroupClearBits(dev->event_group, OTA_CONFIG_FETCHED_EVENT);
                     state = STATE_OTA_CONFIG_FETCHED;
                     break;
                 }
+                if (dev->attributes_request_id < 0)
+                {
+                    ESP_LOGW(TAG, "No shared attributes response, requesting them again");
+                    request_shared_attributes(dev);
+                }
                 state = STATE_WAIT_OTA_CONFIG_FETCHED;
                 break;
             }
@@ -857,8 +1852,14 @@ static void ota_task(void *pvParameters)
 
             if (actual_event & (WIFI_CONNECTED_EVENT | MQTT_CONNECTED_EVENT))
             {
-
-                start_ota(current_version, shared_attributes);
+                if (!resume_download(dev))
+                {
+                    if (dev->downloading)
+                    {
+                        abort_download(dev);
+                    }
+                    schedule_ota(dev);
+                }
                 state = STATE_APP_LOOP;
                 break;
             }
@@ -877,28 +1878,44 @@ static void ota_task(void *pvParameters)
 
             if (actual_event & (WIFI_CONNECTED_EVENT | MQTT_CONNECTED_EVENT))
             {
-                ota_events = xEventGroupWaitBits(event_group,
-                OTA_CONFIG_UPDATED_EVENT, false, true, 0);
+                ota_events = xEventGroupWaitBits(dev->event_group,
+                OTA_CONFIG_UPDATED_EVENT, true, true, 0);
                 if ((ota_events & OTA_CONFIG_UPDATED_EVENT))
                 {
-                    chunkCounter = 0;
-                    calcInit = 0;
-                    start_ota(current_version, shared_attributes);
-                    publishState("UPDATE", current_version, "DOWNLOADING",
-                    NULL);
-                    vTaskDelay(2000 / portTICK_PERIOD_MS);
-                    publishFwChunkReq();
+                    dev->attributes_cached = false;
+                    abort_download(dev);
+                    schedule_ota(dev);
                 }
-                ota_events = xEventGroupWaitBits(event_group,
+                if (dev->ota_start_pending && rollout_may_start(&dev->rollout) && !self_test_pending(&dev->self_test))
+                {
+                    dev->ota_start_pending = false;
+                    start_ota(dev);
+                }
+                ota_events = xEventGroupWaitBits(dev->event_group,
+                OTA_APPLY_REQUESTED_EVENT, true, true, 0);
+                if ((ota_events & OTA_APPLY_REQUESTED_EVENT))
+                {
+                    xEventGroupClearBits(dev->event_group, OTA_UPDATE_PENDING_EVENT);
+                    run_ota_states(dev, STATE_OTA_SET_BOOT);
+                }
+                ota_events = xEventGroupWaitBits(dev->event_group,
                 MQTT_CHUNK_RECEIVED_EVENT, false, true, 0);
                 if ((ota_events & MQTT_CHUNK_RECEIVED_EVENT))
                 {
-                    xEventGroupClearBits(event_group,
+                    xEventGroupClearBits(dev->event_group,
                     MQTT_CHUNK_RECEIVED_EVENT);
-                    addChunk();
+                    addChunk(dev);
                 }
-                xEventGroupClearBits(event_group, OTA_CONFIG_UPDATED_EVENT);
-                xEventGroupSetBits(event_group, OTA_TASK_IN_NORMAL_STATE_EVENT);
+#ifdef CONFIG_OTA_HTTP_DOWNLOAD
+                http_download_step(dev);
+#endif
+                send_due_chunk_request(dev);
+                check_chunk_timeout(dev);
+                self_test_poll(&dev->self_test);
+                xEventGroupSetBits(dev->event_group, OTA_TASK_IN_NORMAL_STATE_EVENT);
+#ifdef CONFIG_DUTY_CYCLE_MODE
+                duty_cycle_step(dev);
+#endif
                 state = STATE_APP_LOOP;
                 break;
             }
@@ -915,29 +1932,57 @@ static void ota_task(void *pvParameters)
         }
         }
 
-        vTaskDelay(1000 / portTICK_PERIOD_MS);
+        fw_state_poll(&dev->fw_state);
+        tb_request_poll(&dev->requests);
+        broker_poll(&dev->broker, dev->mqtt_client);
+#ifdef CONFIG_TB_GATEWAY_MODE
+        gateway_poll(&dev->gateway);
+#endif
+        vTaskDelay(ota_task_period_ms(dev) / portTICK_PERIOD_MS);
     }
 }
 
 void app_main()
 {
-    strcpy(current_version, FIRMWARE_VERSION);
-
-    event_group = xEventGroupCreate();
+    // The context of the device running on this ESP32, it lives as long as its tasks
+    struct ota_device *dev = calloc(1, sizeof(struct ota_device));
+    assert(dev != NULL);
+    strcpy(dev->current_version, FIRMWARE_VERSION);
+
+    dev->event_group = xEventGroupCreate();
+    dev->attributes_request_id = -1;
+    trace_init(&dev->trace);
+    ota_erase_init(&dev->erase, &dev->trace);
+    http_download_init(&dev->download, &dev->rollout);
+    telemetry_agg_init(&dev->agg);
+#ifdef CONFIG_DUTY_CYCLE_MODE
+    duty_cycle_init(&dev->cycle, awake_time_reached, dev);
+#endif
     ESP_LOGI(TAG, "Starting ota_task and main_application_task.");
-    xTaskCreate(&ota_task, "ota_task", 8192, NULL, 5, NULL);
-    xTaskCreate(&main_application_task, "main_application_task", 8192, NULL, 5,
-    NULL);
+    xTaskCreatePinnedToCore(&ota_task, "ota_task", 8192, dev, CONFIG_OTA_TASK_PRIORITY, NULL, TASK_CORE(CONFIG_OTA_TASK_CORE));
+    xTaskCreatePinnedToCore(&main_application_task, "main_application_task", 8192, dev, CONFIG_APP_TASK_PRIORITY,
+    NULL, TASK_CORE(CONFIG_APP_TASK_CORE));
+}
+
+bool ota_update_pending(struct ota_device *dev)
+{
+    return (xEventGroupGetBits(dev->event_group) & OTA_UPDATE_PENDING_EVENT) != 0;
+}
+
+void ota_apply_update(struct ota_device *dev)
+{
+    ESP_LOGI(TAG, "Application approved the firmware update");
+    xEventGroupSetBits(dev->event_group, OTA_APPLY_REQUESTED_EVENT);
 }
 
-void notify_wifi_connected()
+void notify_wifi_connected(struct ota_device *dev)
 {
-    xEventGroupClearBits(event_group, WIFI_DISCONNECTED_EVENT);
-    xEventGroupSetBits(event_group, WIFI_CONNECTED_EVENT);
+    xEventGroupClearBits(dev->event_group, WIFI_DISCONNECTED_EVENT);
+    xEventGroupSetBits(dev->event_group, WIFI_CONNECTED_EVENT);
 }
 
-void notify_wifi_disconnected()
+void notify_wifi_disconnected(struct ota_device *dev)
 {
-    xEventGroupClearBits(event_group, WIFI_CONNECTED_EVENT);
-    xEventGroupSetBits(event_group, WIFI_DISCONNECTED_EVENT);
+    xEventGroupClearBits(dev->event_group, WIFI_CONNECTED_EVENT);
+    xEventGroupSetBits(dev->event_group, WIFI_DISCONNECTED_EVENT);
 }
@@ -5,7 +5,25 @@
 #ifndef PRJ_MAIN_MODULE
 #define PRJ_MAIN_MODULE
 
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
+#include "esp_ota_ops.h"
+#include "mqtt_client.h"
+#include "mbedtls/md.h"
+#include "trace.h"
+#include "fw_state.h"
+#include "ota_erase.h"
+#include "image_verify.h"
+#include "rollout.h"
+#include "broker.h"
+#include "tb_request.h"
+#include "http_download.h"
+#include "self_test.h"
+#include "telemetry_agg.h"
+#include "gateway.h"
+#include "data_image.h"
+#include "duty_cycle.h"
 
 #define TAG "tb_ota"
 /* Change the version as it's used to determine if the firmware offered differs */
@@ -18,21 +36,26 @@
 #define TB_FW_REQUEST_TOPIC "v2/fw/request/1/chunk/"
 #define TB_FW_RESPONSE_TOPIC "v2/fw/response/+"
 #define TB_FW_RESPONSE_STRING "v2/fw/response/1/chunk/"
+#define TB_SW_REQUEST_TOPIC "v2/sw/request/1/chunk/"
+#define TB_SW_RESPONSE_TOPIC "v2/sw/response/+"
+#define TB_SW_RESPONSE_STRING "v2/sw/response/1/chunk/"
 #define TB_ATTRIBUTES_SUBSCRIBE_TO_RESPONSE_TOPIC "v1/devices/me/attributes/response/+"
 
-#define TB_ATTRIBUTES_REQUEST_TOPIC "v1/devices/me/attributes/request/2"
+/*! Core to pin a task to, -1 lets the scheduler choose */
+#define TASK_CORE(core) ((core) < 0 ? tskNO_AFFINITY : (core))
 
-/**
- * @brief  MQTT topic to receive the requested specified shared attributes from ThingsBoard.
- *         44332 is a request id, have to be the same as used for the request.
- */
-#define TB_ATTRIBUTES_RESPONSE_TOPIC "v1/devices/me/attributes/response/2"
+/*! Time to wait for the shared attributes response before requesting them again */
+#define TB_ATTRIBUTES_REQUEST_TIMEOUT_MS 10000
 
 /*! Client attribute key to send the firmware version value to ThingsBoard */
 #define TB_CLIENT_ATTR_FIELD_CURRENT_FW "current_fw_version"
 #define TB_CLIENT_ATTR_FIELD_CURRENT_FW_TITLE "current_fw_title"
+#define TB_CLIENT_ATTR_FIELD_CURRENT_SW "current_sw_version"
+#define TB_CLIENT_ATTR_FIELD_CURRENT_SW_TITLE "current_sw_title"
 #define TB_CLIENT_ATTR_FIELD_FW_STATE "fw_state"
 #define TB_CLIENT_ATTR_FIELD_FW_ERROR "fw_error"
+#define TB_CLIENT_ATTR_FIELD_SW_STATE "sw_state"
+#define TB_CLIENT_ATTR_FIELD_SW_ERROR "sw_error"
 #define TB_CLIENT_STATE_UPDATED "UPDATED"
 
 /*! Shared attribute keys on ThingsBoard */
@@ -48,8 +71,17 @@
 #define TB_SHARED_ATTR_FIELD_TARGET_FW_VER "targetFwVer"
 #define TB_SHARED_ATTR_FIELD_TARGET_FW_URL "targetFwUrl"
 
+/*! Shared attribute keys of the software package on ThingsBoard, written to the data partition */
+#define TB_SHARED_ATTR_FIELD_SW_CHECKSUM "sw_checksum"
+#define TB_SHARED_ATTR_FIELD_SW_VER "sw_version"
+#define TB_SHARED_ATTR_FIELD_SW_SIZE "sw_size"
+#define TB_SHARED_ATTR_FIELD_SW_TITLE "sw_title"
+
+/*! Shared attribute keys requested from ThingsBoard */
+#define TB_SHARED_ATTR_KEYS "fw_checksum,fw_checksum_algorithm,fw_size,fw_title,fw_version,targetFwVer,targetFwUrl,ota_start_jitter,ota_max_rate,ota_window,mqtt_endpoints,telemetry_window,telemetry_windows,sw_checksum,sw_size,sw_title,sw_version"
+
 /*! Body of the request of specified shared attributes */
-#define TB_SHARED_ATTR_KEYS_REQUEST "{\"sharedKeys\":\"fw_checksum,fw_checksum_algorithm,fw_size,fw_title,fw_version,targetFwVer,targetFwUrl\"}"
+#define TB_SHARED_ATTR_KEYS_REQUEST "{\"sharedKeys\":\"" TB_SHARED_ATTR_KEYS "\"}"
 
 #define STATE_OTA_WRITE 0
 #define STATE_OTA_REQUEST_NEXT_CHUNK 1
@@ -59,6 +91,8 @@
 #define STATE_IMAGE_UPDATED 5
 #define STATE_OTA_ERROR 6
 #define STATE_EXIT 7
+#define STATE_OTA_WAIT_APPLY 8
+#define STATE_OTA_NEXT_IMAGE 9
 
 /**
  * @brief Bit set for application events
@@ -71,6 +105,10 @@
 #define OTA_CONFIG_UPDATED_EVENT BIT5
 #define OTA_TASK_IN_NORMAL_STATE_EVENT BIT6
 #define MQTT_CHUNK_RECEIVED_EVENT BIT7
+#define OTA_UPDATE_PENDING_EVENT BIT8
+#define OTA_APPLY_REQUESTED_EVENT BIT9
+#define DUTY_CYCLE_SLEEP_EVENT BIT10
+#define SELF_TEST_TIMEOUT_EVENT BIT11
 
 /*! Max length of access token */
 #define MAX_LENGTH_TB_ACCESS_TOKEN 20
@@ -101,9 +139,144 @@ enum state
     STATE_CONNECTION_IS_OK
 };
 
+/**
+ * @brief Images of an OTA session, the app image is written first
+ */
+enum ota_image
+{
+    OTA_IMAGE_APP,
+    OTA_IMAGE_DATA
+};
+
+/* Chunk size must be a value low enough as to not cause memory shortages
+ * but the larger the faster the download.  Note that CHUNK_SIZE is used
+ * for the MQTT receive size and for temporarily saving the data, thus
+ * the total used will be twice the chunk size.
+ */
+#define CHUNK_SIZE 30000
+
+/* Saves OTA config received from ThingsBoard*/
+struct shared_keys
+{
+    int fw_size;
+    char fw_title[256];
+    char fw_checksum[520];
+    char fw_checksum_algorithm[32];
+    char fw_version[32];
+    char target_fw_url[MAX_LENGTH_TB_URL + 1];
+    int sw_size;
+    char sw_checksum[65];
+    char sw_title[256];
+    char sw_version[32];
+};
+
+/**
+ * @brief State of one device: its MQTT connection, the OTA config received from ThingsBoard,
+ *        the download in progress and the contexts of the modules. All OTA functions work on
+ *        the context they are given, the MQTT event handler gets it as the client's user context.
+ */
+struct ota_device
+{
+    /*! Saves bit values used in application */
+    EventGroupHandle_t event_group;
+    esp_mqtt_client_handle_t mqtt_client;
+    struct shared_keys shared_attributes;
+    char current_version[32];
+    /*! Title and version of the image in the data partition */
+    char current_sw_title[256];
+    char current_sw_version[32];
+
+    /*! Buffer to save a received MQTT message */
+    char mqtt_msg[CHUNK_SIZE + 2];
+
+    int chunkCounter;
+    int totSize;
+    char fwTopic[32];
+    char fwResponse[32];
+    const char *rcvdChunk;
+    int rcvdChunkSize;
+
+    esp_ota_handle_t update_handle;
+    const esp_partition_t *update_partition;
+
+    mbedtls_md_context_t ctx;
+    int calcInit;
+    unsigned char shaResult[32];
+    char shaString[65];
+
+    /*! Id of the pending shared attributes request, -1 if none is pending */
+    int attributes_request_id;
+
+    /*! Set when a firmware offered by ThingsBoard waits for its scheduled start */
+    bool ota_start_pending;
+    /*! Set while the shared attributes are those of the last duty cycle, not received in this boot */
+    bool attributes_cached;
+    /*! Set from the first chunk request until the download completed or failed */
+    bool downloading;
+    /*! Image the received chunks are written to */
+    enum ota_image image;
+    /*! Set when the session writes the data image after the app image */
+    bool data_pending;
+    /*! Set when the session staged an app image in update_partition */
+    bool app_staged;
+    /*! Set when the session wrote the data image */
+    bool data_staged;
+    /*! Set while the firmware is downloaded from targetFwUrl instead of with MQTT chunks */
+    bool http_download;
+    /*! Set when the update partition is erased in the background ahead of the writes */
+    bool pre_erase;
+    /*! Set when the image is verified while it is streamed instead of read back by esp_ota_end() */
+    bool streaming_verify;
+    /*! Time the processing of the current chunk started */
+    int64_t chunk_started_us;
+    /*! Time the pending chunk was requested */
+    int64_t chunk_requested_us;
+    /*! Set while the request of the pending chunk waits for the rate cap or CPU budget, sent at chunk_request_at_us */
+    bool chunk_request_due;
+    int64_t chunk_request_at_us;
+    /*! The next chunk isn't requested or written before this time, see CONFIG_OTA_BACKGROUND_CPU_BUDGET */
+    int64_t chunk_not_before_us;
+    /*! Requests of the pending chunk sent again after a timeout */
+    int chunk_retries;
+    /*! Checksum of the image being downloaded, a reconnect resumes the download while it is still the target */
+    char download_checksum[65];
+    /*! Failed sessions for the current target, retried up to CONFIG_OTA_MAX_ATTEMPTS times */
+    int ota_attempts;
+    /*! Time the MQTT connection of a download in progress was lost */
+    int64_t disconnected_us;
+
+    /*! Broker URL and access token read from NVS */
+    char mqtt_url[MAX_LENGTH_TB_URL + 1];
+    char access_token[MAX_LENGTH_TB_ACCESS_TOKEN + 1];
+    /*! Station MAC address, the Wi-Fi hostname is derived from it */
+    uint8_t mac[6];
+    /*! Set while the Wi-Fi connect uses the AP of the last duty cycle */
+    bool wifi_hint_used;
+
+    struct trace trace;
+    struct fw_state fw_state;
+    struct ota_erase erase;
+    struct image_verify verify;
+    struct rollout rollout;
+    struct broker broker;
+    struct tb_request requests;
+    struct http_download download;
+    struct self_test self_test;
+    struct telemetry_agg agg;
+    struct gateway gateway;
+    struct data_image data;
+    struct duty_cycle cycle;
+};
+
+/*! Returns true when a downloaded firmware waits for @ref ota_apply_update (background update mode) */
+bool ota_update_pending(struct ota_device *dev);
+
+/*! Approves the restart into the pending firmware, called by the application at a safe point */
+void ota_apply_update(struct ota_device *dev);
+
 /*! Updates application event bits on changing Wi-Fi state */
-void notify_wifi_connected();
-void notify_wifi_disconnected();
+void notify_wifi_connected(struct ota_device *dev);
+void notify_wifi_disconnected(struct ota_device *dev);
 
 /**
  * Macro to check the error code.
@@ -0,0 +1,160 @@
+/**
+ * @file ota_digest.c
+ */
+
+#include <string.h>
+#include "esp_log.h"
+#include "esp_system.h"
+#include "nvs.h"
+#include "mbedtls/md.h"
+
+#include "mqttOta.h"
+#include "ota_digest.h"
+
+/*! Size of the buffer the partition is read with */
+#define OTA_DIGEST_READ_SIZE 4096
+
+/* Digest cached in NVS together with the range it covers */
+struct ota_digest_entry
+{
+    uint32_t address;
+    uint32_t size;
+    /*! Last bytes of the range, the SHA256 an app image carries at its end */
+    uint8_t tail[OTA_DIGEST_LEN];
+    uint8_t digest[OTA_DIGEST_LEN];
+};
+
+/**
+ * @brief Reads the last bytes of the range. They change with any image written to the partition,
+ *        also by a serial flash the cache doesn't know about.
+ */
+static esp_err_t read_tail(const esp_partition_t *partition, uint32_t size, uint8_t *tail)
+{
+    if (size < OTA_DIGEST_LEN)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return esp_partition_read(partition, size - OTA_DIGEST_LEN, tail, OTA_DIGEST_LEN);
+}
+
+static bool load_cached_digest(const esp_partition_t *partition, uint32_t size, uint8_t *digest)
+{
+    nvs_handle handle;
+    if (nvs_open(NVS_KEY_OTA_DIGEST, NVS_READONLY, &handle) != ESP_OK)
+    {
+        return false;
+    }
+
+    struct ota_digest_entry entry;
+    size_t entry_len = sizeof(entry);
+    esp_err_t result_code = nvs_get_blob(handle, NVS_KEY_OTA_DIGEST, &entry, &entry_len);
+    nvs_close(handle);
+
+    if (result_code != ESP_OK || entry_len != sizeof(entry) || entry.address != partition->address || entry.size != size)
+    {
+        return false;
+    }
+
+    uint8_t tail[OTA_DIGEST_LEN];
+    if (read_tail(partition, size, tail) != ESP_OK || memcmp(tail, entry.tail, OTA_DIGEST_LEN) != 0)
+    {
+        ESP_LOGW(TAG, "Partition %s changed since its digest was cached", partition->label);
+        return false;
+    }
+    memcpy(digest, entry.digest, OTA_DIGEST_LEN);
+    return true;
+}
+
+static esp_err_t compute_digest(const esp_partition_t *partition, uint32_t size, uint8_t *digest)
+{
+    uint8_t *buffer = malloc(OTA_DIGEST_READ_SIZE);
+    if (buffer == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    mbedtls_md_context_t md_ctx;
+    mbedtls_md_init(&md_ctx);
+    mbedtls_md_setup(&md_ctx, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0);
+    mbedtls_md_starts(&md_ctx);
+
+    esp_err_t err = ESP_OK;
+    for (uint32_t offset = 0; offset < size; offset += OTA_DIGEST_READ_SIZE)
+    {
+        size_t len = size - offset < OTA_DIGEST_READ_SIZE ? size - offset : OTA_DIGEST_READ_SIZE;
+        err = esp_partition_read(partition, offset, buffer, len);
+        if (err != ESP_OK)
+        {
+            break;
+        }
+        mbedtls_md_update(&md_ctx, buffer, len);
+    }
+
+    mbedtls_md_finish(&md_ctx, digest);
+    mbedtls_md_free(&md_ctx);
+    free(buffer);
+    return err;
+}
+
+esp_err_t ota_digest_get(const esp_partition_t *partition, uint32_t size, uint8_t *digest)
+{
+    assert(partition != NULL && digest != NULL);
+
+    if (size == 0 || size > partition->size)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    if (load_cached_digest(partition, size, digest))
+    {
+        ESP_LOGI(TAG, "Digest of partition %s taken from cache", partition->label);
+        return ESP_OK;
+    }
+
+    esp_err_t err = compute_digest(partition, size, digest);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Unable to compute digest of partition %s (%s)", partition->label, esp_err_to_name(err));
+        return err;
+    }
+    ota_digest_store(partition, size, digest);
+    return ESP_OK;
+}
+
+void ota_digest_store(const esp_partition_t *partition, uint32_t size, const uint8_t *digest)
+{
+    assert(partition != NULL && digest != NULL);
+
+    struct ota_digest_entry entry = { .address = partition->address, .size = size };
+    memcpy(entry.digest, digest, OTA_DIGEST_LEN);
+    if (read_tail(partition, size, entry.tail) != ESP_OK)
+    {
+        return;
+    }
+
+    nvs_handle handle;
+    if (nvs_open(NVS_KEY_OTA_DIGEST, NVS_READWRITE, &handle) != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Unable to cache partition digest");
+        return;
+    }
+    if (nvs_set_blob(handle, NVS_KEY_OTA_DIGEST, &entry, sizeof(entry)) == ESP_OK)
+    {
+        nvs_commit(handle);
+    }
+    nvs_close(handle);
+}
+
+void ota_digest_invalidate(void)
+{
+    nvs_handle handle;
+    if (nvs_open(NVS_KEY_OTA_DIGEST, NVS_READWRITE, &handle) != ESP_OK)
+    {
+        return;
+    }
+    if (nvs_erase_key(handle, NVS_KEY_OTA_DIGEST) == ESP_OK)
+    {
+        nvs_commit(handle);
+    }
+    nvs_close(handle);
+}
@@ -0,0 +1,35 @@
+/**
+ * @file ota_digest.h
+ */
+
+#ifndef PRJ_OTA_DIGEST_MODULE
+#define PRJ_OTA_DIGEST_MODULE
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_partition.h"
+
+/*! NVS storage key where the digest of the inactive OTA partition is cached */
+#define NVS_KEY_OTA_DIGEST "ota_digest"
+
+/*! Length of a SHA256 digest */
+#define OTA_DIGEST_LEN 32
+
+/**
+ * @brief Get the SHA256 of the first size bytes of the partition.
+ *        The digest is taken from NVS when it was cached for the same partition, size and last
+ *        bytes of the range (the appended SHA256 of an app image), otherwise it is computed from flash and cached.
+ *
+ * @param partition Inactive OTA partition
+ * @param size Number of bytes to hash, the firmware size offered by ThingsBoard
+ * @param digest Output buffer of @ref OTA_DIGEST_LEN bytes
+ */
+esp_err_t ota_digest_get(const esp_partition_t *partition, uint32_t size, uint8_t *digest);
+
+/*! Caches the digest of an image that was fully written to the partition and validated */
+void ota_digest_store(const esp_partition_t *partition, uint32_t size, const uint8_t *digest);
+
+/*! Drops the cached digest, must be called before the partition is modified */
+void ota_digest_invalidate(void);
+
+#endif
@@ -0,0 +1,116 @@
+/**
+ * @file ota_erase.c
+ */
+
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "mqttOta.h"
+#include "ota_erase.h"
+
+static void ota_erase_task(void *pvParameters)
+{
+    struct ota_erase *erase = pvParameters;
+    int64_t started = esp_timer_get_time();
+
+    while (!erase->abort && erase->erased_end < erase->target)
+    {
+        size_t step = MIN(OTA_ERASE_STEP_SIZE, erase->target - erase->erased_end);
+        TRACE(erase->trace, TRACE_ERASE_BEGIN, erase->erased_end, step, 0);
+        esp_err_t err = esp_partition_erase_range(erase->partition, erase->erased_end, step);
+        TRACE(erase->trace, TRACE_ERASE_END, erase->erased_end, err, 0);
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Pre-erase failed at offset 0x%x (%s)", erase->erased_end, esp_err_to_name(err));
+            erase->error = err;
+            break;
+        }
+        erase->erased_end += step;
+        xSemaphoreGive(erase->progress);
+    }
+
+    if (erase->erased_end >= erase->target)
+    {
+        ESP_LOGI(TAG, "Pre-erased %d bytes in %d ms", erase->target, (int) ((esp_timer_get_time() - started) / 1000));
+    }
+    xSemaphoreGive(erase->progress);
+    xSemaphoreGive(erase->done);
+    vTaskDelete(NULL);
+}
+
+void ota_erase_init(struct ota_erase *erase, struct trace *trace)
+{
+    erase->trace = trace;
+    erase->progress = xSemaphoreCreateBinary();
+    erase->done = xSemaphoreCreateBinary();
+}
+
+esp_err_t ota_erase_start(struct ota_erase *erase, const esp_partition_t *partition, size_t image_size)
+{
+    assert(partition != NULL);
+
+    ota_erase_stop(erase);
+
+    size_t aligned_size = (image_size + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+    if (image_size == 0 || aligned_size > partition->size)
+    {
+        ESP_LOGE(TAG, "Image size %d doesn't fit partition %s", image_size, partition->label);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    erase->partition = partition;
+    erase->target = aligned_size;
+    erase->erased_end = 0;
+    erase->error = ESP_OK;
+    erase->abort = false;
+    xSemaphoreTake(erase->progress, 0);
+    xSemaphoreTake(erase->done, 0);
+
+    // Kept off the application core with the OTA task
+    if (xTaskCreatePinnedToCore(&ota_erase_task, "ota_erase_task", 2048, erase, tskIDLE_PRIORITY + 1, &erase->task,
+                    TASK_CORE(CONFIG_OTA_TASK_CORE)) != pdPASS)
+    {
+        erase->task = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+esp_err_t ota_erase_wait(struct ota_erase *erase, size_t end, uint32_t timeout_ms)
+{
+    const TickType_t deadline = xTaskGetTickCount() + pdMS_TO_TICKS(timeout_ms);
+
+    while (erase->erased_end < end)
+    {
+        if (erase->error != ESP_OK)
+        {
+            return erase->error;
+        }
+        if (erase->task == NULL || end > erase->target)
+        {
+            return ESP_ERR_INVALID_STATE;
+        }
+        TickType_t now = xTaskGetTickCount();
+        if ((int32_t) (deadline - now) <= 0 || xSemaphoreTake(erase->progress, deadline - now) != pdTRUE)
+        {
+            ESP_LOGE(TAG, "Pre-erase didn't reach offset 0x%x in time", end);
+            return ESP_ERR_TIMEOUT;
+        }
+    }
+    return ESP_OK;
+}
+
+void ota_erase_stop(struct ota_erase *erase)
+{
+    if (erase->task == NULL)
+    {
+        return;
+    }
+    erase->abort = true;
+    xSemaphoreTake(erase->done, portMAX_DELAY);
+    erase->task = NULL;
+}
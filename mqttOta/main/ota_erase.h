@@ -0,0 +1,64 @@
+/**
+ * @file ota_erase.h
+ */
+
+#ifndef PRJ_OTA_ERASE_MODULE
+#define PRJ_OTA_ERASE_MODULE
+
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_partition.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "trace.h"
+
+/*! Size erased by one step of the background erase task */
+#ifdef CONFIG_OTA_PRE_ERASE
+#define OTA_ERASE_STEP_SIZE (CONFIG_OTA_PRE_ERASE_STEP_KB * 1024)
+#else
+#define OTA_ERASE_STEP_SIZE (64 * 1024)
+#endif
+
+/*! Max time the writer waits for the erase to get ahead of the write cursor */
+#define OTA_ERASE_WAIT_TIMEOUT_MS 30000
+
+/* Background erase of one device's update partition, set up by @ref ota_erase_init */
+struct ota_erase
+{
+    struct trace *trace;
+    const esp_partition_t *partition;
+    size_t target;
+    volatile size_t erased_end;
+    volatile esp_err_t error;
+    volatile bool abort;
+    TaskHandle_t task;
+    /*! Given after each erased step and once on exit */
+    SemaphoreHandle_t progress;
+    /*! Given when the erase task is about to exit */
+    SemaphoreHandle_t done;
+};
+
+/*! Creates the semaphores of the erase task, its events are recorded into trace */
+void ota_erase_init(struct ota_erase *erase, struct trace *trace);
+
+/**
+ * @brief Starts erasing the first image_size bytes of the partition in a low priority task.
+ *        A running erase is stopped first.
+ *
+ * @param partition Target OTA partition
+ * @param image_size Size of the image that will be written, rounded up to whole sectors
+ */
+esp_err_t ota_erase_start(struct ota_erase *erase, const esp_partition_t *partition, size_t image_size);
+
+/**
+ * @brief Blocks until the range [0, end) of the partition is erased.
+ *
+ * @return ESP_OK when the range can be programmed, ESP_ERR_TIMEOUT or the erase error otherwise
+ */
+esp_err_t ota_erase_wait(struct ota_erase *erase, size_t end, uint32_t timeout_ms);
+
+/*! Stops the background erase and waits for its task to exit */
+void ota_erase_stop(struct ota_erase *erase);
+
+#endif
@@ -0,0 +1,185 @@
+/**
+ * @file rollout.c
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_sntp.h"
+
+#include "mqttOta.h"
+#include "rollout.h"
+
+#define MINUTES_PER_DAY (24 * 60)
+
+static bool parse_window(struct rollout *rollout, const char *window)
+{
+    int start_h, start_m, end_h, end_m;
+
+    if (strlen(window) == 0)
+    {
+        portENTER_CRITICAL(&rollout->lock);
+        rollout->window_start_min = rollout->window_end_min = 0;
+        portEXIT_CRITICAL(&rollout->lock);
+        return true;
+    }
+    if (sscanf(window, "%d:%d-%d:%d", &start_h, &start_m, &end_h, &end_m) != 4 || start_h < 0 || start_h > 23 || end_h < 0
+                    || end_h > 23 || start_m < 0 || start_m > 59 || end_m < 0 || end_m > 59)
+    {
+        ESP_LOGE(TAG, "Invalid maintenance window '%s', expected HH:MM-HH:MM", window);
+        return false;
+    }
+    portENTER_CRITICAL(&rollout->lock);
+    rollout->window_start_min = start_h * 60 + start_m;
+    rollout->window_end_min = end_h * 60 + end_m;
+    portEXIT_CRITICAL(&rollout->lock);
+    return true;
+}
+
+static bool inside_window(struct rollout *rollout)
+{
+    portENTER_CRITICAL(&rollout->lock);
+    int start_min = rollout->window_start_min;
+    int end_min = rollout->window_end_min;
+    portEXIT_CRITICAL(&rollout->lock);
+    if (start_min == end_min)
+    {
+        return true;
+    }
+
+    time_t now;
+    struct tm timeinfo;
+    time(&now);
+    gmtime_r(&now, &timeinfo);
+    if (timeinfo.tm_year + 1900 < ROLLOUT_MIN_VALID_YEAR)
+    {
+        if (!rollout->window_logged)
+        {
+            ESP_LOGW(TAG, "System time is not set, waiting for it to check the maintenance window");
+            rollout->window_logged = true;
+        }
+        return false;
+    }
+
+    int minute = timeinfo.tm_hour * 60 + timeinfo.tm_min;
+    bool inside;
+    if (start_min < end_min)
+    {
+        inside = minute >= start_min && minute < end_min;
+    } else
+    {
+        // The window wraps around midnight
+        inside = minute >= start_min || minute < end_min;
+    }
+    if (!inside && !rollout->window_logged)
+    {
+        ESP_LOGI(TAG, "Outside of the maintenance window %02d:%02d-%02d:%02d UTC, OTA deferred", start_min / 60,
+                        start_min % 60, end_min / 60, end_min % 60);
+        rollout->window_logged = true;
+    }
+    return inside;
+}
+
+void rollout_init(struct rollout *rollout)
+{
+    if (rollout->initialized)
+    {
+        return;
+    }
+    rollout->initialized = true;
+    portMUX_INITIALIZE(&rollout->lock);
+    rollout->start_jitter_s = CONFIG_OTA_ROLLOUT_START_JITTER_S;
+    rollout->max_rate = CONFIG_OTA_ROLLOUT_MAX_RATE;
+
+    parse_window(rollout, CONFIG_OTA_ROLLOUT_WINDOW);
+    if (strlen(CONFIG_OTA_ROLLOUT_SNTP_SERVER) != 0)
+    {
+        sntp_setoperatingmode(SNTP_OPMODE_POLL);
+        sntp_setservername(0, CONFIG_OTA_ROLLOUT_SNTP_SERVER);
+        sntp_init();
+    }
+}
+
+void rollout_parse_config(struct rollout *rollout, const cJSON *object)
+{
+    if (object == NULL)
+    {
+        return;
+    }
+
+    cJSON *jitter = cJSON_GetObjectItem(object, TB_SHARED_ATTR_FIELD_OTA_START_JITTER);
+    if (cJSON_IsNumber(jitter) && jitter->valueint >= 0)
+    {
+        portENTER_CRITICAL(&rollout->lock);
+        rollout->start_jitter_s = jitter->valueint;
+        portEXIT_CRITICAL(&rollout->lock);
+        ESP_LOGI(TAG, "Received OTA start jitter: %d s", rollout->start_jitter_s);
+    }
+
+    cJSON *rate = cJSON_GetObjectItem(object, TB_SHARED_ATTR_FIELD_OTA_MAX_RATE);
+    if (cJSON_IsNumber(rate) && rate->valueint >= 0)
+    {
+        portENTER_CRITICAL(&rollout->lock);
+        rollout->max_rate = rate->valueint;
+        rollout->rate_tokens = 0;
+        portEXIT_CRITICAL(&rollout->lock);
+        ESP_LOGI(TAG, "Received OTA max rate: %d B/s", rate->valueint);
+    }
+
+    cJSON *window = cJSON_GetObjectItem(object, TB_SHARED_ATTR_FIELD_OTA_WINDOW);
+    if (cJSON_IsString(window) && window->valuestring != NULL && parse_window(rollout, window->valuestring))
+    {
+        rollout->window_logged = false;
+        ESP_LOGI(TAG, "Received OTA maintenance window: '%s'", window->valuestring);
+    }
+}
+
+void rollout_schedule(struct rollout *rollout)
+{
+    portENTER_CRITICAL(&rollout->lock);
+    uint32_t jitter_s = rollout->start_jitter_s;
+    portEXIT_CRITICAL(&rollout->lock);
+    uint32_t delay_ms = jitter_s == 0 ? 0 : esp_random() % (jitter_s * 1000 + 1);
+    rollout->start_at_us = esp_timer_get_time() + (int64_t) delay_ms * 1000;
+    rollout->window_logged = false;
+    ESP_LOGI(TAG, "OTA scheduled to start in %d ms", delay_ms);
+}
+
+bool rollout_may_start(struct rollout *rollout)
+{
+    return esp_timer_get_time() >= rollout->start_at_us && inside_window(rollout);
+}
+
+int64_t rollout_reserve(struct rollout *rollout, size_t bytes)
+{
+    int64_t now = esp_timer_get_time();
+    int64_t allowed_at = now;
+
+    portENTER_CRITICAL(&rollout->lock);
+    if (rollout->max_rate != 0)
+    {
+        // Refill for the elapsed time, at most one second worth of burst
+        rollout->rate_tokens += (now - rollout->rate_updated_us) * rollout->max_rate / 1000000;
+        if (rollout->rate_tokens > rollout->max_rate)
+        {
+            rollout->rate_tokens = rollout->max_rate;
+        }
+        rollout->rate_tokens -= bytes;
+        if (rollout->rate_tokens < 0)
+        {
+            allowed_at = now - rollout->rate_tokens * 1000000 / rollout->max_rate;
+        }
+    }
+    rollout->rate_updated_us = now;
+    portEXIT_CRITICAL(&rollout->lock);
+
+    if (allowed_at > now)
+    {
+        ESP_LOGD(TAG, "Download rate capped, next request in %d ms", (int) ((allowed_at - now) / 1000));
+    }
+    return allowed_at;
+}
@@ -0,0 +1,71 @@
+/**
+ * @file rollout.h
+ */
+
+#ifndef PRJ_ROLLOUT_MODULE
+#define PRJ_ROLLOUT_MODULE
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "cJSON.h"
+#include "freertos/FreeRTOS.h"
+
+/*! Shared attribute keys to tune the rollout on ThingsBoard */
+#define TB_SHARED_ATTR_FIELD_OTA_START_JITTER "ota_start_jitter"
+#define TB_SHARED_ATTR_FIELD_OTA_MAX_RATE "ota_max_rate"
+#define TB_SHARED_ATTR_FIELD_OTA_WINDOW "ota_window"
+
+/*! Year the system time has to reach to be considered synchronized */
+#define ROLLOUT_MIN_VALID_YEAR 2020
+
+/* Rollout controls of one device, zeroed until @ref rollout_init */
+struct rollout
+{
+    bool initialized;
+    /*! Max random start delay in seconds */
+    uint32_t start_jitter_s;
+    /*! Download rate cap in bytes per second, 0 is unlimited */
+    uint32_t max_rate;
+    /*! Maintenance window in minutes of the day (UTC), equal values allow any time */
+    int window_start_min;
+    int window_end_min;
+
+    /*! Time in us when the scheduled download may start */
+    int64_t start_at_us;
+
+    /*! Token bucket of the download rate cap, may go negative */
+    int64_t rate_tokens;
+    int64_t rate_updated_us;
+
+    bool window_logged;
+
+    /*! The config is written from the MQTT task, the token bucket is used by the OTA and HTTP download tasks */
+    portMUX_TYPE lock;
+};
+
+/*! Sets the defaults from the ThingsBoard OTA configuration submenu and starts SNTP if configured, once per boot */
+void rollout_init(struct rollout *rollout);
+
+/**
+ * @brief Applies the rollout keys found in a shared attributes object, other keys are ignored.
+ *        ota_start_jitter: max random start delay in seconds,
+ *        ota_max_rate: max firmware download rate in bytes per second, 0 is unlimited,
+ *        ota_window: "HH:MM-HH:MM" maintenance window in UTC, empty allows any time.
+ */
+void rollout_parse_config(struct rollout *rollout, const cJSON *object);
+
+/*! Picks a random start time for a newly offered firmware */
+void rollout_schedule(struct rollout *rollout);
+
+/*! Returns true once the scheduled start time is reached and the device is inside the maintenance window */
+bool rollout_may_start(struct rollout *rollout);
+
+/**
+ * @brief Takes bytes more from the download rate budget without blocking.
+ *
+ * @return int64_t esp_timer time in us from which the bytes may be requested, now if the rate isn't capped
+ */
+int64_t rollout_reserve(struct rollout *rollout, size_t bytes);
+
+#endif
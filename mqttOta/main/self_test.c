@@ -0,0 +1,425 @@
+/**
+ * @file self_test.c
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_sleep.h"
+#include "esp_timer.h"
+#include "nvs.h"
+
+#include "mqttOta.h"
+#include "fw_state.h"
+#include "tb_request.h"
+#include "tb_proto.h"
+#include "self_test.h"
+
+#ifdef CONFIG_OTA_SELF_TEST
+
+/*! NVS keys in the NVS_KEY_SELF_TEST namespace */
+#define NVS_KEY_SELF_TEST_BASELINE "baseline"
+#define NVS_KEY_SELF_TEST_FAILURE "failure"
+#define NVS_KEY_SELF_TEST_REJECTED "rejected"
+
+/*! Round trips measured with an attributes request */
+#define SELF_TEST_RTT_SAMPLES 5
+#define SELF_TEST_RTT_TIMEOUT_MS 5000
+
+/*! Added to the time limits, so a few ms of jitter on a fast baseline don't fail the test */
+#define SELF_TEST_TIME_MARGIN_MS 500
+
+#define SELF_TEST_MAX_REASON 128
+
+/* Metrics of one boot, the baseline is their average over the last boots of valid images */
+struct self_test_metrics
+{
+    uint32_t boot_ms;
+    uint32_t rtt_ms;
+    uint32_t free_heap;
+    uint32_t min_free_heap;
+};
+
+/* Metrics of the last CONFIG_OTA_SELF_TEST_BASELINE_WINDOWS boots as stored in NVS, the oldest is replaced */
+struct self_test_windows
+{
+    uint32_t count;
+    uint32_t next;
+    struct self_test_metrics window[CONFIG_OTA_SELF_TEST_BASELINE_WINDOWS];
+};
+
+static void save_failure(const char *reason)
+{
+    nvs_handle handle;
+    if (nvs_open(NVS_KEY_SELF_TEST, NVS_READWRITE, &handle) != ESP_OK)
+    {
+        return;
+    }
+    nvs_set_str(handle, NVS_KEY_SELF_TEST_FAILURE, reason);
+    nvs_set_str(handle, NVS_KEY_SELF_TEST_REJECTED, FIRMWARE_VERSION);
+    nvs_commit(handle);
+    nvs_close(handle);
+}
+
+/**
+ * @brief Rolls back to the previous image. The reason is kept in NVS,
+ *        the previous image reports it to ThingsBoard after connecting.
+ */
+static void roll_back(struct self_test *self_test, const char *reason, bool report)
+{
+    ESP_LOGE(TAG, "Self-test of %s failed: %s, rolling back", FIRMWARE_VERSION, reason);
+    save_failure(reason);
+    if (report)
+    {
+        fw_state_report(self_test->fw_state, "UPDATE", FIRMWARE_VERSION, "FAILED", reason);
+        fw_state_flush(self_test->fw_state, FW_STATE_DELIVERY_TIMEOUT_MS);
+    }
+    esp_ota_mark_app_invalid_rollback_and_reboot();
+    ESP_LOGE(TAG, "Rollback failed, the previous image is not valid");
+}
+
+static void connect_timeout(void *arg)
+{
+    struct self_test *self_test = arg;
+
+    self_test->timeout_cb(self_test->timeout_ctx);
+}
+
+/*! Reads the stored windows, none if they were saved with another number of windows */
+static void load_windows(nvs_handle handle, struct self_test_windows *windows)
+{
+    size_t len = sizeof(*windows);
+    if (nvs_get_blob(handle, NVS_KEY_SELF_TEST_BASELINE, windows, &len) != ESP_OK || len != sizeof(*windows)
+                    || windows->count > CONFIG_OTA_SELF_TEST_BASELINE_WINDOWS
+                    || windows->next >= CONFIG_OTA_SELF_TEST_BASELINE_WINDOWS)
+    {
+        memset(windows, 0, sizeof(*windows));
+    }
+}
+
+static bool load_baseline(struct self_test_metrics *baseline)
+{
+    struct self_test_windows windows;
+    nvs_handle handle;
+    if (nvs_open(NVS_KEY_SELF_TEST, NVS_READONLY, &handle) != ESP_OK)
+    {
+        return false;
+    }
+    load_windows(handle, &windows);
+    nvs_close(handle);
+    if (windows.count == 0)
+    {
+        return false;
+    }
+
+    uint64_t boot_ms = 0, rtt_ms = 0, free_heap = 0, min_free_heap = 0;
+    for (uint32_t i = 0; i < windows.count; i++)
+    {
+        boot_ms += windows.window[i].boot_ms;
+        rtt_ms += windows.window[i].rtt_ms;
+        free_heap += windows.window[i].free_heap;
+        min_free_heap += windows.window[i].min_free_heap;
+    }
+    baseline->boot_ms = boot_ms / windows.count;
+    baseline->rtt_ms = rtt_ms / windows.count;
+    baseline->free_heap = free_heap / windows.count;
+    baseline->min_free_heap = min_free_heap / windows.count;
+    ESP_LOGI(TAG, "Self-test baseline of %u boots", windows.count);
+    return true;
+}
+
+/*! Adds the metrics to the windows of the baseline, replacing the oldest */
+static void save_baseline(const struct self_test_metrics *metrics)
+{
+    struct self_test_windows windows;
+    nvs_handle handle;
+    if (nvs_open(NVS_KEY_SELF_TEST, NVS_READWRITE, &handle) != ESP_OK)
+    {
+        return;
+    }
+    load_windows(handle, &windows);
+    windows.window[windows.next] = *metrics;
+    windows.next = (windows.next + 1) % CONFIG_OTA_SELF_TEST_BASELINE_WINDOWS;
+    if (windows.count < CONFIG_OTA_SELF_TEST_BASELINE_WINDOWS)
+    {
+        windows.count++;
+    }
+    if (nvs_set_blob(handle, NVS_KEY_SELF_TEST_BASELINE, &windows, sizeof(windows)) == ESP_OK)
+    {
+        nvs_commit(handle);
+    }
+    nvs_close(handle);
+}
+
+static bool time_exceeds(uint32_t value_ms, uint32_t baseline_ms, uint32_t max_percent)
+{
+    return baseline_ms != 0 && value_ms > (uint64_t) baseline_ms * max_percent / 100 + SELF_TEST_TIME_MARGIN_MS;
+}
+
+static bool heap_below(uint32_t value, uint32_t baseline, uint32_t min_percent)
+{
+    return value < (uint64_t) baseline * min_percent / 100;
+}
+
+/**
+ * @brief Compares the metrics with the baseline.
+ *
+ * @return true If all metrics are within the thresholds, otherwise reason describes the first regression
+ */
+static bool within_thresholds(const struct self_test_metrics *metrics, const struct self_test_metrics *baseline,
+                char *reason, size_t size)
+{
+    if (time_exceeds(metrics->boot_ms, baseline->boot_ms, CONFIG_OTA_SELF_TEST_MAX_BOOT_PERCENT))
+    {
+        snprintf(reason, size, "Boot to connected %u ms, baseline %u ms", metrics->boot_ms, baseline->boot_ms);
+        return false;
+    }
+    if (time_exceeds(metrics->rtt_ms, baseline->rtt_ms, CONFIG_OTA_SELF_TEST_MAX_RTT_PERCENT))
+    {
+        snprintf(reason, size, "MQTT round trip %u ms, baseline %u ms", metrics->rtt_ms, baseline->rtt_ms);
+        return false;
+    }
+    if (heap_below(metrics->free_heap, baseline->free_heap, CONFIG_OTA_SELF_TEST_MIN_HEAP_PERCENT))
+    {
+        snprintf(reason, size, "Free heap %u bytes, baseline %u bytes", metrics->free_heap, baseline->free_heap);
+        return false;
+    }
+    if (heap_below(metrics->min_free_heap, baseline->min_free_heap, CONFIG_OTA_SELF_TEST_MIN_HEAP_PERCENT))
+    {
+        snprintf(reason, size, "Min free heap %u bytes, baseline %u bytes", metrics->min_free_heap,
+                        baseline->min_free_heap);
+        return false;
+    }
+    return true;
+}
+
+static void rtt_received(int id, const char *data, int data_len, void *ctx)
+{
+    struct self_test *self_test = ctx;
+    int64_t elapsed_us = esp_timer_get_time() - self_test->rtt_sent_us;
+    portENTER_CRITICAL(&self_test->lock);
+    if (data != NULL)
+    {
+        self_test->rtt_total_ms += elapsed_us / 1000;
+        self_test->rtt_samples++;
+    }
+    self_test->rtt_in_flight = false;
+    portEXIT_CRITICAL(&self_test->lock);
+}
+
+static void send_rtt_request(struct self_test *self_test)
+{
+    portENTER_CRITICAL(&self_test->lock);
+    self_test->rtt_in_flight = true;
+    portEXIT_CRITICAL(&self_test->lock);
+    self_test->rtt_sent_us = esp_timer_get_time();
+    self_test->rtt_requests++;
+
+#ifdef CONFIG_TB_PAYLOAD_PROTOBUF
+    uint8_t request[sizeof(TB_SHARED_ATTR_FIELD_FW_VER) + 8];
+    int request_len = tb_proto_encode_attributes_request(request, sizeof(request), TB_SHARED_ATTR_FIELD_FW_VER);
+    int id = tb_request_attributes(self_test->requests, (const char*) request, request_len, SELF_TEST_RTT_TIMEOUT_MS,
+                    rtt_received, self_test, NULL);
+#else
+    const char *request = "{\"sharedKeys\":\"" TB_SHARED_ATTR_FIELD_FW_VER "\"}";
+    int id = tb_request_attributes(self_test->requests, request, strlen(request), SELF_TEST_RTT_TIMEOUT_MS,
+                    rtt_received, self_test, NULL);
+#endif
+    if (id < 0)
+    {
+        portENTER_CRITICAL(&self_test->lock);
+        self_test->rtt_in_flight = false;
+        portEXIT_CRITICAL(&self_test->lock);
+    }
+}
+
+/*! Reports the self-test failure that rolled the device back to this image */
+static void report_failure(struct self_test *self_test)
+{
+    self_test->failure_reported = true;
+    nvs_handle handle;
+    if (nvs_open(NVS_KEY_SELF_TEST, NVS_READWRITE, &handle) != ESP_OK)
+    {
+        return;
+    }
+
+    char reason[SELF_TEST_MAX_REASON];
+    size_t len = sizeof(reason);
+    if (nvs_get_str(handle, NVS_KEY_SELF_TEST_FAILURE, reason, &len) == ESP_OK)
+    {
+        char rejected[sizeof(((struct shared_keys*) 0)->fw_version)] = "";
+        len = sizeof(rejected);
+        nvs_get_str(handle, NVS_KEY_SELF_TEST_REJECTED, rejected, &len);
+        ESP_LOGW(TAG, "Rolled back from %s: %s", rejected, reason);
+        fw_state_report(self_test->fw_state, "UPDATE", FIRMWARE_VERSION, "FAILED", reason);
+        nvs_erase_key(handle, NVS_KEY_SELF_TEST_FAILURE);
+        nvs_commit(handle);
+    }
+    nvs_close(handle);
+}
+
+void self_test_init(struct self_test *self_test, struct fw_state *fw_state, struct tb_request *requests,
+                self_test_timeout_t timeout, void *ctx)
+{
+    assert(timeout != NULL);
+
+    esp_ota_img_states_t ota_state;
+
+    self_test->fw_state = fw_state;
+    self_test->requests = requests;
+    self_test->timeout_cb = timeout;
+    self_test->timeout_ctx = ctx;
+    portMUX_INITIALIZE(&self_test->lock);
+    if (self_test->pending || esp_ota_get_state_partition(esp_ota_get_running_partition(), &ota_state) != ESP_OK
+                    || ota_state != ESP_OTA_IMG_PENDING_VERIFY)
+    {
+        return;
+    }
+
+    ESP_LOGW(TAG, "First boot of %s, it is verified by the self-test", FIRMWARE_VERSION);
+    self_test->pending = true;
+    const esp_timer_create_args_t timer_args = { .callback = connect_timeout, .arg = self_test, .name = "self_test" };
+    if (esp_timer_create(&timer_args, &self_test->connect_timer) == ESP_OK)
+    {
+        esp_timer_start_once(self_test->connect_timer, CONFIG_OTA_SELF_TEST_CONNECT_TIMEOUT_S * 1000000ULL);
+    }
+}
+
+void self_test_connected(struct self_test *self_test)
+{
+    if (self_test->connected_us != 0)
+    {
+        return;
+    }
+    self_test->connected_us = esp_timer_get_time();
+    if (self_test->pending && self_test->connect_timer != NULL)
+    {
+        esp_timer_stop(self_test->connect_timer);
+    }
+}
+
+void self_test_connect_timeout(struct self_test *self_test)
+{
+    if (!self_test->pending || self_test->connected_us != 0)
+    {
+        return;
+    }
+    char reason[SELF_TEST_MAX_REASON];
+    snprintf(reason, sizeof(reason), "Not connected to ThingsBoard within %d s", CONFIG_OTA_SELF_TEST_CONNECT_TIMEOUT_S);
+    roll_back(self_test, reason, false);
+}
+
+void self_test_poll(struct self_test *self_test)
+{
+    if (self_test->done || self_test->connected_us == 0)
+    {
+        return;
+    }
+    if (!self_test->pending && !self_test->failure_reported)
+    {
+        report_failure(self_test);
+    }
+
+    bool in_flight;
+    portENTER_CRITICAL(&self_test->lock);
+    in_flight = self_test->rtt_in_flight;
+    portEXIT_CRITICAL(&self_test->lock);
+    if (in_flight)
+    {
+        return;
+    }
+    if (self_test->rtt_requests < SELF_TEST_RTT_SAMPLES)
+    {
+        send_rtt_request(self_test);
+        return;
+    }
+    if (esp_timer_get_time() - self_test->connected_us < CONFIG_OTA_SELF_TEST_DURATION_S * 1000000LL)
+    {
+        return;
+    }
+    self_test->done = true;
+
+    struct self_test_metrics metrics = {
+        .boot_ms = self_test->connected_us / 1000,
+        .rtt_ms = self_test->rtt_samples > 0 ? self_test->rtt_total_ms / self_test->rtt_samples : 0,
+        .free_heap = esp_get_free_heap_size(),
+        .min_free_heap = esp_get_minimum_free_heap_size(),
+    };
+    ESP_LOGI(TAG, "Self-test: boot to connected %u ms, MQTT round trip %u ms (%d/%d), free heap %u, min free heap %u",
+                    metrics.boot_ms, metrics.rtt_ms, self_test->rtt_samples, self_test->rtt_requests, metrics.free_heap,
+                    metrics.min_free_heap);
+
+    if (self_test->pending)
+    {
+        char reason[SELF_TEST_MAX_REASON];
+        struct self_test_metrics baseline;
+        if (self_test->rtt_samples == 0)
+        {
+            snprintf(reason, sizeof(reason), "No response to %d attributes requests", self_test->rtt_requests);
+            roll_back(self_test, reason, true);
+            return;
+        }
+        if (!load_baseline(&baseline))
+        {
+            ESP_LOGW(TAG, "No baseline of the previous image, accepting %s", FIRMWARE_VERSION);
+        } else if (!within_thresholds(&metrics, &baseline, reason, sizeof(reason)))
+        {
+            roll_back(self_test, reason, true);
+            return;
+        }
+        APP_ABORT_ON_ERROR(esp_ota_mark_app_valid_cancel_rollback());
+        self_test->pending = false;
+        ESP_LOGI(TAG, "Self-test passed, %s is valid", FIRMWARE_VERSION);
+    }
+
+    /* A timer wake reconnects with the cached Wi-Fi channel, it would set a baseline no restart reaches */
+    if (metrics.rtt_ms != 0 && esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_TIMER)
+    {
+        save_baseline(&metrics);
+    }
+}
+
+bool self_test_pending(const struct self_test *self_test)
+{
+    return self_test->pending;
+}
+
+bool self_test_rejected(const char *version)
+{
+    assert(version != NULL);
+
+    nvs_handle handle;
+    if (nvs_open(NVS_KEY_SELF_TEST, NVS_READONLY, &handle) != ESP_OK)
+    {
+        return false;
+    }
+    char rejected[sizeof(((struct shared_keys*) 0)->fw_version)];
+    size_t len = sizeof(rejected);
+    esp_err_t result_code = nvs_get_str(handle, NVS_KEY_SELF_TEST_REJECTED, rejected, &len);
+    nvs_close(handle);
+    return result_code == ESP_OK && strcasecmp(rejected, version) == 0;
+}
+
+void self_test_target_offered(const char *version)
+{
+    assert(version != NULL);
+
+    nvs_handle handle;
+    if (nvs_open(NVS_KEY_SELF_TEST, NVS_READWRITE, &handle) != ESP_OK)
+    {
+        return;
+    }
+    char rejected[sizeof(((struct shared_keys*) 0)->fw_version)];
+    size_t len = sizeof(rejected);
+    if (nvs_get_str(handle, NVS_KEY_SELF_TEST_REJECTED, rejected, &len) == ESP_OK && strcasecmp(rejected, version) != 0)
+    {
+        ESP_LOGI(TAG, "Target changed to %s, %s may be offered again", version, rejected);
+        nvs_erase_key(handle, NVS_KEY_SELF_TEST_REJECTED);
+        nvs_commit(handle);
+    }
+    nvs_close(handle);
+}
+
+#endif
@@ -0,0 +1,99 @@
+/**
+ * @file self_test.h
+ */
+
+#ifndef PRJ_SELF_TEST_MODULE
+#define PRJ_SELF_TEST_MODULE
+
+#include <stdbool.h>
+#include "esp_ota_ops.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "fw_state.h"
+#include "tb_request.h"
+
+/*! NVS namespace of the baseline metrics and the result of a failed self-test */
+#define NVS_KEY_SELF_TEST "self_test"
+
+/*! Called in the esp_timer task when a new image didn't connect in time */
+typedef void (*self_test_timeout_t)(void *ctx);
+
+#ifdef CONFIG_OTA_SELF_TEST
+
+/* Self-test of the image one device runs, zeroed until @ref self_test_init */
+struct self_test
+{
+    /*! The failure is reported with fw_state, the round trip is measured with attributes requests */
+    struct fw_state *fw_state;
+    struct tb_request *requests;
+
+    portMUX_TYPE lock;
+    bool pending;
+    bool done;
+    bool failure_reported;
+    int64_t connected_us;
+    self_test_timeout_t timeout_cb;
+    void *timeout_ctx;
+    esp_timer_handle_t connect_timer;
+
+    bool rtt_in_flight;
+    int64_t rtt_sent_us;
+    uint32_t rtt_total_ms;
+    int rtt_samples;
+    int rtt_requests;
+};
+
+/**
+ * @brief Checks if the running image is booted for the first time and waits for verification.
+ *        If such an image doesn't connect within CONFIG_OTA_SELF_TEST_CONNECT_TIMEOUT_S, timeout is called.
+ */
+void self_test_init(struct self_test *self_test, struct fw_state *fw_state, struct tb_request *requests,
+                self_test_timeout_t timeout, void *ctx);
+
+/*! Rolls back the image after the connect timeout, unless it connected since. Called from the OTA task */
+void self_test_connect_timeout(struct self_test *self_test);
+
+/*! Called on MQTT_EVENT_CONNECTED, the first connect of the boot gives the boot-to-connected time */
+void self_test_connected(struct self_test *self_test);
+
+/**
+ * @brief Measures the MQTT round trip and, CONFIG_OTA_SELF_TEST_DURATION_S after the first connect,
+ *        compares the metrics with the baseline of the previous image. Marks a new image valid or
+ *        rolls it back, a valid image stores its metrics as the next baseline.
+ *        Called from the OTA task loop while connected.
+ */
+void self_test_poll(struct self_test *self_test);
+
+/*! Returns true while the running image waits for the self-test, no update may be written until then */
+bool self_test_pending(const struct self_test *self_test);
+
+/*! Returns true if the firmware version was rolled back by a failed self-test, it isn't downloaded again */
+bool self_test_rejected(const char *version);
+
+/*! Forgets the version rolled back by a failed self-test when ThingsBoard offers another one */
+void self_test_target_offered(const char *version);
+
+#else
+
+/* Nothing to verify */
+struct self_test
+{
+    char unused;
+};
+
+#ifdef CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE
+/* Without the self-test a new image is accepted as soon as it runs */
+#define self_test_init(self_test, fw_state, requests, timeout, ctx) ((void) esp_ota_mark_app_valid_cancel_rollback())
+#else
+#define self_test_init(self_test, fw_state, requests, timeout, ctx) do { } while (0)
+#endif
+#define self_test_connect_timeout(self_test) do { } while (0)
+#define self_test_connected(self_test) do { } while (0)
+#define self_test_poll(self_test) do { } while (0)
+#define self_test_pending(self_test) false
+#define self_test_rejected(version) false
+#define self_test_target_offered(version) do { } while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,425 @@
+/**
+ * @file tb_proto.c
+ *
+ * Protobuf wire format encoders and decoders for the ThingsBoard protobuf MQTT transport.
+ * Messages are encoded into and decoded from caller buffers, field by field, without generated code.
+ * Downlink messages follow ThingsBoard's transport.proto, uplink telemetry proto/tb_ota.proto.
+ */
+
+#include <assert.h>
+#include <string.h>
+#include "esp_log.h"
+
+#include "mqttOta.h"
+#include "tb_proto.h"
+
+#define PB_WIRE_VARINT 0
+#define PB_WIRE_FIXED64 1
+#define PB_WIRE_BYTES 2
+#define PB_WIRE_FIXED32 5
+
+/* Field numbers of tb_ota.proto Telemetry */
+#define TELEMETRY_CURRENT_FW_TITLE 1
+#define TELEMETRY_CURRENT_FW_VERSION 2
+#define TELEMETRY_FW_STATE 3
+#define TELEMETRY_FW_ERROR 4
+#define TELEMETRY_COUNTER 5
+#define TELEMETRY_CURRENT_SW_TITLE 6
+#define TELEMETRY_CURRENT_SW_VERSION 7
+#define TELEMETRY_SW_STATE 8
+#define TELEMETRY_SW_ERROR 9
+
+/* Field numbers of transport.proto AttributesRequest */
+#define ATTRIBUTES_REQUEST_SHARED_KEYS 2
+
+/* Field numbers of transport.proto GetAttributeResponseMsg */
+#define RESPONSE_SHARED_ATTRIBUTE_LIST 3
+#define RESPONSE_ERROR 5
+
+/* Field numbers of transport.proto AttributeUpdateNotificationMsg */
+#define UPDATE_SHARED_UPDATED 1
+#define UPDATE_SHARED_DELETED 2
+
+/* Field numbers of transport.proto TsKvProto */
+#define TSKV_KV 2
+
+/* Field numbers of transport.proto KeyValueProto */
+#define KV_KEY 1
+#define KV_TYPE 2
+#define KV_BOOL 3
+#define KV_LONG 4
+#define KV_DOUBLE 5
+#define KV_STRING 6
+#define KV_JSON 7
+
+/* Values of transport.proto KeyValueType */
+#define KV_TYPE_BOOLEAN 0
+#define KV_TYPE_LONG 1
+#define KV_TYPE_DOUBLE 2
+#define KV_TYPE_STRING 3
+#define KV_TYPE_JSON 4
+
+struct pb_writer
+{
+    uint8_t *buf;
+    size_t size;
+    size_t len;
+    bool overflow;
+};
+
+struct pb_reader
+{
+    const uint8_t *pos;
+    const uint8_t *end;
+};
+
+static void pb_put_varint(struct pb_writer *w, uint64_t value)
+{
+    do
+    {
+        uint8_t byte = value & 0x7f;
+        value >>= 7;
+        if (value != 0)
+        {
+            byte |= 0x80;
+        }
+        if (w->len >= w->size)
+        {
+            w->overflow = true;
+            return;
+        }
+        w->buf[w->len++] = byte;
+    } while (value != 0);
+}
+
+static void pb_put_string(struct pb_writer *w, uint32_t field, const char *value)
+{
+    if (value == NULL)
+    {
+        return;
+    }
+    size_t len = strlen(value);
+    pb_put_varint(w, (field << 3) | PB_WIRE_BYTES);
+    pb_put_varint(w, len);
+    if (w->overflow || w->size - w->len < len)
+    {
+        w->overflow = true;
+        return;
+    }
+    memcpy(w->buf + w->len, value, len);
+    w->len += len;
+}
+
+static void pb_put_int(struct pb_writer *w, uint32_t field, int64_t value)
+{
+    pb_put_varint(w, (field << 3) | PB_WIRE_VARINT);
+    // int32/int64 negative values are encoded as 10 byte two's complement varints
+    pb_put_varint(w, (uint64_t) value);
+}
+
+static bool pb_get_varint(struct pb_reader *r, uint64_t *value)
+{
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        if (r->pos >= r->end)
+        {
+            return false;
+        }
+        uint8_t byte = *r->pos++;
+        *value |= (uint64_t) (byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool pb_get_tag(struct pb_reader *r, uint32_t *field, uint32_t *wire_type)
+{
+    uint64_t tag;
+    if (!pb_get_varint(r, &tag))
+    {
+        return false;
+    }
+    *field = tag >> 3;
+    *wire_type = tag & 0x07;
+    return true;
+}
+
+static bool pb_get_bytes(struct pb_reader *r, const uint8_t **data, size_t *len)
+{
+    uint64_t value;
+    if (!pb_get_varint(r, &value) || value > (uint64_t) (r->end - r->pos))
+    {
+        return false;
+    }
+    *data = r->pos;
+    *len = value;
+    r->pos += value;
+    return true;
+}
+
+static bool pb_skip(struct pb_reader *r, uint32_t wire_type)
+{
+    uint64_t value;
+    const uint8_t *data;
+    size_t len;
+
+    switch (wire_type)
+    {
+    case PB_WIRE_VARINT:
+        return pb_get_varint(r, &value);
+    case PB_WIRE_BYTES:
+        return pb_get_bytes(r, &data, &len);
+    case PB_WIRE_FIXED64:
+        len = 8;
+    break;
+    case PB_WIRE_FIXED32:
+        len = 4;
+    break;
+    default:
+        return false;
+    }
+    if ((size_t) (r->end - r->pos) < len)
+    {
+        return false;
+    }
+    r->pos += len;
+    return true;
+}
+
+static void copy_string(char *dst, size_t dst_size, const uint8_t *src, size_t len)
+{
+    len = len < dst_size - 1 ? len : dst_size - 1;
+    memcpy(dst, src, len);
+    dst[len] = 0;
+}
+
+/*! Decodes a KeyValueProto and adds it to the object */
+static bool decode_key_value(const uint8_t *data, size_t len, cJSON *object)
+{
+    struct pb_reader r = { data, data + len };
+    char key[TB_PROTO_MAX_KEY + 1] = { 0 };
+    char string_value[TB_PROTO_MAX_STRING + 1] = { 0 };
+    uint64_t type = KV_TYPE_BOOLEAN;
+    uint64_t int_value = 0;
+    double double_value = 0;
+    uint32_t field, wire_type;
+
+    while (r.pos < r.end)
+    {
+        if (!pb_get_tag(&r, &field, &wire_type))
+        {
+            return false;
+        }
+        const uint8_t *bytes;
+        size_t bytes_len;
+        if ((field == KV_KEY || field == KV_STRING || field == KV_JSON) && wire_type == PB_WIRE_BYTES)
+        {
+            if (!pb_get_bytes(&r, &bytes, &bytes_len))
+            {
+                return false;
+            }
+            if (field == KV_KEY)
+            {
+                copy_string(key, sizeof(key), bytes, bytes_len);
+            } else
+            {
+                copy_string(string_value, sizeof(string_value), bytes, bytes_len);
+            }
+        } else if (field == KV_TYPE && wire_type == PB_WIRE_VARINT)
+        {
+            if (!pb_get_varint(&r, &type))
+            {
+                return false;
+            }
+        } else if ((field == KV_BOOL || field == KV_LONG) && wire_type == PB_WIRE_VARINT)
+        {
+            if (!pb_get_varint(&r, &int_value))
+            {
+                return false;
+            }
+        } else if (field == KV_DOUBLE && wire_type == PB_WIRE_FIXED64)
+        {
+            if (r.end - r.pos < 8)
+            {
+                return false;
+            }
+            // Both the wire format and the ESP32 are little endian
+            memcpy(&double_value, r.pos, sizeof(double_value));
+            r.pos += 8;
+        } else if (!pb_skip(&r, wire_type))
+        {
+            return false;
+        }
+    }
+
+    if (key[0] == 0)
+    {
+        return false;
+    }
+
+    switch (type)
+    {
+    case KV_TYPE_BOOLEAN:
+        cJSON_AddBoolToObject(object, key, int_value != 0);
+    break;
+    case KV_TYPE_LONG:
+        cJSON_AddNumberToObject(object, key, (double) (int64_t) int_value);
+    break;
+    case KV_TYPE_DOUBLE:
+        cJSON_AddNumberToObject(object, key, double_value);
+    break;
+    default:
+        // JSON values are passed on as their text, like the OTA keys they are not used as objects
+        cJSON_AddStringToObject(object, key, string_value);
+    break;
+    }
+    return true;
+}
+
+/*! Decodes a TsKvProto and adds its value to the object */
+static bool decode_ts_kv(const uint8_t *data, size_t len, cJSON *object)
+{
+    struct pb_reader r = { data, data + len };
+    uint32_t field, wire_type;
+
+    while (r.pos < r.end)
+    {
+        if (!pb_get_tag(&r, &field, &wire_type))
+        {
+            return false;
+        }
+        if (field == TSKV_KV && wire_type == PB_WIRE_BYTES)
+        {
+            const uint8_t *kv;
+            size_t kv_len;
+            if (!pb_get_bytes(&r, &kv, &kv_len) || !decode_key_value(kv, kv_len, object))
+            {
+                return false;
+            }
+        } else if (!pb_skip(&r, wire_type))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+int tb_proto_encode_telemetry(uint8_t *buf, size_t size, const struct tb_proto_telemetry *msg)
+{
+    assert(buf != NULL && msg != NULL);
+
+    struct pb_writer w = { buf, size, 0, false };
+    pb_put_string(&w, TELEMETRY_CURRENT_FW_TITLE, msg->current_fw_title);
+    pb_put_string(&w, TELEMETRY_CURRENT_FW_VERSION, msg->current_fw_version);
+    pb_put_string(&w, TELEMETRY_FW_STATE, msg->fw_state);
+    pb_put_string(&w, TELEMETRY_FW_ERROR, msg->fw_error);
+    if (msg->has_counter)
+    {
+        pb_put_int(&w, TELEMETRY_COUNTER, msg->counter);
+    }
+    pb_put_string(&w, TELEMETRY_CURRENT_SW_TITLE, msg->current_sw_title);
+    pb_put_string(&w, TELEMETRY_CURRENT_SW_VERSION, msg->current_sw_version);
+    pb_put_string(&w, TELEMETRY_SW_STATE, msg->sw_state);
+    pb_put_string(&w, TELEMETRY_SW_ERROR, msg->sw_error);
+    return w.overflow ? -1 : (int) w.len;
+}
+
+int tb_proto_encode_attributes_request(uint8_t *buf, size_t size, const char *shared_keys)
+{
+    assert(buf != NULL && shared_keys != NULL);
+
+    struct pb_writer w = { buf, size, 0, false };
+    pb_put_string(&w, ATTRIBUTES_REQUEST_SHARED_KEYS, shared_keys);
+    return w.overflow ? -1 : (int) w.len;
+}
+
+cJSON* tb_proto_decode_attributes_response(const uint8_t *data, size_t len)
+{
+    struct pb_reader r = { data, data + len };
+    uint32_t field, wire_type;
+    cJSON *shared = cJSON_CreateObject();
+
+    while (r.pos < r.end)
+    {
+        const uint8_t *bytes;
+        size_t bytes_len;
+        if (!pb_get_tag(&r, &field, &wire_type))
+        {
+            goto malformed;
+        }
+        if ((field == RESPONSE_SHARED_ATTRIBUTE_LIST || field == RESPONSE_ERROR) && wire_type == PB_WIRE_BYTES)
+        {
+            if (!pb_get_bytes(&r, &bytes, &bytes_len))
+            {
+                goto malformed;
+            }
+            if (field == RESPONSE_ERROR)
+            {
+                ESP_LOGE(TAG, "Attributes request failed: %.*s", (int) bytes_len, (const char*) bytes);
+            } else if (!decode_ts_kv(bytes, bytes_len, shared))
+            {
+                goto malformed;
+            }
+        } else if (!pb_skip(&r, wire_type))
+        {
+            goto malformed;
+        }
+    }
+    return shared;
+
+malformed:
+    ESP_LOGE(TAG, "Malformed protobuf attributes response");
+    cJSON_Delete(shared);
+    return NULL;
+}
+
+cJSON* tb_proto_decode_attributes_update(const uint8_t *data, size_t len)
+{
+    struct pb_reader r = { data, data + len };
+    uint32_t field, wire_type;
+    cJSON *updated = cJSON_CreateObject();
+    cJSON *deleted = NULL;
+
+    while (r.pos < r.end)
+    {
+        const uint8_t *bytes;
+        size_t bytes_len;
+        if (!pb_get_tag(&r, &field, &wire_type))
+        {
+            goto malformed;
+        }
+        if (field == UPDATE_SHARED_UPDATED && wire_type == PB_WIRE_BYTES)
+        {
+            if (!pb_get_bytes(&r, &bytes, &bytes_len) || !decode_ts_kv(bytes, bytes_len, updated))
+            {
+                goto malformed;
+            }
+        } else if (field == UPDATE_SHARED_DELETED && wire_type == PB_WIRE_BYTES)
+        {
+            char key[TB_PROTO_MAX_KEY + 1];
+            if (!pb_get_bytes(&r, &bytes, &bytes_len))
+            {
+                goto malformed;
+            }
+            if (deleted == NULL)
+            {
+                deleted = cJSON_AddArrayToObject(updated, "deleted");
+            }
+            copy_string(key, sizeof(key), bytes, bytes_len);
+            cJSON_AddItemToArray(deleted, cJSON_CreateString(key));
+        } else if (!pb_skip(&r, wire_type))
+        {
+            goto malformed;
+        }
+    }
+    return updated;
+
+malformed:
+    ESP_LOGE(TAG, "Malformed protobuf attributes update");
+    cJSON_Delete(updated);
+    return NULL;
+}
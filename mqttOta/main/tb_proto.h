@@ -0,0 +1,71 @@
+/**
+ * @file tb_proto.h
+ */
+
+#ifndef PRJ_TB_PROTO_MODULE
+#define PRJ_TB_PROTO_MODULE
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "cJSON.h"
+
+/*! Max length of a string value decoded from ThingsBoard */
+#define TB_PROTO_MAX_STRING 600
+
+/*! Max length of an attribute key decoded from ThingsBoard */
+#define TB_PROTO_MAX_KEY 64
+
+/*! Buffer size large enough for any telemetry message sent by the device */
+#define TB_PROTO_TELEMETRY_MAX_SIZE 640
+
+/**
+ * @brief Fields of the telemetry schema, see proto/tb_ota.proto.
+ *        NULL strings and has_counter == false leave the field out.
+ */
+struct tb_proto_telemetry
+{
+    const char *current_fw_title;
+    const char *current_fw_version;
+    const char *fw_state;
+    const char *fw_error;
+    bool has_counter;
+    int32_t counter;
+    const char *current_sw_title;
+    const char *current_sw_version;
+    const char *sw_state;
+    const char *sw_error;
+};
+
+/**
+ * @brief Encodes a telemetry message of the device profile schema.
+ *
+ * @return int Encoded length, -1 if buf is too small
+ */
+int tb_proto_encode_telemetry(uint8_t *buf, size_t size, const struct tb_proto_telemetry *msg);
+
+/**
+ * @brief Encodes the attributes request of the ThingsBoard protobuf transport (AttributesRequest).
+ *
+ * @param shared_keys Comma separated shared attribute keys
+ * @return int Encoded length, -1 if buf is too small
+ */
+int tb_proto_encode_attributes_request(uint8_t *buf, size_t size, const char *shared_keys);
+
+/**
+ * @brief Decodes the shared attributes of an attributes response (GetAttributeResponseMsg)
+ *        into a cJSON object, as they would be in the "shared" object of a JSON response.
+ *
+ * @return cJSON* Object the caller has to delete, NULL on malformed input
+ */
+cJSON* tb_proto_decode_attributes_response(const uint8_t *data, size_t len);
+
+/**
+ * @brief Decodes a shared attributes update (AttributeUpdateNotificationMsg) into a cJSON object,
+ *        as the JSON transport would send it. Deleted keys are listed in its "deleted" array.
+ *
+ * @return cJSON* Object the caller has to delete, NULL on malformed input
+ */
+cJSON* tb_proto_decode_attributes_update(const uint8_t *data, size_t len);
+
+#endif
@@ -0,0 +1,247 @@
+/**
+ * @file tb_request.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+
+#include "mqttOta.h"
+#include "tb_request.h"
+
+#define TOPIC_SIZE 64
+
+/*! Removes the request with the id from the table, must be called with the lock taken */
+static bool take_request_locked(struct tb_request *requests, int id, struct pending_request *request)
+{
+    for (int i = 0; i < CONFIG_TB_REQUEST_MAX_PENDING; i++)
+    {
+        if (requests->pending[i].id == id)
+        {
+            *request = requests->pending[i];
+            requests->pending[i].id = 0;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*! Parses the request id at the end of topic after prefix, returns 0 if the topic doesn't match */
+static int topic_request_id(const char *topic, const char *prefix)
+{
+    size_t prefix_len = strlen(prefix);
+    if (strncmp(topic, prefix, prefix_len) != 0)
+    {
+        return 0;
+    }
+    char *end;
+    long id = strtol(topic + prefix_len, &end, 10);
+    return *end == 0 && id > 0 ? id : 0;
+}
+
+void tb_request_init(struct tb_request *requests, esp_mqtt_client_handle_t client)
+{
+    if (requests->lock == NULL)
+    {
+        requests->lock = xSemaphoreCreateMutex();
+        requests->next_id = 1;
+    }
+    requests->client = client;
+}
+
+int tb_request_attributes(struct tb_request *requests, const char *payload, int payload_len, uint32_t timeout_ms,
+                tb_request_completion_t completion, void *ctx, int *request_id)
+{
+    assert(requests->lock != NULL && payload != NULL && completion != NULL);
+
+    struct pending_request *request = NULL;
+    xSemaphoreTake(requests->lock, portMAX_DELAY);
+    for (int i = 0; request == NULL && i < CONFIG_TB_REQUEST_MAX_PENDING; i++)
+    {
+        if (requests->pending[i].id == 0)
+        {
+            request = &requests->pending[i];
+        }
+    }
+    if (request == NULL)
+    {
+        xSemaphoreGive(requests->lock);
+        ESP_LOGE(TAG, "Unable to request attributes, %d requests pending", CONFIG_TB_REQUEST_MAX_PENDING);
+        return -1;
+    }
+
+    // Ids are never reused while a request is pending, a late response can't complete a newer request
+    int id = requests->next_id;
+    requests->next_id = requests->next_id < INT32_MAX ? requests->next_id + 1 : 1;
+    request->id = id;
+    request->deadline = xTaskGetTickCount() + pdMS_TO_TICKS(timeout_ms);
+    request->completion = completion;
+    request->ctx = ctx;
+    if (request_id != NULL)
+    {
+        *request_id = id;
+    }
+    xSemaphoreGive(requests->lock);
+
+    char topic[TOPIC_SIZE];
+    snprintf(topic, sizeof(topic), TB_ATTRIBUTES_REQUEST_TOPIC_PREFIX "%d", id);
+    if (esp_mqtt_client_publish(requests->client, topic, payload, payload_len, 1, 0) < 0)
+    {
+        struct pending_request failed;
+        xSemaphoreTake(requests->lock, portMAX_DELAY);
+        take_request_locked(requests, id, &failed);
+        if (request_id != NULL)
+        {
+            *request_id = -1;
+        }
+        xSemaphoreGive(requests->lock);
+        ESP_LOGE(TAG, "Unable to publish attributes request %d", id);
+        return -1;
+    }
+    ESP_LOGD(TAG, "Attributes request %d sent", id);
+    return id;
+}
+
+bool tb_request_handle_response(struct tb_request *requests, const char *topic, const char *data, int data_len)
+{
+    int id = topic_request_id(topic, TB_ATTRIBUTES_RESPONSE_TOPIC_PREFIX);
+    if (id == 0 || requests->lock == NULL)
+    {
+        return false;
+    }
+
+    struct pending_request request;
+    xSemaphoreTake(requests->lock, portMAX_DELAY);
+    bool found = take_request_locked(requests, id, &request);
+    xSemaphoreGive(requests->lock);
+
+    if (found)
+    {
+        request.completion(id, data, data_len, request.ctx);
+    } else
+    {
+        ESP_LOGW(TAG, "Dropping response to unknown or timed out attributes request %d", id);
+    }
+    return true;
+}
+
+void tb_request_poll(struct tb_request *requests)
+{
+    if (requests->lock == NULL)
+    {
+        return;
+    }
+
+    TickType_t now = xTaskGetTickCount();
+    for (int i = 0; i < CONFIG_TB_REQUEST_MAX_PENDING; i++)
+    {
+        struct pending_request request;
+        bool expired = false;
+        xSemaphoreTake(requests->lock, portMAX_DELAY);
+        if (requests->pending[i].id != 0 && (int32_t) (now - requests->pending[i].deadline) >= 0)
+        {
+            expired = take_request_locked(requests, requests->pending[i].id, &request);
+        }
+        xSemaphoreGive(requests->lock);
+
+        // Completions are called without the lock, they may send a new request
+        if (expired)
+        {
+            ESP_LOGW(TAG, "Attributes request %d timed out", request.id);
+            request.completion(request.id, NULL, 0, request.ctx);
+        }
+    }
+}
+
+bool tb_rpc_register(struct tb_request *requests, const char *method, tb_rpc_handler_t handler, void *ctx)
+{
+    assert(requests->lock != NULL && method != NULL && handler != NULL);
+
+    if (strlen(method) >= sizeof(requests->rpc_methods[0].name))
+    {
+        return false;
+    }
+
+    struct rpc_method *entry = NULL;
+    xSemaphoreTake(requests->lock, portMAX_DELAY);
+    for (int i = 0; i < CONFIG_TB_RPC_MAX_METHODS; i++)
+    {
+        if (strcmp(requests->rpc_methods[i].name, method) == 0)
+        {
+            entry = &requests->rpc_methods[i];
+            break;
+        }
+        if (entry == NULL && requests->rpc_methods[i].name[0] == 0)
+        {
+            entry = &requests->rpc_methods[i];
+        }
+    }
+    if (entry != NULL)
+    {
+        strcpy(entry->name, method);
+        entry->handler = handler;
+        entry->ctx = ctx;
+    }
+    xSemaphoreGive(requests->lock);
+    return entry != NULL;
+}
+
+bool tb_rpc_handle_request(struct tb_request *requests, const char *topic, const char *data)
+{
+    int id = topic_request_id(topic, TB_RPC_REQUEST_TOPIC_PREFIX);
+    if (id == 0 || requests->lock == NULL)
+    {
+        return false;
+    }
+
+    cJSON *request = cJSON_Parse(data);
+    cJSON *method = cJSON_GetObjectItem(request, "method");
+    if (!cJSON_IsString(method))
+    {
+        ESP_LOGE(TAG, "Malformed RPC request %d: %s", id, data);
+        cJSON_Delete(request);
+        return true;
+    }
+
+    tb_rpc_handler_t handler = NULL;
+    void *ctx = NULL;
+    xSemaphoreTake(requests->lock, portMAX_DELAY);
+    for (int i = 0; i < CONFIG_TB_RPC_MAX_METHODS; i++)
+    {
+        if (strcmp(requests->rpc_methods[i].name, method->valuestring) == 0)
+        {
+            handler = requests->rpc_methods[i].handler;
+            ctx = requests->rpc_methods[i].ctx;
+            break;
+        }
+    }
+    xSemaphoreGive(requests->lock);
+
+    cJSON *response;
+    if (handler != NULL)
+    {
+        response = handler(cJSON_GetObjectItem(request, "params"), ctx);
+    } else
+    {
+        ESP_LOGW(TAG, "No handler for RPC method %s", method->valuestring);
+        response = cJSON_CreateObject();
+        cJSON_AddStringToObject(response, "error", "unknown method");
+    }
+    cJSON_Delete(request);
+
+    if (response != NULL)
+    {
+        char topic_response[TOPIC_SIZE];
+        snprintf(topic_response, sizeof(topic_response), TB_RPC_RESPONSE_TOPIC_PREFIX "%d", id);
+        char *response_string = cJSON_PrintUnformatted(response);
+        cJSON_Delete(response);
+        esp_mqtt_client_publish(requests->client, topic_response, response_string, 0, 1, 0);
+        // Free is intentional, it's client responsibility to free the result of cJSON_Print
+        free(response_string);
+    }
+    return true;
+}
@@ -0,0 +1,101 @@
+/**
+ * @file tb_request.h
+ */
+
+#ifndef PRJ_TB_REQUEST_MODULE
+#define PRJ_TB_REQUEST_MODULE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "mqtt_client.h"
+#include "cJSON.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#define TB_ATTRIBUTES_REQUEST_TOPIC_PREFIX "v1/devices/me/attributes/request/"
+#define TB_ATTRIBUTES_RESPONSE_TOPIC_PREFIX "v1/devices/me/attributes/response/"
+#define TB_RPC_REQUEST_TOPIC_PREFIX "v1/devices/me/rpc/request/"
+#define TB_RPC_RESPONSE_TOPIC_PREFIX "v1/devices/me/rpc/response/"
+#define TB_RPC_SUBSCRIBE_TO_REQUEST_TOPIC "v1/devices/me/rpc/request/+"
+
+/**
+ * @brief Completion of an attributes request, runs in the MQTT task or,
+ *        when the request timed out, in the task calling @ref tb_request_poll.
+ *
+ * @param id Request id returned by @ref tb_request_attributes
+ * @param data Response payload, NULL if no response arrived before the deadline
+ */
+typedef void (*tb_request_completion_t)(int id, const char *data, int data_len, void *ctx);
+
+/**
+ * @brief Handler of a server-side RPC method, runs in the MQTT task.
+ *
+ * @param params "params" of the request, may be NULL
+ * @return cJSON* Response sent back to ThingsBoard and deleted afterwards, NULL sends no response (one-way RPC)
+ */
+typedef cJSON* (*tb_rpc_handler_t)(const cJSON *params, void *ctx);
+
+/* One attributes request waiting for its response */
+struct pending_request
+{
+    int id;
+    TickType_t deadline;
+    tb_request_completion_t completion;
+    void *ctx;
+};
+
+/* One registered RPC method */
+struct rpc_method
+{
+    char name[32];
+    tb_rpc_handler_t handler;
+    void *ctx;
+};
+
+/* Pending requests and RPC methods of one device, zeroed until @ref tb_request_init */
+struct tb_request
+{
+    esp_mqtt_client_handle_t client;
+    SemaphoreHandle_t lock;
+    struct pending_request pending[CONFIG_TB_REQUEST_MAX_PENDING];
+    struct rpc_method rpc_methods[CONFIG_TB_RPC_MAX_METHODS];
+    int next_id;
+};
+
+void tb_request_init(struct tb_request *requests, esp_mqtt_client_handle_t client);
+
+/**
+ * @brief Publishes an attributes request with a new request id, the completion is called
+ *        with the response of this id or after timeout_ms without one.
+ *
+ * @param payload Request body, encoded in the payload format of the device
+ * @param request_id Set to the request id before the publish, so a completion running in the MQTT task
+ *        right after it sees the id, and back to -1 if the publish fails. May be NULL.
+ * @return int Request id, -1 if CONFIG_TB_REQUEST_MAX_PENDING requests are pending or the publish failed
+ */
+int tb_request_attributes(struct tb_request *requests, const char *payload, int payload_len, uint32_t timeout_ms,
+                tb_request_completion_t completion, void *ctx, int *request_id);
+
+/**
+ * @brief Completes the request a message on TB_ATTRIBUTES_RESPONSE_TOPIC_PREFIX<id> answers.
+ *        Responses of unknown or timed out requests are dropped.
+ *
+ * @return true If the topic is an attributes response topic
+ */
+bool tb_request_handle_response(struct tb_request *requests, const char *topic, const char *data, int data_len);
+
+/*! Completes the requests past their deadline, called from the OTA task loop */
+void tb_request_poll(struct tb_request *requests);
+
+/*! Registers the handler of an RPC method, a method registered again gets the new handler */
+bool tb_rpc_register(struct tb_request *requests, const char *method, tb_rpc_handler_t handler, void *ctx);
+
+/**
+ * @brief Calls the handler of a request on TB_RPC_REQUEST_TOPIC_PREFIX<id> and publishes its response.
+ *
+ * @param data NUL terminated request body
+ * @return true If the topic is an RPC request topic
+ */
+bool tb_rpc_handle_request(struct tb_request *requests, const char *topic, const char *data);
+
+#endif
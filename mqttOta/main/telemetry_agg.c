@@ -0,0 +1,301 @@
+/**
+ * @file telemetry_agg.c
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <float.h>
+#include <assert.h>
+#include <time.h>
+#include <sys/time.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "mqttOta.h"
+#include "telemetry_agg.h"
+#include "rollout.h"
+
+#ifdef CONFIG_TELEMETRY_AGGREGATION
+
+/*! Returns the time in ms since epoch, 0 while the system time is not set */
+static int64_t timestamp_ms(void)
+{
+    struct timeval now;
+    struct tm timeinfo;
+    gettimeofday(&now, NULL);
+    gmtime_r(&now.tv_sec, &timeinfo);
+    if (timeinfo.tm_year + 1900 < ROLLOUT_MIN_VALID_YEAR)
+    {
+        return 0;
+    }
+    return (int64_t) now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+static void reset_window(struct agg_key *key, int64_t now)
+{
+    key->window_start_us = now;
+    key->min = DBL_MAX;
+    key->max = -DBL_MAX;
+    key->sum = 0;
+    key->count = 0;
+}
+
+/*! Returns the slot of the key, a new one if create is set. Must be called with the lock taken */
+static struct agg_key* find_key_locked(struct telemetry_agg *agg, const char *name, bool create)
+{
+    for (int i = 0; i < agg->key_count; i++)
+    {
+        if (strcmp(agg->keys[i].name, name) == 0)
+        {
+            return &agg->keys[i];
+        }
+    }
+    if (!create || agg->key_count == CONFIG_TELEMETRY_AGG_MAX_KEYS || strlen(name) > TELEMETRY_AGG_MAX_KEY)
+    {
+        return NULL;
+    }
+    struct agg_key *key = &agg->keys[agg->key_count++];
+    strcpy(key->name, name);
+    key->window_s = agg->default_window_s;
+    key->window_set = false;
+    reset_window(key, esp_timer_get_time());
+    return key;
+}
+
+void telemetry_agg_init(struct telemetry_agg *agg)
+{
+    agg->key_count = 0;
+    agg->default_window_s = CONFIG_TELEMETRY_AGG_WINDOW_S;
+    agg->raw_first = 0;
+    agg->raw_count = 0;
+    agg->raw_dropped = 0;
+    portMUX_INITIALIZE(&agg->lock);
+}
+
+bool telemetry_agg_add(struct telemetry_agg *agg, const char *key_name, double value)
+{
+    assert(key_name != NULL);
+
+    int64_t ts_ms = timestamp_ms();
+    portENTER_CRITICAL(&agg->lock);
+    struct agg_key *key = find_key_locked(agg, key_name, true);
+    if (key != NULL && key->window_s == 0)
+    {
+        // A full buffer keeps the newest samples
+        if (agg->raw_count == CONFIG_TELEMETRY_AGG_RAW_SAMPLES)
+        {
+            agg->raw_first = (agg->raw_first + 1) % CONFIG_TELEMETRY_AGG_RAW_SAMPLES;
+            agg->raw_count--;
+            agg->raw_dropped++;
+        }
+        int slot = (agg->raw_first + agg->raw_count++) % CONFIG_TELEMETRY_AGG_RAW_SAMPLES;
+        struct raw_sample *sample = &agg->raw_samples[slot];
+        sample->key = key - agg->keys;
+        sample->ts_ms = ts_ms;
+        sample->value = value;
+    } else if (key != NULL)
+    {
+        if (value < key->min)
+        {
+            key->min = value;
+        }
+        if (value > key->max)
+        {
+            key->max = value;
+        }
+        key->sum += value;
+        key->last = value;
+        key->count++;
+    }
+    portEXIT_CRITICAL(&agg->lock);
+
+    if (key == NULL)
+    {
+        ESP_LOGW(TAG, "Unable to aggregate telemetry key %s", key_name);
+    }
+    return key != NULL;
+}
+
+/**
+ * @brief Returns true if the window of the key ended with samples, the aggregates of a key switched to raw
+ *        mode are sent at once. Must be called with the lock taken.
+ */
+static bool window_ended_locked(struct agg_key *key, int64_t now)
+{
+    bool ended = key->window_s == 0 || now - key->window_start_us >= (int64_t) key->window_s * 1000000;
+    if (ended && key->count == 0)
+    {
+        // Keep the window aligned to its start even if no samples arrived
+        reset_window(key, now);
+        return false;
+    }
+    return ended;
+}
+
+/*! Publishes the aggregates of the keys in one message */
+static void publish_aggregates(struct telemetry_agg *agg, esp_mqtt_client_handle_t client, int count)
+{
+    char *msg = agg->msg;
+    const size_t size = sizeof(agg->msg);
+    const struct agg_key *ended = agg->ended;
+    size_t len = 1;
+
+    if (count == 0)
+    {
+        return;
+    }
+    msg[0] = '{';
+    for (int i = 0; i < count; i++)
+    {
+        const struct agg_key *key = &ended[i];
+        int written = snprintf(msg + len, size - 1 - len,
+                        "%s\"%s_min\":%g,\"%s_max\":%g,\"%s_avg\":%g,\"%s_count\":%u,\"%s_last\":%g", i != 0 ? "," : "",
+                        key->name, key->min, key->name, key->max, key->name, key->sum / key->count, key->name, key->count,
+                        key->name, key->last);
+        if (written < 0 || (size_t) written >= size - 1 - len)
+        {
+            break;
+        }
+        len += written;
+    }
+    msg[len++] = '}';
+    esp_mqtt_client_publish(client, TB_TELEMETRY_TOPIC, msg, len, 1, 0);
+}
+
+/*! Publishes the raw samples in one message, each with its timestamp once the system time is set */
+static void publish_samples(struct telemetry_agg *agg, esp_mqtt_client_handle_t client, int count)
+{
+    char *msg = agg->raw_msg;
+    const size_t size = sizeof(agg->raw_msg);
+    const struct raw_sample *samples = agg->samples;
+    size_t len = 1;
+
+    if (count == 0)
+    {
+        return;
+    }
+    msg[0] = '[';
+    for (int i = 0; i < count; i++)
+    {
+        const struct raw_sample *sample = &samples[i];
+        const char *sep = i != 0 ? "," : "";
+        int written;
+        if (sample->ts_ms != 0)
+        {
+            written = snprintf(msg + len, size - 1 - len, "%s{\"ts\":%lld,\"values\":{\"%s\":%g}}", sep,
+                            (long long) sample->ts_ms, agg->keys[sample->key].name, sample->value);
+        } else
+        {
+            written = snprintf(msg + len, size - 1 - len, "%s{\"%s\":%g}", sep, agg->keys[sample->key].name,
+                            sample->value);
+        }
+        if (written < 0 || (size_t) written >= size - 1 - len)
+        {
+            break;
+        }
+        len += written;
+    }
+    msg[len++] = ']';
+    esp_mqtt_client_publish(client, TB_TELEMETRY_TOPIC, msg, len, 1, 0);
+}
+
+void telemetry_agg_poll(struct telemetry_agg *agg, esp_mqtt_client_handle_t client)
+{
+    int ended_count = 0;
+    int64_t now = esp_timer_get_time();
+
+    // Only copies are taken under the lock, the messages are formatted after it
+    portENTER_CRITICAL(&agg->lock);
+    for (int i = 0; i < agg->key_count; i++)
+    {
+        if (window_ended_locked(&agg->keys[i], now))
+        {
+            agg->ended[ended_count++] = agg->keys[i];
+            reset_window(&agg->keys[i], now);
+        }
+    }
+    int sample_count = agg->raw_count;
+    for (int i = 0; i < sample_count; i++)
+    {
+        agg->samples[i] = agg->raw_samples[(agg->raw_first + i) % CONFIG_TELEMETRY_AGG_RAW_SAMPLES];
+    }
+    agg->raw_first = 0;
+    agg->raw_count = 0;
+    uint32_t dropped = agg->raw_dropped;
+    agg->raw_dropped = 0;
+    portEXIT_CRITICAL(&agg->lock);
+
+    if (dropped != 0)
+    {
+        ESP_LOGW(TAG, "%u raw telemetry samples dropped, the buffer holds %d between polls", dropped,
+                        CONFIG_TELEMETRY_AGG_RAW_SAMPLES);
+    }
+    publish_aggregates(agg, client, ended_count);
+    publish_samples(agg, client, sample_count);
+}
+
+static void set_window(struct agg_key *key, uint32_t window_s, int64_t now)
+{
+    if (key->window_s != window_s)
+    {
+        // The samples of the shortened or extended window are sent with the new one
+        key->window_s = window_s;
+        key->window_start_us = now;
+    }
+}
+
+void telemetry_agg_parse_config(struct telemetry_agg *agg, const cJSON *object)
+{
+    if (object == NULL)
+    {
+        return;
+    }
+
+    int64_t now = esp_timer_get_time();
+    cJSON *window = cJSON_GetObjectItem(object, TB_SHARED_ATTR_FIELD_TELEMETRY_WINDOW);
+    if (cJSON_IsNumber(window) && window->valueint >= 0)
+    {
+        ESP_LOGI(TAG, "Received telemetry window: %d s", window->valueint);
+        portENTER_CRITICAL(&agg->lock);
+        agg->default_window_s = window->valueint;
+        for (int i = 0; i < agg->key_count; i++)
+        {
+            if (!agg->keys[i].window_set)
+            {
+                set_window(&agg->keys[i], agg->default_window_s, now);
+            }
+        }
+        portEXIT_CRITICAL(&agg->lock);
+    }
+
+    cJSON *windows = cJSON_GetObjectItem(object, TB_SHARED_ATTR_FIELD_TELEMETRY_WINDOWS);
+    cJSON *parsed = NULL;
+    if (cJSON_IsString(windows) && windows->valuestring != NULL)
+    {
+        // JSON attributes arrive as text with the protobuf payload
+        windows = parsed = cJSON_Parse(windows->valuestring);
+    }
+    if (cJSON_IsObject(windows))
+    {
+        for (cJSON *item = windows->child; item != NULL; item = item->next)
+        {
+            if (!cJSON_IsNumber(item) || item->valueint < 0)
+            {
+                continue;
+            }
+            ESP_LOGI(TAG, "Received telemetry window of %s: %d s", item->string, item->valueint);
+            portENTER_CRITICAL(&agg->lock);
+            struct agg_key *key = find_key_locked(agg, item->string, true);
+            if (key != NULL)
+            {
+                key->window_set = true;
+                set_window(key, item->valueint, now);
+            }
+            portEXIT_CRITICAL(&agg->lock);
+        }
+    }
+    cJSON_Delete(parsed);
+}
+
+#endif
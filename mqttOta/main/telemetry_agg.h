@@ -0,0 +1,109 @@
+/**
+ * @file telemetry_agg.h
+ */
+
+#ifndef PRJ_TELEMETRY_AGG_MODULE
+#define PRJ_TELEMETRY_AGG_MODULE
+
+#include <stdbool.h>
+#include "mqtt_client.h"
+#include "cJSON.h"
+#include "freertos/FreeRTOS.h"
+
+/*! Shared attribute key of the window in seconds of all telemetry keys, 0 sends every sample (raw mode) */
+#define TB_SHARED_ATTR_FIELD_TELEMETRY_WINDOW "telemetry_window"
+
+/*! Shared attribute key of per telemetry key windows, an object like {"counter":60} */
+#define TB_SHARED_ATTR_FIELD_TELEMETRY_WINDOWS "telemetry_windows"
+
+/*! Max length of an aggregated telemetry key */
+#define TELEMETRY_AGG_MAX_KEY 24
+
+#ifdef CONFIG_TELEMETRY_AGGREGATION
+
+/*! Size of the aggregates message, enough for all keys with their five aggregates */
+#define TELEMETRY_AGG_MSG_SIZE (CONFIG_TELEMETRY_AGG_MAX_KEYS * (5 * (TELEMETRY_AGG_MAX_KEY + 32)) + 2)
+/*! Size of the raw samples message, enough for all buffered samples with their timestamp */
+#define TELEMETRY_AGG_RAW_MSG_SIZE (CONFIG_TELEMETRY_AGG_RAW_SAMPLES * (TELEMETRY_AGG_MAX_KEY + 64) + 2)
+
+/* Tumbling window state of one telemetry key */
+struct agg_key
+{
+    char name[TELEMETRY_AGG_MAX_KEY + 1];
+    /*! Window length in seconds, 0 is raw mode */
+    uint32_t window_s;
+    /*! Set when the window was configured for this key, the default window doesn't apply then */
+    bool window_set;
+    int64_t window_start_us;
+    double min;
+    double max;
+    double sum;
+    double last;
+    uint32_t count;
+};
+
+/* Sample of a key in raw mode */
+struct raw_sample
+{
+    /*! Slot of the key, slots are never freed so its name stays valid */
+    uint8_t key;
+    /*! Time in ms since epoch, 0 while the system time is not set */
+    int64_t ts_ms;
+    double value;
+};
+
+/* Telemetry windows of one device, set up by @ref telemetry_agg_init */
+struct telemetry_agg
+{
+    struct agg_key keys[CONFIG_TELEMETRY_AGG_MAX_KEYS];
+    int key_count;
+    uint32_t default_window_s;
+    /*! Ring buffer of the raw samples until the next poll */
+    struct raw_sample raw_samples[CONFIG_TELEMETRY_AGG_RAW_SAMPLES];
+    int raw_first;
+    int raw_count;
+    /*! Raw samples overwritten since the last poll */
+    uint32_t raw_dropped;
+    portMUX_TYPE lock;
+
+    /*! Copies taken by the poll, the messages are formatted from them without the lock */
+    struct agg_key ended[CONFIG_TELEMETRY_AGG_MAX_KEYS];
+    struct raw_sample samples[CONFIG_TELEMETRY_AGG_RAW_SAMPLES];
+    char msg[TELEMETRY_AGG_MSG_SIZE];
+    char raw_msg[TELEMETRY_AGG_RAW_MSG_SIZE];
+};
+
+/*! Sets the default window from CONFIG_TELEMETRY_AGG_WINDOW_S, no key is aggregated yet */
+void telemetry_agg_init(struct telemetry_agg *agg);
+
+/**
+ * @brief Adds a sample of a telemetry key to its window, or to the raw sample buffer with its timestamp in
+ *        raw mode. The key gets a slot on its first sample, nothing is allocated or sent.
+ *
+ * @return false If CONFIG_TELEMETRY_AGG_MAX_KEYS other keys are aggregated already or the key is too long
+ */
+bool telemetry_agg_add(struct telemetry_agg *agg, const char *key, double value);
+
+/**
+ * @brief Publishes the keys whose window ended as <key>_min, <key>_max, <key>_avg, <key>_count and
+ *        <key>_last in one telemetry message, and the buffered samples of keys in raw mode as <key>
+ *        in a second one, a {"ts":..,"values":{..}} array once the system time is set.
+ */
+void telemetry_agg_poll(struct telemetry_agg *agg, esp_mqtt_client_handle_t client);
+
+/*! Applies the window keys found in a shared attributes object, other keys are ignored */
+void telemetry_agg_parse_config(struct telemetry_agg *agg, const cJSON *object);
+
+#else
+
+/* Every sample is sent as it is taken */
+struct telemetry_agg
+{
+    char unused;
+};
+
+#define telemetry_agg_init(agg) do { } while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,103 @@
+/**
+ * @file trace.c
+ */
+
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "mqttOta.h"
+#include "trace.h"
+
+#ifdef CONFIG_OTA_TRACE
+
+static const char *const trace_event_names[TRACE_EVENT_COUNT] =
+{
+    [TRACE_CHUNK_REQUEST] = "CHUNK_REQUEST",
+    [TRACE_CHUNK_RECEIVED] = "CHUNK_RECEIVED",
+    [TRACE_CHUNK_WRITE_BEGIN] = "CHUNK_WRITE_BEGIN",
+    [TRACE_CHUNK_WRITE_END] = "CHUNK_WRITE_END",
+    [TRACE_MQTT_DATA] = "MQTT_DATA",
+    [TRACE_OTA_STATE] = "OTA_STATE",
+    [TRACE_ERASE_BEGIN] = "ERASE_BEGIN",
+    [TRACE_ERASE_END] = "ERASE_END",
+    [TRACE_CHUNK_RETRY] = "CHUNK_RETRY",
+    [TRACE_TASK_STATE] = "TASK_STATE",
+};
+
+void trace_init(struct trace *trace)
+{
+    trace->count = 0;
+    trace->dumping = false;
+    trace->dropped = 0;
+    portMUX_INITIALIZE(&trace->lock);
+}
+
+void trace_record(struct trace *trace, enum trace_event id, int32_t arg0, int32_t arg1, int32_t arg2)
+{
+    int64_t now = esp_timer_get_time();
+
+    portENTER_CRITICAL(&trace->lock);
+    if (trace->dumping)
+    {
+        trace->dropped++;
+        portEXIT_CRITICAL(&trace->lock);
+        return;
+    }
+    struct trace_entry *entry = &trace->buffer[trace->count % CONFIG_OTA_TRACE_BUFFER_SIZE];
+    trace->count++;
+    entry->timestamp_us = now;
+    entry->id = id;
+    entry->args[0] = arg0;
+    entry->args[1] = arg1;
+    entry->args[2] = arg2;
+    portEXIT_CRITICAL(&trace->lock);
+}
+
+void trace_dump(struct trace *trace)
+{
+    uint32_t count;
+    uint32_t first;
+    uint32_t dropped;
+
+    // The buffer is printed in place, trace_record() drops the events of other tasks until it is done
+    portENTER_CRITICAL(&trace->lock);
+    if (trace->dumping)
+    {
+        portEXIT_CRITICAL(&trace->lock);
+        return;
+    }
+    trace->dumping = true;
+    count = trace->count;
+    portEXIT_CRITICAL(&trace->lock);
+
+    first = count > CONFIG_OTA_TRACE_BUFFER_SIZE ? count - CONFIG_OTA_TRACE_BUFFER_SIZE : 0;
+    if (first > 0)
+    {
+        ESP_LOGW(TAG, "Trace buffer overflowed, %d oldest events lost", first);
+    }
+
+    // Lines are parsed by tools/trace_to_chrome.py, keep the format in sync
+    ESP_LOGI(TAG, "TRACE_BEGIN %d", count - first);
+    for (uint32_t i = first; i < count; i++)
+    {
+        const struct trace_entry *entry = &trace->buffer[i % CONFIG_OTA_TRACE_BUFFER_SIZE];
+        ESP_LOGI(TAG, "TRACE %lld %s %d %d %d", entry->timestamp_us, trace_event_names[entry->id], entry->args[0],
+                        entry->args[1], entry->args[2]);
+    }
+
+    portENTER_CRITICAL(&trace->lock);
+    dropped = trace->dropped;
+    trace->dropped = 0;
+    trace->count = 0;
+    trace->dumping = false;
+    portEXIT_CRITICAL(&trace->lock);
+
+    if (dropped > 0)
+    {
+        ESP_LOGW(TAG, "%d events dropped while dumping the trace", dropped);
+    }
+    ESP_LOGI(TAG, "TRACE_END");
+}
+
+#endif
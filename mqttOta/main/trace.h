@@ -0,0 +1,78 @@
+/**
+ * @file trace.h
+ */
+
+#ifndef PRJ_TRACE_MODULE
+#define PRJ_TRACE_MODULE
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+
+/**
+ * @brief Ids of the traced events, names are in trace.c.
+ *        Events named ..._BEGIN and ..._END are paired by their first argument by tools/trace_to_chrome.py.
+ */
+enum trace_event
+{
+    TRACE_CHUNK_REQUEST,      /*!< chunk number, chunk size */
+    TRACE_CHUNK_RECEIVED,     /*!< chunk number, data length */
+    TRACE_CHUNK_WRITE_BEGIN,  /*!< chunk number, data length */
+    TRACE_CHUNK_WRITE_END,    /*!< chunk number, esp_err_t */
+    TRACE_MQTT_DATA,          /*!< msg id, topic length, data length */
+    TRACE_OTA_STATE,          /*!< STATE_OTA_* value */
+    TRACE_ERASE_BEGIN,        /*!< offset, size */
+    TRACE_ERASE_END,          /*!< offset, esp_err_t */
+    TRACE_CHUNK_RETRY,        /*!< chunk number, attempt */
+    TRACE_TASK_STATE,         /*!< enum state value the OTA task enters */
+    TRACE_EVENT_COUNT
+};
+
+#ifdef CONFIG_OTA_TRACE
+
+/* One recorded event */
+struct trace_entry
+{
+    int64_t timestamp_us;
+    int32_t args[3];
+    uint16_t id;
+};
+
+/* RAM ring buffer of the events of one device */
+struct trace
+{
+    struct trace_entry buffer[CONFIG_OTA_TRACE_BUFFER_SIZE];
+    /*! Total number of recorded events, the buffer holds the last CONFIG_OTA_TRACE_BUFFER_SIZE of them */
+    uint32_t count;
+    /*! Set while trace_dump() prints the buffer, events recorded meanwhile are dropped and counted */
+    bool dumping;
+    uint32_t dropped;
+    portMUX_TYPE lock;
+};
+
+/*! Empties the buffer, called once before the first event */
+void trace_init(struct trace *trace);
+
+/*! Records an event with its arguments into the RAM ring buffer, nothing is formatted */
+void trace_record(struct trace *trace, enum trace_event id, int32_t arg0, int32_t arg1, int32_t arg2);
+
+/*! Prints the recorded events, oldest first, and empties the buffer */
+void trace_dump(struct trace *trace);
+
+#define TRACE(trace, id, arg0, arg1, arg2) trace_record((trace), (id), (arg0), (arg1), (arg2))
+
+#else
+
+/* Nothing is recorded, the buffer isn't allocated */
+struct trace
+{
+    char unused;
+};
+
+#define trace_init(trace) do { } while (0)
+#define TRACE(trace, id, arg0, arg1, arg2) do { } while (0)
+#define trace_dump(trace) do { } while (0)
+
+#endif
+
+#endif
@@ -11,12 +11,28 @@
 #include "esp_system.h"
 #include "esp_wifi.h"
 #include "mqttOta.h"
+#ifdef CONFIG_DUTY_CYCLE_MODE
+#include "duty_cycle.h"
+#endif
 
-/*! Buffer to save ESP32 MAC address */
-uint8_t esp32_mac[6];
+#ifdef CONFIG_DUTY_CYCLE_MODE
+/*! Saves the AP connected to as the hint for the next cycle */
+static void remember_ap(struct ota_device *dev)
+{
+    wifi_ap_record_t ap_info;
+
+    dev->wifi_hint_used = false;
+    if (esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK)
+    {
+        duty_cycle_save_wifi_hint(ap_info.bssid, ap_info.primary);
+    }
+}
+#endif
 
 static esp_err_t esp_event_handler(void *ctx, system_event_t *event)
 {
+    struct ota_device *dev = ctx;
+
     assert(event != NULL);
 
     switch (event->event_id)
@@ -25,14 +41,31 @@ static esp_err_t esp_event_handler(void *ctx, system_event_t *event)
         esp_wifi_connect();
     break;
     case SYSTEM_EVENT_STA_GOT_IP:
-        notify_wifi_connected();
+#ifdef CONFIG_DUTY_CYCLE_MODE
+        remember_ap(dev);
+#endif
+        notify_wifi_connected(dev);
         ESP_LOGI(TAG, "Connected to WI-FI, IP address: %s",
                         ip4addr_ntoa(&event->event_info.got_ip.ip_info.ip));
     break;
     case SYSTEM_EVENT_STA_DISCONNECTED:
+#ifdef CONFIG_DUTY_CYCLE_MODE
+        if (dev->wifi_hint_used)
+        {
+            // The AP of the last cycle is gone or moved, scan for the SSID again
+            ESP_LOGW(TAG, "Unable to connect to the AP of the last cycle, scanning");
+            dev->wifi_hint_used = false;
+            duty_cycle_clear_wifi_hint();
+            wifi_config_t wifi_config;
+            esp_wifi_get_config(ESP_IF_WIFI_STA, &wifi_config);
+            wifi_config.sta.bssid_set = false;
+            wifi_config.sta.channel = 0;
+            esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config);
+        }
+#endif
         /* This is a workaround as ESP32 WiFi libs don't currently auto-reassociate. */
         esp_wifi_connect();
-        notify_wifi_disconnected();
+        notify_wifi_disconnected(dev);
     break;
     default:
     break;
@@ -40,12 +73,12 @@ static esp_err_t esp_event_handler(void *ctx, system_event_t *event)
     return ESP_OK;
 }
 
-void initialise_wifi(const char *running_partition_label)
+void initialise_wifi(struct ota_device *dev, const char *running_partition_label)
 {
     assert(running_partition_label != NULL);
 
     tcpip_adapter_init();
-    APP_ABORT_ON_ERROR(esp_event_loop_init(esp_event_handler, NULL));
+    APP_ABORT_ON_ERROR(esp_event_loop_init(esp_event_handler, dev));
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     APP_ABORT_ON_ERROR(esp_wifi_init(&cfg));
     APP_ABORT_ON_ERROR(esp_wifi_set_storage(WIFI_STORAGE_FLASH));
@@ -78,12 +111,23 @@ void initialise_wifi(const char *running_partition_label)
                         wifi_config.sta.ssid, wifi_config.sta.password);
     }
 
-    APP_ABORT_ON_ERROR(esp_wifi_get_mac(ESP_IF_WIFI_STA, esp32_mac))
-    ESP_LOGI(TAG, "MAC address: %02X:%02X:%02X:%02X:%02X:%02X", esp32_mac[0],
-                    esp32_mac[1], esp32_mac[2], esp32_mac[3], esp32_mac[4],
-                    esp32_mac[5]);
+    APP_ABORT_ON_ERROR(esp_wifi_get_mac(ESP_IF_WIFI_STA, dev->mac))
+    ESP_LOGI(TAG, "MAC address: %02X:%02X:%02X:%02X:%02X:%02X", dev->mac[0],
+                    dev->mac[1], dev->mac[2], dev->mac[3], dev->mac[4],
+                    dev->mac[5]);
     APP_ABORT_ON_ERROR(esp_wifi_set_mode(WIFI_MODE_STA));
 
+#ifdef CONFIG_DUTY_CYCLE_MODE
+    if (duty_cycle_get_wifi_hint(&dev->cycle, wifi_config.sta.bssid, &wifi_config.sta.channel))
+    {
+        // Connect to the AP of the last cycle without a full scan, the hint is not written to flash
+        ESP_LOGI(TAG, "Connecting to the AP of the last cycle on channel %d", wifi_config.sta.channel);
+        wifi_config.sta.bssid_set = true;
+        dev->wifi_hint_used = true;
+        APP_ABORT_ON_ERROR(esp_wifi_set_storage(WIFI_STORAGE_RAM));
+    }
+#endif
+
     APP_ABORT_ON_ERROR(esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config));
     APP_ABORT_ON_ERROR(esp_wifi_start());
 }
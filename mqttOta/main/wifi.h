@@ -11,6 +11,9 @@
 #define WIFI_SSID CONFIG_WIFI_SSID
 #define WIFI_PASS CONFIG_WIFI_PASSWORD
 
-void initialise_wifi(const char *running_partition_label);
+struct ota_device;
+
+/*! Starts connecting to the AP, the Wi-Fi events of the device are set in its event group */
+void initialise_wifi(struct ota_device *dev, const char *running_partition_label);
 
 #endif
@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+"""Convert the OTA trace printed by trace_dump() into a Chrome trace / Perfetto JSON timeline.
+
+Usage: trace_to_chrome.py <serial log> [output.json]
+
+Open the output in chrome://tracing or https://ui.perfetto.dev.
+"""
+
+import json
+import re
+import sys
+
+TRACE_LINE = re.compile(r"TRACE (\d+) (\w+) (-?\d+) (-?\d+) (-?\d+)")
+
+# Track (thread id in the timeline) of each event
+TRACKS = {
+    "CHUNK_REQUEST": ("network", 1),
+    "CHUNK_RECEIVED": ("network", 1),
+    "CHUNK_RETRY": ("network", 1),
+    "MQTT_DATA": ("network", 1),
+    "CHUNK_WRITE_BEGIN": ("flash write", 2),
+    "CHUNK_WRITE_END": ("flash write", 2),
+    "ERASE_BEGIN": ("flash erase", 3),
+    "ERASE_END": ("flash erase", 3),
+    "OTA_STATE": ("ota state", 4),
+    "TASK_STATE": ("ota state", 4),
+}
+
+# Begin event -> (end event, name of the span)
+SPANS = {
+    "CHUNK_REQUEST": ("CHUNK_RECEIVED", "chunk {0} transfer"),
+    "CHUNK_WRITE_BEGIN": ("CHUNK_WRITE_END", "chunk {0} write"),
+    "ERASE_BEGIN": ("ERASE_END", "erase 0x{0:x}"),
+}
+SPAN_ENDS = {end: begin for begin, (end, _) in SPANS.items()}
+
+
+def parse(lines):
+    for line in lines:
+        match = TRACE_LINE.search(line)
+        if match:
+            ts, name, a0, a1, a2 = match.groups()
+            yield int(ts), name, [int(a0), int(a1), int(a2)]
+
+
+def convert(events):
+    out = []
+    open_spans = {}
+    for (name, tid) in sorted(set(TRACKS.values()), key=lambda t: t[1]):
+        out.append({"ph": "M", "name": "thread_name", "pid": 1, "tid": tid, "args": {"name": name}})
+
+    for ts, name, args in events:
+        track = TRACKS.get(name, ("other", 9))[1]
+        if name in SPANS:
+            open_spans[(name, args[0])] = (ts, args)
+            continue
+        if name in SPAN_ENDS:
+            begin = SPAN_ENDS[name]
+            started = open_spans.pop((begin, args[0]), None)
+            if started is not None:
+                begin_ts, begin_args = started
+                out.append({"ph": "X", "name": SPANS[begin][1].format(args[0]), "pid": 1,
+                            "tid": TRACKS[begin][1], "ts": begin_ts, "dur": ts - begin_ts,
+                            "args": {"begin": begin_args, "end": args}})
+                continue
+        out.append({"ph": "i", "s": "t", "name": name, "pid": 1, "tid": track, "ts": ts, "args": {"args": args}})
+    return {"traceEvents": out, "displayTimeUnit": "ms"}
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit(__doc__)
+    with open(sys.argv[1], errors="replace") as log:
+        timeline = convert(parse(log))
+    output = sys.argv[2] if len(sys.argv) > 2 else "ota_trace.json"
+    with open(output, "w") as out:
+        json.dump(timeline, out)
+    print("Wrote {} events to {}".format(len(timeline["traceEvents"]), output))
+
+
+if __name__ == "__main__":
+    main()